@@ -136,6 +136,43 @@ std::optional<std::string> parse_arguments(int argc, char* argv[], const std::ve
     while (i < argc) {
         std::string arg = argv[i];
 
+        // "--" ends the options, everything after it is positional
+        if (arg == "--") {
+            for (i++; i < argc; i++) {
+                parsed_args.positional_args.push_back(argv[i]);
+            }
+            break;
+        }
+
+        // "--name=value" is "--name value" in one token
+        size_t equals = arg.find('=');
+        if (arg.rfind("--", 0) == 0 && equals != std::string::npos) {
+            std::string name = arg.substr(0, equals);
+            std::string value = arg.substr(equals + 1);
+            bool known = false;
+            for (auto& argument : arguments) {
+                if (argument->matches_long(name)) {
+                    if (argument->nargs != 1) {
+                        return "Error: Argument '" + name + "' doesn't take a value";
+                    }
+                    char* pair[] = {name.data(), value.data()};
+                    int pair_argc = 2;
+                    char** pair_argv = pair;
+                    auto result = argument->parse_from_argv(pair_argc, pair_argv, parsed_args);
+                    if (result.has_value()) {
+                        return result;
+                    }
+                    known = true;
+                    break;
+                }
+            }
+            if (!known) {
+                return "Error: Unknown argument '" + arg + "'";
+            }
+            i++;
+            continue;
+        }
+
         bool matched = false;
         for (auto& argument : arguments) {
             if (argument->matches_short(arg) || argument->matches_long(arg)) {
@@ -341,6 +378,24 @@ void setup_parser(Parser& parser) {
         cmd_commit
     );
 
+    auto diff_cmd = std::make_unique<Command>(
+        "diff",
+        "Show changes between the worktree, the index and commits",
+        cmd_diff
+    );
+
+    auto fsmonitor_daemon_cmd = std::make_unique<Command>(
+        "fsmonitor--daemon",
+        "Watch the worktree so status only looks at changed files",
+        cmd_fsmonitor_daemon
+    );
+
+    auto sparse_checkout_cmd = std::make_unique<Command>(
+        "sparse-checkout",
+        "Check out only the given directories of the worktree",
+        cmd_sparse_checkout
+    );
+
     auto hash_object_cmd = std::make_unique<Command>(
         "hash-object",
         "Compute object ID and optionally creates a blob from a file",
@@ -421,6 +476,56 @@ void setup_parser(Parser& parser) {
         "verbose"            // long_opt
     ));
 
+    // --cached keeps the files in the worktree
+    rm_cmd->add_argument(std::make_unique<Argument>(
+        "cached",            // dest_name
+        0,                   // nargs (is a flag)
+        "Only remove from the index",  // help_text
+        false,               // required
+        "false",             // default_value
+        "",                  // short_opt
+        "cached"             // long_opt
+    ));
+
+    // start | run | stop | status
+    std::vector<std::string> fsmonitor_actions = {"start", "run", "stop", "status"};
+    fsmonitor_daemon_cmd->add_argument(std::make_unique<Argument>(
+        "action",
+        1,
+        "What to do [start|run|stop|status]",
+        true,                // required
+        fsmonitor_actions,
+        "",                  // default_value
+        "",                  // short_opt
+        "",                  // long_opt
+        true                 // positional
+    ));
+
+    // init | set | add | list | disable, then the directories
+    std::vector<std::string> sparse_actions = {"init", "set", "add", "list", "disable"};
+    sparse_checkout_cmd->add_argument(std::make_unique<Argument>(
+        "action",
+        1,
+        "What to do [init|set|add|list|disable]",
+        true,                // required
+        sparse_actions,
+        "",                  // default_value
+        "",                  // short_opt
+        "",                  // long_opt
+        true                 // positional
+    ));
+
+    check_ignore_cmd->add_argument(std::make_unique<Argument> (
+        "verbose",
+        0,                   // flag (no value)
+        "Show the matching pattern and where it comes from",
+        false,               // not required
+        "false",             // default_value
+        "v",                 // short_opt
+        "verbose",           // long_opt
+        false                // not positional
+    ));
+
     // Add argument to init command for directory path
     init_cmd->add_argument(std::make_unique<Argument> (
         "directory",
@@ -430,6 +535,18 @@ void setup_parser(Parser& parser) {
         "."
     ));
 
+    init_cmd->add_argument(std::make_unique<Argument> (
+        "object-format",
+        1,
+        "Hash function for object ids [sha1|sha256]",
+        false,
+        std::vector<std::string>{"sha1", "sha256"},
+        "sha1",              // default_value
+        "",                  // short_opt
+        "object-format",     // long_opt
+        false                // not positional
+    ));
+
     // Define choices for cat-file type argument
     std::vector<std::string> type_choices = {"blob", "commit", "tag", "tree"};
 
@@ -512,6 +629,53 @@ void setup_parser(Parser& parser) {
         false
     ));
 
+    // --cached (or --staged) compares the index with HEAD or a commit
+    diff_cmd->add_argument(std::make_unique<Argument>(
+        "cached",
+        0,
+        "Compare the index with HEAD, or with the commit given",
+        false,
+        "false",
+        "",
+        "cached",
+        false
+    ));
+
+    diff_cmd->add_argument(std::make_unique<Argument>(
+        "staged",
+        0,
+        "Same as --cached",
+        false,
+        "false",
+        "",
+        "staged",
+        false
+    ));
+
+    diff_cmd->add_argument(std::make_unique<Argument>(
+        "unified",
+        1,
+        "Lines of context around each change",
+        false,
+        "3",
+        "U",
+        "unified",
+        false
+    ));
+
+    // myers | patience | histogram; diff.algorithm when not given
+    diff_cmd->add_argument(std::make_unique<Argument>(
+        "diff-algorithm",
+        1,
+        "Line diff algorithm [myers|minimal|patience|histogram]",
+        false,
+        std::vector<std::string>{"myers", "default", "minimal", "patience", "histogram"},
+        "",
+        "",
+        "diff-algorithm",
+        false
+    ));
+
     ls_tree_cmd->add_argument(std::make_unique<Argument> (
         "recursive",
         0,                   // flag (no value)
@@ -630,6 +794,7 @@ void setup_parser(Parser& parser) {
     parser.add_command(std::move(hash_object_cmd));
     parser.add_command(std::move(log_cmd));
     parser.add_command(std::move(commit_cmd));
+    parser.add_command(std::move(diff_cmd));
     parser.add_command(std::move(ls_files_cmd));
     parser.add_command(std::move(status_cmd));
     parser.add_command(std::move(rm_cmd));
@@ -639,4 +804,6 @@ void setup_parser(Parser& parser) {
     parser.add_command(std::move(show_ref_cmd));
     parser.add_command(std::move(tag_cmd));
     parser.add_command(std::move(rev_parse_cmd));
+    parser.add_command(std::move(fsmonitor_daemon_cmd));
+    parser.add_command(std::move(sparse_checkout_cmd));
 }
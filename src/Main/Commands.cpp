@@ -6,6 +6,14 @@
 #include "Objects.hpp"
 #include "Repository.hpp" // Include the header for Repository
 #include "Index.hpp"
+#include "Utils.hpp"
+#include "Fsmonitor.hpp"
+#include "Sparse.hpp"
+#include "Scan.hpp"
+#include "Ignore.hpp"
+#include "IoBatch.hpp"
+#include "Pack.hpp"
+#include "Diff.hpp"
 #include <filesystem>
 #include <set>
 #include <map>
@@ -14,9 +22,9 @@
 #include <fstream>
 #include <ctime>
 #include <cstdio>
-#include <sys/stat.h>
+#include <cstring>
 #include <zlib.h>
-#include <openssl/sha.h>
+#include "Hash.hpp"
 
 // Helper to parse boolean flags from ParsedArgs:
 // - If the flag is not present, return false.
@@ -36,113 +44,148 @@ bool parse_bool_flag(const ParsedArgs& args, const std::string& key) {
     return (lower == "true" || lower == "1" || lower == "yes" || lower == "on");
 }
 
-std::string write_raw_object(const std::string& fmt, const std::string& data, Repository* repo) {
-    std::string full_object = fmt + " " + std::to_string(data.size()) + '\0' + data;
+std::string write_raw_object(const std::string& fmt, std::string_view data, Repository* repo) {
+    std::string header = fmt + " " + std::to_string(data.size()) + '\0';
 
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1(reinterpret_cast<const unsigned char*>(full_object.data()), full_object.size(), hash);
-
-    char sha_hex[41];
-    for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-        std::snprintf(sha_hex + (i * 2), 3, "%02x", hash[i]);
-    }
-    sha_hex[40] = '\0';
-    std::string sha(sha_hex);
-
-    std::string dir = sha.substr(0, 2);
-    std::string file = sha.substr(2);
-    std::filesystem::path object_path = repo_file(*repo, "objects", dir.c_str(), file.c_str(), nullptr);
-
-    if (!std::filesystem::exists(object_path)) {
-        std::filesystem::create_directories(object_path.parent_path());
-
-        uLongf compressed_size = compressBound(full_object.size());
-        std::vector<char> compressed_data(compressed_size);
-        if (compress(reinterpret_cast<Bytef*>(compressed_data.data()), &compressed_size,
-                     reinterpret_cast<const Bytef*>(full_object.data()), full_object.size()) != Z_OK) {
-            throw std::runtime_error("Failed to compress object data.");
-        }
-
-        std::ofstream out(object_path, std::ios::binary);
-        out.write(compressed_data.data(), compressed_size);
-        out.close();
-    }
+    std::string sha = with_object_format(repo->object_format, [&](auto algo) {
+        using Algo = decltype(algo);
+        unsigned char hash[Algo::raw_size];
+        typename Algo::Context ctx;
+        ctx.update(header.data(), header.size());
+        ctx.update(data.data(), data.size());
+        ctx.final(hash);
+        return hash_to_hex<Algo>(hash);
+    });
 
+    object_store(repo, sha, header, data);
     return sha;
 }
 
-struct TreeNode {
-    std::map<std::string, TreeNode> children;
-    std::map<std::string, std::pair<std::string, std::string>> files; // filename -> (mode, blob sha)
-};
-
-std::vector<std::string> split_git_path(const std::string& path) {
-    std::vector<std::string> parts;
-    std::string current;
-    for (char c : path) {
-        if (c == '/' || c == '\\') {
-            if (!current.empty()) {
-                parts.push_back(current);
-                current.clear();
-            }
-        } else {
-            current += c;
-        }
+// Mode of an index entry as a tree spells it
+const char* tree_mode(uint32_t mode) {
+    uint32_t type = mode & 0170000;
+    if (type == 0160000) {
+        return "160000";
     }
-    if (!current.empty()) {
-        parts.push_back(current);
+    if (type == 0120000) {
+        return "120000";
     }
-    return parts;
-}
-
-std::string write_tree_recursive(const TreeNode& node, Repository* repo) {
-    std::vector<GitTreeLeaf> leaves;
-
-    for (const auto& [name, file] : node.files) {
-        leaves.emplace_back(file.first, name, file.second);
-    }
-
-    for (const auto& [dirname, child] : node.children) {
-        std::string child_sha = write_tree_recursive(child, repo);
-        leaves.emplace_back("40000", dirname, child_sha);
+    if (mode & 0111) {
+        return "100755";
     }
-
-    auto tree = std::make_unique<GitTree>();
-    tree->set_leaves(leaves);
-    return object_write(std::move(tree), repo);
+    return "100644";
 }
 
-std::string build_tree_from_index(const std::vector<IndexEntry>& entries, Repository* repo) {
-    TreeNode root;
+// Write the trees of the index, updating its cache tree, and return the
+// root's id.
+//
+// Index order is tree order (a directory's entries are contiguous and sort
+// where "name/" does among its siblings), so one pass over the entries
+// builds every tree. A stack holds the directories on the path of the
+// current entry; when an entry outside the top one comes up, that
+// directory is complete, and its tree is written and added to its parent.
+// The trees being built share one buffer, each after its parent's, so a
+// finished tree is simply cut off the end. A directory whose cached tree
+// is still valid is added as it is and skipped over.
+std::string build_tree_from_index(Index& index, Repository* repo) {
+    CacheTree& root = index.cache_tree();
+    if (root.valid()) {
+        return root.sha(index.oid_size());
+    }
+
+    struct Frame {
+        CacheTree* node;
+        std::string_view prefix;  // the directory's path with its slash
+        std::string_view name;
+        size_t first;             // its first entry
+        size_t start;             // where its tree starts in `buffer`
+        size_t seen_start;        // where its subtrees start in `seen`
+    };
+    std::vector<Frame> stack;
+    std::string buffer;
+    std::vector<std::string_view> seen;
+
+    auto append_entry = [&](const char* mode, std::string_view name, const unsigned char* oid) {
+        buffer += mode;
+        buffer += ' ';
+        buffer.append(name);
+        buffer += '\0';
+        buffer.append(reinterpret_cast<const char*>(oid), index.oid_size());
+    };
 
-    auto mode_for_tree = [](int mode) -> std::string {
-        int type = mode & 0170000;
-        if (type == 0160000) {
-            return "160000";
+    // Write the tree on top of the stack, whose entries end at `end`
+    auto finish = [&](size_t end) {
+        Frame frame = stack.back();
+        stack.pop_back();
+
+        // forget subtrees whose directories are gone
+        auto seen_first = seen.begin() + frame.seen_start;
+        std::sort(seen_first, seen.end());
+        auto& subtrees = frame.node->subtrees;
+        subtrees.erase(std::remove_if(subtrees.begin(), subtrees.end(),
+                                      [&](const CacheTree& sub) {
+                                          return !std::binary_search(seen_first, seen.end(),
+                                                                     std::string_view(sub.name));
+                                      }),
+                       subtrees.end());
+        seen.resize(frame.seen_start);
+
+        std::string sha = write_raw_object("tree", std::string_view(buffer).substr(frame.start), repo);
+        frame.node->set(static_cast<int32_t>(end - frame.first), sha);
+        buffer.resize(frame.start);
+        if (!stack.empty()) {
+            append_entry("40000", frame.name, frame.node->oid);
         }
-        if (type == 0120000) {
-            return "120000";
-        }
-        if (mode & 0111) {
-            return "100755";
-        }
-        return "100644";
+        return sha;
     };
 
-    for (const auto& entry : entries) {
-        std::vector<std::string> parts = split_git_path(entry.path);
-        if (parts.empty()) {
-            continue;
+    stack.push_back({&root, "", "", 0, 0, 0});
+    size_t pos = 0;
+    while (pos < index.size()) {
+        IndexEntryRef entry = index[pos];
+        std::string_view path = entry.path();
+
+        // close the directories this entry is outside of
+        while (stack.size() > 1 && path.substr(0, stack.back().prefix.size()) != stack.back().prefix) {
+            finish(pos);
         }
 
-        TreeNode* node = &root;
-        for (size_t i = 0; i + 1 < parts.size(); i++) {
-            node = &node->children[parts[i]];
+        // open the ones it's inside of, unless they can be skipped
+        bool skipped = false;
+        size_t slash;
+        while (!skipped && (slash = path.find('/', stack.back().prefix.size())) != std::string_view::npos) {
+            Frame& top = stack.back();
+            std::string_view name = path.substr(top.prefix.size(), slash - top.prefix.size());
+            CacheTree& child = top.node->subtree(name);
+            seen.push_back(name);
+
+            if (slash + 1 == path.size()) {
+                // a sparse directory entry is the whole tree already, as one entry
+                child.subtrees.clear();
+                child.set(1, entry.sha());
+                append_entry("40000", name, entry.oid());
+                pos++;
+                skipped = true;
+            } else if (child.valid()) {
+                append_entry("40000", name, child.oid);
+                pos = index.directory_range(path.substr(0, slash)).second;
+                skipped = true;
+            } else {
+                stack.push_back({&child, path.substr(0, slash + 1), name, pos, buffer.size(), seen.size()});
+            }
+        }
+        if (skipped) {
+            continue;
         }
-        node->files[parts.back()] = {mode_for_tree(entry.mode), entry.sha};
+
+        append_entry(tree_mode(entry.mode()), path.substr(stack.back().prefix.size()), entry.oid());
+        pos++;
     }
 
-    return write_tree_recursive(root, repo);
+    while (stack.size() > 1) {
+        finish(index.size());
+    }
+    return finish(index.size());
 }
 
 std::string head_target_ref(const Repository& repo) {
@@ -168,6 +211,65 @@ std::string branch_name_from_ref(const std::string& ref_name) {
     return ref_name.substr(pos + 1);
 }
 
+// Take index.lock and read the index (unless `read` is false), for a
+// command that writes it back; false, with a message, if another process
+// keeps holding the lock or the index can't be read. Writing back what
+// was read of a damaged index would lose its entries, so then the lock is
+// released again.
+bool lock_index(Index& index, const Repository& repo, bool read = true) {
+    if (!index.lock(repo)) {
+        std::cerr << "Error: Unable to create '" << Index::get_index_path(repo).string() << ".lock': File exists."
+                  << std::endl;
+        std::cerr << "Another silt process seems to be running in this repository." << std::endl;
+        return false;
+    }
+    if (read && !index.read(repo)) {
+        index.unlock();
+        std::cerr << "Error: Index file corrupt: " << Index::get_index_path(repo).string() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Bring the index's filesystem monitor state up to date, if core.fsmonitor
+// is set: ask the daemon what changed since the index's token and forget
+// what was known about those paths. Returns true if what the monitor
+// didn't report can be taken as unchanged; sets `changed` if the index
+// has to be written.
+bool refresh_fsmonitor(Index& index, const Repository& repo, const ConfigParser& config, bool& changed) {
+    std::optional<FsmonitorChanges> answer;
+    if (config.get("core", "fsmonitor") == "true") {
+        answer = fsmonitor_query(repo, index.fsmonitor_token());
+    }
+    if (!answer) {
+        // nothing can keep what the index knows current
+        if (!index.fsmonitor_token().empty()) {
+            index.set_fsmonitor_token("");
+            changed = true;
+        }
+        return false;
+    }
+
+    if (answer->trivial) {
+        index.invalidate_fsmonitor();
+    } else if (answer->paths.empty()) {
+        // nothing happened, and asking with the old token still says so
+        return true;
+    }
+    for (const auto& path : answer->paths) {
+        index.invalidate_fsmonitor(path);
+        if (auto& cache = index.untracked_cache()) {
+            cache->invalidate(path);
+            if (path.back() == '/') {
+                cache->invalidate(path.substr(0, path.size() - 1));
+            }
+        }
+    }
+    index.set_fsmonitor_token(answer->token);
+    changed = true;
+    return !answer->trivial;
+}
+
 // Implementation of cmd_add to stage files to the index
 void cmd_add(const ParsedArgs& args, Repository* repo) {
     // Get paths from positional arguments (for multiple files passed without flags)
@@ -178,8 +280,59 @@ void cmd_add(const ParsedArgs& args, Repository* repo) {
         paths.push_back(".");
     }
     
-    // Load or create index
-    Index index(*repo);
+    // Load or create index, locked until it's written back
+    Index index;
+    if (!lock_index(index, *repo)) {
+        return;
+    }
+
+    // Files the filesystem monitor saw no change to since they were found
+    // to match their entries are already staged as they are
+    ConfigParser config;
+    config.read((repo->gitdir / "config").string());
+    bool fsmonitor_changed = false;  // the index is written below anyway
+    refresh_fsmonitor(index, *repo, config, fsmonitor_changed);
+    auto unchanged = [&index](const std::string& rel) {
+        auto pos = index.find(rel);
+        return pos && index.fsmonitor_valid(*pos);
+    };
+
+    // Paths outside the sparse-checkout cone stay as the index has them
+    std::optional<SparseCheckout> sparse = SparseCheckout::load(*repo);
+    auto outside_cone = [&sparse](const std::string& rel) {
+        if (sparse && !sparse->contains(rel)) {
+            std::cerr << "Warning: '" << rel << "' is outside the sparse-checkout cone, not added" << std::endl;
+            return true;
+        }
+        return false;
+    };
+
+    // Untracked files the ignore rules match aren't added, and ignored
+    // directories aren't even read, unless something in them is tracked
+    IgnoreRules ignore_rules(*repo);
+    ScanIgnore scan_ignore;
+    scan_ignore.rules = &ignore_rules;
+    scan_ignore.tracked = [&index](std::string_view rel, bool is_dir) {
+        if (is_dir) {
+            auto range = index.directory_range(rel);
+            return range.first < range.second;
+        }
+        return index.find(rel).has_value();
+    };
+    std::vector<std::string> ignored_paths;
+    auto ignored = [&](const std::string& rel, bool is_dir) {
+        if (!scan_ignore.tracked(rel, is_dir) && ignore_rules.ignored(rel, is_dir)) {
+            ignored_paths.push_back(rel);
+            return true;
+        }
+        return false;
+    };
+
+    // Entries are collected first and merged into the index in one go, and
+    // the new blobs go to one pack (or stay loose if there are only a few)
+    std::vector<IndexEntry> staged;
+    IoBatch io(*repo);
+    OdbTransaction transaction(*repo);
     
     // Process each path
     for (const auto& path_str : paths) {
@@ -190,85 +343,119 @@ void cmd_add(const ParsedArgs& args, Repository* repo) {
             path = repo->worktree / path;
         }
         
-        // Handle directories and files recursively
-        if (std::filesystem::is_directory(path)) {
+        // Handle directories and files recursively. A symlink is added as
+        // the link itself, even one pointing at a directory, so nothing
+        // here follows it.
+        std::error_code status_ec;
+        std::filesystem::file_status status = std::filesystem::symlink_status(path, status_ec);
+        if (std::filesystem::is_directory(status)) {
             // Add all files in directory recursively
-            for (const auto& file_entry : std::filesystem::recursive_directory_iterator(path)) {
-                if (file_entry.is_regular_file()) {
-                    // Get path relative to worktree
-                    auto rel_path = std::filesystem::relative(file_entry.path(), repo->worktree);
-                    
-                    // Skip files in .git directory
-                    if (rel_path.string().find(".git") == 0) {
+            std::string rel_dir = std::filesystem::relative(path, repo->worktree).generic_string();
+            if (rel_dir == ".") {
+                rel_dir.clear();
+            }
+            if (!rel_dir.empty() && ignored(rel_dir, true)) {
+                continue;
+            }
+            // the files are stat'ed and read a batch at a time, the stat
+            // first so a concurrent edit shows up as a stat change later
+            std::vector<IoRequest> reads;
+            std::vector<std::string> read_paths;
+            auto stage_reads = [&] {
+                io.run(reads);
+                // hash the batch side by side; a symlink's blob is its target
+                std::vector<std::string_view> contents;
+                for (const auto& read : reads) {
+                    if (read.ok) {
+                        contents.push_back(read.data);
+                    }
+                }
+                std::vector<std::string> shas = object_hash_many(contents, "blob", repo);
+                auto sha = shas.begin();
+                for (size_t i = 0; i < reads.size(); i++) {
+                    if (!reads[i].ok) {
                         continue;
                     }
-                    
-                    // Read file and compute hash
-                    std::ifstream file(file_entry.path(), std::ios::binary);
-                    std::string content((std::istreambuf_iterator<char>(file)),
-                                       std::istreambuf_iterator<char>());
-                    file.close();
-                    
-                    // Hash the blob
-                    std::string sha = object_hash(content, "blob", repo);
-                    
-                    // Create index entry
                     IndexEntry index_entry;
-                    index_entry.path = rel_path.generic_string();
-                    
-                    // Get file stats using the actual file path
-                    struct stat st;
-                    if (stat(file_entry.path().string().c_str(), &st) == 0) {
-                        index_entry.ctime_sec = static_cast<int>(st.st_ctime);
-                        index_entry.mtime_sec = static_cast<int>(st.st_mtime);
-                        index_entry.mode = static_cast<int>(st.st_mode);
-                        index_entry.uid = static_cast<int>(st.st_uid);
-                        index_entry.gid = static_cast<int>(st.st_gid);
-                        index_entry.file_size = static_cast<int>(st.st_size);
-                    }
-                    
-                    index_entry.sha = sha;
-                    index_entry.flags = static_cast<int>(index_entry.path.size() & 0xFFF); // Bit 0-11: name length
-                    
-                    // Add to index
-                    index.add_entry(index_entry);
+                    index_entry.path = std::move(read_paths[i]);
+                    index_entry.stat = reads[i].stat;
+                    index_entry.sha = std::move(*sha++);
+                    index_entry.flags = static_cast<uint16_t>(std::min<size_t>(index_entry.path.size(), 0xFFF)); // Bit 0-11: name length
+                    staged.push_back(std::move(index_entry));
+                }
+                reads.clear();
+                read_paths.clear();
+            };
+            for (const auto& file_entry : scan_worktree(repo->worktree, rel_dir, 0, &scan_ignore)) {
+                if (unchanged(file_entry.path) || outside_cone(file_entry.path)) {
+                    continue;
+                }
+                reads.emplace_back();
+                reads.back().kind = IoRequest::Kind::Read;
+                reads.back().path = repo->worktree / file_entry.path;
+                read_paths.push_back(file_entry.path);
+                if (reads.size() == IO_BATCH_SIZE) {
+                    stage_reads();
                 }
             }
-        } else if (std::filesystem::is_regular_file(path)) {
-            // Single file
-            auto rel_path = std::filesystem::relative(path, repo->worktree);
-            
-            // Read file and compute hash
-            std::ifstream file(path, std::ios::binary);
-            std::string content((std::istreambuf_iterator<char>(file)),
-                               std::istreambuf_iterator<char>());
-            file.close();
-            
-            // Hash the blob
-            std::string sha = object_hash(content, "blob", repo);
-            
-            // Create index entry
-            IndexEntry entry;
-            entry.path = rel_path.generic_string();
-            
-            // Get file stats
-            struct stat st;
-            if (stat(path.string().c_str(), &st) == 0) {
-                entry.ctime_sec = static_cast<int>(st.st_ctime);
-                entry.mtime_sec = static_cast<int>(st.st_mtime);
-                entry.mode = static_cast<int>(st.st_mode);
-                entry.uid = static_cast<int>(st.st_uid);
-                entry.gid = static_cast<int>(st.st_gid);
-                entry.file_size = static_cast<int>(st.st_size);
+            stage_reads();
+        } else if (std::filesystem::is_regular_file(status) || std::filesystem::is_symlink(status)) {
+            // Single file or symlink, named by its path in the worktree as
+            // given. The link itself must not be resolved; a path reaching
+            // the worktree another way (through a linked directory) is
+            // tried again with only its directory resolved.
+            auto outside = [](const std::string& rel) {
+                return rel.empty() || rel == "." || rel == ".." || rel.rfind("../", 0) == 0;
+            };
+            std::filesystem::path worktree = repo->worktree.lexically_normal();
+            std::string rel = path.lexically_normal().lexically_relative(worktree).generic_string();
+            if (outside(rel)) {
+                std::error_code ec;
+                std::filesystem::path dir = std::filesystem::weakly_canonical(path.parent_path(), ec);
+                rel = (dir / path.filename()).lexically_relative(std::filesystem::weakly_canonical(worktree, ec))
+                          .generic_string();
+            }
+            if (outside(rel)) {
+                std::cerr << "Error: '" << path_str << "' is outside repository" << std::endl;
+                continue;
+            }
+            if (unchanged(rel) || outside_cone(rel) || ignored(rel, false)) {
+                continue;
+            }
+
+            // Stat and read it as the directory walk does: a symlink's
+            // blob is its target
+            std::vector<IoRequest> read(1);
+            read[0].kind = IoRequest::Kind::Read;
+            read[0].path = path;
+            io.run(read);
+            if (!read[0].ok) {
+                std::cerr << "Error: unable to read '" << path_str << "'" << std::endl;
+                continue;
             }
-            
-            entry.sha = sha;
-            entry.flags = static_cast<int>(entry.path.size() & 0xFFF);
-            
-            // Add to index
-            index.add_entry(entry);
+
+            IndexEntry entry;
+            entry.path = rel;
+            entry.stat = read[0].stat;
+            entry.sha = object_hash(read[0].data, "blob", repo);
+            entry.flags = static_cast<uint16_t>(std::min<size_t>(entry.path.size(), 0xFFF));
+
+            staged.push_back(std::move(entry));
         }
     }
+
+    if (!ignored_paths.empty()) {
+        std::cerr << "The following paths are ignored by one of your .gitignore files:" << std::endl;
+        for (const auto& rel : ignored_paths) {
+            std::cerr << rel << std::endl;
+        }
+    }
+
+    // The blobs must be there before the index refers to them
+    transaction.commit();
+
+    // Add to index
+    index.add_entries(std::move(staged));
     
     // Write index back to disk
     if (index.write(*repo)) {
@@ -280,17 +467,43 @@ void cmd_add(const ParsedArgs& args, Repository* repo) {
 
 // Implementation of cmd_check_ignore to handle multiple paths
 void cmd_check_ignore(const ParsedArgs& args, Repository* repo) {
-    // Get paths from positional arguments (for multiple files)
-    std::vector<std::string> paths = args.positional_args;
+    bool verbose = parse_bool_flag(args, "verbose");
+    Index index(*repo);
+    IgnoreRules rules(*repo);
 
-    // Process each path to check if it's ignored
-    for (const auto& path : paths) {
-        // In a real implementation, this would check the ignore patterns
-        // For now, just print the path being checked
-        std::cout << "Checking ignore status for: " << path << std::endl;
-        // Example: if the file matches a pattern in .gitignore, print it
-        // For now, assume no files are ignored
-        std::cout << path << " is not ignored" << std::endl;
+    for (const auto& path_str : args.positional_args) {
+        std::filesystem::path path(path_str);
+        if (path.is_relative()) {
+            path = repo->worktree / path;
+        }
+        std::string rel = std::filesystem::path(path).lexically_relative(repo->worktree).generic_string();
+        while (!rel.empty() && rel.back() == '/') {
+            rel.pop_back();
+        }
+        // tracked files aren't subject to ignore rules
+        if (rel.empty() || rel == "." || index.find(rel)) {
+            continue;
+        }
+
+        // an ignored parent directory decides, then the path itself
+        const IgnorePattern* pattern = nullptr;
+        for (size_t slash = rel.find('/'); slash != std::string::npos && !pattern; slash = rel.find('/', slash + 1)) {
+            pattern = rules.match(rel.substr(0, slash), true);
+            if (pattern && pattern->negated) {
+                pattern = nullptr;
+            }
+        }
+        if (!pattern) {
+            std::error_code ec;
+            pattern = rules.match(rel, std::filesystem::is_directory(path, ec));
+        }
+
+        if (pattern && verbose) {
+            std::cout << rules.last_source() << ":" << pattern->line_number << ":" << pattern->line << "\t"
+                      << path_str << std::endl;
+        } else if (pattern && !pattern->negated) {
+            std::cout << path_str << std::endl;
+        }
     }
 }
 
@@ -298,12 +511,60 @@ void cmd_check_ignore(const ParsedArgs& args, Repository* repo) {
 void cmd_rm(const ParsedArgs& args, Repository* repo) {
     // Get paths from positional arguments (for multiple files)
     std::vector<std::string> paths = args.positional_args;
+    bool cached = parse_bool_flag(args, "cached");
+
+    if (paths.empty()) {
+        std::cerr << "Error: No paths given to remove." << std::endl;
+        return;
+    }
+
+    // Load index, locked until it's written back
+    Index index;
+    if (!lock_index(index, *repo)) {
+        return;
+    }
+
+    // Collect the staged paths first: a path names either one entry or
+    // every entry under a directory
+    std::vector<std::string> removed;
+    for (const auto& path_str : paths) {
+        std::filesystem::path path(path_str);
+        if (path.is_absolute()) {
+            path = path.lexically_relative(repo->worktree);
+        }
+        std::string rel = path.lexically_normal().generic_string();
+        while (!rel.empty() && rel.back() == '/') {
+            rel.pop_back();
+        }
+
+        if (index.find(rel)) {
+            removed.push_back(rel);
+            continue;
+        }
+        auto [first, last] = index.directory_range(rel == "." ? "" : rel);
+        if (first == last) {
+            std::cerr << "Error: pathspec '" << path_str << "' did not match any files" << std::endl;
+            return;
+        }
+        for (size_t pos = first; pos < last; pos++) {
+            removed.emplace_back(index[pos].path());
+        }
+    }
+
+    // Remove them from the index, and from the worktree unless --cached
+    for (const auto& rel : removed) {
+        if (!index.remove_entry(rel)) {
+            continue;
+        }
+        if (!cached) {
+            std::error_code ec;
+            std::filesystem::remove(repo->worktree / rel, ec);
+        }
+        std::cout << "rm '" << rel << "'" << std::endl;
+    }
 
-    // Process each path for removal
-    for (const auto& path : paths) {
-        // In a real implementation, this would call the actual rm logic
-        // For now, just print the path being removed
-        std::cout << "Would remove: " << path << std::endl;
+    if (!index.write(*repo)) {
+        std::cerr << "Error: Failed to write index." << std::endl;
     }
 }
 
@@ -442,10 +703,12 @@ void cmd_checkout(const ParsedArgs& args, Repository* repo) {
                 std::cerr << "Error: Target path must be a directory." << std::endl;
                 return;
             }
-            // if it's not empty
-            if (!std::filesystem::is_empty(target_path)) {
-                std::cerr << "Error: Target directory must be empty." << std::endl;
-                return;
+            // if it's not empty (a lone .git is fine, so the worktree itself can be a target)
+            for (const auto& dir_entry : std::filesystem::directory_iterator(target_path)) {
+                if (dir_entry.path().filename() != ".git") {
+                    std::cerr << "Error: Target directory must be empty." << std::endl;
+                    return;
+                }
             }
         } else {
             std::filesystem::create_directories(target_path);
@@ -456,16 +719,135 @@ void cmd_checkout(const ParsedArgs& args, Repository* repo) {
         return;
     }
 
-    // perform checkout
-    tree_checkout(repo, *tree, target_path);
+    // if the target lies inside the worktree, record what we write in the index,
+    // so a following status only has to compare stat data
+    std::filesystem::path rel_target = std::filesystem::weakly_canonical(target_path)
+        .lexically_relative(std::filesystem::weakly_canonical(repo->worktree));
+    bool in_worktree = !rel_target.empty() && *rel_target.begin() != "..";
+
+    if (!in_worktree) {
+        tree_checkout(repo, *tree, target_path);
+        return;
+    }
+
+    // the worktree root gets a fresh index, a subdirectory only replaces its own paths
+    std::string prefix;
+    Index index;
+    if (!lock_index(index, *repo, rel_target != ".")) {
+        return;
+    }
+    if (rel_target != ".") {
+        // what the index had there is replaced by the tree, not merged
+        // with it: drop the entries under the target (or a file in its
+        // place) first
+        std::string dir = rel_target.generic_string();
+        index.remove_entry(dir);
+        auto range = index.directory_range(dir);
+        if (range.first < range.second) {
+            index.remove_ranges({range});
+        }
+        prefix = dir + "/";
+    }
+
+    // perform checkout, leaving out what the sparse-checkout cone doesn't want
+    std::optional<SparseCheckout> sparse = SparseCheckout::load(*repo);
+    tree_checkout(repo, *tree, target_path, &index, prefix, sparse ? &*sparse : nullptr);
+
+    if (!index.write(*repo)) {
+        std::cerr << "Error: Failed to write index." << std::endl;
+    }
 }
 
-void tree_checkout(Repository* repo, const GitTree& tree, const std::filesystem::path& target_path) {
+// The blobs a checkout writes, sent to the disk a batch at a time, with
+// the index entries they get once their stat data is known
+class CheckoutWrites {
+public:
+    CheckoutWrites(Repository* repo, Index* index) : io(*repo), index(index) {}
+
+    void add(const std::filesystem::path& destination, std::string data, const GitTreeLeaf& leaf,
+             const std::string& prefix) {
+        IndexEntry entry(prefix + leaf.path);
+        entry.stat.mode = index_mode_from_stat(static_cast<uint32_t>(std::stoul(leaf.mode, nullptr, 8)));
+        entry.sha = leaf.sha;
+        entry.flags = static_cast<uint16_t>(std::min<size_t>(entry.path.size(), 0xFFF));
+
+        // a symlink's blob is its target, and it's created as a link right
+        // away. Where links can't be made, the target is written to a
+        // plain file, as Git does with core.symlinks=false: the entry keeps
+        // the link's mode and gets the stat data of that file.
+        if (entry.stat.mode == 0120000) {
+            std::error_code ec;
+            std::filesystem::create_symlink(data, destination, ec);
+            if (!ec && index_stat(entry.stat, destination)) {
+                links.push_back(std::move(entry));
+                return;
+            }
+        }
+
+        // the blob of an executable file gets the execute bits
+        IoRequest request;
+        request.kind = IoRequest::Kind::Write;
+        request.path = destination;
+        request.mode = leaf.mode == "100755" ? 0777 : 0666;
+        bytes += data.size();
+        request.data = std::move(data);
+        writes.push_back(std::move(request));
+        entries.push_back(std::move(entry));
+
+        if (writes.size() == IO_BATCH_SIZE || bytes >= MAX_PENDING_BYTES) {
+            flush();
+        }
+    }
+
+    void flush() {
+        io.run(writes);
+        std::vector<IndexEntry> written = std::move(links);
+        for (size_t i = 0; i < writes.size(); i++) {
+            if (!writes[i].ok) {
+                std::cerr << "Warning: Could not write file '" << writes[i].path.string() << "'." << std::endl;
+                continue;
+            }
+            // the stat of the file written, keeping the mode recorded in the tree
+            uint32_t mode = entries[i].stat.mode;
+            entries[i].stat = writes[i].stat;
+            entries[i].stat.mode = mode;
+            written.push_back(std::move(entries[i]));
+        }
+        if (index) {
+            index->add_entries(std::move(written));
+        }
+        writes.clear();
+        entries.clear();
+        links.clear();
+        bytes = 0;
+    }
+
+private:
+    // Blob contents held before a batch goes out regardless of its size
+    static constexpr size_t MAX_PENDING_BYTES = 64 * 1024 * 1024;
+
+    IoBatch io;
+    Index* index;
+    std::vector<IoRequest> writes;
+    std::vector<IndexEntry> entries;
+    std::vector<IndexEntry> links;     // symlinks, created already
+    size_t bytes = 0;
+};
+
+void checkout_tree(Repository* repo, const GitTree& tree, const std::filesystem::path& target_path,
+                   Index* index, const std::string& prefix, const SparseCheckout* sparse, CheckoutWrites& writes) {
     // get the leaves of the tree
     const auto& leaves = tree.get_leaves();
 
     // for each leaf in the tree
     for (const auto& leaf : leaves) {
+        // a directory outside the sparse-checkout cone only goes into the index
+        if (sparse && index && leaf.mode == "040000" &&
+            sparse->match_dir(prefix + leaf.path) == SparseCheckout::DirMatch::Outside) {
+            sparse_skip_tree(*index, repo, leaf.sha, prefix + leaf.path, sparse->sparse_index);
+            continue;
+        }
+
         // read the object
         auto obj_opt = object_read(repo, const_cast<char*>(leaf.sha.c_str()));
         // if the object is not found, print warning and continue
@@ -493,7 +875,7 @@ void tree_checkout(Repository* repo, const GitTree& tree, const std::filesystem:
             GitTree* subtree = dynamic_cast<GitTree*>(obj.get());
             // if the cast was successful, recurse
             if (subtree) {
-                tree_checkout(repo, *subtree, destination);
+                checkout_tree(repo, *subtree, destination, index, prefix + leaf.path + "/", sparse, writes);
             }
         // if the object is a blob, write to file
         } else if (obj->get_fmt() == "blob") {
@@ -503,18 +885,8 @@ void tree_checkout(Repository* repo, const GitTree& tree, const std::filesystem:
                 std::filesystem::create_directories(destination.parent_path(), ec);
             }
 
-            // write blob data to file
-            std::ofstream file(destination, std::ios::binary);
-
-            // if file could not be opened, print warning and continue
-            if (!file.is_open()) {
-                std::cerr << "Warning: Could not write file '" << destination.string() << "'." << std::endl;
-                continue;
-            }
-
-            // serialize the object and write to file
-            std::string data = obj->serialize();
-            file.write(data.data(), data.size());
+            // queue the blob for writing, and for the index once written
+            writes.add(destination, obj->serialize(), leaf, prefix);
         } else {
             // unsupported object type
             std::cerr << "Warning: Unsupported object type '" << obj->get_fmt() << "' for path '" << leaf.path << "'." << std::endl;
@@ -522,6 +894,13 @@ void tree_checkout(Repository* repo, const GitTree& tree, const std::filesystem:
     }
 }
 
+void tree_checkout(Repository* repo, const GitTree& tree, const std::filesystem::path& target_path,
+                   Index* index, const std::string& prefix, const SparseCheckout* sparse) {
+    CheckoutWrites writes(repo, index);
+    checkout_tree(repo, tree, target_path, index, prefix, sparse, writes);
+    writes.flush();
+}
+
 void cmd_commit(const ParsedArgs& args, Repository* repo) {
     // Get commit message
     std::string message = args.get("message");
@@ -531,17 +910,25 @@ void cmd_commit(const ParsedArgs& args, Repository* repo) {
         return;
     }
     
-    // Load index
-    Index index(*repo);
-    const auto& entries = index.get_entries();
-    
-    if (entries.empty()) {
+    // Load index, locked until the cached trees are written back
+    Index index;
+    if (!lock_index(index, *repo)) {
+        return;
+    }
+    if (index.empty()) {
         std::cerr << "Error: nothing to commit" << std::endl;
         return;
     }
     
-    // Build nested trees from index paths and write the root tree object.
-    std::string tree_sha = build_tree_from_index(entries, repo);
+    // Write the trees that changed since the last commit (into one pack if
+    // there are many) and remember them in the index, so the next commit
+    // can skip them too.
+    OdbTransaction transaction(*repo);
+    std::string tree_sha = build_tree_from_index(index, repo);
+    transaction.commit();
+    if (!index.write(*repo)) {
+        std::cerr << "Warning: Failed to update the cached trees in the index." << std::endl;
+    }
     
     // Get parent commit (HEAD)
     auto head_ref = ref_resolve(*repo, "HEAD");
@@ -565,8 +952,14 @@ void cmd_commit(const ParsedArgs& args, Repository* repo) {
     std::string commit_sha = write_raw_object("commit", commit_data, repo);
     
     // Update the reference that HEAD points to (e.g. refs/heads/main).
+    // Only if no other commit moved it since HEAD was read
     std::string target_ref = head_target_ref(*repo);
-    ref_create(repo, target_ref, commit_sha);
+    try {
+        ref_create(repo, target_ref, commit_sha, parent_sha);
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return;
+    }
     
     std::cout << "[" << branch_name_from_ref(target_ref) << " " << commit_sha.substr(0, 7) << "] " << message << std::endl;
 }
@@ -598,8 +991,8 @@ void cmd_hash_object(const ParsedArgs& args, Repository* repo) {
                         std::istreambuf_iterator<char>());
     file.close();
 
-    // Call object_hash to compute the SHA1 hash
-    std::string sha = object_hash(content, type, write ? repo : nullptr);
+    // Call object_hash to compute the object id, in the repository's object format
+    std::string sha = object_hash(content, type, repo, write);
 
     // Print the SHA
     std::cout << sha << std::endl;
@@ -621,8 +1014,16 @@ void cmd_init(const ParsedArgs& args, Repository* repo) {
         init_path = "."; // Default to current directory if no path provided
     }
 
+    // Hash function for the repository's object ids (sha1 unless asked otherwise)
+    std::string format_name = args.get("object-format", "sha1");
+    std::optional<ObjectFormat> format = parse_object_format(format_name);
+    if (!format) {
+        std::cerr << "Error: unknown object format '" << format_name << "'" << std::endl;
+        return;
+    }
+
     try {
-        Repository new_repo = repo_create(init_path); // Call repo_create which returns a Repository object
+        Repository new_repo = repo_create(init_path, *format); // Call repo_create which returns a Repository object
         std::cout << "Initialized empty Silt repository in " << new_repo.gitdir << std::endl;
     } catch (const std::exception& e) {
         std::cerr << "Error initializing repository: " << e.what() << std::endl;
@@ -741,15 +1142,42 @@ std::string log_graphviz(Repository* repo, std::string sha, std::set<std::string
 void cmd_ls_files(const ParsedArgs& args, Repository* repo) {
     // Load index
     Index index(*repo);
-    
-    // Get all entries
-    const auto& entries = index.get_entries();
-    
-    // Print each entry
-    for (const auto& entry : entries) {
+
+    auto print_entry = [](const IndexEntryRef& entry) {
         // Print: [mode] [object] [stage] [file]
         // Format similar to: 100644 blob_sha 0	filename
-        printf("%06o %s %d\t%s\n", entry.mode, entry.sha.substr(0, 7).c_str(), 0, entry.path.c_str());
+        std::string path(entry.path());
+        printf("%06o %s %d\t%s\n", entry.mode(), entry.sha().substr(0, 7).c_str(), 0, path.c_str());
+    };
+
+    // Without pathspecs, print each entry
+    if (args.positional_args.empty()) {
+        for (const auto entry : index) {
+            print_entry(entry);
+        }
+        return;
+    }
+
+    // Otherwise print the entries matching each path, either the file
+    // itself or everything under it. Entries are sorted, so a directory
+    // is a contiguous range found by binary search.
+    for (const auto& spec : args.positional_args) {
+        std::string path = std::filesystem::path(spec).lexically_normal().generic_string();
+        while (!path.empty() && path.back() == '/') {
+            path.pop_back();
+        }
+        if (path == ".") {
+            path.clear();
+        }
+
+        if (auto pos = index.find(path)) {
+            print_entry(index[*pos]);
+            continue;
+        }
+        auto [first, last] = index.directory_range(path);
+        for (size_t pos = first; pos < last; pos++) {
+            print_entry(index[pos]);
+        }
     }
 }
 
@@ -926,9 +1354,658 @@ void show_ref(Repository* repo, const std::map<std::string, std::string>& refs,
     }
 }
 
-void cmd_status(const ParsedArgs& args, Repository* repo) {
-    // Load index
+// Leaves of the tree `sha`, none for an empty sha
+std::vector<GitTreeLeaf> read_tree_leaves(Repository* repo, const std::string& sha) {
+    if (sha.empty()) {
+        return {};
+    }
+    auto obj = object_read(repo, const_cast<char*>(sha.c_str()));
+    GitTree* tree = obj ? dynamic_cast<GitTree*>(obj->get()) : nullptr;
+    if (!tree) {
+        std::cerr << "Warning: Unable to read tree '" << sha << "'." << std::endl;
+        return {};
+    }
+    return tree->get_leaves();
+}
+
+bool is_tree_mode(uint32_t mode) {
+    return (mode & 0170000) == 0040000;
+}
+
+// Compare two versions of a file, by type first, then by content and mode
+void compare_file(uint32_t old_mode, const std::string& old_sha, uint32_t new_mode, const std::string& new_sha,
+                  const std::string& path, std::vector<std::pair<std::string, std::string>>& changes) {
+    if ((old_mode & 0170000) != (new_mode & 0170000)) {
+        changes.emplace_back("typechange", path);
+    } else if (old_sha != new_sha || old_mode != new_mode) {
+        changes.emplace_back("modified", path);
+    }
+}
+
+// Append the differences between the trees `old_sha` and `new_sha` (either
+// may be empty, for no tree) of the directory `prefix` to `changes`.
+// Entries of both are in Git order, where a directory sorts as if its name
+// ended in '/', so one merged pass finds each name on both sides.
+void diff_trees(Repository* repo, const std::string& old_sha, const std::string& new_sha, const std::string& prefix,
+                std::vector<std::pair<std::string, std::string>>& changes) {
+    if (old_sha == new_sha) {
+        return;
+    }
+    std::vector<GitTreeLeaf> old_leaves = read_tree_leaves(repo, old_sha);
+    std::vector<GitTreeLeaf> new_leaves = read_tree_leaves(repo, new_sha);
+    auto key = [](const GitTreeLeaf& leaf) {
+        return is_tree_mode(std::stoul(leaf.mode, nullptr, 8)) ? leaf.path + "/" : leaf.path;
+    };
+
+    size_t o = 0;
+    size_t n = 0;
+    while (o < old_leaves.size() || n < new_leaves.size()) {
+        int cmp = o == old_leaves.size() ? 1 : n == new_leaves.size() ? -1
+                : key(old_leaves[o]).compare(key(new_leaves[n]));
+        const GitTreeLeaf* old_leaf = cmp <= 0 ? &old_leaves[o++] : nullptr;
+        const GitTreeLeaf* new_leaf = cmp >= 0 ? &new_leaves[n++] : nullptr;
+        const GitTreeLeaf& leaf = old_leaf ? *old_leaf : *new_leaf;
+        std::string path = prefix + leaf.path;
+
+        if (is_tree_mode(std::stoul(leaf.mode, nullptr, 8))) {
+            diff_trees(repo, old_leaf ? old_leaf->sha : "", new_leaf ? new_leaf->sha : "", path + "/", changes);
+        } else if (!new_leaf) {
+            changes.emplace_back("deleted", path);
+        } else if (!old_leaf) {
+            changes.emplace_back("new file", path);
+        } else {
+            compare_file(std::stoul(old_leaf->mode, nullptr, 8), old_leaf->sha,
+                         std::stoul(new_leaf->mode, nullptr, 8), new_leaf->sha, path, changes);
+        }
+    }
+}
+
+// Walk the tree `tree_sha` of directory `prefix` alongside the index entries
+// [first, last) under it, appending the differences to `changes`. A cache
+// tree node with the same id means the entries haven't changed since that
+// tree, so the whole directory is skipped without reading it.
+void diff_index_tree(const Index& index, Repository* repo, const std::string& tree_sha, const CacheTree* node,
+                     size_t first, size_t last, const std::string& prefix,
+                     std::vector<std::pair<std::string, std::string>>& changes) {
+    if (!tree_sha.empty() && node && node->valid() && node->sha(index.oid_size()) == tree_sha) {
+        return;
+    }
+    // a sparse directory entry is compared as the tree it is
+    if (!prefix.empty() && first < last && index[first].path().size() == prefix.size()) {
+        diff_trees(repo, tree_sha, index[first].sha(), prefix, changes);
+        return;
+    }
+
+    std::vector<GitTreeLeaf> leaves = read_tree_leaves(repo, tree_sha);
+    size_t pos = first;
+    size_t l = 0;
+    while (pos < last || l < leaves.size()) {
+        // the next name in the index: a file, or a directory and its range
+        std::string_view path;
+        std::string_view name;
+        size_t next = pos + 1;
+        if (pos < last) {
+            path = index[pos].path();
+            name = path.substr(prefix.size());
+            size_t slash = name.find('/');
+            if (slash != std::string_view::npos) {
+                name = name.substr(0, slash + 1);
+                next = index.directory_range(path.substr(0, prefix.size() + slash)).second;
+            }
+        }
+
+        std::string leaf_key;
+        if (l < leaves.size()) {
+            bool dir = is_tree_mode(std::stoul(leaves[l].mode, nullptr, 8));
+            leaf_key = dir ? leaves[l].path + "/" : leaves[l].path;
+        }
+        int cmp = pos == last ? 1 : l == leaves.size() ? -1 : name.compare(leaf_key);
+        bool dir = cmp <= 0 ? name.back() == '/' : leaf_key.back() == '/';
+        std::string dir_prefix = prefix + std::string(cmp <= 0 ? name : std::string_view(leaf_key));
+
+        if (cmp < 0) {
+            // only in the index
+            if (dir) {
+                diff_index_tree(index, repo, "", nullptr, pos, next, dir_prefix, changes);
+            } else {
+                changes.emplace_back("new file", std::string(path));
+            }
+            pos = next;
+        } else if (cmp > 0) {
+            // only in HEAD
+            if (dir) {
+                diff_trees(repo, leaves[l].sha, "", dir_prefix, changes);
+            } else {
+                changes.emplace_back("deleted", prefix + leaves[l].path);
+            }
+            l++;
+        } else {
+            if (dir) {
+                const CacheTree* child = nullptr;
+                if (node) {
+                    child = node->find_subtree(name.substr(0, name.size() - 1));
+                }
+                diff_index_tree(index, repo, leaves[l].sha, child, pos, next, dir_prefix, changes);
+            } else {
+                IndexEntryRef entry = index[pos];
+                compare_file(std::stoul(leaves[l].mode, nullptr, 8), leaves[l].sha, entry.mode(), entry.sha(),
+                             std::string(path), changes);
+            }
+            pos = next;
+            l++;
+        }
+    }
+}
+
+std::vector<std::pair<std::string, std::string>> index_tree_changes(const Index& index, Repository* repo,
+                                                                    const std::string& tree_sha) {
+    std::vector<std::pair<std::string, std::string>> changes;
+    diff_index_tree(index, repo, tree_sha, &index.cache_tree(), 0, index.size(), "", changes);
+    return changes;
+}
+
+// One side of a file in a diff: its mode (0 if the file isn't there), its
+// blob id, and its contents once known
+struct DiffSide {
+    uint32_t mode = 0;
+    std::string sha;
+    std::optional<std::string> content;
+};
+
+// The mode and blob id of the file at `path` in the tree `tree_sha`, if
+// it has one. Trees read on the way are kept in `trees` for the next path.
+std::optional<DiffSide> tree_file_at(Repository* repo, const std::string& tree_sha, std::string_view path,
+                                     std::map<std::string, std::vector<GitTreeLeaf>>& trees) {
+    std::string sha = tree_sha;
+    while (!sha.empty()) {
+        auto cached = trees.find(sha);
+        if (cached == trees.end()) {
+            cached = trees.emplace(sha, read_tree_leaves(repo, sha)).first;
+        }
+        size_t slash = path.find('/');
+        std::string_view name = path.substr(0, slash);
+        const GitTreeLeaf* found = nullptr;
+        for (const auto& leaf : cached->second) {
+            if (leaf.path == name) {
+                found = &leaf;
+                break;
+            }
+        }
+        if (!found) {
+            break;
+        }
+        uint32_t mode = std::stoul(found->mode, nullptr, 8);
+        if (slash == std::string_view::npos) {
+            if (is_tree_mode(mode)) {
+                break;
+            }
+            return DiffSide{mode, found->sha, std::nullopt};
+        }
+        if (!is_tree_mode(mode)) {
+            break;
+        }
+        sha = found->sha;
+        path = path.substr(slash + 1);
+    }
+    return std::nullopt;
+}
+
+// The file at `path` as the index has it, looking into the tree of a
+// sparse directory entry if the path is under one
+std::optional<DiffSide> index_file_at(const Index& index, Repository* repo, const std::string& path,
+                                      std::map<std::string, std::vector<GitTreeLeaf>>& trees) {
+    if (auto pos = index.find(path)) {
+        return DiffSide{index[*pos].mode(), index[*pos].sha(), std::nullopt};
+    }
+    for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        auto pos = index.find(std::string_view(path).substr(0, slash + 1));
+        if (pos && index[*pos].sparse_dir()) {
+            return tree_file_at(repo, index[*pos].sha(), std::string_view(path).substr(slash + 1), trees);
+        }
+    }
+    return std::nullopt;
+}
+
+// Print the diff of one file between `old_side` and `new_side`, in Git's
+// format; nothing if the two are the same
+void print_file_diff(Repository* repo, const std::string& path, DiffSide old_side, DiffSide new_side, size_t context,
+                     DiffAlgorithm algorithm) {
+    if (old_side.mode == new_side.mode && old_side.sha == new_side.sha) {
+        return;
+    }
+    // a file that became a symlink (or the other way) is removed and added
+    if (old_side.mode && new_side.mode && (old_side.mode & 0170000) != (new_side.mode & 0170000)) {
+        print_file_diff(repo, path, old_side, DiffSide(), context, algorithm);
+        print_file_diff(repo, path, DiffSide(), new_side, context, algorithm);
+        return;
+    }
+
+    auto load = [repo](DiffSide& side) {
+        if (!side.mode) {
+            side.content = std::string();
+        } else if (!side.content) {
+            auto obj = object_read(repo, const_cast<char*>(side.sha.c_str()));
+            side.content = obj ? (*obj)->serialize() : std::string();
+        }
+    };
+    load(old_side);
+    load(new_side);
+
+    auto mode_str = [](uint32_t mode) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "%06o", mode);
+        return std::string(buf);
+    };
+    auto abbrev = [](const DiffSide& side) { return side.mode ? side.sha.substr(0, 7) : std::string(7, '0'); };
+
+    std::cout << "diff --git a/" << path << " b/" << path << "\n";
+    if (!old_side.mode) {
+        std::cout << "new file mode " << mode_str(new_side.mode) << "\n";
+    } else if (!new_side.mode) {
+        std::cout << "deleted file mode " << mode_str(old_side.mode) << "\n";
+    } else if (old_side.mode != new_side.mode) {
+        std::cout << "old mode " << mode_str(old_side.mode) << "\n";
+        std::cout << "new mode " << mode_str(new_side.mode) << "\n";
+    }
+    if (old_side.sha == new_side.sha) {
+        return;
+    }
+    std::cout << "index " << abbrev(old_side) << ".." << abbrev(new_side);
+    if (old_side.mode == new_side.mode) {
+        std::cout << " " << mode_str(new_side.mode);
+    }
+    std::cout << "\n";
+
+    std::string old_name = old_side.mode ? "a/" + path : "/dev/null";
+    std::string new_name = new_side.mode ? "b/" + path : "/dev/null";
+    if (diff_is_binary(*old_side.content) || diff_is_binary(*new_side.content)) {
+        std::cout << "Binary files " << old_name << " and " << new_name << " differ\n";
+        return;
+    }
+    std::cout << "--- " << old_name << "\n";
+    std::cout << "+++ " << new_name << "\n";
+    std::cout << unified_diff(*old_side.content, *new_side.content, context, algorithm);
+}
+
+// The tree of the commit (or tree) `name`; empty for HEAD before the first commit
+std::string diff_tree_of(Repository* repo, const std::string& name) {
+    if (name == "HEAD" && !ref_resolve(*repo, "HEAD")) {
+        return "";
+    }
+    return object_find(repo, name, "tree", true);
+}
+
+void cmd_diff(const ParsedArgs& args, Repository* repo) {
+    bool cached = parse_bool_flag(args, "cached") || parse_bool_flag(args, "staged");
+    const std::vector<std::string>& commits = args.positional_args;
+    size_t context = 3;
+    try {
+        context = std::stoul(args.get("unified", "3"));
+    } catch (const std::exception&) {
+        std::cerr << "Error: Invalid context line count: " << args.get("unified") << std::endl;
+        return;
+    }
+    ConfigParser config;
+    config.read((repo->gitdir / "config").string());
+    DiffAlgorithm algorithm = DiffAlgorithm::Myers;
+    // the option is empty when it isn't given
+    std::string algorithm_name = args.get("diff-algorithm");
+    if (algorithm_name.empty()) {
+        algorithm_name = config.get("diff", "algorithm", "myers");
+    }
+    if (!parse_diff_algorithm(algorithm_name, algorithm)) {
+        std::cerr << "Error: Unknown diff algorithm: " << algorithm_name << std::endl;
+        return;
+    }
+    if (commits.size() > 2 || (cached && commits.size() > 1) || (!cached && commits.size() == 1)) {
+        std::cerr << "Error: Usage: silt diff [--cached [<commit>]] | <commit> <commit>" << std::endl;
+        return;
+    }
+    std::map<std::string, std::vector<GitTreeLeaf>> trees;
+    std::vector<std::string> commit_trees;
+    try {
+        if (cached) {
+            commit_trees.push_back(diff_tree_of(repo, commits.empty() ? "HEAD" : commits[0]));
+        }
+        for (size_t i = cached ? 1 : 0; i < commits.size(); i++) {
+            commit_trees.push_back(diff_tree_of(repo, commits[i]));
+        }
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return;
+    }
+
+    // commit against commit
+    if (commits.size() == 2) {
+        const std::string& old_tree = commit_trees[0];
+        const std::string& new_tree = commit_trees[1];
+        std::vector<std::pair<std::string, std::string>> changes;
+        diff_trees(repo, old_tree, new_tree, "", changes);
+        for (const auto& [change, path] : changes) {
+            print_file_diff(repo, path, tree_file_at(repo, old_tree, path, trees).value_or(DiffSide()),
+                            tree_file_at(repo, new_tree, path, trees).value_or(DiffSide()), context, algorithm);
+        }
+        return;
+    }
+
     Index index(*repo);
+
+    // index against HEAD (or the commit given)
+    if (cached) {
+        const std::string& tree = commit_trees[0];
+        for (const auto& [change, path] : index_tree_changes(index, repo, tree)) {
+            print_file_diff(repo, path, tree_file_at(repo, tree, path, trees).value_or(DiffSide()),
+                            index_file_at(index, repo, path, trees).value_or(DiffSide()), context, algorithm);
+        }
+        return;
+    }
+
+    // worktree against index: stat a window of entries in one batch, then
+    // read the ones whose stat data changed (or can't be trusted), as status
+    // does. With core.filemode=false, the executable bit isn't looked at.
+    bool filemode = config.get("core", "filemode", "true") != "false";
+    IoBatch io(*repo);
+    std::vector<size_t> window;
+    std::vector<IoRequest> stats;
+    std::vector<IoRequest> reads;
+    for (size_t start = 0; start < index.size();) {
+        window.clear();
+        stats.clear();
+        for (; start < index.size() && window.size() < IO_BATCH_SIZE; start++) {
+            if (index[start].skip_worktree()) {
+                continue;
+            }
+            window.push_back(start);
+            stats.emplace_back();
+            stats.back().path = repo->worktree / index[start].path();
+        }
+        io.run(stats);
+
+        reads.clear();
+        for (size_t i = 0; i < window.size(); i++) {
+            auto entry = index[window[i]];
+            if (stats[i].ok && !entry.stat_clean(stats[i].stat)) {
+                reads.emplace_back();
+                reads.back().kind = IoRequest::Kind::Read;
+                reads.back().path = stats[i].path;
+            }
+        }
+        io.run(reads);
+
+        auto read = reads.begin();
+        for (size_t i = 0; i < window.size(); i++) {
+            auto entry = index[window[i]];
+            DiffSide staged{entry.mode(), entry.sha(), std::nullopt};
+            std::string path(entry.path());
+            if (!stats[i].ok) {
+                print_file_diff(repo, path, staged, DiffSide(), context, algorithm);
+            } else if (read != reads.end() && read->path == stats[i].path) {
+                if (!read->ok) {
+                    print_file_diff(repo, path, staged, DiffSide(), context, algorithm);
+                } else {
+                    uint32_t mode = read->stat.mode;
+                    if (!filemode && (mode & 0170000) == 0100000 && (entry.mode() & 0170000) == 0100000) {
+                        mode = entry.mode();
+                    }
+                    DiffSide worktree{mode, object_hash(read->data, "blob", repo, false), std::move(read->data)};
+                    print_file_diff(repo, path, staged, std::move(worktree), context, algorithm);
+                }
+                ++read;
+            }
+        }
+    }
+}
+
+// The id of the blob holding the file at `path` in `format`, without
+// storing it (INDEX_OID_MAX bytes, zero past the id)
+void blob_oid(const std::filesystem::path& path, ObjectFormat format, unsigned char* oid) {
+    std::ifstream file(path, std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::string header = "blob " + std::to_string(content.size()) + '\0';
+    std::fill(oid, oid + INDEX_OID_MAX, 0);
+    with_object_format(format, [&](auto algo) {
+        typename decltype(algo)::Context ctx;
+        ctx.update(header.data(), header.size());
+        ctx.update(content.data(), content.size());
+        ctx.final(oid);
+    });
+}
+
+// The object id of the ignore file at `path` (worktree-relative `rel`),
+// from its index entry when that's clean, else hashed; null if there's none
+void ignore_file_oid(const Index& index, const std::filesystem::path& path, const std::string& rel,
+                     unsigned char* oid) {
+    IndexStat current;
+    if (!index_stat(current, path)) {
+        std::fill(oid, oid + INDEX_OID_MAX, 0);
+        return;
+    }
+    auto pos = index.find(rel);
+    if (pos && index[*pos].stat_clean(current)) {
+        std::fill(oid, oid + INDEX_OID_MAX, 0);
+        std::memcpy(oid, index[*pos].oid(), index.oid_size());
+        return;
+    }
+    blob_oid(path, index.object_format(), oid);
+}
+
+// Refresh the recorded stat data and id of a global exclude file; true if
+// its contents changed
+bool refresh_exclude_file(const std::filesystem::path& path, ObjectFormat format, IndexStat& stat,
+                          unsigned char* oid) {
+    IndexStat current;
+    if (!path.empty() && index_stat(current, path)) {
+        current.mode = 0;
+    }
+    if (index_stat_matches(stat, current) && !std::all_of(oid, oid + INDEX_OID_MAX, [](unsigned char c) { return c == 0; })) {
+        return false;
+    }
+
+    unsigned char current_oid[INDEX_OID_MAX] = {};
+    if (current.mtime_sec || current.ino) {
+        blob_oid(path, format, current_oid);
+    }
+    stat = current;
+    bool changed = std::memcmp(oid, current_oid, INDEX_OID_MAX) != 0;
+    std::memcpy(oid, current_oid, INDEX_OID_MAX);
+    return changed;
+}
+
+void invalidate_untracked_dir(UntrackedCacheDir& node) {
+    node.valid = false;
+    for (auto& sub : node.dirs) {
+        invalidate_untracked_dir(sub);
+    }
+}
+
+// Append the untracked files under `dir` (relative path `rel`, empty or
+// ending in '/') to `out`, leaving out what `ignore` matches. Directories
+// whose stat data and .gitignore still match the cache reuse its list; the
+// others are read again and their cache entry refreshed, setting `changed`.
+// A changed .gitignore also drops the lists below it. With `monitored`,
+// valid directories are trusted without looking at them: the monitor
+// reported nothing there.
+void collect_untracked(const Index& index, UntrackedCacheDir& node, const std::filesystem::path& dir,
+                       const std::string& rel, bool monitored, IgnoreRules& ignore, std::vector<std::string>& out,
+                       bool& changed) {
+    bool trusted = monitored && node.valid;
+    IndexStat current;
+    unsigned char exclude_oid[INDEX_OID_MAX] = {};
+    if (!trusted) {
+        if (!index_stat(current, dir)) {
+            return;
+        }
+        // the cache doesn't keep the mode
+        current.mode = 0;
+
+        ignore_file_oid(index, dir / ".gitignore", rel + ".gitignore", exclude_oid);
+        if (node.valid && std::memcmp(node.exclude_oid, exclude_oid, INDEX_OID_MAX) != 0) {
+            invalidate_untracked_dir(node);
+        }
+    }
+
+    if (!trusted && (!node.valid || !index_stat_matches(node.stat, current) || index.is_racy(current))) {
+        std::vector<UntrackedCacheDir> old_dirs = std::move(node.dirs);
+        node.dirs.clear();
+        node.untracked.clear();
+
+        auto excluded = [&ignore](const std::string& path, bool is_dir) {
+            const IgnorePattern* pattern = ignore.match(path, is_dir);
+            return pattern && !pattern->negated;
+        };
+        DirListing listing;
+        read_dir(dir, listing);
+        for (const auto& file : listing.files) {
+            if (!index.find(rel + file.path) && !excluded(rel + file.path, false)) {
+                node.untracked.push_back(file.path);
+            }
+        }
+        for (const auto& name : listing.dirs) {
+            // nothing untracked in an ignored directory is shown
+            if (name != ".git" && !excluded(rel + name, true)) {
+                // keep what's cached for subdirectories that are still there
+                auto old = std::lower_bound(old_dirs.begin(), old_dirs.end(), name,
+                                            [](const UntrackedCacheDir& d, const std::string& n) { return d.name < n; });
+                if (old != old_dirs.end() && old->name == name) {
+                    node.dirs.push_back(std::move(*old));
+                } else {
+                    node.dirs.emplace_back();
+                    node.dirs.back().name = name;
+                }
+            }
+        }
+        std::sort(node.untracked.begin(), node.untracked.end());
+        std::sort(node.dirs.begin(), node.dirs.end(),
+                  [](const UntrackedCacheDir& a, const UntrackedCacheDir& b) { return a.name < b.name; });
+        std::memcpy(node.exclude_oid, exclude_oid, INDEX_OID_MAX);
+        node.stat = current;
+        node.valid = true;
+        changed = true;
+    }
+
+    for (const auto& name : node.untracked) {
+        out.push_back(rel + name);
+    }
+    for (auto& sub : node.dirs) {
+        collect_untracked(index, sub, dir / sub.name, rel + sub.name + "/", monitored, ignore, out, changed);
+    }
+}
+
+void cmd_fsmonitor_daemon(const ParsedArgs& args, Repository* repo) {
+    std::string action = args.get("action");
+    std::string worktree = std::filesystem::absolute(repo->worktree).string();
+
+    if (action == "start") {
+        if (fsmonitor_query(*repo, "")) {
+            std::cerr << "fsmonitor--daemon is already running for '" << worktree << "'" << std::endl;
+        } else if (!fsmonitor_start(*repo)) {
+            std::cerr << "Error: could not start fsmonitor--daemon" << std::endl;
+        }
+    } else if (action == "run") {
+        fsmonitor_run(*repo);
+    } else if (action == "stop") {
+        if (!fsmonitor_stop(*repo)) {
+            std::cerr << "fsmonitor--daemon is not running" << std::endl;
+        }
+    } else if (fsmonitor_query(*repo, "")) {
+        std::cout << "fsmonitor-daemon is watching '" << worktree << "'" << std::endl;
+    } else {
+        std::cout << "fsmonitor-daemon is not watching '" << worktree << "'" << std::endl;
+    }
+}
+
+void cmd_sparse_checkout(const ParsedArgs& args, Repository* repo) {
+    std::string action = args.get("action");
+    std::filesystem::path config_path = repo->gitdir / "config";
+    std::optional<SparseCheckout> current = SparseCheckout::load(*repo);
+
+    if (action == "list") {
+        if (!current) {
+            std::cerr << "Error: this worktree is not sparse" << std::endl;
+            return;
+        }
+        for (const auto& dir : current->dirs()) {
+            std::cout << dir << std::endl;
+        }
+        return;
+    }
+
+    // disable brings everything back
+    SparseCheckout cone;
+    if (action == "disable") {
+        config_set(config_path, "core", "sparseCheckout", "false");
+        config_set(config_path, "index", "sparse", "false");
+    } else {
+        // init keeps the cone there is, add extends it, set replaces it
+        std::vector<std::string> dirs = args.positional_args;
+        if (action == "add" && !current) {
+            std::cerr << "Error: no sparse-checkout to add to" << std::endl;
+            return;
+        }
+        if (current && action != "set") {
+            dirs.insert(dirs.end(), current->dirs().begin(), current->dirs().end());
+        }
+
+        std::filesystem::path patterns_path = repo->gitdir / "info" / "sparse-checkout";
+        std::error_code ec;
+        std::filesystem::create_directories(patterns_path.parent_path(), ec);
+        std::ofstream patterns(patterns_path, std::ios::binary | std::ios::trunc);
+        patterns << SparseCheckout(dirs).patterns();
+        patterns.close();
+        if (!patterns) {
+            std::cerr << "Error: could not write '" << patterns_path.string() << "'" << std::endl;
+            return;
+        }
+
+        // a sparse index unless asked otherwise
+        ConfigParser config;
+        config.read(config_path.string());
+        bool configured = config_set(config_path, "core", "sparseCheckout", "true") &&
+                          config_set(config_path, "core", "sparseCheckoutCone", "true") &&
+                          (!config.get("index", "sparse").empty() ||
+                           config_set(config_path, "index", "sparse", "true"));
+        std::optional<SparseCheckout> loaded = SparseCheckout::load(*repo);
+        if (!configured || !loaded) {
+            std::cerr << "Error: could not enable the sparse checkout" << std::endl;
+            return;
+        }
+        cone = std::move(*loaded);
+    }
+
+    // Check out and remove files to match, then fold what's left out
+    Index index;
+    if (!lock_index(index, *repo)) {
+        return;
+    }
+    if (!sparse_update_worktree(index, repo, cone)) {
+        std::cerr << "Warning: the worktree could not be fully updated" << std::endl;
+    }
+    if (cone.sparse_index) {
+        build_tree_from_index(index, repo);
+        sparse_collapse(index, cone);
+        build_tree_from_index(index, repo);
+    }
+    if (!index.write(*repo)) {
+        std::cerr << "Error: Failed to write index." << std::endl;
+    }
+}
+
+void cmd_status(const ParsedArgs& args, Repository* repo) {
+    // Load index. Refreshed caches are saved if index.lock can be taken
+    // right away, as Git's opportunistic refresh does; if another process
+    // holds it, status doesn't wait and doesn't write.
+    Index index;
+    bool locked = index.lock(*repo, 0);
+    if (!index.read(*repo)) {
+        std::cerr << "Error: Index file corrupt: " << Index::get_index_path(*repo).string() << std::endl;
+        return;
+    }
+    ConfigParser config;
+    config.read((repo->gitdir / "config").string());
+
+    // With a filesystem monitor, only what it reported needs a look
+    bool index_changed = false;
+    bool monitored = refresh_fsmonitor(index, *repo, config, index_changed);
     
     // Get current HEAD commit
     auto head_ref = ref_resolve(*repo, "HEAD");
@@ -940,93 +2017,160 @@ void cmd_status(const ParsedArgs& args, Repository* repo) {
     std::cout << "On branch master" << std::endl;
     
     // Section 1: Changes to be committed (index vs HEAD)
-    bool has_staged = false;
+    std::string head_tree;
     if (!head_sha.empty()) {
         auto commit_obj = object_read(repo, const_cast<char*>(head_sha.c_str()));
-        if (commit_obj.has_value()) {
-            GitCommit* commit = dynamic_cast<GitCommit*>(commit_obj->get());
-            if (commit) {
-                // Would compare index with HEAD tree
-                // For now, just list index entries as staged
-                const auto& entries = index.get_entries();
-                if (!entries.empty()) {
-                    has_staged = true;
-                    std::cout << "\nChanges to be committed:" << std::endl;
-                    std::cout << "  (use \"git reset HEAD <file>...\" to unstage)" << std::endl;
-                    for (const auto& entry : entries) {
-                        std::cout << "\tmodified:   " << entry.path << std::endl;
-                    }
-                }
+        GitCommit* commit = commit_obj ? dynamic_cast<GitCommit*>(commit_obj->get()) : nullptr;
+        if (commit) {
+            KVLM kvlm = kvlm_parse(commit->serialize());
+            auto tree_it = kvlm.find("tree");
+            if (tree_it != kvlm.end() && std::holds_alternative<std::string>(tree_it->second)) {
+                head_tree = std::get<std::string>(tree_it->second);
             }
         }
-    } else {
-        // Initial commit - all staged files are new
-        const auto& entries = index.get_entries();
-        if (!entries.empty()) {
-            has_staged = true;
-            std::cout << "\nChanges to be committed:" << std::endl;
+    }
+
+    auto staged = index_tree_changes(index, repo, head_tree);
+    bool has_staged = !staged.empty();
+    if (has_staged) {
+        std::cout << "\nChanges to be committed:" << std::endl;
+        if (head_sha.empty()) {
+            std::cout << "  (use \"git rm --cached <file>...\" to unstage)" << std::endl;
+        } else {
             std::cout << "  (use \"git reset HEAD <file>...\" to unstage)" << std::endl;
-            for (const auto& entry : entries) {
-                std::cout << "\tnew file:   " << entry.path << std::endl;
-            }
+        }
+        for (const auto& [change, path] : staged) {
+            std::string label = change + ":";
+            label.resize(12, ' ');
+            std::cout << "\t" << label << path << std::endl;
         }
     }
     
-    // Section 2: Changes not staged (worktree vs index)
+    // Section 2: Changes not staged (worktree vs index). Entries are
+    // stat'ed a window at a time in one batch, then the ones whose stat data
+    // changed (or can't be trusted) are read in another to compare contents.
     bool has_unstaged = false;
-    const auto& entries = index.get_entries();
-    for (const auto& entry : entries) {
-        std::filesystem::path file_path = repo->worktree / entry.path;
-        
-        // Check if file still exists
-        if (!std::filesystem::exists(file_path)) {
-            if (!has_unstaged) {
-                has_unstaged = true;
-                std::cout << "\nChanges not staged for commit:" << std::endl;
-                std::cout << "  (use \"git add <file>...\" to update what will be committed)" << std::endl;
+    auto print_unstaged = [&has_unstaged](const char* label, std::string_view path) {
+        if (!has_unstaged) {
+            has_unstaged = true;
+            std::cout << "\nChanges not staged for commit:" << std::endl;
+            std::cout << "  (use \"git add <file>...\" to update what will be committed)" << std::endl;
+        }
+        std::cout << "\t" << label << path << std::endl;
+    };
+    IoBatch io(*repo);
+    std::vector<size_t> window;
+    std::vector<IoRequest> stats;
+    std::vector<IoRequest> reads;
+    for (size_t start = 0; start < index.size();) {
+        // entries the monitor vouches for and paths a sparse checkout leaves out need no look
+        window.clear();
+        stats.clear();
+        for (; start < index.size() && window.size() < IO_BATCH_SIZE; start++) {
+            if (index.fsmonitor_valid(start) || index[start].skip_worktree()) {
+                continue;
             }
-            std::cout << "\tdeleted:    " << entry.path << std::endl;
-        } else {
-            // Check if file content changed
-            std::ifstream file(file_path, std::ios::binary);
-            std::string content((std::istreambuf_iterator<char>(file)),
-                               std::istreambuf_iterator<char>());
-            file.close();
-            
-            std::string sha = object_hash(content, "blob", nullptr);
-            if (sha != entry.sha) {
-                if (!has_unstaged) {
-                    has_unstaged = true;
-                    std::cout << "\nChanges not staged for commit:" << std::endl;
-                    std::cout << "  (use \"git add <file>...\" to update what will be committed)" << std::endl;
+            window.push_back(start);
+            stats.emplace_back();
+            stats.back().path = repo->worktree / index[start].path();
+        }
+        io.run(stats);
+
+        reads.clear();
+        for (size_t i = 0; i < window.size(); i++) {
+            auto entry = index[window[i]];
+            if (stats[i].ok && !entry.stat_clean(stats[i].stat)) {
+                reads.emplace_back();
+                reads.back().kind = IoRequest::Kind::Read;
+                reads.back().path = stats[i].path;
+            }
+        }
+        io.run(reads);
+        std::vector<std::string_view> contents;
+        for (const auto& read : reads) {
+            contents.push_back(read.data);
+        }
+        std::vector<std::string> shas = object_hash_many(contents, "blob", repo, false);
+
+        auto read = reads.begin();
+        for (size_t i = 0; i < window.size(); i++) {
+            auto entry = index[window[i]];
+            if (!stats[i].ok) {
+                print_unstaged("deleted:    ", entry.path());
+            } else if (read != reads.end() && read->path == stats[i].path) {
+                // gone between the two batches is as good as deleted
+                if (!read->ok) {
+                    print_unstaged("deleted:    ", entry.path());
+                } else if (shas[read - reads.begin()] != entry.sha()) {
+                    print_unstaged("modified:   ", entry.path());
+                } else {
+                    // unchanged after all: record the stat data so the next
+                    // status can trust it, keeping the staged mode
+                    IndexStat refreshed = stats[i].stat;
+                    refreshed.mode = entry.stat().mode;
+                    index.set_stat(entry.position(), refreshed);
+                    index_changed = true;
                 }
-                std::cout << "\tmodified:   " << entry.path << std::endl;
+                ++read;
+            } else if (!index.fsmonitor_token().empty()) {
+                // unchanged until the monitor says otherwise
+                index.set_fsmonitor_valid(entry.position());
+                index_changed = true;
             }
         }
     }
     
-    // Section 3: Untracked files
-    bool has_untracked = false;
-    for (const auto& entry : std::filesystem::recursive_directory_iterator(repo->worktree)) {
-        if (entry.is_regular_file()) {
-            auto rel_path = std::filesystem::relative(entry.path(), repo->worktree);
-            
-            // Skip .git directory and files already in index
-            if (rel_path.string().find(".git") == 0) {
-                continue;
-            }
-            
-            auto index_entry = index.get_entry(rel_path.string());
-            if (!index_entry.has_value()) {
-                if (!has_untracked) {
-                    has_untracked = true;
-                    std::cout << "\nUntracked files:" << std::endl;
-                    std::cout << "  (use \"git add <file>...\" to include in what will be committed)" << std::endl;
-                }
-                std::cout << "\t" << rel_path.string() << std::endl;
-            }
+    // Section 3: Untracked files, from the untracked cache where the
+    // directories haven't changed
+    std::string use_cache = config.get("core", "untrackedCache");
+    bool cache_changed = false;
+    auto& cache = index.untracked_cache();
+    std::string ident = untracked_cache_ident(std::filesystem::absolute(repo->worktree));
+    if (use_cache == "false") {
+        cache_changed = cache.has_value();
+        cache.reset();
+    } else if (!cache || cache->ident != ident || cache->dir_flags != 0) {
+        // made elsewhere or with other settings: start over
+        cache.emplace();
+        cache->ident = ident;
+        cache_changed = true;
+    }
+
+    // lists made with other global exclude files can't be reused
+    IgnoreRules ignore(*repo);
+    if (cache) {
+        bool info_changed = refresh_exclude_file(ignore.info_exclude_path(), index.object_format(), cache->info_exclude_stat,
+                                                 cache->info_exclude_oid);
+        bool global_changed = refresh_exclude_file(ignore.excludes_file_path(), index.object_format(), cache->excludes_file_stat,
+                                                   cache->excludes_file_oid);
+        if (info_changed || global_changed) {
+            cache->root = UntrackedCacheDir();
+            cache_changed = true;
+        }
+    }
+
+    std::vector<std::string> untracked;
+    if (cache) {
+        collect_untracked(index, cache->root, repo->worktree, "", monitored, ignore, untracked, cache_changed);
+    } else {
+        UntrackedCacheDir scratch;
+        collect_untracked(index, scratch, repo->worktree, "", false, ignore, untracked, cache_changed);
+    }
+    std::sort(untracked.begin(), untracked.end());
+
+    bool has_untracked = !untracked.empty();
+    if (has_untracked) {
+        std::cout << "\nUntracked files:" << std::endl;
+        std::cout << "  (use \"git add <file>...\" to include in what will be committed)" << std::endl;
+        for (const auto& path : untracked) {
+            std::cout << "\t" << path << std::endl;
         }
     }
+
+    // Saving the refreshed caches is only an optimization
+    if (locked && (index_changed || cache_changed)) {
+        index.write(*repo);
+    }
     
     // Summary
     if (!has_staged && !has_unstaged && !has_untracked) {
@@ -1099,12 +2243,26 @@ void tag_create(Repository* repo, const std::string& name, const std::string& re
 }
 
 // ref_create(repo, ref_name, sha)
-void ref_create(Repository* repo, const std::string& ref_name, const std::string& sha) {
-    // Open repo_file(repo, ref_name) and write sha
+void ref_create(Repository* repo, const std::string& ref_name, const std::string& sha,
+                const std::optional<std::string>& expected) {
+    // Write through <ref>.lock, so the ref is replaced whole or not at all
     std::filesystem::path ref_path = repo_file(*repo, ref_name.c_str(), nullptr);
+    LockFile lock;
+    if (!lock.acquire(ref_path, repo->ref_lock_timeout)) {
+        throw std::runtime_error("Unable to lock " + ref_name + ": " + lock.lock_path().string() + " exists");
+    }
+    if (expected) {
+        std::string current = ref_resolve(*repo, ref_name).value_or("");
+        if (current != *expected) {
+            throw std::runtime_error("Cannot update " + ref_name + ": it is at " +
+                                     (current.empty() ? "nothing" : current) + " but expected " +
+                                     (expected->empty() ? "nothing" : *expected));
+        }
+    }
 
     // Write refs with LF-only to stay compatible with Git parsing on Windows.
-    std::ofstream file(ref_path, std::ios::binary);
-    file << sha << "\n";
-    file.close();
+    lock.write(sha + "\n");
+    if (!lock.commit(repo->fsync, FSYNC_REFERENCE)) {
+        throw std::runtime_error("Failed to write " + ref_name);
+    }
 }
@@ -6,10 +6,13 @@
 #include <filesystem>
 #include <map>
 #include <variant>
+#include <vector>
 
 // Forward declarations
 class Repository;
 class GitTree;
+class Index;
+class SparseCheckout;
 
 void cmd_add(const ParsedArgs& args, Repository* repo);
 void cmd_cat_file(const ParsedArgs& args, Repository* repo);
@@ -18,6 +21,11 @@ void cmd_check_ignore(const ParsedArgs& args, Repository* repo);
 void cmd_checkout(const ParsedArgs& args, Repository* repo);
 
 void cmd_commit(const ParsedArgs& args, Repository* repo);
+// Write the trees of the index in one pass, reusing and updating its cache
+// tree, and return the root tree's id
+std::string build_tree_from_index(Index& index, Repository* repo);
+void cmd_diff(const ParsedArgs& args, Repository* repo);
+void cmd_fsmonitor_daemon(const ParsedArgs& args, Repository* repo);
 void cmd_hash_object(const ParsedArgs& args, Repository* repo);
 void cmd_init(const ParsedArgs& args, Repository* repo);
 void cmd_log(const ParsedArgs& args, Repository* repo);
@@ -28,11 +36,21 @@ void cmd_rm(const ParsedArgs& args, Repository* repo);
 
 void cmd_show_ref(const ParsedArgs& args, Repository* repo);
 void show_ref(Repository* repo, const std::map<std::string, std::string>& refs, bool with_hash = true, const std::string& prefix="");
+void cmd_sparse_checkout(const ParsedArgs& args, Repository* repo);
 
 void cmd_status(const ParsedArgs& args, Repository* repo);
+// What committing the index would change in the tree `tree_sha` (empty for
+// none), as (new file|deleted|modified|typechange, path) in path order
+std::vector<std::pair<std::string, std::string>> index_tree_changes(const Index& index, Repository* repo,
+                                                                    const std::string& tree_sha);
 void cmd_tag(const ParsedArgs& args, Repository* repo);
 void tag_create(Repository* repo, const std::string& name, const std::string& ref, bool create_tag_object);
-void ref_create(Repository* repo, const std::string& ref_name, const std::string& sha);
+// Point `ref_name` at `sha`. With `expected`, only if the ref is still at
+// that id ("" for a ref that doesn't exist yet), checked under its lock.
+void ref_create(Repository* repo, const std::string& ref_name, const std::string& sha,
+                const std::optional<std::string>& expected = std::nullopt);
 std::string log_graphviz(Repository* repo, std::string sha, std::set<std::string> seen);
 void ls_tree(Repository *repo, const GitTree &tree, const std::string &prefix, bool recursive);
-void tree_checkout(Repository* repo, const GitTree& tree, const std::filesystem::path& target_path);
+void tree_checkout(Repository* repo, const GitTree& tree, const std::filesystem::path& target_path,
+                   Index* index = nullptr, const std::string& prefix = "",
+                   const SparseCheckout* sparse = nullptr);
@@ -0,0 +1,1199 @@
+#include "Diff.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SILT_DIFF_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+#ifdef SILT_DIFF_X86
+bool has_avx2() {
+    static const bool avx2 = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    }();
+    return avx2;
+}
+
+// Append the offset past each '\n' of the first whole 32-byte blocks of
+// `text`; returns how far it got
+__attribute__((target("avx2")))
+size_t find_newlines_avx2(std::string_view text, std::vector<uint32_t>& ends) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= text.size(); i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text.data() + i));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+        while (mask) {
+            ends.push_back(static_cast<uint32_t>(i + __builtin_ctz(mask) + 1));
+            mask &= mask - 1;
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t common_prefix_avx2(const uint32_t* a, const uint32_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        uint32_t equal = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi32(x, y)));
+        if (equal != 0xFFFFFFFFu) {
+            return i + __builtin_ctz(~equal) / 4;
+        }
+    }
+    return i;
+}
+
+// Same, from the ends `a` and `b` backwards
+__attribute__((target("avx2")))
+size_t common_suffix_avx2(const uint32_t* a, const uint32_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a - i - 8));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b - i - 8));
+        uint32_t equal = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi32(x, y)));
+        if (equal != 0xFFFFFFFFu) {
+            return i + __builtin_clz(~equal) / 4;
+        }
+    }
+    return i;
+}
+#endif
+
+// Offsets just past each line of `text`; the last line may lack its newline
+void find_line_ends(std::string_view text, std::vector<uint32_t>& ends) {
+    if (text.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("File too large to diff");
+    }
+    ends.reserve(text.size() / 32 + 1);
+    size_t pos = 0;
+#ifdef SILT_DIFF_X86
+    if (has_avx2()) {
+        pos = find_newlines_avx2(text, ends);
+    }
+#endif
+    while (pos < text.size()) {
+        const void* newline = std::memchr(text.data() + pos, '\n', text.size() - pos);
+        if (!newline) {
+            break;
+        }
+        pos = static_cast<const char*>(newline) - text.data() + 1;
+        ends.push_back(static_cast<uint32_t>(pos));
+    }
+    if (!text.empty() && text.back() != '\n') {
+        ends.push_back(static_cast<uint32_t>(text.size()));
+    }
+}
+
+size_t common_prefix(const uint32_t* a, const uint32_t* b, size_t n) {
+    size_t i = 0;
+#ifdef SILT_DIFF_X86
+    if (has_avx2()) {
+        i = common_prefix_avx2(a, b, n);
+    }
+#endif
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+size_t common_suffix(const uint32_t* a_end, const uint32_t* b_end, size_t n) {
+    size_t i = 0;
+#ifdef SILT_DIFF_X86
+    if (has_avx2()) {
+        i = common_suffix_avx2(a_end, b_end, n);
+    }
+#endif
+    while (i < n && a_end[-1 - static_cast<ptrdiff_t>(i)] == b_end[-1 - static_cast<ptrdiff_t>(i)]) {
+        i++;
+    }
+    return i;
+}
+
+// A hash of a line, eight bytes at a time
+uint64_t line_hash(std::string_view line) {
+    const char* p = line.data();
+    size_t n = line.size();
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ n;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    if (n) {
+        uint64_t word = 0;
+        std::memcpy(&word, p, n);
+        hash = (hash ^ word) * 0xC4CEB9FE1A85EC53ull;
+    }
+    return hash ^ (hash >> 29);
+}
+
+// Open-addressed table from line to id
+class LineInterner {
+public:
+    explicit LineInterner(size_t lines) {
+        size_t size = 16;
+        while (size < 2 * lines) {
+            size *= 2;
+        }
+        slots.assign(size, 0);
+        mask = size - 1;
+    }
+
+    uint32_t intern(std::string_view line) {
+        uint64_t hash = line_hash(line);
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            uint32_t id = slots[slot];
+            if (id == 0) {
+                hashes.push_back(hash);
+                lines.push_back(line);
+                slots[slot] = static_cast<uint32_t>(lines.size());
+                return static_cast<uint32_t>(lines.size() - 1);
+            }
+            if (hashes[id - 1] == hash && lines[id - 1] == line) {
+                return id - 1;
+            }
+        }
+    }
+
+    size_t size() const { return lines.size(); }
+
+private:
+    std::vector<uint32_t> slots;   // id + 1, 0 for a free slot
+    std::vector<uint64_t> hashes;
+    std::vector<std::string_view> lines;
+    size_t mask;
+};
+
+// Myers' algorithm over the ids `a` and `b`, marking the lines that aren't
+// part of the common subsequence it finds in `a_changed` and `b_changed`
+class Myers {
+public:
+    Myers(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b, std::vector<bool>& a_changed,
+          std::vector<bool>& b_changed)
+        : a(a), b(b), a_changed(a_changed), b_changed(b_changed) {
+        // both diagonal arrays are indexed by k = i - j, from -(|b| + 1) to |a| + 1
+        size_t diagonals = a.size() + b.size() + 3;
+        forward.resize(diagonals);
+        backward.resize(diagonals);
+        offset = static_cast<long>(b.size()) + 1;
+        // past this many steps, a box is split where the paths got furthest
+        // instead of where they meet, as xdiff does
+        max_cost = 1;
+        for (size_t n = diagonals; n > 0; n >>= 2) {
+            max_cost <<= 1;
+        }
+        max_cost = std::max(max_cost, 256L);
+    }
+
+    void run() {
+        // boxes still to compare, a stack so deep recursions can't overflow
+        std::vector<Box> boxes{{0, static_cast<long>(a.size()), 0, static_cast<long>(b.size()), false}};
+        while (!boxes.empty()) {
+            Box box = boxes.back();
+            boxes.pop_back();
+
+            while (box.a_lo < box.a_hi && box.b_lo < box.b_hi && a[box.a_lo] == b[box.b_lo]) {
+                box.a_lo++;
+                box.b_lo++;
+            }
+            while (box.a_lo < box.a_hi && box.b_lo < box.b_hi && a[box.a_hi - 1] == b[box.b_hi - 1]) {
+                box.a_hi--;
+                box.b_hi--;
+            }
+            if (box.a_lo == box.a_hi || box.b_lo == box.b_hi) {
+                for (long i = box.a_lo; i < box.a_hi; i++) {
+                    a_changed[i] = true;
+                }
+                for (long j = box.b_lo; j < box.b_hi; j++) {
+                    b_changed[j] = true;
+                }
+                continue;
+            }
+
+            Split split = find_split(box);
+            boxes.push_back({split.i, box.a_hi, split.j, box.b_hi, split.minimal_hi});
+            boxes.push_back({box.a_lo, split.i, box.b_lo, split.j, split.minimal_lo});
+        }
+    }
+
+private:
+    struct Box {
+        long a_lo, a_hi, b_lo, b_hi;
+        bool minimal;   // no cost limit for this one
+    };
+    struct Split {
+        long i, j;
+        bool minimal_lo, minimal_hi;
+    };
+
+    const std::vector<uint32_t>& a;
+    const std::vector<uint32_t>& b;
+    std::vector<bool>& a_changed;
+    std::vector<bool>& b_changed;
+    std::vector<long> forward;    // furthest i reached on each diagonal, from the top left
+    std::vector<long> backward;   // and from the bottom right
+    long offset;
+    long max_cost;
+
+    static constexpr long SNAKE_LENGTH = 20;
+    static constexpr long SNAKE_MIN_COST = 256;
+
+    long& fwd(long k) { return forward[k + offset]; }
+    long& bwd(long k) { return backward[k + offset]; }
+
+    // Where the forward and backward paths of `box` overlap: the middle snake
+    Split find_split(const Box& box) {
+        const long a_lo = box.a_lo, a_hi = box.a_hi, b_lo = box.b_lo, b_hi = box.b_hi;
+        const long k_min = a_lo - b_hi, k_max = a_hi - b_lo;
+        const long f_mid = a_lo - b_lo, b_mid = a_hi - b_hi;
+        const bool odd = (f_mid - b_mid) & 1;
+        long f_min = f_mid, f_max = f_mid;
+        long b_min = b_mid, b_max = b_mid;
+        fwd(f_mid) = a_lo;
+        bwd(b_mid) = a_hi;
+        bool got_snake = false;   // a run of common lines on some path
+
+        for (long cost = 1;; cost++) {
+            // one more step forward on every diagonal in reach
+            if (f_min > k_min) {
+                fwd(--f_min - 1) = -1;
+            } else {
+                ++f_min;
+            }
+            if (f_max < k_max) {
+                fwd(++f_max + 1) = -1;
+            } else {
+                --f_max;
+            }
+            for (long k = f_max; k >= f_min; k -= 2) {
+                long i = fwd(k - 1) >= fwd(k + 1) ? fwd(k - 1) + 1 : fwd(k + 1);
+                long j = i - k;
+                long start = i;
+                while (i < a_hi && j < b_hi && a[i] == b[j]) {
+                    i++;
+                    j++;
+                }
+                got_snake = got_snake || i - start > SNAKE_LENGTH;
+                fwd(k) = i;
+                if (odd && b_min <= k && k <= b_max && bwd(k) <= i) {
+                    return {i, j, true, true};
+                }
+            }
+
+            // and one back
+            if (b_min > k_min) {
+                bwd(--b_min - 1) = std::numeric_limits<long>::max();
+            } else {
+                ++b_min;
+            }
+            if (b_max < k_max) {
+                bwd(++b_max + 1) = std::numeric_limits<long>::max();
+            } else {
+                --b_max;
+            }
+            for (long k = b_max; k >= b_min; k -= 2) {
+                long i = bwd(k - 1) < bwd(k + 1) ? bwd(k - 1) : bwd(k + 1) - 1;
+                long j = i - k;
+                long start = i;
+                while (i > a_lo && j > b_lo && a[i - 1] == b[j - 1]) {
+                    i--;
+                    j--;
+                }
+                got_snake = got_snake || start - i > SNAKE_LENGTH;
+                bwd(k) = i;
+                if (!odd && f_min <= k && k <= f_max && i <= fwd(k)) {
+                    return {i, j, true, true};
+                }
+            }
+
+            if (box.minimal) {
+                continue;
+            }
+            Split split;
+            if (got_snake && cost > SNAKE_MIN_COST && snake_split(box, cost, f_min, f_max, b_min, b_max, split)) {
+                return split;
+            }
+            if (cost >= max_cost) {
+                return cheap_split(box, f_min, f_max, b_min, b_max);
+            }
+        }
+    }
+
+    // Whether the SNAKE_LENGTH lines from a[i] and b[j] are the same
+    bool common_run(long i, long j) const {
+        return std::equal(a.begin() + i, a.begin() + i + SNAKE_LENGTH, b.begin() + j);
+    }
+
+    // Split where a path has got far for its cost (by more than 4 lines a
+    // step, less how far it strayed from the middle diagonal) and ends in,
+    // or going back, starts with a run of SNAKE_LENGTH common lines, as
+    // xdiff does past SNAKE_MIN_COST steps; false if no path has
+    bool snake_split(const Box& box, long cost, long f_min, long f_max, long b_min, long b_max, Split& split) {
+        const long f_mid = box.a_lo - box.b_lo, b_mid = box.a_hi - box.b_hi;
+        long best = 0;
+        for (long k = f_max; k >= f_min; k -= 2) {
+            long i = fwd(k), j = i - k;
+            long value = (i - box.a_lo) + (j - box.b_lo) - std::abs(k - f_mid);
+            if (value > 4 * cost && value > best && box.a_lo + SNAKE_LENGTH <= i && i < box.a_hi &&
+                box.b_lo + SNAKE_LENGTH <= j && j < box.b_hi && common_run(i - SNAKE_LENGTH, j - SNAKE_LENGTH)) {
+                best = value;
+                split = {i, j, true, false};
+            }
+        }
+        if (best > 0) {
+            return true;
+        }
+        for (long k = b_max; k >= b_min; k -= 2) {
+            long i = bwd(k), j = i - k;
+            long value = (box.a_hi - i) + (box.b_hi - j) - std::abs(k - b_mid);
+            if (value > 4 * cost && value > best && box.a_lo < i && i <= box.a_hi - SNAKE_LENGTH &&
+                box.b_lo < j && j <= box.b_hi - SNAKE_LENGTH && common_run(i, j)) {
+                best = value;
+                split = {i, j, false, true};
+            }
+        }
+        return best > 0;
+    }
+
+    // Split at whichever of the forward or backward paths got further
+    Split cheap_split(const Box& box, long f_min, long f_max, long b_min, long b_max) {
+        long f_best = -1, f_best_i = -1;
+        for (long k = f_max; k >= f_min; k -= 2) {
+            long i = std::min(fwd(k), box.a_hi);
+            long j = i - k;
+            if (j > box.b_hi) {
+                i = box.b_hi + k;
+                j = box.b_hi;
+            }
+            if (i + j > f_best) {
+                f_best = i + j;
+                f_best_i = i;
+            }
+        }
+        long b_best = std::numeric_limits<long>::max(), b_best_i = 0;
+        for (long k = b_max; k >= b_min; k -= 2) {
+            long i = std::max(box.a_lo, bwd(k));
+            long j = i - k;
+            if (j < box.b_lo) {
+                i = box.b_lo + k;
+                j = box.b_lo;
+            }
+            if (i + j < b_best) {
+                b_best = i + j;
+                b_best_i = i;
+            }
+        }
+        if ((box.a_hi + box.b_hi) - b_best < f_best - (box.a_lo + box.b_lo)) {
+            return {f_best_i, f_best - f_best_i, true, false};
+        }
+        return {b_best_i, b_best - b_best_i, false, true};
+    }
+};
+
+// The runs of changed lines of one side, walked one at a time as xdiff's
+// groups are: [start, end) is a run, empty between two unchanged lines.
+// The n-th run of one side is across from the n-th run of the other.
+struct ChangeRun {
+    const std::vector<uint32_t>& ids;
+    std::vector<bool>& changed;
+    size_t start = 0;
+    size_t end = 0;
+
+    ChangeRun(const std::vector<uint32_t>& ids, std::vector<bool>& changed) : ids(ids), changed(changed) {
+        extend_down();
+    }
+
+    bool next() {
+        if (end == ids.size()) {
+            return false;
+        }
+        start = end = end + 1;
+        extend_down();
+        return true;
+    }
+
+    bool previous() {
+        if (start == 0) {
+            return false;
+        }
+        start = end = start - 1;
+        extend_up();
+        return true;
+    }
+
+    // Move the run a line down, if the line after it is the same as its
+    // first line; it takes in the run below if it runs into it
+    bool slide_down() {
+        if (end == ids.size() || ids[start] != ids[end]) {
+            return false;
+        }
+        changed[start++] = false;
+        changed[end++] = true;
+        extend_down();
+        return true;
+    }
+
+    bool slide_up() {
+        if (start == 0 || ids[start - 1] != ids[end - 1]) {
+            return false;
+        }
+        changed[--start] = true;
+        changed[--end] = false;
+        extend_up();
+        return true;
+    }
+
+private:
+    void extend_down() {
+        while (end < ids.size() && changed[end]) {
+            end++;
+        }
+    }
+    void extend_up() {
+        while (start > 0 && changed[start - 1]) {
+            start--;
+        }
+    }
+};
+
+// Slide each run of changed lines of `ids` as far down as it goes, as
+// diff tools conventionally place them (an added function then ends up
+// below the blank line it shares with its neighbour, not above it), unless
+// on the way it was across from a change in the other side: then it goes
+// back to the last place it was, so the two read as one change. This is
+// xdiff's compaction, without its indent heuristic.
+void slide_changes(const std::vector<uint32_t>& ids, std::vector<bool>& changed,
+                   const std::vector<uint32_t>& other_ids, std::vector<bool>& other_changed) {
+    ChangeRun run(ids, changed);
+    ChangeRun other(other_ids, other_changed);
+    while (true) {
+        if (run.end != run.start) {
+            // up and then down as far as it goes, again if it took in
+            // another run on the way
+            size_t size, earliest_end;
+            bool across_change;
+            do {
+                size = run.end - run.start;
+                while (run.slide_up()) {
+                    other.previous();
+                }
+                earliest_end = run.end;
+                across_change = other.end > other.start;
+                while (run.slide_down()) {
+                    other.next();
+                    across_change = across_change || other.end > other.start;
+                }
+            } while (size != run.end - run.start);
+
+            if (run.end != earliest_end && across_change) {
+                while (other.end == other.start) {
+                    run.slide_up();
+                    other.previous();
+                }
+            }
+        }
+        if (!run.next()) {
+            break;
+        }
+        other.next();
+    }
+}
+
+// How a line of one text matches the other's lines
+enum LineMatch : uint8_t {
+    NO_MATCH,
+    MATCH,
+    MANY_MATCHES,
+};
+
+// Whether line `i` of `matches`, one with many matches, sits among lines
+// without a match, as xdiff decides: the lines right before and after it
+// (up to 100 each way) without a match or with many must include some of
+// the first kind on both sides and few enough of the second
+bool among_unmatched(const std::vector<uint8_t>& matches, size_t i) {
+    const size_t WINDOW = 100;
+    size_t lo = i > WINDOW ? i - WINDOW : 0;
+    size_t hi = std::min(matches.size(), i + WINDOW + 1);
+    size_t unmatched_before = 0, many_before = 1;
+    for (size_t r = i; r-- > lo;) {
+        if (matches[r] == NO_MATCH) {
+            unmatched_before++;
+        } else if (matches[r] == MANY_MATCHES) {
+            many_before++;
+        } else {
+            break;
+        }
+    }
+    if (unmatched_before == 0) {
+        return false;
+    }
+    size_t unmatched_after = 0, many_after = 1;
+    for (size_t r = i + 1; r < hi; r++) {
+        if (matches[r] == NO_MATCH) {
+            unmatched_after++;
+        } else if (matches[r] == MANY_MATCHES) {
+            many_after++;
+        } else {
+            break;
+        }
+    }
+    if (unmatched_after == 0) {
+        return false;
+    }
+    size_t many = many_before + many_after;
+    return many * 4 < many + unmatched_before + unmatched_after;
+}
+
+// Of lines [lo, hi) of `ids`, put the ones worth giving Myers in `kept`,
+// and where they are in `pos`, and mark the others changed: the lines the
+// other text (with `in_other` of each line) doesn't have, and as in
+// xdiff, the lines it has many times over that sit among those. Lines
+// like "}" or "0,0,1" would otherwise match all over and slow Myers down.
+void keep_lines(const std::vector<uint32_t>& ids, const std::vector<uint32_t>& in_other, size_t lo, size_t hi,
+                std::vector<bool>& changed, std::vector<uint32_t>& kept, std::vector<size_t>& pos) {
+    // many: about the square root of the line count, at most 1024
+    size_t many = 1;
+    for (size_t n = ids.size(); n > 0; n >>= 2) {
+        many <<= 1;
+    }
+    many = std::min<size_t>(many, 1024);
+
+    std::vector<uint8_t> matches(hi - lo);
+    for (size_t i = lo; i < hi; i++) {
+        uint32_t count = in_other[ids[i]];
+        matches[i - lo] = count == 0 ? NO_MATCH : count >= many ? MANY_MATCHES : MATCH;
+    }
+    for (size_t i = lo; i < hi; i++) {
+        uint8_t match = matches[i - lo];
+        if (match == MATCH || (match == MANY_MATCHES && !among_unmatched(matches, i - lo))) {
+            kept.push_back(ids[i]);
+            pos.push_back(i);
+        } else {
+            changed[i] = true;
+        }
+    }
+}
+
+// Myers over the ids `a` and `b` (with `unique_lines` different ids),
+// once the lines they start and end with are trimmed and the lines that
+// can't or shouldn't be matched are set aside
+void myers_diff(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b, size_t unique_lines,
+                std::vector<bool>& a_changed, std::vector<bool>& b_changed) {
+    size_t shorter = std::min(a.size(), b.size());
+    size_t prefix = common_prefix(a.data(), b.data(), shorter);
+    size_t suffix = common_suffix(a.data() + a.size(), b.data() + b.size(), shorter - prefix);
+
+    std::vector<uint32_t> in_a(unique_lines, 0);
+    std::vector<uint32_t> in_b(unique_lines, 0);
+    for (uint32_t id : a) {
+        in_a[id]++;
+    }
+    for (uint32_t id : b) {
+        in_b[id]++;
+    }
+    std::vector<uint32_t> a_kept, b_kept;   // ids that go to Myers
+    std::vector<size_t> a_pos, b_pos;       // and where they are
+    keep_lines(a, in_b, prefix, a.size() - suffix, a_changed, a_kept, a_pos);
+    keep_lines(b, in_a, prefix, b.size() - suffix, b_changed, b_kept, b_pos);
+    if (a_kept.empty() && b_kept.empty()) {
+        return;
+    }
+
+    std::vector<bool> a_kept_changed(a_kept.size(), false);
+    std::vector<bool> b_kept_changed(b_kept.size(), false);
+    Myers(a_kept, b_kept, a_kept_changed, b_kept_changed).run();
+    for (size_t i = 0; i < a_kept.size(); i++) {
+        if (a_kept_changed[i]) {
+            a_changed[a_pos[i]] = true;
+        }
+    }
+    for (size_t j = 0; j < b_kept.size(); j++) {
+        if (b_kept_changed[j]) {
+            b_changed[b_pos[j]] = true;
+        }
+    }
+}
+
+// Bump allocator for the tables a patience or histogram diff builds over
+// each part of the texts it looks at. They're all given back at once by
+// rewinding to a mark, and the chunks are reused for the next part, so
+// the thousands of small parts of a big diff don't each go to the heap.
+class Arena {
+public:
+    struct Mark {
+        size_t chunk;
+        size_t used;
+    };
+
+    Mark mark() const { return {current, used}; }
+    void release(const Mark& to) {
+        current = to.chunk;
+        used = to.used;
+    }
+
+    // Room for `n` T's, uninitialized
+    template <typename T>
+    T* alloc(size_t n) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena memory is never destroyed");
+        return static_cast<T*>(alloc_bytes(n * sizeof(T), alignof(T)));
+    }
+
+private:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    struct Chunk {
+        std::unique_ptr<unsigned char[]> data;
+        size_t size = 0;
+    };
+    std::vector<Chunk> chunks;
+    size_t current = 0;
+    size_t used = 0;
+
+    void* alloc_bytes(size_t bytes, size_t align) {
+        if (current < chunks.size()) {
+            size_t start = (used + align - 1) & ~(align - 1);
+            if (start + bytes <= chunks[current].size) {
+                used = start + bytes;
+                return chunks[current].data.get() + start;
+            }
+            current++;
+        }
+        // the next chunk, or a bigger one in its place if it's too small
+        if (current == chunks.size()) {
+            chunks.emplace_back();
+        }
+        if (chunks[current].size < bytes) {
+            size_t size = std::max(bytes, CHUNK_SIZE);
+            chunks[current].data.reset(new unsigned char[size]);
+            chunks[current].size = size;
+        }
+        used = bytes;
+        return chunks[current].data.get();
+    }
+};
+
+// What a part of the texts has of one line
+struct LineCount {
+    uint32_t id;        // interned id + 1, 0 for a free slot
+    uint32_t a_count;
+    uint32_t b_count;
+    uint32_t a_pos;     // first in a (the only one, for a line found once)
+    uint32_t b_pos;
+};
+
+// Open-addressed table from interned id to its counts in one part of the
+// texts, in the arena
+class LineCounts {
+public:
+    LineCounts(Arena& arena, size_t lines) {
+        size_t size = 16;
+        while (size < 2 * lines) {
+            size *= 2;
+        }
+        slots = arena.alloc<LineCount>(size);
+        std::fill(slots, slots + size, LineCount{0, 0, 0, 0, 0});
+        mask = size - 1;
+    }
+
+    // The entry of `id`, added if it isn't there
+    LineCount& at(uint32_t id) {
+        size_t slot = probe(id);
+        slots[slot].id = id + 1;
+        return slots[slot];
+    }
+
+    // The entry of `id`, null if it isn't there
+    LineCount* find(uint32_t id) {
+        LineCount& entry = slots[probe(id)];
+        return entry.id ? &entry : nullptr;
+    }
+
+private:
+    LineCount* slots;
+    size_t mask;
+
+    size_t probe(uint32_t id) const {
+        size_t slot = (static_cast<size_t>(id) * 0x9E3779B97F4A7C15ull >> 32) & mask;
+        while (slots[slot].id && slots[slot].id != id + 1) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+};
+
+// No line: the end of a chain of lines
+constexpr uint32_t NO_LINE = std::numeric_limits<uint32_t>::max();
+
+// Lines [a_lo, a_hi) of one text against [b_lo, b_hi) of the other
+struct DiffRegion {
+    long a_lo, a_hi, b_lo, b_hi;
+    unsigned depth;   // splits it took to get here
+};
+
+// Past this many splits, a part of the texts goes to Myers: splitting so
+// often means the anchors only take off a few lines at a time
+constexpr unsigned MAX_SPLIT_DEPTH = 128;
+
+// A histogram diff doesn't split at lines found more often than this, as
+// in Git; a part with only those in common goes to Myers
+constexpr uint32_t MAX_CHAIN_LENGTH = 64;
+
+// The anchors of a patience diff of `region`: of the lines found exactly
+// once in each side, the longest run that's in the same order in both, as
+// (line in a, line in b); false if there are no such lines
+bool patience_anchors(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b, const DiffRegion& region,
+                      Arena& arena, std::vector<std::pair<long, long>>& anchors) {
+    Arena::Mark mark = arena.mark();
+    size_t a_lines = static_cast<size_t>(region.a_hi - region.a_lo);
+    LineCounts counts(arena, a_lines);
+    for (long i = region.a_lo; i < region.a_hi; i++) {
+        LineCount& count = counts.at(a[i]);
+        count.a_count++;
+        count.a_pos = static_cast<uint32_t>(i);
+    }
+    for (long j = region.b_lo; j < region.b_hi; j++) {
+        if (LineCount* count = counts.find(b[j])) {
+            count->b_count++;
+            count->b_pos = static_cast<uint32_t>(j);
+        }
+    }
+
+    // the unique lines in a's order, as their places in b
+    uint32_t* b_pos = arena.alloc<uint32_t>(a_lines);
+    uint32_t* a_pos = arena.alloc<uint32_t>(a_lines);
+    size_t unique = 0;
+    for (long i = region.a_lo; i < region.a_hi; i++) {
+        const LineCount* count = counts.find(a[i]);
+        if (count->a_count == 1 && count->b_count == 1) {
+            a_pos[unique] = static_cast<uint32_t>(i);
+            b_pos[unique++] = count->b_pos;
+        }
+    }
+    if (unique == 0) {
+        arena.release(mark);
+        return false;
+    }
+
+    // patience sorting: piles[k] is the unique line ending the best
+    // increasing run of length k + 1 so far, and each line links to the
+    // one before it in its run
+    uint32_t* piles = arena.alloc<uint32_t>(unique);
+    uint32_t* before = arena.alloc<uint32_t>(unique);
+    size_t pile_count = 0;
+    for (uint32_t u = 0; u < unique; u++) {
+        size_t lo = 0, hi = pile_count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (b_pos[piles[mid]] < b_pos[u]) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        before[u] = lo ? piles[lo - 1] : NO_LINE;
+        piles[lo] = u;
+        pile_count = std::max(pile_count, lo + 1);
+    }
+
+    anchors.clear();
+    for (uint32_t u = piles[pile_count - 1]; u != NO_LINE; u = before[u]) {
+        anchors.emplace_back(a_pos[u], b_pos[u]);
+    }
+    std::reverse(anchors.begin(), anchors.end());
+    arena.release(mark);
+    return true;
+}
+
+enum class HistogramMatch {
+    Found,
+    None,       // no line in common
+    TooCommon,  // only lines found more than MAX_CHAIN_LENGTH times
+};
+
+// Where a histogram diff splits `region`, as Git picks it: the longest
+// run of common lines whose rarest line is found the fewest times in a,
+// set in `match` as [a_lo, a_hi) and [b_lo, b_hi)
+HistogramMatch histogram_match(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b,
+                               const DiffRegion& region, Arena& arena, DiffRegion& match) {
+    Arena::Mark mark = arena.mark();
+    size_t a_lines = static_cast<size_t>(region.a_hi - region.a_lo);
+    LineCounts counts(arena, a_lines);
+
+    // each line of a links to the next one that's the same, and knows how
+    // many times it's found
+    uint32_t* next = arena.alloc<uint32_t>(a_lines);
+    uint32_t* times = arena.alloc<uint32_t>(a_lines);
+    for (long i = region.a_hi - 1; i >= region.a_lo; i--) {
+        LineCount& count = counts.at(a[i]);
+        next[i - region.a_lo] = count.a_count ? count.a_pos : NO_LINE;
+        count.a_pos = static_cast<uint32_t>(i);
+        count.a_count++;
+    }
+    for (long i = region.a_lo; i < region.a_hi; i++) {
+        times[i - region.a_lo] = counts.find(a[i])->a_count;
+    }
+
+    bool common = false;
+    long best_length = 0;
+    uint32_t best_times = MAX_CHAIN_LENGTH + 1;
+    for (long j = region.b_lo; j < region.b_hi;) {
+        long j_next = j + 1;
+        LineCount* count = counts.find(b[j]);
+        if (count) {
+            common = true;
+        }
+        if (!count || count->a_count > best_times) {
+            j = j_next;
+            continue;
+        }
+        for (uint32_t i = count->a_pos; i != NO_LINE;) {
+            // the run of common lines through a[i] and b[j]
+            long a_start = i, b_start = j, a_end = i + 1, b_end = j + 1;
+            uint32_t rarest = times[i - region.a_lo];
+            while (a_start > region.a_lo && b_start > region.b_lo && a[a_start - 1] == b[b_start - 1]) {
+                a_start--;
+                b_start--;
+                rarest = std::min(rarest, times[a_start - region.a_lo]);
+            }
+            while (a_end < region.a_hi && b_end < region.b_hi && a[a_end] == b[b_end]) {
+                rarest = std::min(rarest, times[a_end - region.a_lo]);
+                a_end++;
+                b_end++;
+            }
+            j_next = std::max(j_next, b_end);
+            if (best_length < a_end - a_start || rarest < best_times) {
+                match = {a_start, a_end, b_start, b_end, region.depth};
+                best_length = a_end - a_start;
+                best_times = rarest;
+            }
+            // on to the next copy of the line past this run
+            uint32_t following = next[i - region.a_lo];
+            while (following != NO_LINE && static_cast<long>(following) < a_end) {
+                following = next[following - region.a_lo];
+            }
+            i = following;
+        }
+        j = j_next;
+    }
+
+    arena.release(mark);
+    if (!common) {
+        return HistogramMatch::None;
+    }
+    // a run can only have been found among lines one too many, too
+    return best_times > MAX_CHAIN_LENGTH ? HistogramMatch::TooCommon : HistogramMatch::Found;
+}
+
+// A patience or histogram diff of the ids `a` and `b`, marking the lines
+// that aren't part of it in `a_changed` and `b_changed`. Unlike Myers,
+// they get every line, as in Git: trimming the ends or leaving out lines
+// only one side has would change where they split.
+void anchored_diff(DiffAlgorithm algorithm, const std::vector<uint32_t>& a, const std::vector<uint32_t>& b,
+                   std::vector<bool>& a_changed, std::vector<bool>& b_changed) {
+    Arena arena;
+    std::vector<uint32_t> sub_a, sub_b;
+    std::vector<bool> sub_a_changed, sub_b_changed;
+    auto fall_back = [&](const DiffRegion& region) {
+        // a diff of its own, as Git does it, with the region's lines
+        // numbered afresh so its tables are only as big as the region
+        Arena::Mark mark = arena.mark();
+        LineCounts numbers(arena, static_cast<size_t>((region.a_hi - region.a_lo) + (region.b_hi - region.b_lo)));
+        uint32_t numbered = 0;
+        auto renumber = [&](uint32_t id) {
+            LineCount& count = numbers.at(id);
+            if (count.a_count++ == 0) {
+                count.a_pos = numbered++;
+            }
+            return count.a_pos;
+        };
+        sub_a.clear();
+        sub_b.clear();
+        for (long i = region.a_lo; i < region.a_hi; i++) {
+            sub_a.push_back(renumber(a[i]));
+        }
+        for (long j = region.b_lo; j < region.b_hi; j++) {
+            sub_b.push_back(renumber(b[j]));
+        }
+        arena.release(mark);
+
+        sub_a_changed.assign(sub_a.size(), false);
+        sub_b_changed.assign(sub_b.size(), false);
+        myers_diff(sub_a, sub_b, numbered, sub_a_changed, sub_b_changed);
+        for (size_t i = 0; i < sub_a.size(); i++) {
+            a_changed[region.a_lo + i] = sub_a_changed[i];
+        }
+        for (size_t j = 0; j < sub_b.size(); j++) {
+            b_changed[region.b_lo + j] = sub_b_changed[j];
+        }
+    };
+
+    // parts still to diff, a stack as in Myers
+    std::vector<DiffRegion> regions{{0, static_cast<long>(a.size()), 0, static_cast<long>(b.size()), 0}};
+    std::vector<std::pair<long, long>> anchors;
+    while (!regions.empty()) {
+        DiffRegion region = regions.back();
+        regions.pop_back();
+        if (region.a_lo == region.a_hi || region.b_lo == region.b_hi) {
+            for (long i = region.a_lo; i < region.a_hi; i++) {
+                a_changed[i] = true;
+            }
+            for (long j = region.b_lo; j < region.b_hi; j++) {
+                b_changed[j] = true;
+            }
+            continue;
+        }
+        if (region.depth >= MAX_SPLIT_DEPTH) {
+            fall_back(region);
+            continue;
+        }
+
+        unsigned depth = region.depth + 1;
+        if (algorithm == DiffAlgorithm::Patience) {
+            if (!patience_anchors(a, b, region, arena, anchors)) {
+                fall_back(region);
+                continue;
+            }
+            // the parts between the anchors, less the common lines each
+            // one ends with (just before the next anchor) and then starts
+            // with, in that order as Git takes them
+            long a_lo = region.a_lo, b_lo = region.b_lo;
+            for (size_t k = 0;; k++) {
+                long a_hi = region.a_hi, b_hi = region.b_hi;
+                if (k < anchors.size()) {
+                    a_hi = anchors[k].first;
+                    b_hi = anchors[k].second;
+                    while (a_hi > a_lo && b_hi > b_lo && a[a_hi - 1] == b[b_hi - 1]) {
+                        a_hi--;
+                        b_hi--;
+                    }
+                }
+                while (a_lo < a_hi && b_lo < b_hi && a[a_lo] == b[b_lo]) {
+                    a_lo++;
+                    b_lo++;
+                }
+                if (a_lo < a_hi || b_lo < b_hi) {
+                    regions.push_back({a_lo, a_hi, b_lo, b_hi, depth});
+                }
+                if (k == anchors.size()) {
+                    break;
+                }
+                while (k + 1 < anchors.size() && anchors[k + 1].first == anchors[k].first + 1 &&
+                       anchors[k + 1].second == anchors[k].second + 1) {
+                    k++;
+                }
+                a_lo = anchors[k].first + 1;
+                b_lo = anchors[k].second + 1;
+            }
+            continue;
+        }
+
+        DiffRegion match = region;
+        switch (histogram_match(a, b, region, arena, match)) {
+        case HistogramMatch::Found:
+            regions.push_back({match.a_hi, region.a_hi, match.b_hi, region.b_hi, depth});
+            regions.push_back({region.a_lo, match.a_lo, region.b_lo, match.b_lo, depth});
+            break;
+        case HistogramMatch::None:
+            for (long i = region.a_lo; i < region.a_hi; i++) {
+                a_changed[i] = true;
+            }
+            for (long j = region.b_lo; j < region.b_hi; j++) {
+                b_changed[j] = true;
+            }
+            break;
+        case HistogramMatch::TooCommon:
+            fall_back(region);
+            break;
+        }
+    }
+}
+
+}
+
+DiffLines::DiffLines(std::string_view old_text, std::string_view new_text) {
+    old_side.text = old_text;
+    new_side.text = new_text;
+    find_line_ends(old_text, old_side.ends);
+    find_line_ends(new_text, new_side.ends);
+
+    LineInterner interner(old_side.ends.size() + new_side.ends.size());
+    for (Side* side : {&old_side, &new_side}) {
+        side->ids.resize(side->ends.size());
+        for (size_t i = 0; i < side->ends.size(); i++) {
+            side->ids[i] = interner.intern(side->line(i));
+        }
+    }
+    interned = interner.size();
+}
+
+bool parse_diff_algorithm(std::string_view name, DiffAlgorithm& algorithm) {
+    if (name == "myers" || name == "default" || name == "minimal") {
+        algorithm = DiffAlgorithm::Myers;
+    } else if (name == "patience") {
+        algorithm = DiffAlgorithm::Patience;
+    } else if (name == "histogram") {
+        algorithm = DiffAlgorithm::Histogram;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::vector<DiffEdit> diff_lines(const DiffLines& lines, DiffAlgorithm algorithm) {
+    const std::vector<uint32_t>& a = lines.old_ids();
+    const std::vector<uint32_t>& b = lines.new_ids();
+    std::vector<bool> a_changed(a.size(), false);
+    std::vector<bool> b_changed(b.size(), false);
+    if (algorithm == DiffAlgorithm::Myers) {
+        myers_diff(a, b, lines.unique_lines(), a_changed, b_changed);
+    } else {
+        anchored_diff(algorithm, a, b, a_changed, b_changed);
+    }
+
+    slide_changes(a, a_changed, b, b_changed);
+    slide_changes(b, b_changed, a, a_changed);
+
+    // the unchanged lines pair up in order; each run of changes between
+    // them is an edit
+    std::vector<DiffEdit> edits;
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+        if ((i < a.size() && a_changed[i]) || (j < b.size() && b_changed[j])) {
+            DiffEdit edit{i, 0, j, 0};
+            while (i < a.size() && a_changed[i]) {
+                i++;
+            }
+            while (j < b.size() && b_changed[j]) {
+                j++;
+            }
+            edit.old_count = i - edit.old_start;
+            edit.new_count = j - edit.new_start;
+            edits.push_back(edit);
+        } else {
+            i++;
+            j++;
+        }
+    }
+    return edits;
+}
+
+bool diff_is_binary(std::string_view text) {
+    return std::memchr(text.data(), '\0', std::min<size_t>(text.size(), 8000)) != nullptr;
+}
+
+namespace {
+
+// "start,count" of a hunk header, Git style: 1-based, the line before for
+// an empty range, and no count when it's 1
+std::string hunk_range(size_t start, size_t count) {
+    if (count == 0) {
+        return std::to_string(start) + ",0";
+    }
+    std::string range = std::to_string(start + 1);
+    if (count != 1) {
+        range += "," + std::to_string(count);
+    }
+    return range;
+}
+
+// What Git's default funcname pattern shows after a hunk header: the last
+// line above the hunk that starts with a letter, '_' or '$', up to 80
+// bytes without trailing whitespace. Only lines from `searched` on are
+// looked at, and `found` is kept if none of them is one; as in Git, each
+// hunk picks up where the one before it stopped, so texts without such
+// lines aren't scanned back to the top for every hunk.
+std::string_view hunk_function(const DiffLines& lines, size_t old_begin, size_t searched, std::string_view found) {
+    for (size_t i = old_begin; i-- > searched;) {
+        std::string_view line = lines.old_line(i);
+        unsigned char first = line.empty() ? 0 : static_cast<unsigned char>(line[0]);
+        if (std::isalpha(first) || first == '_' || first == '$') {
+            line = line.substr(0, 80);
+            while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+                line.remove_suffix(1);
+            }
+            return line;
+        }
+    }
+    return found;
+}
+
+void append_line(std::string& out, char marker, std::string_view line) {
+    out += marker;
+    out += line;
+    if (line.empty() || line.back() != '\n') {
+        out += "\n\\ No newline at end of file\n";
+    }
+}
+
+}
+
+std::string unified_diff(std::string_view old_text, std::string_view new_text, size_t context,
+                         DiffAlgorithm algorithm) {
+    DiffLines lines(old_text, new_text);
+    std::vector<DiffEdit> edits = diff_lines(lines, algorithm);
+    size_t old_lines = lines.old_ids().size();
+
+    std::string out;
+    std::string_view function;
+    size_t searched = 0;
+    for (size_t first = 0; first < edits.size();) {
+        // edits closer than twice the context share a hunk
+        size_t last = first;
+        while (last + 1 < edits.size() &&
+               edits[last + 1].old_start - (edits[last].old_start + edits[last].old_count) <= 2 * context) {
+            last++;
+        }
+        const DiffEdit& head = edits[first];
+        const DiffEdit& tail = edits[last];
+        size_t leading = std::min(context, head.old_start);
+        size_t old_begin = head.old_start - leading;
+        size_t new_begin = head.new_start - leading;
+        size_t tail_old_end = tail.old_start + tail.old_count;
+        size_t trailing = std::min(context, old_lines - tail_old_end);
+        size_t old_end = tail_old_end + trailing;
+        size_t new_end = tail.new_start + tail.new_count + trailing;
+
+        out += "@@ -" + hunk_range(old_begin, old_end - old_begin) + " +" + hunk_range(new_begin, new_end - new_begin) +
+               " @@";
+        function = hunk_function(lines, old_begin, searched, function);
+        searched = old_begin;
+        if (!function.empty()) {
+            out += ' ';
+            out += function;
+        }
+        out += '\n';
+        size_t pos = old_begin;
+        for (size_t e = first; e <= last; e++) {
+            const DiffEdit& edit = edits[e];
+            for (; pos < edit.old_start; pos++) {
+                append_line(out, ' ', lines.old_line(pos));
+            }
+            for (size_t i = 0; i < edit.old_count; i++) {
+                append_line(out, '-', lines.old_line(edit.old_start + i));
+            }
+            for (size_t j = 0; j < edit.new_count; j++) {
+                append_line(out, '+', lines.new_line(edit.new_start + j));
+            }
+            pos = edit.old_start + edit.old_count;
+        }
+        for (; pos < old_end; pos++) {
+            append_line(out, ' ', lines.old_line(pos));
+        }
+        first = last + 1;
+    }
+    return out;
+}
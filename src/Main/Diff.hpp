@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Line diffs, for `silt diff`. Both texts are cut into lines (each with
+ * its newline, so a last line without one differs from the same line with
+ * it) and every line is interned: equal lines get the same small id, and
+ * from then on lines are compared as ids. For Myers, the lines both texts
+ * start and end with are trimmed first, and lines found in only one of the
+ * texts (or found many times over among such lines) are set aside as
+ * changed; what's left goes to Myers' O(ND) algorithm, in its linear-space
+ * form that looks for the middle snake of each box and splits the box
+ * there, as Git's xdiff does. The newline scan and the prefix and suffix
+ * compares use AVX2 where the CPU has it.
+ *
+ * Myers slows down a lot on texts where the same lines come back over and
+ * over (lockfiles, CSV fixtures), so the patience and histogram diffs are
+ * there too, on the same interned lines. Both split the texts at anchors
+ * (lines found once on each side for patience; the longest common run
+ * around the line found the fewest times for histogram) and diff the
+ * parts between them the same way, handing a part to Myers when it has no
+ * anchor to split at or the splitting goes too deep. The tables they build
+ * for each part come from an arena.
+ *
+ * Whichever algorithm ran, each run of changes is then slid to where xdiff
+ * would put it, so the hunks come out as Git prints them (without its
+ * indent heuristic).
+ */
+
+enum class DiffAlgorithm {
+    Myers,
+    Patience,
+    Histogram,
+};
+
+// The algorithm called `name` (myers, patience, histogram, or Git's
+// "default" and "minimal", both Myers here); false if there's none
+bool parse_diff_algorithm(std::string_view name, DiffAlgorithm& algorithm);
+
+// One change: `old_count` lines of the old text from `old_start` are
+// replaced by `new_count` lines of the new text from `new_start` (0-based)
+struct DiffEdit {
+    size_t old_start;
+    size_t old_count;
+    size_t new_start;
+    size_t new_count;
+};
+
+// The lines of two texts, interned together
+class DiffLines {
+public:
+    DiffLines(std::string_view old_text, std::string_view new_text);
+
+    const std::vector<uint32_t>& old_ids() const { return old_side.ids; }
+    const std::vector<uint32_t>& new_ids() const { return new_side.ids; }
+    std::string_view old_line(size_t i) const { return old_side.line(i); }
+    std::string_view new_line(size_t i) const { return new_side.line(i); }
+
+    // Number of different lines in the two texts
+    size_t unique_lines() const { return interned; }
+
+private:
+    struct Side {
+        std::string_view text;
+        std::vector<uint32_t> ends;   // offset just past each line
+        std::vector<uint32_t> ids;
+
+        std::string_view line(size_t i) const {
+            size_t start = i ? ends[i - 1] : 0;
+            return text.substr(start, ends[i] - start);
+        }
+    };
+
+    Side old_side;
+    Side new_side;
+    size_t interned = 0;
+};
+
+// The edits turning the old text of `lines` into the new one, in order
+std::vector<DiffEdit> diff_lines(const DiffLines& lines, DiffAlgorithm algorithm = DiffAlgorithm::Myers);
+
+// Whether `text` looks binary: a NUL in its first 8000 bytes, as Git decides
+bool diff_is_binary(std::string_view text);
+
+// The hunks of a unified diff from `old_text` to `new_text` ("@@ -a,b +c,d
+// @@", the function the hunk is in, and the lines, with `context`
+// unchanged lines around each change); empty if the texts have the same lines
+std::string unified_diff(std::string_view old_text, std::string_view new_text, size_t context = 3,
+                         DiffAlgorithm algorithm = DiffAlgorithm::Myers);
@@ -0,0 +1,315 @@
+#include "Durable.hpp"
+#include "Repository.hpp"
+#include "Utils.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+#ifdef _WIN32
+int open_exclusive(const std::filesystem::path& path) {
+    return _wopen(path.c_str(), _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+}
+long write_some(int fd, const char* data, size_t size) {
+    return _write(fd, data, static_cast<unsigned int>(std::min<size_t>(size, 1 << 30)));
+}
+bool flush_fd(int fd) {
+    return _commit(fd) == 0;
+}
+void close_fd(int fd) {
+    _close(fd);
+}
+#else
+int open_exclusive(const std::filesystem::path& path) {
+    return ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+}
+long write_some(int fd, const char* data, size_t size) {
+    return ::write(fd, data, size);
+}
+bool flush_fd(int fd) {
+    while (::fsync(fd) != 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+void close_fd(int fd) {
+    ::close(fd);
+}
+#endif
+
+bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        long written = write_some(fd, data.data(), data.size());
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data.remove_prefix(static_cast<size_t>(written));
+    }
+    return true;
+}
+
+// One generator per thread, so threads writing at once don't share it
+std::mt19937_64& thread_random() {
+    thread_local std::mt19937_64 random{std::random_device{}()};
+    return random;
+}
+
+// Create a new file with a name of its own in `dir`, setting `temp` to it
+int create_temp(const std::filesystem::path& dir, std::filesystem::path& temp) {
+    static const char digits[] = "0123456789abcdef";
+    for (int attempt = 0; attempt < 100; attempt++) {
+        std::string name = "tmp_";
+        uint64_t bits = thread_random()();
+        for (int i = 0; i < 16; i++) {
+            name += digits[(bits >> (4 * i)) & 0xF];
+        }
+        temp = dir / name;
+        int fd = open_exclusive(temp);
+        if (fd >= 0 || errno != EEXIST) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// Flush a file that's already written and closed
+bool fsync_path(const std::filesystem::path& path) {
+#ifdef _WIN32
+    int fd = _wopen(path.c_str(), _O_RDWR | _O_BINARY);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = flush_fd(fd);
+    close_fd(fd);
+    return ok;
+}
+
+// Flush everything written to the filesystem holding `dir`, in one call;
+// false where that can't be done
+bool syncfs_dir(const std::filesystem::path& dir) {
+#ifdef __linux__
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::syncfs(fd) == 0;
+    ::close(fd);
+    return ok;
+#else
+    (void)dir;
+    return false;
+#endif
+}
+
+// Put `temp` at `path`. With `keep_existing`, it's linked there, and a
+// file already at `path` (another writer's copy of the same object) wins.
+bool publish(const std::filesystem::path& temp, const std::filesystem::path& path, bool keep_existing) {
+    std::error_code ec;
+    if (keep_existing) {
+#ifndef _WIN32
+        if (::link(temp.c_str(), path.c_str()) == 0 || errno == EEXIST) {
+            ::unlink(temp.c_str());
+            return true;
+        }
+        // no hard links on this filesystem: rename instead
+#endif
+        if (std::filesystem::exists(path, ec)) {
+            std::filesystem::remove(temp, ec);
+            return true;
+        }
+    }
+    std::filesystem::rename(temp, path, ec);
+    if (ec) {
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    return true;
+}
+
+unsigned fsync_component(const std::string& name) {
+    if (name == "loose-object") return FSYNC_LOOSE_OBJECT;
+    if (name == "pack") return FSYNC_PACK;
+    if (name == "index") return FSYNC_INDEX;
+    if (name == "reference") return FSYNC_REFERENCE;
+    if (name == "objects") return FSYNC_LOOSE_OBJECT | FSYNC_PACK;
+    if (name == "committed") return FSYNC_LOOSE_OBJECT | FSYNC_PACK | FSYNC_REFERENCE;
+    if (name == "added" || name == "all") return FSYNC_LOOSE_OBJECT | FSYNC_PACK | FSYNC_REFERENCE | FSYNC_INDEX;
+    return 0;
+}
+
+}
+
+FsyncPolicy fsync_policy(const ConfigParser& config) {
+    FsyncPolicy policy;
+
+    // like Git, the list adds to (or with '-', takes from) the default
+    std::stringstream list(config.get("core", "fsync"));
+    std::string name;
+    while (std::getline(list, name, ',')) {
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (name == "none") {
+            policy.components = 0;
+        } else if (!name.empty() && name[0] == '-') {
+            policy.components &= ~fsync_component(name.substr(1));
+        } else {
+            policy.components |= fsync_component(name);
+        }
+    }
+
+    policy.batch = config.get("core", "fsyncMethod") == "batch";
+    return policy;
+}
+
+DurableWrites::DurableWrites(const Repository& repo) : gitdir(repo.gitdir), policy(repo.fsync) {}
+
+DurableWrites::~DurableWrites() {
+    std::error_code ec;
+    for (const auto& file : staged) {
+        std::filesystem::remove(file.temp, ec);
+    }
+}
+
+void DurableWrites::stage(const std::filesystem::path& path, std::string_view data, FsyncComponent component,
+                          bool keep_existing) {
+    std::filesystem::create_directories(path.parent_path());
+    std::filesystem::path temp;
+    int fd = create_temp(path.parent_path(), temp);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create a temporary file for " + path.string());
+    }
+
+    bool ok = write_all(fd, data);
+    if (ok && policy.wants(component)) {
+        if (policy.batch) {
+            needs_syncfs = true;
+        } else {
+            ok = flush_fd(fd);
+        }
+    }
+    close_fd(fd);
+    if (!ok) {
+        std::error_code ec;
+        std::filesystem::remove(temp, ec);
+        throw std::runtime_error("Failed to write " + path.string());
+    }
+    staged.push_back({temp, path, keep_existing});
+}
+
+void DurableWrites::stage_file(const std::filesystem::path& temp, const std::filesystem::path& path,
+                               FsyncComponent component, bool keep_existing) {
+    staged.push_back({temp, path, keep_existing});
+    if (policy.wants(component)) {
+        if (policy.batch) {
+            needs_syncfs = true;
+        } else if (!fsync_path(temp)) {
+            throw std::runtime_error("Failed to flush " + temp.string());
+        }
+    }
+}
+
+void DurableWrites::flush() {
+    if (needs_syncfs && !syncfs_dir(gitdir)) {
+        for (const auto& file : staged) {
+            if (!fsync_path(file.temp)) {
+                throw std::runtime_error("Failed to flush " + file.temp.string());
+            }
+        }
+    }
+    needs_syncfs = false;
+
+    std::vector<Staged> files;
+    files.swap(staged);
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!publish(files[i].temp, files[i].path, files[i].keep_existing)) {
+            // what's left isn't put in place either
+            staged.assign(files.begin() + i + 1, files.end());
+            throw std::runtime_error("Failed to move " + files[i].path.string() + " into place");
+        }
+    }
+}
+
+bool LockFile::acquire(const std::filesystem::path& path, long timeout_ms) {
+    rollback();
+    target = path;
+    lock = path;
+    lock += ".lock";
+    failed = false;
+
+    // retry with a backoff that doubles up to a second, jittered so that
+    // writers who collided once don't keep colliding
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    long backoff_ms = 1;
+    while (true) {
+        fd = open_exclusive(lock);
+        if (fd >= 0) {
+            return true;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (errno != EEXIST || now >= deadline) {
+            return false;
+        }
+        std::uniform_int_distribution<long> jitter(backoff_ms * 750, backoff_ms * 1250);
+        auto wait = std::min<std::chrono::steady_clock::duration>(std::chrono::microseconds(jitter(thread_random())),
+                                                                  deadline - now);
+        std::this_thread::sleep_for(wait);
+        backoff_ms = std::min(backoff_ms * 2, 1000L);
+    }
+}
+
+bool LockFile::write(std::string_view data) {
+    if (fd < 0 || !write_all(fd, data)) {
+        failed = true;
+    }
+    return !failed;
+}
+
+bool LockFile::commit(const FsyncPolicy& policy, FsyncComponent component) {
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = !failed && (!policy.wants(component) || flush_fd(fd));
+    close_fd(fd);
+    fd = -1;
+
+    std::error_code ec;
+    if (ok) {
+        std::filesystem::rename(lock, target, ec);
+        ok = !ec;
+    }
+    if (!ok) {
+        std::filesystem::remove(lock, ec);
+    }
+    return ok;
+}
+
+void LockFile::rollback() {
+    if (fd < 0) {
+        return;
+    }
+    close_fd(fd);
+    fd = -1;
+    std::error_code ec;
+    std::filesystem::remove(lock, ec);
+}
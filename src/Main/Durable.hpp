@@ -0,0 +1,122 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class ConfigParser;
+class Repository;
+
+/*
+ * Crash-safe writes for the object database, the index and refs. Nothing
+ * is written in place: a new file is written under a temporary name and
+ * then renamed over the old one (or, for an object, linked to its name,
+ * since an object that's already there is the same object), so a reader
+ * or a crash only ever finds the old file or the whole new one. The index
+ * and refs are written through a lockfile (<name>.lock, created
+ * exclusively), which also keeps two writers from clobbering each other.
+ * A writer that finds the lock taken retries for a while, backing off,
+ * before it gives up. Temporary names are unique per file, so any number
+ * of threads and processes can write objects at once; whoever links an
+ * object first wins, and the rest find it there.
+ *
+ * core.fsync names what has to reach the disk before it's renamed into
+ * place: loose-object, pack, index and reference, or objects (both kinds
+ * of object), committed (objects and refs), added (committed and the
+ * index), all, or none; a name with a '-' in front takes it away again.
+ * The default is committed. With core.fsyncMethod=fsync (the default)
+ * each file is flushed on its own. With core.fsyncMethod=batch, the files
+ * of a batch are all written first, one syncfs flushes them together,
+ * and only then are they renamed into place, which on a large commit
+ * costs one flush instead of one per object.
+ */
+
+enum FsyncComponent : unsigned {
+    FSYNC_LOOSE_OBJECT = 1,
+    FSYNC_PACK = 2,
+    FSYNC_INDEX = 4,
+    FSYNC_REFERENCE = 8,
+};
+
+// How long a writer waits for index.lock, and by default for a ref's lock
+// (core.filesRefLockTimeout), in milliseconds
+constexpr long INDEX_LOCK_TIMEOUT_MS = 1000;
+constexpr long REF_LOCK_TIMEOUT_MS = 100;
+
+struct FsyncPolicy {
+    unsigned components = FSYNC_LOOSE_OBJECT | FSYNC_PACK | FSYNC_REFERENCE;
+    bool batch = false;
+
+    bool wants(FsyncComponent component) const { return components & component; }
+};
+
+// core.fsync and core.fsyncMethod of `config`
+FsyncPolicy fsync_policy(const ConfigParser& config);
+
+// Files written under temporary names and put in place together by
+// flush(). Whatever isn't flushed is removed.
+class DurableWrites {
+public:
+    explicit DurableWrites(const Repository& repo);
+    ~DurableWrites();
+    DurableWrites(const DurableWrites&) = delete;
+    DurableWrites& operator=(const DurableWrites&) = delete;
+
+    // Write `data` to a temporary file beside `path`. With `keep_existing`
+    // (objects), a file already at `path` is left as it is.
+    void stage(const std::filesystem::path& path, std::string_view data, FsyncComponent component,
+               bool keep_existing = false);
+
+    // Same, for a temporary file that's already written
+    void stage_file(const std::filesystem::path& temp, const std::filesystem::path& path, FsyncComponent component,
+                    bool keep_existing = false);
+
+    // Flush what has to be flushed, then put everything in place, in the
+    // order it was staged
+    void flush();
+
+private:
+    struct Staged {
+        std::filesystem::path temp;
+        std::filesystem::path path;
+        bool keep_existing;
+    };
+
+    std::filesystem::path gitdir;
+    FsyncPolicy policy;
+    std::vector<Staged> staged;
+    bool needs_syncfs = false;
+};
+
+// Exclusive lock on a file, held by creating <path>.lock; what's written
+// to the lockfile replaces the file on commit
+class LockFile {
+public:
+    LockFile() = default;
+    ~LockFile() { rollback(); }
+    LockFile(const LockFile&) = delete;
+    LockFile& operator=(const LockFile&) = delete;
+
+    // Take the lock, waiting up to `timeout_ms` for another writer to
+    // release it; false if it's still held then (or can't be created)
+    bool acquire(const std::filesystem::path& path, long timeout_ms = 0);
+
+    bool write(std::string_view data);
+
+    // Flush the new contents if `policy` asks for `component`, and rename
+    // them over the file, releasing the lock
+    bool commit(const FsyncPolicy& policy, FsyncComponent component);
+
+    // Release the lock, leaving the file as it was
+    void rollback();
+
+    bool held() const { return fd >= 0; }
+    const std::filesystem::path& lock_path() const { return lock; }
+
+private:
+    std::filesystem::path target;
+    std::filesystem::path lock;
+    int fd = -1;
+    bool failed = false;
+};
@@ -0,0 +1,146 @@
+#include "Ewah.hpp"
+
+namespace {
+constexpr uint64_t CLEAN_ONES = ~static_cast<uint64_t>(0);
+
+// Largest run and literal counts a marker word can hold
+constexpr uint64_t MAX_RUN = 0xFFFFFFFFull;
+constexpr uint64_t MAX_LITERALS = 0x7FFFFFFFull;
+
+void append_u32(std::string& out, uint32_t v) {
+    out += static_cast<char>((v >> 24) & 0xFF);
+    out += static_cast<char>((v >> 16) & 0xFF);
+    out += static_cast<char>((v >> 8) & 0xFF);
+    out += static_cast<char>(v & 0xFF);
+}
+
+void append_u64(std::string& out, uint64_t v) {
+    append_u32(out, static_cast<uint32_t>(v >> 32));
+    append_u32(out, static_cast<uint32_t>(v));
+}
+
+uint32_t read_u32(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return (static_cast<uint32_t>(u[0]) << 24) | (static_cast<uint32_t>(u[1]) << 16) |
+           (static_cast<uint32_t>(u[2]) << 8) | static_cast<uint32_t>(u[3]);
+}
+
+uint64_t read_u64(const char* p) {
+    return (static_cast<uint64_t>(read_u32(p)) << 32) | read_u32(p + 4);
+}
+}
+
+void EwahBitmap::set(size_t pos) {
+    if (pos >= bits) {
+        bits = pos + 1;
+        words.resize((bits + 63) / 64, 0);
+    }
+    words[pos / 64] |= static_cast<uint64_t>(1) << (pos % 64);
+}
+
+bool EwahBitmap::get(size_t pos) const {
+    if (pos >= bits) {
+        return false;
+    }
+    return (words[pos / 64] >> (pos % 64)) & 1;
+}
+
+bool EwahBitmap::empty() const {
+    for (uint64_t word : words) {
+        if (word) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<size_t> EwahBitmap::positions() const {
+    std::vector<size_t> result;
+    for (size_t w = 0; w < words.size(); w++) {
+        uint64_t word = words[w];
+        while (word) {
+            result.push_back(w * 64 + __builtin_ctzll(word));
+            word &= word - 1;
+        }
+    }
+    return result;
+}
+
+void EwahBitmap::serialize(std::string& out) const {
+    std::vector<uint64_t> encoded;
+    size_t last_marker = 0;
+
+    size_t i = 0;
+    do {
+        // a run of clean words...
+        uint64_t run_bit = 0;
+        uint64_t run = 0;
+        if (i < words.size() && (words[i] == 0 || words[i] == CLEAN_ONES)) {
+            run_bit = words[i] ? 1 : 0;
+            uint64_t clean = words[i];
+            while (i < words.size() && words[i] == clean && run < MAX_RUN) {
+                run++;
+                i++;
+            }
+        }
+
+        // ...followed by the literal words up to the next clean one
+        size_t literal_start = i;
+        while (i < words.size() && words[i] != 0 && words[i] != CLEAN_ONES &&
+               i - literal_start < MAX_LITERALS) {
+            i++;
+        }
+
+        last_marker = encoded.size();
+        encoded.push_back(run_bit | (run << 1) | (static_cast<uint64_t>(i - literal_start) << 33));
+        encoded.insert(encoded.end(), words.begin() + literal_start, words.begin() + i);
+    } while (i < words.size());
+
+    append_u32(out, static_cast<uint32_t>(bits));
+    append_u32(out, static_cast<uint32_t>(encoded.size()));
+    for (uint64_t word : encoded) {
+        append_u64(out, word);
+    }
+    append_u32(out, static_cast<uint32_t>(last_marker));
+}
+
+bool EwahBitmap::deserialize(const char*& p, const char* end) {
+    if (end - p < 8) {
+        return false;
+    }
+    size_t bit_size = read_u32(p);
+    size_t word_count = read_u32(p + 4);
+    if (static_cast<size_t>(end - p - 8) / 8 < word_count || end - p - 8 - word_count * 8 < 4) {
+        return false;
+    }
+    const char* data = p + 8;
+
+    std::vector<uint64_t> decoded;
+    decoded.reserve((bit_size + 63) / 64);
+    size_t i = 0;
+    while (i < word_count) {
+        uint64_t marker = read_u64(data + i * 8);
+        i++;
+        uint64_t run = (marker >> 1) & MAX_RUN;
+        uint64_t literals = marker >> 33;
+        if (literals > word_count - i || decoded.size() + run + literals > (bit_size + 63) / 64) {
+            return false;
+        }
+        decoded.insert(decoded.end(), run, (marker & 1) ? CLEAN_ONES : 0);
+        for (uint64_t l = 0; l < literals; l++, i++) {
+            decoded.push_back(read_u64(data + i * 8));
+        }
+    }
+
+    // trailing clean zero words may be left out
+    decoded.resize((bit_size + 63) / 64, 0);
+    // and bits past the end must not be set
+    if (bit_size % 64 && !decoded.empty()) {
+        decoded.back() &= (static_cast<uint64_t>(1) << (bit_size % 64)) - 1;
+    }
+
+    words = std::move(decoded);
+    bits = bit_size;
+    p = data + word_count * 8 + 4;
+    return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Bitmap stored in Git's EWAH format, which index extensions (split index,
+ * untracked cache, fsmonitor) use to mark entries by position.
+ *
+ * On disk: the number of bits (32-bit), the number of 64-bit words that
+ * follow (32-bit), the words, and the position of the last marker word
+ * (32-bit), all big-endian. The words are a sequence of marker words, each
+ * followed by its literal words. A marker packs a run of identical clean
+ * words (bit 0: their value, bits 1-32: how many) and the number of literal
+ * words after it (bits 33-63).
+ *
+ * In memory the bitmap is kept uncompressed; it's only as large as the
+ * index it describes.
+ */
+class EwahBitmap {
+public:
+    EwahBitmap() = default;
+
+    void set(size_t pos);
+    bool get(size_t pos) const;
+
+    // One past the highest bit that can be set
+    size_t bit_size() const { return bits; }
+    bool empty() const;
+
+    // Positions of the set bits, in increasing order
+    std::vector<size_t> positions() const;
+
+    // Append the on-disk form to `out`
+    void serialize(std::string& out) const;
+
+    // Parse the on-disk form at `p`, advancing it past the bitmap. Returns
+    // false if the data is truncated or inconsistent.
+    bool deserialize(const char*& p, const char* end);
+
+private:
+    std::vector<uint64_t> words;
+    size_t bits = 0;
+};
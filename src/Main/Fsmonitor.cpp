@@ -0,0 +1,555 @@
+#include "Fsmonitor.hpp"
+#include "Repository.hpp"
+#include <iostream>
+#include <filesystem>
+
+#ifdef __linux__
+#include <deque>
+#include <set>
+#include <unordered_map>
+#include <chrono>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef __linux__
+namespace {
+std::filesystem::path socket_path(const Repository& repo) {
+    return repo.gitdir / "silt-fsmonitor.ipc";
+}
+
+constexpr const char* TOKEN_PREFIX = "silt:";
+
+// Changes kept for answering; a client asking from before the oldest one
+// gets a trivial answer
+constexpr size_t MAX_JOURNAL = 1 << 20;
+
+constexpr uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                                IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+// How long a request may take before the other side is given up on
+constexpr int IPC_TIMEOUT_SEC = 10;
+
+volatile sig_atomic_t stop_signal = 0;
+
+void handle_stop_signal(int) {
+    stop_signal = 1;
+}
+
+bool make_address(const std::filesystem::path& path, sockaddr_un& addr) {
+    std::string name = path.string();
+    std::memset(&addr, 0, sizeof(addr));
+    if (name.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, name.c_str(), name.size() + 1);
+    return true;
+}
+
+void set_timeouts(int fd) {
+    timeval timeout{IPC_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+int connect_daemon(const Repository& repo) {
+    sockaddr_un addr;
+    if (!make_address(socket_path(repo), addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    // a daemon that stopped answering is as good as none
+    set_timeouts(fd);
+    return fd;
+}
+
+bool send_all(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Send a request and read the answer, which ends when the daemon closes
+// the connection
+std::optional<std::string> request(const Repository& repo, const std::string& message) {
+    int fd = connect_daemon(repo);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+
+    std::string answer;
+    bool ok = send_all(fd, message);
+    char buffer[65536];
+    while (ok) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        answer.append(buffer, static_cast<size_t>(n));
+    }
+    close(fd);
+
+    if (!ok) {
+        return std::nullopt;
+    }
+    return answer;
+}
+
+class Daemon {
+public:
+    explicit Daemon(const Repository& repo) : worktree(repo.worktree), socket_file(socket_path(repo)) {}
+    ~Daemon();
+
+    // Watch the worktree and listen for clients
+    bool start(const Repository& repo);
+
+    // Answer clients until asked (or signalled) to stop
+    void serve();
+
+private:
+    std::filesystem::path worktree;
+    std::filesystem::path socket_file;
+    int inotify_fd = -1;
+    int listen_fd = -1;
+    bool listening = false;
+    bool stopping = false;
+
+    // Watched directories, relative to the worktree with a trailing '/'
+    // ("" for the top)
+    std::unordered_map<int, std::string> watches;
+
+    // Tokens are "silt:<instance>:<n>", n being the number of changes
+    // journaled when it was handed out. Each start, and each time events
+    // were lost, is a new instance, which makes every older token trivial.
+    std::string instance;
+    uint64_t journaled = 0;             // changes journaled in this instance
+    std::deque<std::string> journal;    // the latest ones, oldest first
+
+    void new_instance();
+    std::string token() const;
+    void record(std::string path);
+    bool watch_tree(const std::string& rel);
+    void forget_tree(const std::string& rel);
+    bool read_events();
+    void answer(int client);
+};
+
+Daemon::~Daemon() {
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+    if (listening) {
+        unlink(socket_file.c_str());
+    }
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+    }
+}
+
+void Daemon::new_instance() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    instance = std::to_string(getpid()) + "." +
+               std::to_string(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+    journaled = 0;
+    journal.clear();
+}
+
+std::string Daemon::token() const {
+    return TOKEN_PREFIX + instance + ":" + std::to_string(journaled);
+}
+
+void Daemon::record(std::string path) {
+    journal.push_back(std::move(path));
+    journaled++;
+    if (journal.size() > MAX_JOURNAL) {
+        journal.erase(journal.begin(), journal.begin() + MAX_JOURNAL / 2);
+    }
+}
+
+bool Daemon::watch_tree(const std::string& rel) {
+    std::vector<std::string> pending = {rel};
+    while (!pending.empty()) {
+        std::string dir = std::move(pending.back());
+        pending.pop_back();
+
+        std::filesystem::path abs = worktree / dir;
+        int wd = inotify_add_watch(inotify_fd, abs.c_str(), WATCH_MASK);
+        if (wd < 0) {
+            // gone again already: its parent's events cover it
+            if (errno == ENOENT || errno == ENOTDIR) {
+                continue;
+            }
+            std::cerr << "fsmonitor--daemon: cannot watch '" << abs.string() << "': " << std::strerror(errno);
+            if (errno == ENOSPC) {
+                std::cerr << " (raise fs.inotify.max_user_watches)";
+            }
+            std::cerr << std::endl;
+            return false;
+        }
+        watches[wd] = dir;
+
+        DIR* handle = opendir(abs.c_str());
+        if (!handle) {
+            continue;
+        }
+        while (dirent* entry = readdir(handle)) {
+            std::string name = entry->d_name;
+            if (name == "." || name == ".." || (dir.empty() && name == ".git")) {
+                continue;
+            }
+            bool is_dir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN) {
+                struct stat st;
+                is_dir = lstat((abs / name).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (is_dir) {
+                pending.push_back(dir + name + "/");
+            }
+        }
+        closedir(handle);
+    }
+    return true;
+}
+
+void Daemon::forget_tree(const std::string& rel) {
+    // the watches stay on the moved directories; their paths are wrong now
+    for (auto it = watches.begin(); it != watches.end();) {
+        if (it->second.compare(0, rel.size(), rel) == 0) {
+            inotify_rm_watch(inotify_fd, it->first);
+            it = watches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool Daemon::read_events() {
+    alignas(inotify_event) char buffer[65536];
+    for (;;) {
+        ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN;
+        }
+
+        for (char* p = buffer; p < buffer + n;) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // changes were lost: nobody can trust their token now
+                new_instance();
+                continue;
+            }
+            auto watch = watches.find(event->wd);
+            if (watch == watches.end()) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watches.erase(watch);
+                continue;
+            }
+            std::string dir = watch->second;
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                if (dir.empty()) {
+                    std::cerr << "fsmonitor--daemon: the worktree went away" << std::endl;
+                    stopping = true;
+                }
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+
+            std::string name = event->name;
+            if (dir.empty() && name == ".git") {
+                continue;
+            }
+            std::string rel = dir + name;
+            if (!(event->mask & IN_ISDIR)) {
+                record(rel);
+            } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                // whatever was put in it before the watch counts as changed
+                if (!watch_tree(rel + "/")) {
+                    stopping = true;
+                }
+                record(rel + "/");
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                forget_tree(rel + "/");
+                record(rel + "/");
+            }
+        }
+    }
+}
+
+void Daemon::answer(int client) {
+    set_timeouts(client);
+
+    std::string message;
+    char buffer[4096];
+    while (message.find('\n') == std::string::npos && message.size() < sizeof(buffer)) {
+        ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        message.append(buffer, static_cast<size_t>(n));
+    }
+    message = message.substr(0, message.find('\n'));
+
+    if (message == "stop") {
+        stopping = true;
+        return;
+    }
+    if (message.compare(0, 6, "since ") != 0) {
+        return;
+    }
+
+    // Everything that happened before the request is queued by now:
+    // inotify events are added as part of the change itself
+    if (!read_events()) {
+        stopping = true;
+        return;
+    }
+
+    // Changes after the asked token, if the journal reaches back to it
+    std::string asked = message.substr(6);
+    std::string prefix = TOKEN_PREFIX + instance + ":";
+    bool known = false;
+    uint64_t since = 0;
+    if (asked.compare(0, prefix.size(), prefix) == 0 && asked.size() > prefix.size()) {
+        try {
+            since = std::stoull(asked.substr(prefix.size()));
+            known = since <= journaled && journaled - since <= journal.size();
+        } catch (const std::exception&) {
+            known = false;
+        }
+    }
+
+    std::string reply = token();
+    reply += '\0';
+    if (!known) {
+        reply += "/";
+        reply += '\0';
+    } else {
+        std::set<std::string> changed(journal.end() - static_cast<ptrdiff_t>(journaled - since), journal.end());
+        for (const auto& path : changed) {
+            reply += path;
+            reply += '\0';
+        }
+    }
+    send_all(client, reply);
+}
+
+bool Daemon::start(const Repository& repo) {
+    int running = connect_daemon(repo);
+    if (running >= 0) {
+        close(running);
+        std::cerr << "fsmonitor--daemon is already running" << std::endl;
+        return false;
+    }
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        std::cerr << "fsmonitor--daemon: inotify: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    new_instance();
+    if (!watch_tree("")) {
+        return false;
+    }
+
+    sockaddr_un addr;
+    if (!make_address(socket_file, addr)) {
+        std::cerr << "fsmonitor--daemon: socket path too long: " << socket_file.string() << std::endl;
+        return false;
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        std::cerr << "fsmonitor--daemon: socket: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    // left behind by a daemon that didn't exit cleanly
+    unlink(socket_file.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 16) != 0) {
+        std::cerr << "fsmonitor--daemon: cannot listen on " << socket_file.string() << ": "
+                  << std::strerror(errno) << std::endl;
+        return false;
+    }
+    listening = true;
+    return true;
+}
+
+void Daemon::serve() {
+    struct sigaction action {};
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGHUP, &action, nullptr);
+
+    while (!stopping && !stop_signal) {
+        pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {listen_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if ((fds[0].revents & POLLIN) && !read_events()) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) {
+                answer(client);
+                close(client);
+            }
+        }
+    }
+}
+}
+
+std::optional<FsmonitorChanges> fsmonitor_query(const Repository& repo, const std::string& token) {
+    auto answer = request(repo, "since " + token + "\n");
+    if (!answer) {
+        return std::nullopt;
+    }
+
+    FsmonitorChanges changes;
+    size_t start = 0;
+    size_t nul;
+    bool first = true;
+    while ((nul = answer->find('\0', start)) != std::string::npos) {
+        std::string item = answer->substr(start, nul - start);
+        start = nul + 1;
+        if (first) {
+            changes.token = std::move(item);
+            first = false;
+        } else if (item == "/") {
+            changes.trivial = true;
+        } else if (!item.empty()) {
+            changes.paths.push_back(std::move(item));
+        }
+    }
+    if (changes.token.empty()) {
+        return std::nullopt;
+    }
+    return changes;
+}
+
+bool fsmonitor_run(const Repository& repo) {
+    Daemon daemon(repo);
+    if (!daemon.start(repo)) {
+        return false;
+    }
+    daemon.serve();
+    return true;
+}
+
+bool fsmonitor_start(const Repository& repo) {
+    std::cout.flush();
+    std::cerr.flush();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "fsmonitor--daemon: fork: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (pid == 0) {
+        // detach from the terminal; errors still go to stderr
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        _exit(fsmonitor_run(repo) ? 0 : 1);
+    }
+
+    // Watching a large worktree takes a while; wait until it answers
+    for (int waited_ms = 0; waited_ms < 120000; waited_ms += 20) {
+        if (waitpid(pid, nullptr, WNOHANG) == pid) {
+            return false;
+        }
+        if (fsmonitor_query(repo, "")) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return false;
+}
+
+bool fsmonitor_stop(const Repository& repo) {
+    if (!request(repo, "stop\n")) {
+        return false;
+    }
+    // it's gone once nothing answers anymore
+    for (int waited_ms = 0; waited_ms < 5000; waited_ms += 20) {
+        int fd = connect_daemon(repo);
+        if (fd < 0) {
+            return true;
+        }
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return true;
+}
+
+#else
+
+std::optional<FsmonitorChanges> fsmonitor_query(const Repository&, const std::string&) {
+    return std::nullopt;
+}
+
+bool fsmonitor_run(const Repository&) {
+    std::cerr << "fsmonitor--daemon is not supported on this platform" << std::endl;
+    return false;
+}
+
+bool fsmonitor_start(const Repository& repo) {
+    return fsmonitor_run(repo);
+}
+
+bool fsmonitor_stop(const Repository&) {
+    return false;
+}
+
+#endif
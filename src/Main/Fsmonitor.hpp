@@ -0,0 +1,44 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+class Repository;
+
+/*
+ * Filesystem monitor. `silt fsmonitor--daemon` watches the worktree with
+ * inotify and journals every path that changes; commands ask it what
+ * changed since the token they got last time (kept in the index, FSMN
+ * extension) and only look at those paths instead of every file.
+ *
+ * Requests go over a Unix socket in the git directory. "since <token>\n"
+ * is answered with the current token, then the paths changed since
+ * <token>, each NUL-terminated. A path ending in '/' stands for everything
+ * under that directory, and "/" alone for the whole worktree, which is
+ * also the answer when the token isn't one of this daemon's (it was
+ * restarted, or events were lost). "stop\n" shuts the daemon down.
+ *
+ * Only Linux has a monitor; elsewhere the daemon doesn't start and every
+ * query fails, so commands look at everything as before.
+ */
+
+struct FsmonitorChanges {
+    std::string token;                   // to ask with next time
+    bool trivial = false;                // anything may have changed
+    std::vector<std::string> paths;      // changed since the token asked with
+};
+
+// Ask the daemon what changed since `token` (empty: since forever).
+// Returns nothing if no daemon is watching the worktree.
+std::optional<FsmonitorChanges> fsmonitor_query(const Repository& repo, const std::string& token);
+
+// Run the daemon in the foreground until it's stopped. Returns false, with
+// a message on stderr, if it couldn't start.
+bool fsmonitor_run(const Repository& repo);
+
+// Start the daemon in the background and wait until it answers
+bool fsmonitor_start(const Repository& repo);
+
+// Ask the daemon to exit; false if none was running
+bool fsmonitor_stop(const Repository& repo);
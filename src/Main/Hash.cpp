@@ -0,0 +1,46 @@
+// OpenSSL 3 deprecates the SHA256_* calls; they are still the quickest way
+// to one incremental hash (and use the SHA extensions where there are any)
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include "Hash.hpp"
+
+Sha256::Sha256() {
+    SHA256_Init(&ctx);
+}
+
+void Sha256::update(const void* data, size_t size) {
+    SHA256_Update(&ctx, data, size);
+}
+
+void Sha256::final(unsigned char* out) {
+    SHA256_Final(out, &ctx);
+}
+
+void sha256(const void* data, size_t size, unsigned char* out) {
+    Sha256 hash;
+    hash.update(data, size);
+    hash.final(out);
+}
+
+void sha256_many(const Sha1Input* inputs, size_t count, unsigned char* out) {
+    // No multi-buffer SHA-256 yet: one message after another
+    for (size_t i = 0; i < count; i++) {
+        Sha256 hash;
+        hash.update(inputs[i].header.data(), inputs[i].header.size());
+        hash.update(inputs[i].body.data(), inputs[i].body.size());
+        hash.final(out + i * SHA256_SIZE);
+    }
+}
+
+std::string object_format_name(ObjectFormat format) {
+    return with_object_format(format, [](auto algo) { return std::string(decltype(algo)::name); });
+}
+
+std::optional<ObjectFormat> parse_object_format(const std::string& name) {
+    if (name == Sha1Algo::name) {
+        return ObjectFormat::Sha1;
+    }
+    if (name == Sha256Algo::name) {
+        return ObjectFormat::Sha256;
+    }
+    return std::nullopt;
+}
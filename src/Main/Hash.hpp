@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Sha1.hpp"
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <openssl/sha.h>
+
+/*
+ * The hash functions a repository can name its objects with: SHA-1, and
+ * SHA-256 for repositories created with --object-format=sha256 (recorded
+ * as extensions.objectFormat). Code that handles object ids is written as
+ * a template over one of the descriptors below, so the id sizes are
+ * constants and each format gets its own copy of the loop; the format is
+ * looked at once, by with_object_format, where the call comes in.
+ */
+
+enum class ObjectFormat { Sha1, Sha256 };
+
+constexpr size_t SHA256_SIZE = 32;
+
+// Incremental SHA-256 of one message
+class Sha256 {
+public:
+    Sha256();
+    void update(const void* data, size_t size);
+    void final(unsigned char* out);
+
+private:
+    SHA256_CTX ctx;
+};
+
+// SHA-256 of one buffer, and of each of `inputs` (SHA256_SIZE bytes each)
+void sha256(const void* data, size_t size, unsigned char* out);
+void sha256_many(const Sha1Input* inputs, size_t count, unsigned char* out);
+
+struct Sha1Algo {
+    static constexpr ObjectFormat format = ObjectFormat::Sha1;
+    static constexpr const char* name = "sha1";
+    static constexpr size_t raw_size = SHA1_SIZE;
+    static constexpr size_t hex_size = 2 * raw_size;
+    using Context = Sha1;
+
+    static void hash(const void* data, size_t size, unsigned char* out) { sha1(data, size, out); }
+    static void hash_many(const Sha1Input* inputs, size_t count, unsigned char* out) {
+        sha1_many(inputs, count, out);
+    }
+};
+
+struct Sha256Algo {
+    static constexpr ObjectFormat format = ObjectFormat::Sha256;
+    static constexpr const char* name = "sha256";
+    static constexpr size_t raw_size = SHA256_SIZE;
+    static constexpr size_t hex_size = 2 * raw_size;
+    using Context = Sha256;
+
+    static void hash(const void* data, size_t size, unsigned char* out) { sha256(data, size, out); }
+    static void hash_many(const Sha1Input* inputs, size_t count, unsigned char* out) {
+        sha256_many(inputs, count, out);
+    }
+};
+
+// Call `f` with the descriptor of `format`
+template <typename F>
+decltype(auto) with_object_format(ObjectFormat format, F&& f) {
+    if (format == ObjectFormat::Sha256) {
+        return f(Sha256Algo{});
+    }
+    return f(Sha1Algo{});
+}
+
+// The hex form of a binary id
+template <typename Algo>
+std::string hash_to_hex(const unsigned char* hash) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(Algo::hex_size, '0');
+    for (size_t i = 0; i < Algo::raw_size; i++) {
+        hex[2 * i] = digits[hash[i] >> 4];
+        hex[2 * i + 1] = digits[hash[i] & 0xF];
+    }
+    return hex;
+}
+
+inline size_t object_format_hex_size(ObjectFormat format) {
+    return with_object_format(format, [](auto algo) { return decltype(algo)::hex_size; });
+}
+
+inline size_t object_format_raw_size(ObjectFormat format) {
+    return with_object_format(format, [](auto algo) { return decltype(algo)::raw_size; });
+}
+
+// "sha1" / "sha256", as in extensions.objectFormat
+std::string object_format_name(ObjectFormat format);
+std::optional<ObjectFormat> parse_object_format(const std::string& name);
@@ -0,0 +1,376 @@
+#include "Ignore.hpp"
+#include "Repository.hpp"
+#include "Utils.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace {
+bool has_glob_chars(std::string_view text) {
+    return text.find_first_of("*?[\\") != std::string_view::npos;
+}
+
+std::string_view basename_of(std::string_view path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string_view::npos ? path : path.substr(slash + 1);
+}
+
+// Parse one line of an ignore file; false for blank lines and comments
+bool parse_pattern(std::string line, IgnorePattern& pattern) {
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+        return false;
+    }
+    pattern.line = line;
+
+    // trailing spaces go, unless escaped
+    size_t end = line.size();
+    while (end > 0 && line[end - 1] == ' ' && !(end > 1 && line[end - 2] == '\\')) {
+        end--;
+    }
+    line.erase(end);
+
+    if (line[0] == '!') {
+        pattern.negated = true;
+        line.erase(0, 1);
+    } else if (line[0] == '\\' && line.size() > 1 && (line[1] == '!' || line[1] == '#')) {
+        line.erase(0, 1);
+    }
+    if (!line.empty() && line.back() == '/') {
+        pattern.dir_only = true;
+        line.pop_back();
+    }
+    if (line.find('/') != std::string::npos) {
+        pattern.anchored = true;
+        if (line[0] == '/') {
+            line.erase(0, 1);
+        }
+    }
+    if (line.empty()) {
+        return false;
+    }
+
+    // compile to the cheapest kind that matches the same names
+    std::string_view view(line);
+    if (!has_glob_chars(view)) {
+        pattern.kind = IgnorePattern::Kind::Literal;
+        pattern.text = line;
+    } else if (view[0] == '*' && !has_glob_chars(view.substr(1))) {
+        pattern.kind = IgnorePattern::Kind::Suffix;
+        pattern.text = line.substr(1);
+    } else if (view.back() == '*' && !has_glob_chars(view.substr(0, view.size() - 1))) {
+        pattern.kind = IgnorePattern::Kind::Prefix;
+        pattern.text = line.substr(0, line.size() - 1);
+    } else {
+        pattern.kind = IgnorePattern::Kind::Glob;
+        pattern.text = line;
+    }
+    return true;
+}
+
+// Match the bracket expression starting at p[pi] (just past '[') against
+// `c`. Sets `pi` past the closing ']'; false if there's none.
+bool match_class(std::string_view p, size_t& pi, char c, bool& matched) {
+    bool negate = pi < p.size() && (p[pi] == '!' || p[pi] == '^');
+    if (negate) {
+        pi++;
+    }
+    matched = false;
+    bool first = true;
+    while (pi < p.size() && (first || p[pi] != ']')) {
+        first = false;
+        char lo = p[pi];
+        if (lo == '\\' && pi + 1 < p.size()) {
+            lo = p[++pi];
+        }
+        pi++;
+        char hi = lo;
+        if (pi + 1 < p.size() && p[pi] == '-' && p[pi + 1] != ']') {
+            hi = p[pi + 1];
+            if (hi == '\\' && pi + 2 < p.size()) {
+                hi = p[++pi + 1];
+            }
+            pi += 2;
+        }
+        if (lo <= c && c <= hi) {
+            matched = true;
+        }
+    }
+    if (pi >= p.size()) {
+        return false;
+    }
+    pi++;
+    matched = matched != negate;
+    return true;
+}
+}
+
+bool ignore_glob_match(std::string_view p, std::string_view t) {
+    size_t pi = 0;
+    size_t ti = 0;
+    while (pi < p.size()) {
+        char c = p[pi];
+        if (c == '*') {
+            size_t stars = pi;
+            while (pi < p.size() && p[pi] == '*') {
+                pi++;
+            }
+            // "**" as a whole path component also crosses directories
+            bool any_depth = pi - stars >= 2 && (stars == 0 || p[stars - 1] == '/') &&
+                             (pi == p.size() || p[pi] == '/');
+            if (any_depth) {
+                if (pi == p.size()) {
+                    return true;
+                }
+                // "**/" stands for zero or more directories
+                std::string_view rest = p.substr(pi + 1);
+                for (size_t k = ti;;) {
+                    if (ignore_glob_match(rest, t.substr(k))) {
+                        return true;
+                    }
+                    size_t slash = t.find('/', k);
+                    if (slash == std::string_view::npos) {
+                        return false;
+                    }
+                    k = slash + 1;
+                }
+            }
+            if (pi == p.size()) {
+                return t.find('/', ti) == std::string_view::npos;
+            }
+            for (size_t k = ti;; k++) {
+                if (ignore_glob_match(p.substr(pi), t.substr(k))) {
+                    return true;
+                }
+                if (k == t.size() || t[k] == '/') {
+                    return false;
+                }
+            }
+        }
+
+        if (ti == t.size()) {
+            return false;
+        }
+        if (c == '?') {
+            if (t[ti] == '/') {
+                return false;
+            }
+            pi++;
+            ti++;
+            continue;
+        }
+        if (c == '[') {
+            size_t class_end = pi + 1;
+            bool matched;
+            if (match_class(p, class_end, t[ti], matched)) {
+                if (!matched || t[ti] == '/') {
+                    return false;
+                }
+                pi = class_end;
+                ti++;
+                continue;
+            }
+            // no closing ']': a plain '['
+        }
+        if (c == '\\' && pi + 1 < p.size()) {
+            c = p[++pi];
+        }
+        if (c != t[ti]) {
+            return false;
+        }
+        pi++;
+        ti++;
+    }
+    return ti == t.size();
+}
+
+IgnoreList::IgnoreList(const std::string& text, const std::string& base, const std::string& source)
+    : base(base), source_path(source) {
+    std::istringstream stream(text);
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(stream, line)) {
+        line_number++;
+        IgnorePattern pattern;
+        if (!parse_pattern(line, pattern)) {
+            continue;
+        }
+        pattern.line_number = line_number;
+
+        uint32_t index = static_cast<uint32_t>(patterns.size());
+        switch (pattern.kind) {
+        case IgnorePattern::Kind::Literal:
+            literals[pattern.text].push_back(index);
+            break;
+        case IgnorePattern::Kind::Prefix:
+            prefixes.push_back(index);
+            break;
+        case IgnorePattern::Kind::Suffix:
+            suffixes.push_back(index);
+            break;
+        case IgnorePattern::Kind::Glob:
+            globs.push_back(index);
+            break;
+        }
+        patterns.push_back(std::move(pattern));
+    }
+}
+
+bool IgnoreList::applies(const IgnorePattern& pattern, std::string_view path, bool is_dir) const {
+    if (pattern.dir_only && !is_dir) {
+        return false;
+    }
+    // anchored patterns see the path below their directory, the others
+    // only the name
+    std::string_view subject;
+    if (pattern.anchored) {
+        if (path.size() < base.size() || path.compare(0, base.size(), base) != 0) {
+            return false;
+        }
+        subject = path.substr(base.size());
+    } else {
+        subject = basename_of(path);
+    }
+
+    const std::string& text = pattern.text;
+    switch (pattern.kind) {
+    case IgnorePattern::Kind::Literal:
+        return subject == text;
+    case IgnorePattern::Kind::Prefix:
+        return subject.size() >= text.size() && subject.compare(0, text.size(), text) == 0 &&
+               subject.find('/', text.size()) == std::string_view::npos;
+    case IgnorePattern::Kind::Suffix:
+        return subject.size() >= text.size() &&
+               subject.compare(subject.size() - text.size(), text.size(), text) == 0 &&
+               subject.substr(0, subject.size() - text.size()).find('/') == std::string_view::npos;
+    case IgnorePattern::Kind::Glob:
+        return ignore_glob_match(text, subject);
+    }
+    return false;
+}
+
+const IgnorePattern* IgnoreList::match(std::string_view path, bool is_dir) const {
+    if (patterns.empty()) {
+        return nullptr;
+    }
+
+    // the last matching pattern wins: search each kind from its end, and
+    // only for patterns later than the best found so far
+    int64_t best = -1;
+    auto search = [&](const std::vector<uint32_t>& indices) {
+        for (auto it = indices.rbegin(); it != indices.rend() && static_cast<int64_t>(*it) > best; ++it) {
+            if (applies(patterns[*it], path, is_dir)) {
+                best = *it;
+                return;
+            }
+        }
+    };
+
+    if (!literals.empty()) {
+        std::string_view name = basename_of(path);
+        auto it = literals.find(std::string(name));
+        if (it != literals.end()) {
+            search(it->second);
+        }
+        if (path.size() > base.size() && path.compare(0, base.size(), base) == 0) {
+            std::string_view below = path.substr(base.size());
+            if (below != name && (it = literals.find(std::string(below))) != literals.end()) {
+                search(it->second);
+            }
+        }
+    }
+    search(suffixes);
+    search(prefixes);
+    search(globs);
+    return best >= 0 ? &patterns[best] : nullptr;
+}
+
+IgnoreList read_ignore_file(const std::filesystem::path& path, const std::string& base, const std::string& source) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return IgnoreList("", base, source);
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return IgnoreList(buffer.str(), base, source);
+}
+
+IgnoreRules::IgnoreRules(const Repository& repo) : worktree(repo.worktree) {
+    ConfigParser config;
+    config.read((repo.gitdir / "config").string());
+
+    // core.excludesFile, or Git's default of $XDG_CONFIG_HOME/git/ignore
+    std::string configured = config.get("core", "excludesFile");
+    const char* home = std::getenv("HOME");
+    if (configured.rfind("~/", 0) == 0 && home) {
+        excludes_file = std::filesystem::path(home) / configured.substr(2);
+    } else if (!configured.empty()) {
+        excludes_file = configured;
+    } else if (const char* xdg = std::getenv("XDG_CONFIG_HOME"); xdg && *xdg) {
+        excludes_file = std::filesystem::path(xdg) / "git" / "ignore";
+    } else if (home) {
+        excludes_file = std::filesystem::path(home) / ".config" / "git" / "ignore";
+    }
+
+    info_exclude = repo.gitdir / "info" / "exclude";
+    global.push_back(read_ignore_file(info_exclude, "", ".git/info/exclude"));
+    if (!excludes_file.empty()) {
+        global.push_back(read_ignore_file(excludes_file, "", excludes_file.string()));
+    }
+}
+
+const IgnoreList& IgnoreRules::dir_list(const std::string& dir) {
+    auto it = dirs.find(dir);
+    if (it == dirs.end()) {
+        it = dirs.emplace(dir, read_ignore_file(worktree / dir / ".gitignore", dir, dir + ".gitignore")).first;
+    }
+    return it->second;
+}
+
+const IgnorePattern* IgnoreRules::match(const std::string& path, bool is_dir) {
+    // the .gitignore files of the path's directories, deepest first
+    size_t slash = path.rfind('/');
+    for (;;) {
+        std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+        const IgnoreList& list = dir_list(dir);
+        if (const IgnorePattern* pattern = list.match(path, is_dir)) {
+            source = list.source();
+            return pattern;
+        }
+        if (slash == std::string::npos || slash == 0) {
+            break;
+        }
+        slash = path.rfind('/', slash - 1);
+    }
+
+    for (const auto& list : global) {
+        if (const IgnorePattern* pattern = list.match(path, is_dir)) {
+            source = list.source();
+            return pattern;
+        }
+    }
+    return nullptr;
+}
+
+const IgnorePattern* IgnoreRules::match_global(std::string_view path, bool is_dir) const {
+    for (const auto& list : global) {
+        if (const IgnorePattern* pattern = list.match(path, is_dir)) {
+            return pattern;
+        }
+    }
+    return nullptr;
+}
+
+bool IgnoreRules::ignored(const std::string& path, bool is_dir) {
+    // nothing under an ignored directory can be brought back
+    for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        const IgnorePattern* pattern = match(path.substr(0, slash), true);
+        if (pattern && !pattern->negated) {
+            return true;
+        }
+    }
+    const IgnorePattern* pattern = match(path, is_dir);
+    return pattern && !pattern->negated;
+}
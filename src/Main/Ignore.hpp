@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class Repository;
+
+/*
+ * Ignore rules, with Git's semantics. They come from the .gitignore file
+ * of every directory, then $GIT_DIR/info/exclude, then core.excludesFile;
+ * a .gitignore deeper down wins over the ones above it, and within one file
+ * the last matching pattern wins. Nothing under an ignored directory can be
+ * brought back by a negated pattern, which is what lets the worktree scan
+ * skip ignored directories without reading them.
+ *
+ * Patterns are compiled once into four kinds: literals ("node_modules")
+ * are looked up in a hash table, prefixes ("build*") and suffixes ("*.o")
+ * are plain string compares, and only the rest goes through a glob match.
+ */
+
+struct IgnorePattern {
+    enum class Kind { Literal, Prefix, Suffix, Glob };
+
+    Kind kind = Kind::Glob;
+    std::string text;          // the literal, prefix, suffix or glob to match
+    bool negated = false;      // "!pattern" brings paths back
+    bool dir_only = false;     // "pattern/" only matches directories
+    bool anchored = false;     // has a '/', so it matches the whole path below
+                               // its .gitignore rather than just the name
+    std::string line;          // as written, for check-ignore -v
+    size_t line_number = 0;
+};
+
+// The patterns of one file
+class IgnoreList {
+public:
+    IgnoreList() = default;
+
+    // `base` is the directory the patterns apply to (worktree-relative, empty
+    // or ending in '/'), `source` the file they come from
+    IgnoreList(const std::string& text, const std::string& base, const std::string& source);
+
+    // The last pattern matching `path` (worktree-relative, without a
+    // trailing slash), or nullptr
+    const IgnorePattern* match(std::string_view path, bool is_dir) const;
+
+    bool empty() const { return patterns.empty(); }
+    const std::string& source() const { return source_path; }
+
+private:
+    std::string base;
+    std::string source_path;
+    std::vector<IgnorePattern> patterns;
+
+    // Indices into `patterns`, ascending, by kind
+    std::unordered_map<std::string, std::vector<uint32_t>> literals;
+    std::vector<uint32_t> prefixes;
+    std::vector<uint32_t> suffixes;
+    std::vector<uint32_t> globs;
+
+    bool applies(const IgnorePattern& pattern, std::string_view path, bool is_dir) const;
+};
+
+// Git's wildmatch with '/' matched only by "**": `pattern` against `text`
+bool ignore_glob_match(std::string_view pattern, std::string_view text);
+
+// Read the ignore file `path` for the patterns of the directory `base`
+IgnoreList read_ignore_file(const std::filesystem::path& path, const std::string& base, const std::string& source);
+
+class IgnoreRules {
+public:
+    explicit IgnoreRules(const Repository& repo);
+
+    // The last pattern matching `path` in the .gitignore files of
+    // `path`'s directories, deepest first, then the global files. Parent
+    // directories aren't looked at: they're assumed not to be ignored.
+    // Loads .gitignore files as needed, so it isn't thread-safe.
+    const IgnorePattern* match(const std::string& path, bool is_dir);
+
+    // Whether `path` is ignored, or is under an ignored directory
+    bool ignored(const std::string& path, bool is_dir);
+
+    // The pattern matching `path` in info/exclude or core.excludesFile.
+    // Thread-safe.
+    const IgnorePattern* match_global(std::string_view path, bool is_dir) const;
+
+    // Where the pattern last returned by match() comes from
+    const std::string& last_source() const { return source; }
+
+    // The files info/exclude and core.excludesFile, for the untracked cache
+    const std::filesystem::path& info_exclude_path() const { return info_exclude; }
+    const std::filesystem::path& excludes_file_path() const { return excludes_file; }
+
+private:
+    std::filesystem::path worktree;
+    std::filesystem::path info_exclude;
+    std::filesystem::path excludes_file;
+    std::vector<IgnoreList> global;                // highest precedence first
+    std::map<std::string, IgnoreList> dirs;        // .gitignore by directory
+    std::string source;
+
+    const IgnoreList& dir_list(const std::string& dir);
+};
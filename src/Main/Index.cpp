@@ -2,34 +2,697 @@
 #include "Utils.hpp"
 #include <fstream>
 #include <algorithm>
-#include <cstdio>
-#include <openssl/sha.h>
+#include <cstring>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sysmacros.h>
+#endif
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <fcntl.h>
+#include <sys/utsname.h>
+#endif
+#include "Sha1.hpp"
+#include "Durable.hpp"
 
 namespace {
-void append_u32(std::string& out, int value) {
-    const unsigned int v = static_cast<unsigned int>(value);
+void append_u32(std::string& out, uint32_t v) {
     out += static_cast<char>((v >> 24) & 0xFF);
     out += static_cast<char>((v >> 16) & 0xFF);
     out += static_cast<char>((v >> 8) & 0xFF);
     out += static_cast<char>(v & 0xFF);
 }
 
-void append_u16(std::string& out, int value) {
-    const unsigned int v = static_cast<unsigned int>(value) & 0xFFFF;
+void append_u16(std::string& out, uint16_t v) {
     out += static_cast<char>((v >> 8) & 0xFF);
     out += static_cast<char>(v & 0xFF);
 }
 
-int read_u32(const std::string& data, size_t offset) {
-    return (static_cast<unsigned char>(data[offset]) << 24) |
-           (static_cast<unsigned char>(data[offset + 1]) << 16) |
-           (static_cast<unsigned char>(data[offset + 2]) << 8) |
-           (static_cast<unsigned char>(data[offset + 3]));
+uint32_t read_u32(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return (static_cast<uint32_t>(u[0]) << 24) | (static_cast<uint32_t>(u[1]) << 16) |
+           (static_cast<uint32_t>(u[2]) << 8) | static_cast<uint32_t>(u[3]);
 }
 
-int read_u16(const std::string& data, size_t offset) {
-    return (static_cast<unsigned char>(data[offset]) << 8) |
-           (static_cast<unsigned char>(data[offset + 1]));
+uint16_t read_u16(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint16_t>((u[0] << 8) | u[1]);
+}
+
+// On-disk layout of a version 2 entry: 40 bytes of stat data, the object
+// id (as long as the object format's), 2 bytes of flags, then the
+// NUL-terminated path padded to 8 bytes
+constexpr size_t ENTRY_OID_OFFSET = 40;
+
+template <typename Algo>
+struct EntryLayout {
+    static constexpr size_t flags_offset = ENTRY_OID_OFFSET + Algo::raw_size;
+    static constexpr size_t path_offset = flags_offset + 2;
+
+    // Size of a version 2/3 entry, which is padded with NULs to 8 bytes
+    static size_t ondisk_size(size_t path_len, bool extended) {
+        return (path_offset + (extended ? 2 : 0) + path_len + 8) & ~static_cast<size_t>(7);
+    }
+};
+
+// Where the flags of an entry with `oid_size`-byte ids start, for the
+// accessors that aren't specialized on the format
+size_t entry_flags_offset(size_t oid_size) {
+    return ENTRY_OID_OFFSET + oid_size;
+}
+
+// Flag bits of an entry: the name length (capped at 0xFFF), and whether
+// 2 bytes of extended flags follow (version 3 and later)
+constexpr uint16_t FLAG_NAME_MASK = 0x0FFF;
+constexpr uint16_t FLAG_EXTENDED = 0x4000;
+
+// Version 4 stores each path as the number of bytes to strip from the end
+// of the previous path, followed by the suffix to append. The number uses
+// Git's offset varint, where each continuation byte also adds one.
+void append_varint(std::string& out, uint64_t value) {
+    unsigned char buf[16];
+    size_t pos = sizeof(buf) - 1;
+    buf[pos] = value & 127;
+    while (value >>= 7) {
+        buf[--pos] = 128 | (--value & 127);
+    }
+    out.append(reinterpret_cast<const char*>(buf + pos), sizeof(buf) - pos);
+}
+
+// Decode a varint from [p, end), advancing p. Returns false on overflow or
+// truncated input.
+bool read_varint(const char*& p, const char* end, uint64_t& value) {
+    if (p >= end) {
+        return false;
+    }
+    unsigned char c = static_cast<unsigned char>(*p++);
+    value = c & 127;
+    while (c & 128) {
+        value += 1;
+        if (value == 0 || (value >> 57) != 0 || p >= end) {
+            return false;
+        }
+        c = static_cast<unsigned char>(*p++);
+        value = (value << 7) + (c & 127);
+    }
+    return true;
+}
+
+IndexStat decode_stat(const char* raw) {
+    IndexStat st;
+    st.ctime_sec = read_u32(raw + 0);
+    st.ctime_nsec = read_u32(raw + 4);
+    st.mtime_sec = read_u32(raw + 8);
+    st.mtime_nsec = read_u32(raw + 12);
+    st.dev = read_u32(raw + 16);
+    st.ino = read_u32(raw + 20);
+    st.mode = read_u32(raw + 24);
+    st.uid = read_u32(raw + 28);
+    st.gid = read_u32(raw + 32);
+    st.file_size = read_u32(raw + 36);
+    return st;
+}
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return 0;
+}
+}
+
+void hex_to_oid(const std::string& hex, unsigned char* out) {
+    std::fill(out, out + INDEX_OID_MAX, 0);
+    if (hex.size() != Sha1Algo::hex_size && hex.size() != Sha256Algo::hex_size) {
+        return;
+    }
+    for (size_t i = 0; i < hex.size() / 2; i++) {
+        out[i] = static_cast<unsigned char>((hex_value(hex[2 * i]) << 4) | hex_value(hex[2 * i + 1]));
+    }
+}
+
+std::string oid_to_hex(const unsigned char* oid, size_t size) {
+    std::string hex(size * 2, '0');
+    for (size_t i = 0; i < size; i++) {
+        hex[2 * i] = HEX_DIGITS[oid[i] >> 4];
+        hex[2 * i + 1] = HEX_DIGITS[oid[i] & 0xF];
+    }
+    return hex;
+}
+
+namespace {
+
+// Full-width stat result, before truncation to the on-disk index fields
+struct FileStat {
+    int64_t ctime_sec = 0;
+    uint32_t ctime_nsec = 0;
+    int64_t mtime_sec = 0;
+    uint32_t mtime_nsec = 0;
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    uint32_t mode = 0;
+    uint32_t uid = 0;
+    uint32_t gid = 0;
+    uint64_t size = 0;
+};
+
+// lstat() with nanosecond timestamps where the platform has them
+bool file_stat(const std::filesystem::path& path, FileStat& out) {
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+    struct statx stx;
+    if (statx(AT_FDCWD, path.c_str(), AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+              STATX_BASIC_STATS, &stx) == 0) {
+        out.ctime_sec = stx.stx_ctime.tv_sec;
+        out.ctime_nsec = stx.stx_ctime.tv_nsec;
+        out.mtime_sec = stx.stx_mtime.tv_sec;
+        out.mtime_nsec = stx.stx_mtime.tv_nsec;
+        out.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        out.ino = stx.stx_ino;
+        out.mode = stx.stx_mode;
+        out.uid = stx.stx_uid;
+        out.gid = stx.stx_gid;
+        out.size = stx.stx_size;
+        return true;
+    }
+    // kernels older than 4.11 don't have statx, use lstat below
+    if (errno != ENOSYS) {
+        return false;
+    }
+#endif
+
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_wstat64(path.c_str(), &st) != 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+
+    out.ctime_sec = st.st_ctime;
+    out.mtime_sec = st.st_mtime;
+#if defined(__APPLE__)
+    out.ctime_nsec = st.st_ctimespec.tv_nsec;
+    out.mtime_nsec = st.st_mtimespec.tv_nsec;
+#elif !defined(_WIN32)
+    out.ctime_nsec = st.st_ctim.tv_nsec;
+    out.mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+    out.dev = st.st_dev;
+    out.ino = st.st_ino;
+    out.mode = st.st_mode;
+    out.uid = st.st_uid;
+    out.gid = st.st_gid;
+    out.size = st.st_size;
+    return true;
+}
+
+// Set the mtime of `path` to the filesystem's idea of now, as a write would
+bool touch_file(const std::filesystem::path& path) {
+#ifdef _WIN32
+    return _wutime(path.c_str(), nullptr) == 0;
+#else
+    return utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0;
+#endif
+}
+
+// How long a write waits for the filesystem clock to pass the newest entry
+constexpr int RACY_WAIT_MS = 20;
+
+// Entries per block of the entry offset table; below two blocks' worth,
+// splitting the parse isn't worth starting threads for
+constexpr uint32_t ENTRIES_PER_BLOCK = 10000;
+
+// Extension signatures and sizes
+constexpr size_t EXT_HEADER_SIZE = 8;
+constexpr uint32_t IEOT_VERSION = 1;
+
+// EOIE: the offset of the first extension and the hash of their headers
+template <typename Algo>
+constexpr uint32_t EOIE_SIZE = 4 + Algo::raw_size;
+
+// Number of threads to use for the index, from index.threads: "true" or 0
+// means one per CPU, "false" means a single thread.
+unsigned int index_threads(const Repository& repo) {
+    ConfigParser config;
+    config.read((repo.gitdir / "config").string());
+    std::string value = config.get("index", "threads", "true");
+
+    unsigned long threads = 0;
+    if (value == "false") {
+        threads = 1;
+    } else if (value != "true") {
+        try {
+            threads = std::stoul(value);
+        } catch (const std::exception&) {
+            threads = 0;
+        }
+    }
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return static_cast<unsigned int>(threads);
+}
+
+void append_extension(std::string& out, const char* signature, const std::string& payload) {
+    out.append(signature, 4);
+    append_u32(out, static_cast<uint32_t>(payload.size()));
+    out += payload;
+}
+
+// Every index file ends with the hash of everything before it, in the
+// repository's object format
+template <typename Algo>
+void append_checksum(std::string& content) {
+    unsigned char hash[Algo::raw_size];
+    Algo::hash(content.data(), content.size(), hash);
+    content.append(reinterpret_cast<const char*>(hash), Algo::raw_size);
+}
+
+// Write through <path>.lock and rename it over the file, so a reader
+// never sees a half-written file; false if another writer keeps the lock.
+bool write_index_file(const Repository& repo, const std::filesystem::path& path, const std::string& content) {
+    LockFile lock;
+    if (!lock.acquire(path, INDEX_LOCK_TIMEOUT_MS)) {
+        return false;
+    }
+    lock.write(content);
+    return lock.commit(repo.fsync, FSYNC_INDEX);
+}
+
+// Whether the file of an entry was modified at or after `sec`.`nsec`.
+// Gitlinks and sparse directories have no contents of their own to check
+// and are never racy.
+bool modified_since(const IndexStat& st, uint32_t sec, uint32_t nsec) {
+    uint32_t type = st.mode & 0170000;
+    if (type != 0100000 && type != 0120000) {
+        return false;
+    }
+    return st.mtime_sec != sec ? st.mtime_sec > sec : st.mtime_nsec >= nsec;
+}
+
+// Remove shared indexes other than `keep` that haven't been used for
+// splitIndex.sharedIndexExpire: "now", "never", or the default of two weeks.
+// Split indexes freshen the mtime of the shared index they use.
+void expire_shared_indexes(const Repository& repo, const ConfigParser& config, const std::string& keep) {
+    std::string expire = config.get("splitIndex", "sharedIndexExpire", "2.weeks.ago");
+    if (expire == "never") {
+        return;
+    }
+    auto now = std::filesystem::file_time_type::clock::now();
+    auto cutoff = expire == "now" ? now : now - std::chrono::hours(24 * 14);
+
+    std::error_code ec;
+    for (const auto& file : std::filesystem::directory_iterator(repo.gitdir, ec)) {
+        std::string name = file.path().filename().string();
+        if (name.rfind("sharedindex.", 0) != 0 || name == "sharedindex." + keep) {
+            continue;
+        }
+        std::error_code file_ec;
+        auto mtime = std::filesystem::last_write_time(file.path(), file_ec);
+        if (!file_ec && mtime <= cutoff) {
+            std::filesystem::remove(file.path(), file_ec);
+        }
+    }
+}
+
+// TREE extension: for each node, depth first, its name and a NUL, the
+// entry count and number of subtrees in ASCII ("%d %d\n"), then the object
+// id if the node is valid, followed by its subtrees
+void write_cache_tree(std::string& out, const CacheTree& node, size_t oid_size) {
+    out += node.name;
+    out += '\0';
+    out += std::to_string(node.entry_count);
+    out += ' ';
+    out += std::to_string(node.subtrees.size());
+    out += '\n';
+    if (node.valid()) {
+        out.append(reinterpret_cast<const char*>(node.oid), oid_size);
+    }
+    for (const auto& sub : node.subtrees) {
+        write_cache_tree(out, sub, oid_size);
+    }
+}
+
+bool read_ascii_number(const char*& p, const char* end, char terminator, long& value) {
+    const char* start = p;
+    bool negative = p < end && *p == '-';
+    if (negative) {
+        p++;
+    }
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
+        if (value > INT32_MAX) {
+            return false;
+        }
+    }
+    if (p == start + (negative ? 1 : 0) || p >= end || *p != terminator) {
+        return false;
+    }
+    p++;
+    if (negative) {
+        value = -value;
+    }
+    return true;
+}
+
+bool read_cache_tree(const char*& p, const char* end, CacheTree& node, size_t oid_size) {
+    const void* nul = std::memchr(p, '\0', end - p);
+    if (!nul) {
+        return false;
+    }
+    node.name.assign(p, static_cast<const char*>(nul) - p);
+    p = static_cast<const char*>(nul) + 1;
+
+    long count;
+    long subtree_count;
+    if (!read_ascii_number(p, end, ' ', count) || !read_ascii_number(p, end, '\n', subtree_count) ||
+        subtree_count < 0) {
+        return false;
+    }
+    node.entry_count = static_cast<int32_t>(count < 0 ? -1 : count);
+    if (node.valid()) {
+        if (end - p < static_cast<ptrdiff_t>(oid_size)) {
+            return false;
+        }
+        std::memcpy(node.oid, p, oid_size);
+        p += oid_size;
+    }
+
+    node.subtrees.clear();
+    for (long i = 0; i < subtree_count; i++) {
+        CacheTree sub;
+        if (!read_cache_tree(p, end, sub, oid_size)) {
+            return false;
+        }
+        node.subtrees.push_back(std::move(sub));
+    }
+    // Git orders subtrees by name length first, lookups here want byte order
+    std::sort(node.subtrees.begin(), node.subtrees.end(),
+              [](const CacheTree& a, const CacheTree& b) { return a.name < b.name; });
+    return true;
+}
+
+// Stat data as the untracked cache stores it: the index entry fields
+// without the mode
+constexpr size_t UNTR_STAT_SIZE = 36;
+
+void append_untr_stat(std::string& out, const IndexStat& st) {
+    append_u32(out, st.ctime_sec);
+    append_u32(out, st.ctime_nsec);
+    append_u32(out, st.mtime_sec);
+    append_u32(out, st.mtime_nsec);
+    append_u32(out, st.dev);
+    append_u32(out, st.ino);
+    append_u32(out, st.uid);
+    append_u32(out, st.gid);
+    append_u32(out, st.file_size);
+}
+
+IndexStat read_untr_stat(const char* p) {
+    IndexStat st;
+    st.ctime_sec = read_u32(p);
+    st.ctime_nsec = read_u32(p + 4);
+    st.mtime_sec = read_u32(p + 8);
+    st.mtime_nsec = read_u32(p + 12);
+    st.dev = read_u32(p + 16);
+    st.ino = read_u32(p + 20);
+    st.uid = read_u32(p + 24);
+    st.gid = read_u32(p + 28);
+    st.file_size = read_u32(p + 32);
+    return st;
+}
+
+bool oid_is_null(const unsigned char* oid) {
+    for (size_t i = 0; i < INDEX_OID_MAX; i++) {
+        if (oid[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Directory blocks, depth first: the number of untracked names and of
+// subdirectories, the directory name and the untracked names. Validity,
+// stat data and exclude file ids go to the per-field tables in `tables`.
+struct UntrackedTables {
+    size_t oid_size = 0;
+    size_t index = 0;
+    EwahBitmap valid;
+    EwahBitmap check_only;
+    EwahBitmap oid_valid;
+    std::string stats;
+    std::string oids;
+};
+
+void write_untracked_dir(std::string& out, const UntrackedCacheDir& dir, UntrackedTables& tables) {
+    size_t i = tables.index++;
+    if (dir.valid) {
+        tables.valid.set(i);
+        append_untr_stat(tables.stats, dir.stat);
+    }
+    if (dir.check_only) {
+        tables.check_only.set(i);
+    }
+    if (!oid_is_null(dir.exclude_oid)) {
+        tables.oid_valid.set(i);
+        tables.oids.append(reinterpret_cast<const char*>(dir.exclude_oid), tables.oid_size);
+    }
+
+    append_varint(out, dir.untracked.size());
+    append_varint(out, dir.dirs.size());
+    out += dir.name;
+    out += '\0';
+    for (const auto& name : dir.untracked) {
+        out += name;
+        out += '\0';
+    }
+    for (const auto& sub : dir.dirs) {
+        write_untracked_dir(out, sub, tables);
+    }
+}
+
+// UNTR: the ident strings (with their total length), the exclude files'
+// stat data, the directory flags, the exclude files' ids, the per-dir
+// exclude file name, then the number of directories, their blocks, the
+// three bitmaps and the stat and id tables, and a final NUL
+void write_untracked_cache(std::string& out, const UntrackedCache& cache, size_t oid_size) {
+    append_varint(out, cache.ident.size());
+    out += cache.ident;
+    append_untr_stat(out, cache.info_exclude_stat);
+    append_untr_stat(out, cache.excludes_file_stat);
+    append_u32(out, cache.dir_flags);
+    out.append(reinterpret_cast<const char*>(cache.info_exclude_oid), oid_size);
+    out.append(reinterpret_cast<const char*>(cache.excludes_file_oid), oid_size);
+    out += cache.exclude_per_dir;
+    out += '\0';
+
+    UntrackedTables tables;
+    tables.oid_size = oid_size;
+    std::string blocks;
+    write_untracked_dir(blocks, cache.root, tables);
+    append_varint(out, tables.index);
+    out += blocks;
+    tables.valid.serialize(out);
+    tables.check_only.serialize(out);
+    tables.oid_valid.serialize(out);
+    out += tables.stats;
+    out += tables.oids;
+    out += '\0';
+}
+
+bool read_untracked_dir(const char*& p, const char* end, UntrackedCacheDir& dir,
+                        std::vector<UntrackedCacheDir*>& order) {
+    uint64_t untracked_count;
+    uint64_t dir_count;
+    if (!read_varint(p, end, untracked_count) || !read_varint(p, end, dir_count)) {
+        return false;
+    }
+    order.push_back(&dir);
+
+    auto read_name = [&](std::string& name) {
+        const void* nul = std::memchr(p, '\0', end - p);
+        if (!nul) {
+            return false;
+        }
+        name.assign(p, static_cast<const char*>(nul) - p);
+        p = static_cast<const char*>(nul) + 1;
+        return true;
+    };
+    if (!read_name(dir.name)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < untracked_count; i++) {
+        dir.untracked.emplace_back();
+        if (!read_name(dir.untracked.back())) {
+            return false;
+        }
+    }
+    // the pointers in `order` must stay put, so size the vector up front
+    if (dir_count > static_cast<uint64_t>(end - p)) {
+        return false;
+    }
+    dir.dirs.resize(dir_count);
+    for (auto& sub : dir.dirs) {
+        if (!read_untracked_dir(p, end, sub, order)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// FSMN: version 2, the monitor's token (NUL-terminated), then the size of
+// the bitmap of entries not known to be unchanged, and the bitmap. Version
+// 1 had a timestamp instead of the token.
+constexpr uint32_t FSMN_VERSION_1 = 1;
+constexpr uint32_t FSMN_VERSION_2 = 2;
+
+void write_fsmonitor(std::string& out, const std::string& token, const EwahBitmap& dirty) {
+    append_u32(out, FSMN_VERSION_2);
+    out += token;
+    out += '\0';
+    std::string bitmap;
+    dirty.serialize(bitmap);
+    append_u32(out, static_cast<uint32_t>(bitmap.size()));
+    out += bitmap;
+}
+
+bool read_fsmonitor(const char* data, size_t size, std::string& token, EwahBitmap& dirty) {
+    const char* p = data;
+    const char* end = data + size;
+    if (size < 4) {
+        return false;
+    }
+    uint32_t version = read_u32(p);
+    p += 4;
+    if (version == FSMN_VERSION_1) {
+        if (end - p < 8) {
+            return false;
+        }
+        uint64_t since = (static_cast<uint64_t>(read_u32(p)) << 32) | read_u32(p + 4);
+        token = std::to_string(since);
+        p += 8;
+    } else if (version == FSMN_VERSION_2) {
+        const void* nul = std::memchr(p, '\0', end - p);
+        if (!nul) {
+            return false;
+        }
+        token.assign(p, static_cast<const char*>(nul) - p);
+        p = static_cast<const char*>(nul) + 1;
+    } else {
+        return false;
+    }
+    if (end - p < 4) {
+        return false;
+    }
+    uint32_t bitmap_size = read_u32(p);
+    p += 4;
+    if (bitmap_size > static_cast<uint32_t>(end - p)) {
+        return false;
+    }
+    const char* bitmap_end = p + bitmap_size;
+    return dirty.deserialize(p, bitmap_end) && p == bitmap_end && !token.empty();
+}
+
+bool read_untracked_cache(const char* data, size_t size, UntrackedCache& cache, size_t oid_size) {
+    // everything is followed by a final NUL
+    if (size <= 1 || data[size - 1] != '\0') {
+        return false;
+    }
+    const char* p = data;
+    const char* end = data + size - 1;
+
+    uint64_t ident_len;
+    if (!read_varint(p, end, ident_len) || ident_len > static_cast<uint64_t>(end - p)) {
+        return false;
+    }
+    cache.ident.assign(p, ident_len);
+    p += ident_len;
+
+    if (end - p < static_cast<ptrdiff_t>(2 * UNTR_STAT_SIZE + 4 + 2 * oid_size)) {
+        return false;
+    }
+    cache.info_exclude_stat = read_untr_stat(p);
+    cache.excludes_file_stat = read_untr_stat(p + UNTR_STAT_SIZE);
+    cache.dir_flags = read_u32(p + 2 * UNTR_STAT_SIZE);
+    p += 2 * UNTR_STAT_SIZE + 4;
+    std::memcpy(cache.info_exclude_oid, p, oid_size);
+    std::memcpy(cache.excludes_file_oid, p + oid_size, oid_size);
+    p += 2 * oid_size;
+
+    const void* nul = std::memchr(p, '\0', end - p);
+    if (!nul) {
+        return false;
+    }
+    cache.exclude_per_dir.assign(p, static_cast<const char*>(nul) - p);
+    p = static_cast<const char*>(nul) + 1;
+
+    uint64_t dir_count;
+    if (!read_varint(p, end, dir_count) || dir_count == 0) {
+        return false;
+    }
+    std::vector<UntrackedCacheDir*> order;
+    if (!read_untracked_dir(p, end, cache.root, order) || order.size() != dir_count) {
+        return false;
+    }
+
+    EwahBitmap valid;
+    EwahBitmap check_only;
+    EwahBitmap oid_valid;
+    if (!valid.deserialize(p, end) || !check_only.deserialize(p, end) || !oid_valid.deserialize(p, end)) {
+        return false;
+    }
+    for (size_t i : valid.positions()) {
+        if (i >= order.size() || end - p < static_cast<ptrdiff_t>(UNTR_STAT_SIZE)) {
+            return false;
+        }
+        order[i]->valid = true;
+        order[i]->stat = read_untr_stat(p);
+        p += UNTR_STAT_SIZE;
+    }
+    for (size_t i : check_only.positions()) {
+        if (i >= order.size()) {
+            return false;
+        }
+        order[i]->check_only = true;
+    }
+    for (size_t i : oid_valid.positions()) {
+        if (i >= order.size() || end - p < static_cast<ptrdiff_t>(oid_size)) {
+            return false;
+        }
+        std::memcpy(order[i]->exclude_oid, p, oid_size);
+        p += oid_size;
+    }
+
+    // Git lists subdirectories in the order it met them; keep them sorted
+    std::vector<UntrackedCacheDir*> pending = {&cache.root};
+    while (!pending.empty()) {
+        UntrackedCacheDir* dir = pending.back();
+        pending.pop_back();
+        std::sort(dir->dirs.begin(), dir->dirs.end(),
+                  [](const UntrackedCacheDir& a, const UntrackedCacheDir& b) { return a.name < b.name; });
+        for (auto& sub : dir->dirs) {
+            pending.push_back(&sub);
+        }
+    }
+    return p == end;
 }
 }
 
@@ -37,239 +700,1555 @@ Index::Index(const Repository& repo) {
     read(repo);
 }
 
-std::filesystem::path Index::get_index_path(const Repository& repo) {
-    return repo.gitdir / "index";
+bool Index::lock(const Repository& repo, long timeout_ms) {
+    auto lock = std::make_shared<LockFile>();
+    if (!lock->acquire(get_index_path(repo), timeout_ms)) {
+        return false;
+    }
+    held_lock = std::move(lock);
+    format = repo.object_format;
+    return true;
+}
+
+void Index::unlock() {
+    held_lock.reset();
+}
+
+std::filesystem::path Index::get_index_path(const Repository& repo) {
+    return repo.gitdir / "index";
+}
+
+bool Index::read(const Repository& repo) {
+    clear();
+
+    // Ids and checksums in the file are the repository's object format
+    format = repo.object_format;
+    
+    std::filesystem::path index_path = get_index_path(repo);
+    
+    // If index file doesn't exist, that's OK - it just means empty index
+    if (!std::filesystem::exists(index_path)) {
+        return true;
+    }
+    
+    // Remember when the index was written, so entries modified in the same
+    // instant can be treated as racily clean
+    FileStat index_st;
+    if (file_stat(index_path, index_st)) {
+        timestamp_sec = static_cast<uint32_t>(index_st.mtime_sec);
+        timestamp_nsec = index_st.mtime_nsec;
+    }
+
+    unsigned int threads = index_threads(repo);
+    bool sorted = true;
+    std::optional<SplitLink> link;
+    if (!load_file(index_path, threads, sorted, link)) {
+        clear();
+        return false;
+    }
+
+    if (link) {
+        // A split index only holds the changes to a shared index, which
+        // is small: check it as a whole, then apply it to the shared one
+        if (!verify_checksum() || !load_shared(repo, *link, threads)) {
+            clear();
+            return false;
+        }
+    } else if (!sorted) {
+        // Lookups binary search the entries, so make sure a hand-made index
+        // that isn't in Git order doesn't break them
+        sort_entries();
+    }
+
+    // Now that the entries are in place, all but the ones the monitor had
+    // seen change are known unchanged (unless they had to be reordered)
+    if (!fsmonitor_last.empty()) {
+        bool usable = (sorted || link) && fsmonitor_dirty.bit_size() <= size();
+        fsmonitor_bits.assign(size(), usable);
+        for (size_t pos : fsmonitor_dirty.positions()) {
+            fsmonitor_bits[pos] = false;
+        }
+    }
+    fsmonitor_dirty = EwahBitmap();
+    
+    return true;
+}
+
+bool Index::load_file(const std::filesystem::path& path, unsigned int threads, bool& sorted,
+                      std::optional<SplitLink>& link) {
+    // Map the file; entries are decoded lazily from the mapping
+    map = MappedFile::open(path);
+    if (!map) {
+        return false;
+    }
+    const char* data = map->data();
+    
+    if (map->size() < 12 + oid_size()) {
+        // Index file too small to be valid
+        return false;
+    }
+    
+    // Check header: "DIRC" (Git index signature)
+    if (std::memcmp(data, "DIRC", 4) != 0) {
+        return false;
+    }
+    
+    // Parse version (bytes 4-7, big-endian)
+    uint32_t version = read_u32(data + 4);
+    
+    if (version < 2 || version > 4) {
+        return false; // Only versions 2 to 4 exist
+    }
+    format_version = version;
+    
+    // Parse entry count (bytes 8-11, big-endian), find the entries and
+    // load the extensions after them
+    uint32_t num_entries = read_u32(data + 8);
+    size_t entries_end = 0;
+    return scan_entries(num_entries, threads, entries_end, sorted) && read_extensions(entries_end, link);
+}
+
+bool Index::load_shared(const Repository& repo, const SplitLink& link, unsigned int threads) {
+    // The entries read so far are the split index: first the ones
+    // replacing shared entries (with empty names), then the added ones
+    std::vector<IndexEntry> delta;
+    delta.reserve(size());
+    for (size_t pos = 0; pos < size(); pos++) {
+        delta.push_back((*this)[pos].to_entry());
+    }
+
+    // What the split index says about the whole index stays
+    CacheTree tree = std::move(tree_root);
+    std::optional<UntrackedCache> untracked_dirs = std::move(untracked);
+    std::string fsmonitor_token = std::move(fsmonitor_last);
+    EwahBitmap fsmonitor_changed = std::move(fsmonitor_dirty);
+    uint32_t version = format_version;
+    uint32_t saved_sec = timestamp_sec;
+    uint32_t saved_nsec = timestamp_nsec;
+    clear();
+    timestamp_sec = saved_sec;
+    timestamp_nsec = saved_nsec;
+
+    // Load the shared index, which must be the one the link names (its
+    // checksum is the name) and can't be split itself
+    std::filesystem::path shared_path = repo.gitdir / ("sharedindex." + link.shared_sha);
+    bool sorted = true;
+    std::optional<SplitLink> nested;
+    if (!load_file(shared_path, threads, sorted, nested) || nested ||
+        oid_to_hex(reinterpret_cast<const unsigned char*>(map->data() + map->size() - oid_size()), oid_size()) !=
+            link.shared_sha) {
+        return false;
+    }
+    if (!sorted) {
+        sort_entries();
+    }
+    tree_root = CacheTree();
+
+    // Remember the shared entries as loaded, to write the next delta against
+    shared_sha = link.shared_sha;
+    shared_paths = paths;
+    shared_slots = slots;
+
+    // Drop the deleted entries and swap in the replacements, in order
+    size_t replaced_count = 0;
+    std::vector<PathRef> merged_paths;
+    std::vector<uint32_t> merged_slots;
+    merged_paths.reserve(shared_paths.size() + delta.size());
+    merged_slots.reserve(shared_paths.size() + delta.size());
+    for (size_t j = 0; j < shared_paths.size(); j++) {
+        if (link.deleted.get(j)) {
+            continue;
+        }
+        merged_paths.push_back(shared_paths[j]);
+        if (link.replaced.get(j)) {
+            if (replaced_count >= delta.size() || !delta[replaced_count].path.empty()) {
+                return false;
+            }
+            merged_slots.push_back(new_slot(delta[replaced_count++]));
+        } else {
+            merged_slots.push_back(shared_slots[j]);
+        }
+    }
+    if (link.deleted.bit_size() > shared_paths.size() || link.replaced.bit_size() > shared_paths.size()) {
+        return false;
+    }
+    paths = std::move(merged_paths);
+    slots = std::move(merged_slots);
+
+    // The rest of the split index are added entries
+    delta.erase(delta.begin(), delta.begin() + replaced_count);
+    for (const auto& entry : delta) {
+        if (entry.path.empty()) {
+            return false;
+        }
+    }
+    add_entries(std::move(delta));
+
+    tree_root = std::move(tree);
+    untracked = std::move(untracked_dirs);
+    fsmonitor_last = std::move(fsmonitor_token);
+    fsmonitor_dirty = std::move(fsmonitor_changed);
+    format_version = version;
+    return true;
+}
+
+template <typename Algo>
+std::vector<std::pair<uint32_t, uint32_t>> Index::read_entry_offset_table() const {
+    std::vector<std::pair<uint32_t, uint32_t>> blocks;
+    const char* data = map->data();
+    size_t checksum_start = map->size() - Algo::raw_size;
+
+    // The EOIE extension, when present, is the last one before the
+    // checksum and tells where the entries end
+    if (checksum_start < 12 + EXT_HEADER_SIZE + EOIE_SIZE<Algo>) {
+        return blocks;
+    }
+    const char* eoie = data + checksum_start - EXT_HEADER_SIZE - EOIE_SIZE<Algo>;
+    if (std::memcmp(eoie, "EOIE", 4) != 0 || read_u32(eoie + 4) != EOIE_SIZE<Algo>) {
+        return blocks;
+    }
+    size_t ext_start = read_u32(eoie + EXT_HEADER_SIZE);
+    size_t eoie_start = eoie - data;
+    if (ext_start < 12 || ext_start > eoie_start) {
+        return blocks;
+    }
+
+    // Walk the extension headers, checking them against the EOIE hash and
+    // looking for the IEOT extension on the way
+    typename Algo::Context ctx;
+    const char* ieot = nullptr;
+    uint32_t ieot_size = 0;
+    size_t offset = ext_start;
+    while (offset < eoie_start) {
+        if (offset + EXT_HEADER_SIZE > eoie_start) {
+            return blocks;
+        }
+        uint32_t ext_size = read_u32(data + offset + 4);
+        if (ext_size > eoie_start - offset - EXT_HEADER_SIZE) {
+            return blocks;
+        }
+        ctx.update(data + offset, EXT_HEADER_SIZE);
+        if (std::memcmp(data + offset, "IEOT", 4) == 0) {
+            ieot = data + offset + EXT_HEADER_SIZE;
+            ieot_size = ext_size;
+        }
+        offset += EXT_HEADER_SIZE + ext_size;
+    }
+    unsigned char hash[Algo::raw_size];
+    ctx.final(hash);
+    if (offset != eoie_start || std::memcmp(hash, eoie + EXT_HEADER_SIZE + 4, Algo::raw_size) != 0) {
+        return blocks;
+    }
+
+    // IEOT: a version, then an (offset, entry count) pair per block
+    if (!ieot || ieot_size < 4 || (ieot_size - 4) % 8 != 0 || read_u32(ieot) != IEOT_VERSION) {
+        return blocks;
+    }
+    for (size_t pos = 4; pos < ieot_size; pos += 8) {
+        blocks.emplace_back(read_u32(ieot + pos), read_u32(ieot + pos + 4));
+    }
+    return blocks;
+}
+
+bool Index::scan_entries(uint32_t num_entries, unsigned int threads, size_t& entries_end, bool& sorted) {
+    // offsets are stored in 31 bits; larger files are decoded into slots,
+    // which can only be done by one thread
+    bool in_place = map->size() < RAW_ENTRY;
+
+    std::vector<std::pair<uint32_t, uint32_t>> blocks;
+    if (in_place && threads > 1) {
+        blocks = with_object_format(format, [&](auto algo) {
+            return read_entry_offset_table<decltype(algo)>();
+        });
+    }
+
+    // Make sure the blocks line up with the entries before trusting them:
+    // the first starts after the header and the counts add up
+    uint64_t block_entries = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (i == 0 ? blocks[i].first != 12 : blocks[i].first <= blocks[i - 1].first) {
+            blocks.clear();
+            break;
+        }
+        block_entries += blocks[i].second;
+    }
+    if (block_entries != num_entries || blocks.size() < 2) {
+        blocks.clear();
+    }
+    if (blocks.empty()) {
+        blocks.emplace_back(12, num_entries);
+    }
+
+    // Scan the blocks, in parallel when there are several, each thread
+    // taking every n-th block. Each must end where the next one starts.
+    std::vector<BlockScan> results;
+    auto scan_all = [&]() {
+        results.assign(blocks.size(), BlockScan());
+        unsigned int nr_threads = std::min<unsigned int>(threads, blocks.size());
+        auto scan_blocks = [&](unsigned int first) {
+            for (size_t b = first; b < blocks.size(); b += nr_threads) {
+                BlockScan& r = results[b];
+                r.paths.reserve(blocks[b].second);
+                r.slots.reserve(blocks[b].second);
+                r.ok = with_object_format(format, [&](auto algo) {
+                    return scan_block<decltype(algo)>(blocks[b].first, blocks[b].second, r);
+                });
+            }
+        };
+        std::vector<std::thread> workers;
+        for (unsigned int t = 1; t < nr_threads; t++) {
+            workers.emplace_back(scan_blocks, t);
+        }
+        scan_blocks(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        for (size_t b = 0; b < blocks.size(); b++) {
+            if (!results[b].ok || (b + 1 < blocks.size() && results[b].end != blocks[b + 1].first)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    if (!scan_all()) {
+        // A table that doesn't match the entries is only a lost speedup:
+        // read them again in one pass, which doesn't depend on it
+        if (blocks.size() == 1) {
+            return false;
+        }
+        blocks.assign(1, {12, num_entries});
+        if (!scan_all()) {
+            return false;
+        }
+    }
+
+    // Concatenate the blocks. Paths a block had to spell out go into the
+    // pool.
+    sorted = true;
+    paths.reserve(num_entries);
+    slots.reserve(num_entries);
+    for (size_t b = 0; b < blocks.size(); b++) {
+        BlockScan& r = results[b];
+        uint32_t pool_base = static_cast<uint32_t>(path_pool.size());
+        path_pool += r.pool;
+        for (auto& ref : r.paths) {
+            if (!(ref.offset & PATH_IN_MAP)) {
+                ref.offset += pool_base;
+            }
+        }
+
+        size_t first = paths.size();
+        paths.insert(paths.end(), r.paths.begin(), r.paths.end());
+        slots.insert(slots.end(), r.slots.begin(), r.slots.end());
+        if (!r.sorted || (first > 0 && first < paths.size() && !(path_at(first - 1) < path_at(first)))) {
+            sorted = false;
+        }
+    }
+
+    entries_end = results.back().end;
+    return true;
+}
+
+bool Index::read_extensions(size_t offset, std::optional<SplitLink>& link) {
+    const char* data = map->data();
+    size_t end = map->size() - oid_size();
+
+    while (offset < end) {
+        if (offset + EXT_HEADER_SIZE > end) {
+            return false;
+        }
+        const char* signature = data + offset;
+        uint32_t ext_size = read_u32(data + offset + 4);
+        if (ext_size > end - offset - EXT_HEADER_SIZE) {
+            return false;
+        }
+        const char* payload = data + offset + EXT_HEADER_SIZE;
+
+        if (std::memcmp(signature, "TREE", 4) == 0) {
+            // a damaged cache tree is only a lost optimization
+            const char* p = payload;
+            if (!read_cache_tree(p, payload + ext_size, tree_root, oid_size()) || p != payload + ext_size) {
+                tree_root = CacheTree();
+            }
+        } else if (std::memcmp(signature, "UNTR", 4) == 0) {
+            // like the cache tree, a damaged one is just dropped
+            untracked.emplace();
+            if (!read_untracked_cache(payload, ext_size, *untracked, oid_size())) {
+                untracked.reset();
+            }
+        } else if (std::memcmp(signature, "FSMN", 4) == 0) {
+            // without it every entry is just checked again
+            if (!read_fsmonitor(payload, ext_size, fsmonitor_last, fsmonitor_dirty)) {
+                fsmonitor_last.clear();
+                fsmonitor_dirty = EwahBitmap();
+            }
+        } else if (std::memcmp(signature, "sdir", 4) == 0) {
+            // sparse directory entries are told apart by their mode
+        } else if (std::memcmp(signature, "link", 4) == 0) {
+            // split index: the shared index id, then which of its entries
+            // are deleted and which are replaced (both optional)
+            if (ext_size < oid_size()) {
+                return false;
+            }
+            link.emplace();
+            link->shared_sha = oid_to_hex(reinterpret_cast<const unsigned char*>(payload), oid_size());
+            const char* p = payload + oid_size();
+            const char* ext_end = payload + ext_size;
+            if (p < ext_end && (!link->deleted.deserialize(p, ext_end) || !link->replaced.deserialize(p, ext_end))) {
+                return false;
+            }
+        } else if (signature[0] < 'A' || signature[0] > 'Z') {
+            // extensions not starting with an uppercase letter are required
+            // to understand the index
+            return false;
+        }
+        offset += EXT_HEADER_SIZE + ext_size;
+    }
+
+    return true;
+}
+
+template <typename Algo>
+bool Index::scan_block(size_t offset, uint32_t count, BlockScan& out) {
+    using Layout = EntryLayout<Algo>;
+    const char* data = map->data();
+    // entries can't run into the trailing checksum
+    size_t end = map->size() - Algo::raw_size;
+    bool in_place = map->size() < RAW_ENTRY;
+
+    // version 4 paths are relative to the previous one, starting afresh
+    // at each block. Git writes the first entry of a block as stripping
+    // all of the previous path, which a block read on its own doesn't
+    // have, so that count is ignored as Git's reader does.
+    std::string prev_path;
+
+    // the previous path, for checking the order
+    std::string prev_copy;
+    std::string_view prev;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (offset + Layout::path_offset > end) {
+            return false;
+        }
+
+        uint16_t entry_flags = read_u16(data + offset + Layout::flags_offset);
+        bool extended = entry_flags & FLAG_EXTENDED;
+        if (extended && format_version < 3) {
+            return false;
+        }
+        size_t path_start = offset + Layout::path_offset + (extended ? 2 : 0);
+        if (path_start > end) {
+            return false;
+        }
+
+        PathRef ref;
+        size_t entry_size;
+        if (format_version == 4) {
+            const char* p = data + path_start;
+            uint64_t strip;
+            if (!read_varint(p, data + end, strip)) {
+                return false;
+            }
+            if (i == 0) {
+                strip = 0;
+            } else if (strip > prev_path.size()) {
+                return false;
+            }
+            const void* nul = std::memchr(p, '\0', data + end - p);
+            if (!nul) {
+                return false;
+            }
+            prev_path.resize(prev_path.size() - strip);
+            prev_path.append(p, static_cast<const char*>(nul) - p);
+
+            ref = PathRef{static_cast<uint32_t>(out.pool.size()), static_cast<uint32_t>(prev_path.size())};
+            out.pool += prev_path;
+            entry_size = static_cast<const char*>(nul) + 1 - (data + offset);
+        } else {
+            // the low 12 bits of flags hold the path length, unless it's too long
+            size_t path_len = entry_flags & FLAG_NAME_MASK;
+            if (path_len == FLAG_NAME_MASK) {
+                const void* nul = std::memchr(data + path_start, '\0', end - path_start);
+                if (!nul) {
+                    return false;
+                }
+                path_len = static_cast<const char*>(nul) - (data + path_start);
+            }
+            if (path_start + path_len >= end || data[path_start + path_len] != '\0') {
+                return false;
+            }
+
+            if (in_place) {
+                ref = PathRef{static_cast<uint32_t>(path_start) | PATH_IN_MAP, static_cast<uint32_t>(path_len)};
+            } else {
+                ref = PathRef{static_cast<uint32_t>(out.pool.size()), static_cast<uint32_t>(path_len)};
+                out.pool.append(data + path_start, path_len);
+            }
+            entry_size = Layout::ondisk_size(path_len, extended);
+        }
+
+        std::string_view path(ref.offset & PATH_IN_MAP ? data + path_start : out.pool.data() + ref.offset,
+                              ref.length);
+        if (i > 0 && !(prev < path)) {
+            out.sorted = false;
+        }
+
+        if (in_place) {
+            out.slots.push_back(static_cast<uint32_t>(offset) | RAW_ENTRY);
+        } else {
+            IndexEntry entry{std::string(path)};
+            entry.stat = decode_stat(data + offset);
+            entry.sha = oid_to_hex(reinterpret_cast<const unsigned char*>(data + offset + ENTRY_OID_OFFSET),
+                                   Algo::raw_size);
+            entry.flags = entry_flags & ~FLAG_EXTENDED;
+            entry.extended_flags = extended ? read_u16(data + offset + Layout::path_offset) : 0;
+            out.slots.push_back(new_slot(entry));
+        }
+        out.paths.push_back(ref);
+
+        // views into the pool move as it grows, so remember a copy
+        if (ref.offset & PATH_IN_MAP) {
+            prev = path;
+        } else {
+            prev_copy.assign(path);
+            prev = prev_copy;
+        }
+
+        offset += entry_size;
+        if (offset > end) {
+            return false;
+        }
+    }
+
+    out.end = offset;
+    return true;
+}
+
+void Index::sort_entries() {
+    std::vector<size_t> order(size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [this](size_t a, size_t b) { return path_at(a) < path_at(b); });
+
+    std::vector<PathRef> sorted_paths;
+    std::vector<uint32_t> sorted_slots;
+    sorted_paths.reserve(size());
+    sorted_slots.reserve(size());
+    for (size_t pos : order) {
+        sorted_paths.push_back(paths[pos]);
+        sorted_slots.push_back(slots[pos]);
+    }
+    paths = std::move(sorted_paths);
+    slots = std::move(sorted_slots);
+}
+
+bool Index::verify_checksum() const {
+    if (!map) {
+        return true;
+    }
+    return with_object_format(format, [&](auto algo) {
+        using Algo = decltype(algo);
+        size_t body = map->size() - Algo::raw_size;
+        unsigned char hash[Algo::raw_size];
+        Algo::hash(map->data(), body, hash);
+        return std::memcmp(hash, map->data() + body, Algo::raw_size) == 0;
+    });
+}
+
+bool Index::write(const Repository& repo) const {
+    std::filesystem::path index_path = get_index_path(repo);
+    
+    // Ensure directory exists
+    std::filesystem::create_directories(index_path.parent_path());
+
+    ConfigParser config;
+    config.read((repo.gitdir / "config").string());
+    
+    // Version: index.version if configured, else the one that was read.
+    // Extended flags need at least version 3.
+    uint32_t version = format_version ? format_version : 2;
+    std::string configured = config.get("index", "version");
+    if (configured == "2" || configured == "3" || configured == "4") {
+        version = static_cast<uint32_t>(std::stoul(configured));
+    }
+    if (version == 2) {
+        for (size_t pos = 0; pos < size(); pos++) {
+            if ((*this)[pos].extended_flags()) {
+                version = 3;
+                break;
+            }
+        }
+    }
+
+    // The index is written through its lock, taken here unless lock()
+    // took it already
+    LockFile own_lock;
+    LockFile* lock = held_lock && held_lock->held() ? held_lock.get() : &own_lock;
+    if (lock == &own_lock && !own_lock.acquire(index_path, INDEX_LOCK_TIMEOUT_MS)) {
+        return false;
+    }
+
+    // Racy git: the stat data of a file modified in the same instant the
+    // index is written would still match after another change in that
+    // instant. Writing the header first makes the lock file's mtime the
+    // earliest the new index can have; entries modified since then are
+    // smudged (written with a size of 0) like Git's
+    // ce_smudge_racily_clean_entry does, so they're checked by content.
+    //
+    // Files written just before the index, by a checkout or the refresh in
+    // status, share the lock file's timestamp where the clock is coarse, and
+    // every one of them would be smudged and hashed again by the next
+    // status. Instead the lock file is touched until its mtime has moved
+    // past the newest of them, for a few milliseconds at most: filesystems
+    // with whole-second timestamps still smudge, as do entries stamped
+    // further ahead than that.
+    RacyTime newest;
+    for (size_t pos = 0; pos < size(); pos++) {
+        if (!(slots[pos] & RAW_ENTRY) && modified_since(stats[slots[pos]], newest.sec, newest.nsec)) {
+            newest = RacyTime{stats[slots[pos]].mtime_sec, stats[slots[pos]].mtime_nsec};
+        }
+    }
+    RacyTime racy_since;
+    auto begin_file = [&](size_t count) {
+        std::string header = "DIRC";
+        append_u32(header, version);
+        append_u32(header, static_cast<uint32_t>(count));
+        FileStat st;
+        if (!lock->write(header) || !file_stat(lock->lock_path(), st)) {
+            return false;
+        }
+        auto smudges_newest = [&newest, &st] {
+            uint32_t sec = static_cast<uint32_t>(st.mtime_sec);
+            return newest.sec != sec ? newest.sec > sec && newest.sec - sec <= 1 : newest.nsec >= st.mtime_nsec;
+        };
+        for (int waited = 0; waited < RACY_WAIT_MS && newest.sec != 0 && smudges_newest(); waited++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (!touch_file(lock->lock_path()) || !file_stat(lock->lock_path(), st)) {
+                return false;
+            }
+        }
+        racy_since = RacyTime{static_cast<uint32_t>(st.mtime_sec), st.mtime_nsec};
+        return true;
+    };
+    auto finish_file = [&](const std::string& content) {
+        return lock->write(std::string_view(content).substr(12)) && lock->commit(repo.fsync, FSYNC_INDEX);
+    };
+
+    // core.splitIndex turns the split index on or off; when it isn't set,
+    // an index that was split stays split
+    std::string split_config = config.get("core", "splitIndex");
+    bool split = split_config == "true" || (!shared_sha.empty() && split_config != "false");
+    if (!split) {
+        if (!begin_file(size())) {
+            return false;
+        }
+        std::string content = with_object_format(repo.object_format, [&](auto algo) {
+            return serialize_full<decltype(algo)>(version, index_threads(repo), true, racy_since);
+        });
+        return finish_file(content);
+    }
+
+    // Delta against the shared index we read: shared entries that are gone,
+    // entries replacing shared ones (by shared position), and added entries
+    EwahBitmap deleted;
+    EwahBitmap replaced;
+    std::vector<size_t> replacements;
+    std::vector<size_t> added;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < size() || j < shared_paths.size()) {
+        // entries still pointing at the same shared data are untouched
+        if (i < size() && j < shared_paths.size() && slots[i] == shared_slots[j] &&
+            paths[i].offset == shared_paths[j].offset) {
+            i++;
+            j++;
+            continue;
+        }
+        int cmp = i == size() ? 1 : j == shared_paths.size() ? -1 : path_at(i).compare(path_view(shared_paths[j]));
+        if (cmp == 0) {
+            replaced.set(j);
+            replacements.push_back(i++);
+            j++;
+        } else if (cmp > 0) {
+            deleted.set(j++);
+        } else {
+            added.push_back(i++);
+        }
+    }
+
+    // Once the delta outgrows splitIndex.maxPercentChange of the shared
+    // index (or there's none yet), write all entries as a new shared index
+    long max_percent = 20;
+    try {
+        max_percent = std::stol(config.get("splitIndex", "maxPercentChange", "20"));
+    } catch (const std::exception&) {
+    }
+    size_t changes = replacements.size() + added.size() + deleted.positions().size();
+    std::string link_sha = shared_sha;
+    bool new_shared =
+        shared_sha.empty() || changes * 100 > static_cast<size_t>(std::max(0L, max_percent)) * shared_paths.size();
+    if (!begin_file(new_shared ? 0 : replacements.size() + added.size())) {
+        return false;
+    }
+    if (new_shared) {
+        size_t trailer_size = object_format_raw_size(repo.object_format);
+        std::string shared = with_object_format(repo.object_format, [&](auto algo) {
+            return serialize_full<decltype(algo)>(version, index_threads(repo), false, racy_since);
+        });
+        link_sha = oid_to_hex(reinterpret_cast<const unsigned char*>(shared.data() + shared.size() - trailer_size),
+                              trailer_size);
+        std::filesystem::path shared_path = repo.gitdir / ("sharedindex." + link_sha);
+        if (!std::filesystem::exists(shared_path) && !write_index_file(repo, shared_path, shared)) {
+            return false;
+        }
+        expire_shared_indexes(repo, config, link_sha);
+
+        deleted = EwahBitmap();
+        replaced = EwahBitmap();
+        replacements.clear();
+        added.clear();
+    } else {
+        // keep the shared index we use from being expired
+        std::error_code ec;
+        std::filesystem::last_write_time(repo.gitdir / ("sharedindex." + shared_sha),
+                                         std::filesystem::file_time_type::clock::now(), ec);
+    }
+
+    std::string content = with_object_format(repo.object_format, [&](auto algo) {
+        return serialize_split<decltype(algo)>(version, replacements, added, link_sha, deleted, replaced,
+                                               racy_since);
+    });
+    return finish_file(content);
 }
 
-bool Index::read(const Repository& repo) {
-    entries.clear();
-    
-    std::filesystem::path index_path = get_index_path(repo);
-    
-    // If index file doesn't exist, that's OK - it just means empty index
-    if (!std::filesystem::exists(index_path)) {
-        return true;
+template <typename Algo>
+std::string Index::serialize_split(uint32_t version, const std::vector<size_t>& replacements,
+                                   const std::vector<size_t>& added, const std::string& link_sha,
+                                   const EwahBitmap& deleted, const EwahBitmap& replaced,
+                                   const RacyTime& racy_since) const {
+    // Replacing entries (without names), added entries, then the link
+    // extension and the cache tree
+    std::string content;
+    content += "DIRC";
+    append_u32(content, version);
+    append_u32(content, static_cast<uint32_t>(replacements.size() + added.size()));
+    std::string_view prev_path;
+    for (size_t pos : replacements) {
+        serialize_entry<Algo>(content, pos, std::string_view(), version, prev_path, racy_since);
     }
-    
-    // Read the entire file
-    std::ifstream file(index_path, std::ios::binary);
-    if (!file.is_open()) {
-        return false;
+    for (size_t pos : added) {
+        serialize_entry<Algo>(content, pos, path_at(pos), version, prev_path, racy_since);
     }
-    
-    // Read all content
-    std::string content((std::istreambuf_iterator<char>(file)),
-                        std::istreambuf_iterator<char>());
-    file.close();
-    
-    if (content.size() < 12) {
-        // Index file too small to be valid
-        return false;
+
+    std::string link;
+    unsigned char link_oid[INDEX_OID_MAX];
+    hex_to_oid(link_sha, link_oid);
+    link.append(reinterpret_cast<const char*>(link_oid), Algo::raw_size);
+    deleted.serialize(link);
+    replaced.serialize(link);
+    append_extension(content, "link", link);
+
+    std::vector<size_t> ext_headers;
+    append_index_extensions(content, ext_headers, Algo::raw_size);
+
+    append_checksum<Algo>(content);
+    return content;
+}
+
+void Index::append_index_extensions(std::string& content, std::vector<size_t>& ext_headers,
+                                    size_t oid_size) const {
+    if (tree_root.valid() || !tree_root.subtrees.empty()) {
+        std::string tree;
+        write_cache_tree(tree, tree_root, oid_size);
+        ext_headers.push_back(content.size());
+        append_extension(content, "TREE", tree);
     }
-    
-    // Check header: "DIRC" (Git index signature)
-    if (content.substr(0, 4) != "DIRC") {
-        return false;
+    if (untracked) {
+        std::string untr;
+        write_untracked_cache(untr, *untracked, oid_size);
+        ext_headers.push_back(content.size());
+        append_extension(content, "UNTR", untr);
     }
-    
-    // Parse version (bytes 4-7, big-endian)
-    int version = read_u32(content, 4);
-    
-    if (version != 2) {
-        return false; // Only support version 2
+    if (!fsmonitor_last.empty()) {
+        // by position in the whole index, also when it's split
+        EwahBitmap dirty;
+        for (size_t pos = 0; pos < size(); pos++) {
+            if (!fsmonitor_bits[pos]) {
+                dirty.set(pos);
+            }
+        }
+        std::string fsmn;
+        write_fsmonitor(fsmn, fsmonitor_last, dirty);
+        ext_headers.push_back(content.size());
+        append_extension(content, "FSMN", fsmn);
     }
-    
-    // Parse entry count (bytes 8-11, big-endian)
-    int num_entries = read_u32(content, 8);
-    
-    // Parse entries
-    size_t offset = 12;
-    for (int i = 0; i < num_entries; i++) {
-        auto result = deserialize_entry(content, offset);
-        if (!result.has_value()) {
-            return false;
+    for (size_t pos = 0; pos < size(); pos++) {
+        if ((*this)[pos].sparse_dir()) {
+            ext_headers.push_back(content.size());
+            append_extension(content, "sdir", "");
+            break;
         }
-        entries.push_back(result->first);
-        offset = result->second;
     }
-    
-    return true;
 }
 
-bool Index::write(const Repository& repo) const {
-    std::filesystem::path index_path = get_index_path(repo);
-    
-    // Ensure directory exists
-    std::filesystem::create_directories(index_path.parent_path());
-    
+template <typename Algo>
+std::string Index::serialize_full(uint32_t version, unsigned int threads, bool with_extensions,
+                                  const RacyTime& racy_since) const {
     // Build the index file content
     std::string content;
+    content.reserve(map ? map->size() + (size() - std::min(size(), slots.size())) * 80
+                        : 12 + size() * 80 + Algo::raw_size);
     
-    // Header: "DIRC"
+    // Header: "DIRC", version, number of entries
     content += "DIRC";
+    append_u32(content, version);
+    append_u32(content, static_cast<uint32_t>(size()));
     
-    // Version: 2
-    append_u32(content, 2);
-    
-    // Number of entries
-    append_u32(content, static_cast<int>(entries.size()));
-    
-    // Serialize all entries
-    for (const auto& entry : entries) {
-        content += serialize_entry(entry);
+    // Split the entries into blocks that readers can parse in parallel,
+    // one per thread, when there are enough of them to be worth it
+    size_t nr_blocks = std::min<size_t>(size() / ENTRIES_PER_BLOCK, threads);
+    size_t block_size = nr_blocks > 1 ? (size() + nr_blocks - 1) / nr_blocks : size();
+    std::string ieot;
+    append_u32(ieot, IEOT_VERSION);
+
+    // Serialize all entries. Version 4 paths are relative to the previous
+    // one; the first path of each block shares nothing with it, so blocks
+    // can be read on their own.
+    std::string_view prev_path;
+    for (size_t pos = 0; pos < size(); pos++) {
+        bool block_start = pos % block_size == 0;
+        if (block_start) {
+            append_u32(ieot, static_cast<uint32_t>(content.size()));
+            append_u32(ieot, static_cast<uint32_t>(std::min(block_size, size() - pos)));
+        }
+        serialize_entry<Algo>(content, pos, path_at(pos), version, prev_path, racy_since, block_start);
     }
-    
-    // Calculate and append SHA-1 hash of the content
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1(reinterpret_cast<const unsigned char*>(content.c_str()), content.size(), hash);
-    for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-        content += static_cast<char>(hash[i]);
+
+    // Extensions, in the order Git writes them. The entry offset table
+    // comes first; its offsets are 32 bits, which also bounds the file
+    // size it works for.
+    size_t ext_start = content.size();
+    std::vector<size_t> ext_headers;
+
+    bool write_ieot = nr_blocks > 1 && content.size() < RAW_ENTRY;
+    if (write_ieot) {
+        ext_headers.push_back(content.size());
+        append_extension(content, "IEOT", ieot);
     }
-    
-    // Write to file
-    std::ofstream file(index_path, std::ios::binary);
-    if (!file.is_open()) {
-        return false;
+    if (with_extensions) {
+        append_index_extensions(content, ext_headers, Algo::raw_size);
     }
-    
-    file.write(content.c_str(), content.size());
-    file.close();
-    
-    return true;
+
+    // EOIE points back at the end of the entries so the table can be found
+    // without parsing them, and hashes the header (signature and size) of
+    // every extension
+    if (write_ieot) {
+        typename Algo::Context ctx;
+        for (size_t header : ext_headers) {
+            ctx.update(content.data() + header, EXT_HEADER_SIZE);
+        }
+        unsigned char ext_hash[Algo::raw_size];
+        ctx.final(ext_hash);
+
+        content += "EOIE";
+        append_u32(content, EOIE_SIZE<Algo>);
+        append_u32(content, static_cast<uint32_t>(ext_start));
+        content.append(reinterpret_cast<const char*>(ext_hash), Algo::raw_size);
+    }
+
+    append_checksum<Algo>(content);
+    return content;
 }
 
-std::string Index::serialize_entry(const IndexEntry& entry) const {
-    std::string result;
-    
-    // 10 fixed 32-bit metadata fields
-    append_u32(result, entry.ctime_sec);
-    append_u32(result, entry.ctime_nsec);
-    append_u32(result, entry.mtime_sec);
-    append_u32(result, entry.mtime_nsec);
-    append_u32(result, entry.dev);
-    append_u32(result, entry.ino);
-    append_u32(result, entry.mode);
-    append_u32(result, entry.uid);
-    append_u32(result, entry.gid);
-    append_u32(result, entry.file_size);
-    
-    // SHA-1 hash (40 characters hex string converted to 20 bytes)
-    if (entry.sha.size() == 40) {
-        for (size_t i = 0; i < 40; i += 2) {
-            unsigned int byte = 0;
-            for (int j = 0; j < 2; j++) {
-                byte = byte * 16;
-                char c = entry.sha[i + j];
-                if (c >= '0' && c <= '9') {
-                    byte += c - '0';
-                } else if (c >= 'a' && c <= 'f') {
-                    byte += c - 'a' + 10;
-                } else if (c >= 'A' && c <= 'F') {
-                    byte += c - 'A' + 10;
-                }
-            }
-            result += static_cast<char>(byte);
+template <typename Algo>
+void Index::serialize_entry(std::string& out, size_t pos, std::string_view path, uint32_t version,
+                            std::string_view& prev_path, const RacyTime& racy_since, bool block_start) const {
+    using Layout = EntryLayout<Algo>;
+    size_t start = out.size();
+    uint32_t slot = slots[pos];
+    uint16_t entry_flags;
+    uint16_t extended_flags;
+
+    if (slot & RAW_ENTRY) {
+        // stat data and object id are copied from the mapping as they are
+        const char* raw = raw_at(pos);
+        out.append(raw, Layout::flags_offset);
+        if (modified_since(decode_stat(raw), racy_since.sec, racy_since.nsec)) {
+            std::memset(&out[start + 36], 0, 4);  // the size
         }
+        entry_flags = read_u16(raw + Layout::flags_offset);
+        extended_flags = (entry_flags & FLAG_EXTENDED) ? read_u16(raw + Layout::path_offset) : 0;
+    } else {
+        const IndexStat& st = stats[slot];
+
+        // 10 fixed 32-bit metadata fields
+        append_u32(out, st.ctime_sec);
+        append_u32(out, st.ctime_nsec);
+        append_u32(out, st.mtime_sec);
+        append_u32(out, st.mtime_nsec);
+        append_u32(out, st.dev);
+        append_u32(out, st.ino);
+        append_u32(out, st.mode);
+        append_u32(out, st.uid);
+        append_u32(out, st.gid);
+        append_u32(out, modified_since(st, racy_since.sec, racy_since.nsec) ? 0 : st.file_size);
+
+        // object id, already binary
+        out.append(reinterpret_cast<const char*>(oids.data() + slot * INDEX_OID_MAX), Algo::raw_size);
+        entry_flags = flags[slot];
+        extended_flags = ext_flags[slot];
     }
-    
-    // flags (2 bytes, big-endian)
-    append_u16(result, entry.flags);
-    
+
+    // flags (2 bytes, big-endian), with the name length and extended bit
+    // recomputed, then the extended flags if there are any
+    entry_flags &= ~(FLAG_EXTENDED | FLAG_NAME_MASK);
+    entry_flags |= static_cast<uint16_t>(std::min<size_t>(path.size(), FLAG_NAME_MASK));
+    if (extended_flags) {
+        entry_flags |= FLAG_EXTENDED;
+    }
+    append_u16(out, entry_flags);
+    if (extended_flags) {
+        append_u16(out, extended_flags);
+    }
+
+    if (version == 4) {
+        // bytes to strip from the previous path, then the new suffix. As
+        // in Git, a block starts by stripping all of it, which readers of
+        // the whole file follow and readers of the block ignore.
+        size_t common = 0;
+        while (!block_start && common < prev_path.size() && common < path.size() && prev_path[common] == path[common]) {
+            common++;
+        }
+        append_varint(out, prev_path.size() - common);
+        out.append(path.data() + common, path.size() - common);
+        out += '\0';
+        prev_path = path;
+        return;
+    }
+
     // path (variable length, null-terminated)
-    result += entry.path;
-    result += '\0';
+    out += path;
+    out += '\0';
     
-    // Padding: pad to 8-byte boundary
-    while (result.size() % 8 != 0) {
-        result += '\0';
+    // Padding: pad to 8-byte boundary (relative to entry start)
+    while ((out.size() - start) % 8 != 0) {
+        out += '\0';
     }
-    
-    return result;
 }
 
-std::optional<std::pair<IndexEntry, size_t>> Index::deserialize_entry(const std::string& data, size_t offset) const {
-    if (offset + 62 > data.size()) {
-        return std::nullopt;
+std::string_view Index::path_at(size_t pos) const {
+    return path_view(paths[pos]);
+}
+
+std::string_view Index::path_view(const PathRef& ref) const {
+    if (ref.offset & PATH_IN_MAP) {
+        return std::string_view(map->data() + (ref.offset & ~PATH_IN_MAP), ref.length);
     }
-    
-    IndexEntry entry;
-    
-    entry.ctime_sec = read_u32(data, offset + 0);
-    entry.ctime_nsec = read_u32(data, offset + 4);
-    entry.mtime_sec = read_u32(data, offset + 8);
-    entry.mtime_nsec = read_u32(data, offset + 12);
-    entry.dev = read_u32(data, offset + 16);
-    entry.ino = read_u32(data, offset + 20);
-    entry.mode = read_u32(data, offset + 24);
-    entry.uid = read_u32(data, offset + 28);
-    entry.gid = read_u32(data, offset + 32);
-    entry.file_size = read_u32(data, offset + 36);
-    
-    // SHA-1 hash (20 bytes -> 40 hex chars)
-    for (int i = 0; i < 20; i++) {
-        unsigned char byte = static_cast<unsigned char>(data[offset + 40 + i]);
-        char hex[3];
-        snprintf(hex, sizeof(hex), "%02x", byte);
-        entry.sha += hex;
+    return std::string_view(path_pool.data() + ref.offset, ref.length);
+}
+
+const char* Index::raw_at(size_t pos) const {
+    return map->data() + (slots[pos] & ~RAW_ENTRY);
+}
+
+size_t Index::lower_bound(std::string_view path) const {
+    size_t lo = 0;
+    size_t hi = size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (path_at(mid) < path) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    
-    // flags
-    entry.flags = read_u16(data, offset + 60);
-    
-    // path (variable length, null-terminated)
-    size_t path_start = offset + 62;
-    size_t path_end = data.find('\0', path_start);
-    if (path_end == std::string::npos) {
-        return std::nullopt;
+    return lo;
+}
+
+Index::PathRef Index::intern_path(std::string_view path) {
+    PathRef ref{static_cast<uint32_t>(path_pool.size()), static_cast<uint32_t>(path.size())};
+    path_pool.append(path.data(), path.size());
+    return ref;
+}
+
+uint32_t Index::new_slot(const IndexEntry& entry) {
+    unsigned char oid[INDEX_OID_MAX];
+    hex_to_oid(entry.sha, oid);
+
+    stats.push_back(entry.stat);
+    oids.insert(oids.end(), oid, oid + INDEX_OID_MAX);
+    flags.push_back(entry.flags & ~FLAG_EXTENDED);
+    ext_flags.push_back(entry.extended_flags);
+    return static_cast<uint32_t>(stats.size() - 1);
+}
+
+uint32_t Index::own_slot(size_t pos) {
+    if (!(slots[pos] & RAW_ENTRY)) {
+        return slots[pos];
+    }
+
+    const char* raw = raw_at(pos);
+    stats.push_back(decode_stat(raw));
+    // slots have room for the longest id; a shorter one is zero-padded
+    size_t flags_offset = entry_flags_offset(oid_size());
+    oids.insert(oids.end(), raw + ENTRY_OID_OFFSET, raw + flags_offset);
+    oids.insert(oids.end(), INDEX_OID_MAX - oid_size(), 0);
+    uint16_t entry_flags = read_u16(raw + flags_offset);
+    flags.push_back(entry_flags & ~FLAG_EXTENDED);
+    ext_flags.push_back((entry_flags & FLAG_EXTENDED) ? read_u16(raw + flags_offset + 2) : 0);
+    slots[pos] = static_cast<uint32_t>(stats.size() - 1);
+    return slots[pos];
+}
+
+void Index::maybe_compact() {
+    // the shared entries of a split index refer to slots and pooled paths
+    // too; they are compacted by writing a new shared index instead
+    if (!shared_slots.empty()) {
+        return;
+    }
+
+    if (dead_slots > 64 && dead_slots > stats.size() / 2) {
+        std::vector<IndexStat> live_stats;
+        std::vector<unsigned char> live_oids;
+        std::vector<uint16_t> live_flags;
+        std::vector<uint16_t> live_ext_flags;
+        for (auto& slot : slots) {
+            if (slot & RAW_ENTRY) {
+                continue;
+            }
+            live_stats.push_back(stats[slot]);
+            live_oids.insert(live_oids.end(), oids.begin() + slot * INDEX_OID_MAX,
+                             oids.begin() + (slot + 1) * INDEX_OID_MAX);
+            live_flags.push_back(flags[slot]);
+            live_ext_flags.push_back(ext_flags[slot]);
+            slot = static_cast<uint32_t>(live_stats.size() - 1);
+        }
+        stats = std::move(live_stats);
+        oids = std::move(live_oids);
+        flags = std::move(live_flags);
+        ext_flags = std::move(live_ext_flags);
+        dead_slots = 0;
+    }
+
+    if (pool_garbage > 4096 && pool_garbage > path_pool.size() / 2) {
+        std::string pool;
+        pool.reserve(path_pool.size() - pool_garbage);
+        for (auto& ref : paths) {
+            if (ref.offset & PATH_IN_MAP) {
+                continue;
+            }
+            uint32_t offset = static_cast<uint32_t>(pool.size());
+            pool.append(path_pool, ref.offset, ref.length);
+            ref.offset = offset;
+        }
+        path_pool = std::move(pool);
+        pool_garbage = 0;
     }
-    
-    entry.path = data.substr(path_start, path_end - path_start);
-    
-    // Skip padding to 8-byte boundary (alignment is relative to entry start).
-    size_t entry_len = (path_end - offset) + 1; // include null terminator
-    size_t padded_len = (entry_len + 7) & ~static_cast<size_t>(7);
-    size_t entry_end = offset + padded_len;
-    
-    return std::make_pair(entry, entry_end);
 }
 
 void Index::add_entry(const IndexEntry& entry) {
-    // Remove existing entry with same path if it exists
-    remove_entry(entry.path);
-    
-    // Add new entry and sort
-    entries.push_back(entry);
-    std::sort(entries.begin(), entries.end(), 
-              [](const IndexEntry& a, const IndexEntry& b) { return a.path < b.path; });
+    // Replace the existing entry in place, or insert at its sorted position
+    size_t pos = lower_bound(entry.path);
+    if (pos < size() && path_at(pos) == entry.path) {
+        // same path, so the path reference can stay where it is; the cached
+        // trees only change if the object or mode does
+        uint32_t slot = new_slot(entry);
+        if (!same_object(pos, slot)) {
+            tree_root.invalidate(entry.path);
+        }
+        if (!(slots[pos] & RAW_ENTRY)) {
+            dead_slots++;
+        }
+        slots[pos] = slot;
+        set_fsmonitor_valid(pos, false);
+    } else {
+        paths.insert(paths.begin() + pos, intern_path(entry.path));
+        slots.insert(slots.begin() + pos, new_slot(entry));
+        tree_root.invalidate(entry.path);
+        if (untracked) {
+            untracked->invalidate(entry.path);
+        }
+        if (!fsmonitor_last.empty()) {
+            fsmonitor_bits.insert(fsmonitor_bits.begin() + pos, false);
+        }
+    }
+    maybe_compact();
+}
+
+void Index::add_entries(std::vector<IndexEntry> batch) {
+    if (batch.empty()) {
+        return;
+    }
+
+    // Sort the batch and keep only the last entry given for each path
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](const IndexEntry& a, const IndexEntry& b) { return a.path < b.path; });
+    size_t kept = 0;
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (i + 1 < batch.size() && batch[i + 1].path == batch[i].path) {
+            continue;
+        }
+        if (kept != i) {
+            batch[kept] = std::move(batch[i]);
+        }
+        kept++;
+    }
+    batch.resize(kept);
+
+    // Merge the two sorted runs; batch entries replace existing ones, whose
+    // path reference is kept. Only the small per-entry references move.
+    std::vector<PathRef> merged_paths;
+    std::vector<uint32_t> merged_slots;
+    std::vector<bool> merged_valid;
+    bool monitored = !fsmonitor_last.empty();
+    merged_paths.reserve(size() + batch.size());
+    merged_slots.reserve(size() + batch.size());
+
+    size_t i = 0;
+    size_t j = 0;
+    while (i < size() || j < batch.size()) {
+        int cmp = i == size() ? 1 : j == batch.size() ? -1 : path_at(i).compare(batch[j].path);
+        if (monitored) {
+            merged_valid.push_back(cmp < 0 && fsmonitor_bits[i]);
+        }
+        if (cmp < 0) {
+            merged_paths.push_back(paths[i]);
+            merged_slots.push_back(slots[i]);
+            i++;
+            continue;
+        }
+        uint32_t slot = new_slot(batch[j]);
+        if (cmp == 0) {
+            if (!same_object(i, slot)) {
+                tree_root.invalidate(batch[j].path);
+            }
+            if (!(slots[i] & RAW_ENTRY)) {
+                dead_slots++;
+            }
+            merged_paths.push_back(paths[i]);
+            i++;
+        } else {
+            merged_paths.push_back(intern_path(batch[j].path));
+            tree_root.invalidate(batch[j].path);
+            if (untracked) {
+                untracked->invalidate(batch[j].path);
+            }
+        }
+        merged_slots.push_back(slot);
+        j++;
+    }
+
+    paths = std::move(merged_paths);
+    slots = std::move(merged_slots);
+    if (monitored) {
+        fsmonitor_bits = std::move(merged_valid);
+    }
+    maybe_compact();
 }
 
 bool Index::remove_entry(const std::string& path) {
-    auto it = std::find_if(entries.begin(), entries.end(),
-                          [&path](const IndexEntry& e) { return e.path == path; });
-    if (it != entries.end()) {
-        entries.erase(it);
-        return true;
+    size_t pos = lower_bound(path);
+    if (pos >= size() || path_at(pos) != path) {
+        return false;
+    }
+
+    tree_root.invalidate(path);
+    if (untracked) {
+        untracked->invalidate(path);
+    }
+    if (!(paths[pos].offset & PATH_IN_MAP)) {
+        pool_garbage += paths[pos].length;
+    }
+    if (!(slots[pos] & RAW_ENTRY)) {
+        dead_slots++;
+    }
+    paths.erase(paths.begin() + pos);
+    slots.erase(slots.begin() + pos);
+    if (!fsmonitor_last.empty()) {
+        fsmonitor_bits.erase(fsmonitor_bits.begin() + pos);
+    }
+
+    maybe_compact();
+    return true;
+}
+
+void Index::set_fsmonitor_token(const std::string& token) {
+    if (token.empty()) {
+        fsmonitor_bits.clear();
+    } else if (fsmonitor_last.empty()) {
+        // nothing is known yet as of the first token
+        fsmonitor_bits.assign(size(), false);
+    }
+    fsmonitor_last = token;
+}
+
+void Index::set_fsmonitor_valid(size_t pos, bool valid) {
+    if (pos < fsmonitor_bits.size()) {
+        fsmonitor_bits[pos] = valid;
+    }
+}
+
+void Index::invalidate_fsmonitor(std::string_view path) {
+    if (fsmonitor_bits.empty()) {
+        return;
+    }
+    if (!path.empty() && path.back() == '/') {
+        auto [first, last] = directory_range(path.substr(0, path.size() - 1));
+        std::fill(fsmonitor_bits.begin() + first, fsmonitor_bits.begin() + last, false);
+    } else if (auto pos = find(path)) {
+        fsmonitor_bits[*pos] = false;
+    }
+}
+
+void Index::invalidate_fsmonitor() {
+    std::fill(fsmonitor_bits.begin(), fsmonitor_bits.end(), false);
+}
+
+void Index::remove_ranges(const std::vector<std::pair<size_t, size_t>>& ranges) {
+    if (ranges.empty()) {
+        return;
+    }
+
+    size_t out = ranges.front().first;
+    size_t next = out;
+    for (size_t r = 0; r <= ranges.size(); r++) {
+        // keep what lies between this range and the previous one
+        size_t keep_end = r < ranges.size() ? ranges[r].first : size();
+        for (; next < keep_end; next++, out++) {
+            paths[out] = paths[next];
+            slots[out] = slots[next];
+            if (!fsmonitor_last.empty()) {
+                fsmonitor_bits[out] = fsmonitor_bits[next];
+            }
+        }
+        if (r == ranges.size()) {
+            break;
+        }
+
+        auto [first, last] = ranges[r];
+        for (size_t pos = first; pos < last; pos++) {
+            std::string_view path = path_at(pos);
+            tree_root.invalidate(path);
+            if (untracked) {
+                untracked->invalidate(path);
+            }
+            if (!(paths[pos].offset & PATH_IN_MAP)) {
+                pool_garbage += paths[pos].length;
+            }
+            if (!(slots[pos] & RAW_ENTRY)) {
+                dead_slots++;
+            }
+        }
+        next = last;
+    }
+
+    paths.resize(out);
+    slots.resize(out);
+    if (!fsmonitor_last.empty()) {
+        fsmonitor_bits.resize(out);
     }
-    return false;
+    maybe_compact();
 }
 
 std::optional<IndexEntry> Index::get_entry(const std::string& path) const {
-    auto it = std::find_if(entries.begin(), entries.end(),
-                          [&path](const IndexEntry& e) { return e.path == path; });
-    if (it != entries.end()) {
-        return *it;
+    auto pos = find(path);
+    if (pos) {
+        return (*this)[*pos].to_entry();
+    }
+    return std::nullopt;
+}
+
+std::optional<size_t> Index::find(std::string_view path) const {
+    size_t pos = lower_bound(path);
+    if (pos < size() && path_at(pos) == path) {
+        return pos;
     }
     return std::nullopt;
 }
 
-const std::vector<IndexEntry>& Index::get_entries() const {
-    return entries;
+std::pair<size_t, size_t> Index::directory_range(std::string_view dir) const {
+    if (dir.empty()) {
+        return {0, size()};
+    }
+    // everything under "dir/" sorts between "dir/" and "dir0" ('0' follows '/')
+    std::string first(dir);
+    first += '/';
+    std::string last(dir);
+    last += static_cast<char>('/' + 1);
+    return {lower_bound(first), lower_bound(last)};
+}
+
+bool Index::same_object(size_t pos, uint32_t slot) const {
+    IndexEntryRef entry = (*this)[pos];
+    return entry.mode() == stats[slot].mode &&
+           std::memcmp(entry.oid(), oids.data() + slot * INDEX_OID_MAX, oid_size()) == 0;
+}
+
+void Index::set_stat(size_t pos, const IndexStat& stat) {
+    stats[own_slot(pos)] = stat;
 }
 
 void Index::clear() {
-    entries.clear();
+    paths.clear();
+    slots.clear();
+    stats.clear();
+    oids.clear();
+    flags.clear();
+    ext_flags.clear();
+    dead_slots = 0;
+    path_pool.clear();
+    pool_garbage = 0;
+    map.reset();
+    format_version = 0;
+    tree_root = CacheTree();
+    untracked.reset();
+    fsmonitor_last.clear();
+    fsmonitor_bits.clear();
+    fsmonitor_dirty = EwahBitmap();
+    shared_sha.clear();
+    shared_paths.clear();
+    shared_slots.clear();
+    timestamp_sec = 0;
+    timestamp_nsec = 0;
 }
 
 bool Index::has_changes() const {
-    return !entries.empty();
+    return !empty();
+}
+
+bool Index::is_racy(const IndexStat& stat) const {
+    // no timestamp means we never read an index file, nothing can be racy
+    if (timestamp_sec == 0) {
+        return false;
+    }
+    if (timestamp_sec != stat.mtime_sec) {
+        return timestamp_sec < stat.mtime_sec;
+    }
+    return timestamp_nsec <= stat.mtime_nsec;
+}
+
+std::string CacheTree::sha(size_t oid_size) const {
+    return oid_to_hex(oid, oid_size);
+}
+
+void CacheTree::set(int32_t count, const std::string& sha) {
+    entry_count = count;
+    hex_to_oid(sha, oid);
+}
+
+const CacheTree* CacheTree::find_subtree(std::string_view name) const {
+    auto it = std::lower_bound(subtrees.begin(), subtrees.end(), name,
+                               [](const CacheTree& sub, std::string_view n) { return sub.name < n; });
+    if (it != subtrees.end() && it->name == name) {
+        return &*it;
+    }
+    return nullptr;
+}
+
+CacheTree* CacheTree::find_subtree(std::string_view name) {
+    return const_cast<CacheTree*>(static_cast<const CacheTree*>(this)->find_subtree(name));
+}
+
+CacheTree& CacheTree::subtree(std::string_view name) {
+    auto it = std::lower_bound(subtrees.begin(), subtrees.end(), name,
+                               [](const CacheTree& sub, std::string_view n) { return sub.name < n; });
+    if (it == subtrees.end() || it->name != name) {
+        it = subtrees.insert(it, CacheTree());
+        it->name = std::string(name);
+    }
+    return *it;
+}
+
+void CacheTree::invalidate(std::string_view path) {
+    CacheTree* node = this;
+    while (node) {
+        node->entry_count = -1;
+        size_t slash = path.find('/');
+        if (slash == std::string_view::npos) {
+            break;
+        }
+        node = node->find_subtree(path.substr(0, slash));
+        path.remove_prefix(slash + 1);
+    }
+}
+
+UntrackedCacheDir* UntrackedCacheDir::find_dir(std::string_view name) {
+    auto it = std::lower_bound(dirs.begin(), dirs.end(), name,
+                               [](const UntrackedCacheDir& dir, std::string_view n) { return dir.name < n; });
+    if (it != dirs.end() && it->name == name) {
+        return &*it;
+    }
+    return nullptr;
+}
+
+void UntrackedCache::invalidate(std::string_view path) {
+    UntrackedCacheDir* dir = &root;
+    size_t slash;
+    while (dir && (slash = path.find('/')) != std::string_view::npos) {
+        if (path.size() == slash + 1) {
+            // "dir/": the directory holding it, and all of it
+            dir->valid = false;
+            dir = dir->find_dir(path.substr(0, slash));
+            std::vector<UntrackedCacheDir*> pending;
+            if (dir) {
+                pending.push_back(dir);
+            }
+            while (!pending.empty()) {
+                UntrackedCacheDir* sub = pending.back();
+                pending.pop_back();
+                sub->valid = false;
+                for (auto& child : sub->dirs) {
+                    pending.push_back(&child);
+                }
+            }
+            return;
+        }
+        dir = dir->find_dir(path.substr(0, slash));
+        path.remove_prefix(slash + 1);
+    }
+    if (dir) {
+        dir->valid = false;
+    }
+}
+
+std::string_view IndexEntryRef::path() const {
+    return index->path_at(pos);
+}
+
+IndexStat IndexEntryRef::stat() const {
+    uint32_t slot = index->slots[pos];
+    if (slot & Index::RAW_ENTRY) {
+        return decode_stat(index->raw_at(pos));
+    }
+    return index->stats[slot];
+}
+
+uint32_t IndexEntryRef::mode() const {
+    uint32_t slot = index->slots[pos];
+    if (slot & Index::RAW_ENTRY) {
+        return read_u32(index->raw_at(pos) + 24);
+    }
+    return index->stats[slot].mode;
+}
+
+uint16_t IndexEntryRef::flags() const {
+    uint32_t slot = index->slots[pos];
+    if (slot & Index::RAW_ENTRY) {
+        return read_u16(index->raw_at(pos) + entry_flags_offset(index->oid_size())) & ~FLAG_EXTENDED;
+    }
+    return index->flags[slot];
+}
+
+uint16_t IndexEntryRef::extended_flags() const {
+    uint32_t slot = index->slots[pos];
+    if (slot & Index::RAW_ENTRY) {
+        const char* raw = index->raw_at(pos) + entry_flags_offset(index->oid_size());
+        return (read_u16(raw) & FLAG_EXTENDED) ? read_u16(raw + 2) : 0;
+    }
+    return index->ext_flags[slot];
+}
+
+const unsigned char* IndexEntryRef::oid() const {
+    uint32_t slot = index->slots[pos];
+    if (slot & Index::RAW_ENTRY) {
+        return reinterpret_cast<const unsigned char*>(index->raw_at(pos) + ENTRY_OID_OFFSET);
+    }
+    return index->oids.data() + slot * INDEX_OID_MAX;
+}
+
+std::string IndexEntryRef::sha() const {
+    return oid_to_hex(oid(), index->oid_size());
+}
+
+bool IndexEntryRef::stat_clean(const IndexStat& current) const {
+    IndexStat cached = stat();
+    if (!index_stat_matches(cached, current) || index->is_racy(cached)) {
+        return false;
+    }
+    // an empty file is only clean if its blob is empty too; any other is
+    // the size of a smudged entry
+    return cached.file_size != 0 || (mode() & 0170000) != 0100000 ||
+           sha() == with_object_format(index->object_format(), [](auto algo) {
+               using Algo = decltype(algo);
+               unsigned char empty[Algo::raw_size];
+               static const char header[] = "blob 0";  // with its NUL
+               Algo::hash(header, sizeof(header), empty);
+               return hash_to_hex<Algo>(empty);
+           });
+}
+
+IndexEntry IndexEntryRef::to_entry() const {
+    IndexEntry entry{std::string(path())};
+    entry.stat = stat();
+    entry.sha = sha();
+    entry.flags = flags();
+    entry.extended_flags = extended_flags();
+    return entry;
+}
+
+uint32_t index_mode_from_stat(uint32_t st_mode) {
+    uint32_t type = st_mode & 0170000;
+    if (type == 0120000) {
+        return 0120000;
+    }
+    if (type == 0160000) {
+        return 0160000;
+    }
+    if (st_mode & 0111) {
+        return 0100755;
+    }
+    return 0100644;
+}
+
+bool index_stat(IndexStat& stat, const std::filesystem::path& path) {
+    FileStat st;
+    if (!file_stat(path, st)) {
+        return false;
+    }
+
+    // Git keeps only the low 32 bits of every field
+    stat.ctime_sec = static_cast<uint32_t>(st.ctime_sec);
+    stat.ctime_nsec = st.ctime_nsec;
+    stat.mtime_sec = static_cast<uint32_t>(st.mtime_sec);
+    stat.mtime_nsec = st.mtime_nsec;
+    stat.dev = static_cast<uint32_t>(st.dev);
+    stat.ino = static_cast<uint32_t>(st.ino);
+    stat.mode = index_mode_from_stat(st.mode);
+    stat.uid = st.uid;
+    stat.gid = st.gid;
+    stat.file_size = static_cast<uint32_t>(st.size);
+    return true;
+}
+
+std::string untracked_cache_ident(const std::filesystem::path& worktree) {
+    std::string system = "Windows";
+#ifndef _WIN32
+    struct utsname name;
+    system = uname(&name) == 0 ? name.sysname : "";
+#endif
+    std::string ident = "Location " + worktree.string() + ", system " + system;
+    ident += '\0';
+    return ident;
+}
+
+bool index_stat_matches(const IndexStat& cached, const IndexStat& current) {
+    // a file that turned into a symlink (or back) is always a change, but
+    // a link checked out where links can't be made is a plain file
+    uint32_t cached_type = cached.mode & 0170000;
+    uint32_t current_type = current.mode & 0170000;
+    if (cached_type != current_type && !(cached_type == 0120000 && current_type == 0100000)) {
+        return false;
+    }
+    return cached.mtime_sec == current.mtime_sec &&
+           cached.mtime_nsec == current.mtime_nsec &&
+           cached.ctime_sec == current.ctime_sec &&
+           cached.ctime_nsec == current.ctime_nsec &&
+           cached.ino == current.ino &&
+           cached.dev == current.dev &&
+           cached.uid == current.uid &&
+           cached.gid == current.gid &&
+           cached.file_size == current.file_size;
 }
@@ -1,74 +1,507 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <cstdint>
 #include <optional>
+#include <memory>
 #include <filesystem>
 #include "Repository.hpp"
+#include "Ewah.hpp"
 
+class MappedFile;
+
+// Cached stat data of an index entry. Fields are truncated to their low
+// 32 bits, the same way Git stores them on disk.
+struct IndexStat {
+    uint32_t ctime_sec = 0;
+    uint32_t ctime_nsec = 0;
+    uint32_t mtime_sec = 0;
+    uint32_t mtime_nsec = 0;
+    uint32_t dev = 0;
+    uint32_t ino = 0;
+    uint32_t mode = 0;
+    uint32_t uid = 0;
+    uint32_t gid = 0;
+    uint32_t file_size = 0;
+};
+
+// Room for a binary object id in the index. SHA-256 ids fill it; SHA-1
+// ids take the first 20 bytes and leave the rest zero.
+constexpr size_t INDEX_OID_MAX = SHA256_SIZE;
+
+// Extended flags (index version 3 and later)
+constexpr uint16_t INDEX_SKIP_WORKTREE = 0x4000;  // left out of the worktree
+constexpr uint16_t INDEX_INTENT_TO_ADD = 0x2000;
+
+// Mode of a sparse directory entry: "dir/" standing for the tree of a whole
+// directory outside the sparse checkout
+constexpr uint32_t INDEX_SPARSE_DIR_MODE = 0040000;
+
+// An owning, standalone index entry. This is what callers build to stage a
+// path; the Index itself stores entries in a packed form (see below).
 class IndexEntry {
 public:
     // File metadata
     std::string path;
-    
+
     // Staging area metadata (from .git/index)
-    int ctime_sec;
-    int ctime_nsec;
-    int mtime_sec;
-    int mtime_nsec;
-    int dev;
-    int ino;
-    int mode;
-    int uid;
-    int gid;
-    int file_size;
+    IndexStat stat;
     std::string sha;
-    int flags;
-    
-    IndexEntry() : ctime_sec(0), ctime_nsec(0), mtime_sec(0), mtime_nsec(0),
-                   dev(0), ino(0), mode(0), uid(0), gid(0), file_size(0), flags(0) {}
-    
-    IndexEntry(const std::string& p) : path(p), ctime_sec(0), ctime_nsec(0), 
-                                        mtime_sec(0), mtime_nsec(0), dev(0), ino(0), 
-                                        mode(0), uid(0), gid(0), file_size(0), flags(0) {}
+    uint16_t flags = 0;
+    uint16_t extended_flags = 0;       // index version 3 and later
+
+    IndexEntry() = default;
+    IndexEntry(const std::string& p) : path(p) {}
+};
+
+class Index;
+
+/*
+ * Cached tree object ids for the directories of the index, stored in the
+ * TREE extension the same way Git does. Each node covers the entries under
+ * one directory; it is valid when entry_count >= 0, in which case `oid` is
+ * the tree those entries hash to. Changing an entry invalidates the nodes
+ * along its path, so a commit only has to rewrite the trees that changed.
+ */
+struct CacheTree {
+    std::string name;                  // directory name, empty for the root
+    int32_t entry_count = -1;          // index entries covered, -1 if invalid
+    unsigned char oid[INDEX_OID_MAX] = {};
+    std::vector<CacheTree> subtrees;   // sorted by name
+
+    bool valid() const { return entry_count >= 0; }
+    std::string sha(size_t oid_size) const;
+    void set(int32_t count, const std::string& sha);
+
+    // Subtree called `name`, or nullptr / a new invalid one if missing
+    CacheTree* find_subtree(std::string_view name);
+    const CacheTree* find_subtree(std::string_view name) const;
+    CacheTree& subtree(std::string_view name);
+
+    // Invalidate this node and the subtrees along `path`, which is relative
+    // to this node's directory
+    void invalidate(std::string_view path);
+};
+
+/*
+ * Untracked files of the worktree as last seen, per directory, stored in
+ * the UNTR extension in Git's format. A directory's list can be reused as
+ * long as its stat data is unchanged (creating or removing a file touches
+ * the directory's mtime) and no entry inside it was staged or unstaged
+ * since, which invalidates it. Status then only has to lstat directories.
+ */
+struct UntrackedCacheDir {
+    std::string name;                       // empty for the root
+    bool valid = false;                     // `untracked` matches `stat`
+    bool check_only = false;                // kept for Git, unused here
+    IndexStat stat;                         // no mode, Git doesn't store it
+    unsigned char exclude_oid[INDEX_OID_MAX] = {};  // of its .gitignore
+    std::vector<std::string> untracked;     // untracked files directly inside
+    std::vector<UntrackedCacheDir> dirs;    // sorted by name
+
+    UntrackedCacheDir* find_dir(std::string_view name);
+};
+
+struct UntrackedCache {
+    // NUL-terminated strings naming where the cache can be used (worktree
+    // location and system), so a moved worktree doesn't trust it
+    std::string ident;
+
+    // Global exclude files the lists were made with ($GIT_DIR/info/exclude,
+    // core.excludesFile) and the per-directory exclude file name
+    IndexStat info_exclude_stat;
+    unsigned char info_exclude_oid[INDEX_OID_MAX] = {};
+    IndexStat excludes_file_stat;
+    unsigned char excludes_file_oid[INDEX_OID_MAX] = {};
+    std::string exclude_per_dir = ".gitignore";
+
+    // How the lists were collected; Git's flags, 0 meaning every untracked
+    // file is listed and every directory is recursed into
+    uint32_t dir_flags = 0;
+
+    UntrackedCacheDir root;
+
+    // Invalidate the directory holding `path` (a staged path changed, so
+    // it may have become tracked or untracked), and if `path` ends in '/',
+    // that directory and everything below it too
+    void invalidate(std::string_view path);
+};
+
+// Lightweight view of the entry at one position of an Index. It doesn't
+// own anything and is invalidated by any modification of the index.
+class IndexEntryRef {
+public:
+    IndexEntryRef(const Index* index, size_t pos) : index(index), pos(pos) {}
+
+    std::string_view path() const;
+    IndexStat stat() const;
+    uint32_t mode() const;
+    uint16_t flags() const;
+    uint16_t extended_flags() const;
+
+    // Binary object id (the index's oid_size() bytes) and its hex form
+    const unsigned char* oid() const;
+    std::string sha() const;
+
+    // Copy the entry out into an owning IndexEntry
+    IndexEntry to_entry() const;
+
+    // True if the file, freshly stat'ed as `current`, can be taken as
+    // unchanged without reading it: the stat data matches, isn't racy, and
+    // wasn't smudged (a cached size of 0 for a non-empty blob, which is how
+    // a racily clean entry is written)
+    bool stat_clean(const IndexStat& current) const;
+
+    size_t position() const { return pos; }
+
+    // A directory outside the sparse checkout, folded into one entry
+    bool sparse_dir() const { return (mode() & 0170000) == INDEX_SPARSE_DIR_MODE; }
+    bool skip_worktree() const { return extended_flags() & INDEX_SKIP_WORKTREE; }
+
+private:
+    const Index* index;
+    size_t pos;
 };
 
+/*
+ * The index keeps its entries sorted by path in a struct-of-arrays layout:
+ * stat data, binary object ids and flags live in their own contiguous
+ * arrays, and every path is packed into a single string pool that entries
+ * reference by offset. A full scan touches only the arrays it needs and an
+ * entry costs no heap allocation of its own.
+ *
+ * An index read from disk is memory-mapped and only scanned for entry
+ * offsets. Entries loaded that way stay in the mapping: their path and id
+ * are read in place and stat data is decoded when asked for. Only entries
+ * added or changed afterwards get a slot in the arrays above, and writing
+ * copies the untouched entries straight from the mapping.
+ *
+ * Versions 2 to 4 of the file format are read. Writing keeps the version
+ * that was read unless index.version says otherwise; version 4 stores each
+ * path relative to the previous one and leaves entries unpadded, so its
+ * paths are spelled out into the pool when read.
+ *
+ * Large indexes are written with an entry offset table (the IEOT and EOIE
+ * extensions, as Git does), so reading can split the scan across threads
+ * (index.threads).
+ *
+ * With core.splitIndex, the index is split like Git's: most entries live in
+ * a shared index (.git/sharedindex.<sha>) that is rarely rewritten, and
+ * .git/index only records the entries deleted, replaced or added since. A
+ * new shared index is written once that delta grows past
+ * splitIndex.maxPercentChange percent (20 by default) of it.
+ *
+ * A sparse index (see Sparse.hpp) holds sparse directory entries for whole
+ * directories outside the sparse checkout; it's marked by the sdir
+ * extension, so a reader that doesn't know about them refuses it.
+ *
+ * Object ids, the trailing checksum and the ids in extensions take the
+ * repository's object format, as in Git: an index read from or locked for
+ * a SHA-256 repository has 32-byte ids and a SHA-256 checksum. Parsing and
+ * writing entries are templates over the format's descriptor (Hash.hpp).
+ */
 class Index {
 public:
     Index() = default;
     explicit Index(const Repository& repo);
-    
-    // Load index from file
+
+    // Load index from file. The trailing checksum isn't verified here,
+    // call verify_checksum() when that matters.
     bool read(const Repository& repo);
-    
-    // Write index to file
+
+    // Check the trailing hash of the index file that was read (the shared
+    // index, for a split index, whose own small file is checked on read).
+    // An index that wasn't read from disk has nothing to verify and passes.
+    bool verify_checksum() const;
+
+    // Take index.lock (waiting up to `timeout_ms` for another writer)
+    // before read(), so nothing can change the index between the read and
+    // write(), which replaces the index with the lockfile. The lock is
+    // released by write() or unlock(), or when the Index goes away. False
+    // if another writer holds it all that time.
+    bool lock(const Repository& repo, long timeout_ms = INDEX_LOCK_TIMEOUT_MS);
+
+    // Release index.lock without writing, leaving the index as it was
+    void unlock();
+
+    // Write index to file, through the lock taken by lock() if there is one
     bool write(const Repository& repo) const;
-    
-    // Add entry to index
+
+    // Add entry to index, replacing any entry with the same path.
+    // Entries are kept sorted, so this is a binary search plus an insert.
     void add_entry(const IndexEntry& entry);
-    
+
+    // Add many entries at once. The batch is sorted once and merged into
+    // the existing entries; when a path repeats, the last one wins.
+    void add_entries(std::vector<IndexEntry> batch);
+
     // Remove entry from index
     bool remove_entry(const std::string& path);
-    
-    // Get entry by path
+
+    // Remove the entries at positions [first, last) of each range, in one
+    // pass. The ranges must be sorted and not overlap.
+    void remove_ranges(const std::vector<std::pair<size_t, size_t>>& ranges);
+
+    // Get entry by path (copied out)
     std::optional<IndexEntry> get_entry(const std::string& path) const;
-    
-    // Get all entries
-    const std::vector<IndexEntry>& get_entries() const;
-    
+
+    // Position of the entry for `path`, if it is staged
+    std::optional<size_t> find(std::string_view path) const;
+
+    // Positions [first, last) of the entries inside directory `dir`
+    // (given without a trailing slash; empty means everything)
+    std::pair<size_t, size_t> directory_range(std::string_view dir) const;
+
+    // Replace the cached stat data of the entry at `pos`
+    void set_stat(size_t pos, const IndexStat& stat);
+
+    // Entry access and iteration, in index order
+    size_t size() const { return paths.size(); }
+    bool empty() const { return paths.empty(); }
+    IndexEntryRef operator[](size_t pos) const { return IndexEntryRef(this, pos); }
+
+    class const_iterator {
+    public:
+        const_iterator(const Index* index, size_t pos) : index(index), pos(pos) {}
+        IndexEntryRef operator*() const { return IndexEntryRef(index, pos); }
+        const_iterator& operator++() { ++pos; return *this; }
+        bool operator==(const const_iterator& other) const { return pos == other.pos; }
+        bool operator!=(const const_iterator& other) const { return pos != other.pos; }
+    private:
+        const Index* index;
+        size_t pos;
+    };
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size()); }
+
     // Clear all entries
     void clear();
-    
+
     // Check if index has changes
     bool has_changes() const;
-    
+
+    // The cache tree (TREE extension), rooted at the top of the worktree
+    CacheTree& cache_tree() { return tree_root; }
+    const CacheTree& cache_tree() const { return tree_root; }
+
+    // The untracked cache (UNTR extension), if the index has one
+    std::optional<UntrackedCache>& untracked_cache() { return untracked; }
+    const std::optional<UntrackedCache>& untracked_cache() const { return untracked; }
+
+    // Filesystem monitor state (FSMN extension): the token the monitor gave
+    // at the last query, and which entries were seen unchanged as of then.
+    // Without a token nothing is known and every entry has to be checked.
+    const std::string& fsmonitor_token() const { return fsmonitor_last; }
+    void set_fsmonitor_token(const std::string& token);
+    bool fsmonitor_valid(size_t pos) const { return pos < fsmonitor_bits.size() && fsmonitor_bits[pos]; }
+    void set_fsmonitor_valid(size_t pos, bool valid = true);
+
+    // The monitor reported `path` changed: the entry for it, or every entry
+    // under it if it ends in '/'. Without a path, every entry.
+    void invalidate_fsmonitor(std::string_view path);
+    void invalidate_fsmonitor();
+
+    // Object format of the ids, the repository's once the index was read
+    // or locked (SHA-1 before that), and the size of a binary id
+    ObjectFormat object_format() const { return format; }
+    size_t oid_size() const { return object_format_raw_size(format); }
+
+    // File format version the index was read with (0 if it wasn't read)
+    uint32_t version() const { return format_version; }
+    void set_version(uint32_t version) { format_version = version; }
+
+    // True if the entry was modified too close to the index write for its
+    // stat data to be trusted, in which case the content must be hashed.
+    bool is_racy(const IndexStat& stat) const;
+
     // Get index file path
     static std::filesystem::path get_index_path(const Repository& repo);
-    
+
 private:
-    std::vector<IndexEntry> entries;
-    
-    // Helper functions for reading/writing
-    std::string serialize_entry(const IndexEntry& entry) const;
-    std::optional<std::pair<IndexEntry, size_t>> deserialize_entry(const std::string& data, size_t offset) const;
+    friend class IndexEntryRef;
+
+    // Where an entry's path lives: in path_pool, or in the mapped index
+    // file when PATH_IN_MAP is set on the offset
+    struct PathRef {
+        uint32_t offset;
+        uint32_t length;
+    };
+    static constexpr uint32_t PATH_IN_MAP = 0x80000000u;
+
+    // Per entry, in index order: its path, and where the rest of it lives.
+    // A slot with RAW_ENTRY set is the offset of the on-disk entry in the
+    // mapped file; otherwise it indexes stats/oids/flags.
+    std::vector<PathRef> paths;
+    std::vector<uint32_t> slots;
+    static constexpr uint32_t RAW_ENTRY = 0x80000000u;
+
+    // Entries added or changed since the index was read
+    std::vector<IndexStat> stats;
+    std::vector<unsigned char> oids;   // INDEX_OID_MAX bytes per slot
+    std::vector<uint16_t> flags;
+    std::vector<uint16_t> ext_flags;
+    size_t dead_slots = 0;             // slots no entry refers to anymore
+
+    std::string path_pool;
+    size_t pool_garbage = 0;           // bytes of path_pool no entry refers to
+
+    // The index file the raw entries point into
+    std::shared_ptr<const MappedFile> map;
+    uint32_t format_version = 0;
+    ObjectFormat format = ObjectFormat::Sha1;
+    std::shared_ptr<LockFile> held_lock;   // index.lock, from lock() until write() or unlock()
+
+    CacheTree tree_root;
+    std::optional<UntrackedCache> untracked;
+
+    // Entries known unchanged since the monitor's token, by position (empty
+    // without a token). The bitmap of changed ones is kept as read until
+    // the entries are all in place.
+    std::string fsmonitor_last;
+    std::vector<bool> fsmonitor_bits;
+    EwahBitmap fsmonitor_dirty;
+
+    // Split index: the shared index the entries were loaded from, named by
+    // its checksum, and its entries as loaded, to write the next delta
+    // against
+    std::string shared_sha;
+    std::vector<PathRef> shared_paths;
+    std::vector<uint32_t> shared_slots;
+
+    // Contents of the link extension of a split index
+    struct SplitLink {
+        std::string shared_sha;
+        EwahBitmap deleted;
+        EwahBitmap replaced;
+    };
+
+    // mtime of the index file when it was read, used for racy-git checks
+    uint32_t timestamp_sec = 0;
+    uint32_t timestamp_nsec = 0;
+
+    // Entries modified at or after this time are written smudged
+    struct RacyTime {
+        uint32_t sec = 0;
+        uint32_t nsec = 0;
+    };
+
+    std::string_view path_at(size_t pos) const;
+    std::string_view path_view(const PathRef& ref) const;
+    const char* raw_at(size_t pos) const;
+
+    // Lower bound of `path` in the sorted entries
+    size_t lower_bound(std::string_view path) const;
+
+    // Append a path to the pool and return its reference
+    PathRef intern_path(std::string_view path);
+
+    // Store an entry's data in a fresh slot and return it
+    uint32_t new_slot(const IndexEntry& entry);
+
+    // Make sure the entry at `pos` has a slot of its own (decoding it from
+    // the mapping if needed) and return that slot
+    uint32_t own_slot(size_t pos);
+
+    // Drop dead slots and dead pooled paths once they outweigh live ones
+    void maybe_compact();
+
+    // Scan the entries of a mapped index, recording their offsets and
+    // setting `entries_end` past the last one. With more than one thread
+    // and an entry offset table (IEOT) in the file, its blocks are scanned
+    // in parallel and concatenated.
+    bool scan_entries(uint32_t num_entries, unsigned int threads, size_t& entries_end, bool& sorted);
+
+    // Load the extensions between `offset` and the trailing checksum. The
+    // link extension of a split index is returned in `link`.
+    bool read_extensions(size_t offset, std::optional<SplitLink>& link);
+
+    // Map an index file and load its entries and extensions, without
+    // sorting them; `sorted` tells whether they were in order
+    bool load_file(const std::filesystem::path& path, unsigned int threads, bool& sorted,
+                   std::optional<SplitLink>& link);
+
+    // The entries loaded are a split index: load its shared index and
+    // apply them to it
+    bool load_shared(const Repository& repo, const SplitLink& link, unsigned int threads);
+
+    // A complete index file with all entries, as written when the index
+    // isn't split (and for shared indexes, without extensions)
+    template <typename Algo>
+    std::string serialize_full(uint32_t version, unsigned int threads, bool with_extensions,
+                               const RacyTime& racy_since) const;
+
+    // The split index (replaced and added entries, and the link to the
+    // shared index `link_sha`)
+    template <typename Algo>
+    std::string serialize_split(uint32_t version, const std::vector<size_t>& replacements,
+                                const std::vector<size_t>& added, const std::string& link_sha,
+                                const EwahBitmap& deleted, const EwahBitmap& replaced,
+                                const RacyTime& racy_since) const;
+
+    // Append the extensions describing the whole index (cache tree,
+    // untracked cache), recording where each header starts
+    void append_index_extensions(std::string& content, std::vector<size_t>& ext_headers, size_t oid_size) const;
+
+    // True if the entry at `pos` has the same object and mode as `slot`
+    bool same_object(size_t pos, uint32_t slot) const;
+
+    // Entries found by scanning one block of the file. Paths that can't
+    // be referenced in the mapping are spelled out in `pool`.
+    struct BlockScan {
+        std::vector<PathRef> paths;
+        std::vector<uint32_t> slots;
+        std::string pool;
+        size_t end = 0;          // offset past the last entry
+        bool sorted = true;
+        bool ok = false;
+    };
+
+    // Scan `count` entries starting at `offset`. Entries of an index too
+    // large to reference in place are decoded into slots, which is only
+    // safe from a single thread.
+    template <typename Algo>
+    bool scan_block(size_t offset, uint32_t count, BlockScan& out);
+
+    // Blocks (offset, entry count) of the IEOT extension, located through
+    // the EOIE extension. Empty when the file has no valid table.
+    template <typename Algo>
+    std::vector<std::pair<uint32_t, uint32_t>> read_entry_offset_table() const;
+
+    // Sort the entries by path, for index files not written in Git order
+    void sort_entries();
+
+    // Helper functions for writing. An entry modified at or after
+    // `racy_since` is written with a size of 0.
+    template <typename Algo>
+    void serialize_entry(std::string& out, size_t pos, std::string_view path, uint32_t version,
+                         std::string_view& prev_path, const RacyTime& racy_since,
+                         bool block_start = false) const;
 };
+
+// Normalize a raw st_mode (or a tree leaf mode) to one of the modes Git
+// records in the index: 0100644, 0100755, 0120000 or 0160000.
+uint32_t index_mode_from_stat(uint32_t st_mode);
+
+// Fill cached stat data (ctime, mtime, dev, ino, mode, uid, gid, size)
+// from the file at `path`, without following symlinks. Timestamps keep
+// their nanoseconds (statx on Linux) and the mode is normalized with
+// index_mode_from_stat. Used by add, checkout and status, so the stat
+// data they record and compare always agree.
+bool index_stat(IndexStat& stat, const std::filesystem::path& path);
+
+// Ident an untracked cache written for this worktree carries, the same
+// string Git uses ("Location <worktree>, system <OS>"), so either can use
+// the other's cache
+std::string untracked_cache_ident(const std::filesystem::path& worktree);
+
+// 40- or 64-char hex -> INDEX_OID_MAX raw bytes, zero past the id
+// (anything malformed becomes the null id), and `size` raw bytes back
+void hex_to_oid(const std::string& hex, unsigned char* out);
+std::string oid_to_hex(const unsigned char* oid, size_t size);
+
+// Compare cached stat data with a freshly taken one. Returns true when the
+// file looks unchanged without reading it. A symlink entry matches the
+// plain file a checkout writes where links can't be made.
+bool index_stat_matches(const IndexStat& cached, const IndexStat& current);
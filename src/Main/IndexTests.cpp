@@ -0,0 +1,1391 @@
+/*
+ * IndexTests.cpp
+ * ---------------------------------------------------------------------------
+ * Test cases for the staging area (.git/index) in Silt:
+ *   - Index::add_entry / add_entries ordering and replacement
+ *   - Index::remove_entry / find lookups and path pool compaction
+ *   - Index::write / Index::read round trip
+ *   - Lazily decoded entries of a mapped index, and checksum verification
+ *   - IEOT/EOIE extensions and multi-threaded reads
+ *   - Index format version 4 (prefix-compressed paths) and extended flags,
+ *     also as Git writes it in blocks
+ *   - Cache tree (TREE extension) storage and invalidation
+ *   - EWAH bitmaps and the split index (link extension)
+ *   - Untracked cache (UNTR extension) storage and invalidation
+ *   - Filesystem monitor state (FSMN extension) storage and invalidation
+ *   - Skip-worktree and sparse directory entries (sdir extension)
+ *   - SHA-1 of checksums and object ids on every engine the CPU has
+ *   - SHA-256 repositories (extensions.objectFormat)
+ *   - Bulk checkin into a pack, and reading packed objects
+ *   - Lockfiles, staged writes and the core.fsync policy
+ *   - Many threads and processes writing objects and the index at once
+ *
+ * Build and run with `make -f MakeTest run`.
+ */
+
+#include <iostream>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include "Index.hpp"
+#include "Ewah.hpp"
+#include "Repository.hpp"
+#include "Sha1.hpp"
+#include "Objects.hpp"
+#include "Pack.hpp"
+#include "Durable.hpp"
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define NULL_DEVICE "/dev/null"
+#else
+#define NULL_DEVICE "NUL"
+#endif
+
+// Helper to build an entry with a recognizable sha and size
+IndexEntry make_entry(const std::string& path, char sha_digit = 'a', uint32_t size = 1) {
+    IndexEntry entry(path);
+    entry.stat.mode = 0100644;
+    entry.sha = std::string(40, sha_digit);
+    entry.stat.file_size = size;
+    entry.flags = static_cast<uint16_t>(path.size());
+    return entry;
+}
+
+// Helper to create an empty repository in a fresh temp directory
+Repository make_temp_repo(const std::string& name) {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / name;
+    std::filesystem::remove_all(dir);
+    return repo_create(dir);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: add_entry keeps Git order
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Entries added out of order are stored sorted by path, and adding an
+ *   existing path replaces the entry instead of duplicating it.
+ */
+void test_add_entry_sorted_and_replaced() {
+    std::cout << "Test: add_entry keeps Git order... ";
+
+    Index index;
+    index.add_entry(make_entry("src/b.cpp"));
+    index.add_entry(make_entry("README.md"));
+    index.add_entry(make_entry("src/a.cpp"));
+    index.add_entry(make_entry("src/b.cpp", 'b', 7));
+
+    assert(index.size() == 3);
+    assert(index[0].path() == "README.md");
+    assert(index[1].path() == "src/a.cpp");
+    assert(index[2].path() == "src/b.cpp");
+    assert(index[2].sha() == std::string(40, 'b'));
+    assert(index[2].stat().file_size == 7);
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: add_entries bulk merge
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   A batch is merged into existing entries in one pass. Repeated paths in
+ *   the batch keep the last entry, and batch entries replace staged ones.
+ */
+void test_add_entries_bulk_merge() {
+    std::cout << "Test: add_entries bulk merge... ";
+
+    Index index;
+    index.add_entry(make_entry("b.txt", 'a'));
+    index.add_entry(make_entry("d.txt", 'a'));
+
+    std::vector<IndexEntry> batch = {
+        make_entry("e.txt", 'a'),
+        make_entry("b.txt", 'b'),
+        make_entry("a.txt", 'a'),
+        make_entry("e.txt", 'c'),
+    };
+    index.add_entries(batch);
+
+    assert(index.size() == 4);
+    assert(index[0].path() == "a.txt");
+    assert(index[1].path() == "b.txt" && index[1].sha() == std::string(40, 'b'));
+    assert(index[2].path() == "d.txt" && index[2].sha() == std::string(40, 'a'));
+    assert(index[3].path() == "e.txt" && index[3].sha() == std::string(40, 'c'));
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: find / remove_entry
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Lookups find staged paths only (no prefix matches), and removal drops
+ *   exactly the requested path.
+ */
+void test_find_and_remove_entry() {
+    std::cout << "Test: find / remove_entry... ";
+
+    Index index;
+    index.add_entries({make_entry("dir/file"), make_entry("dir"), make_entry("dir-x")});
+
+    assert(index.find("dir").has_value());
+    assert(index.find("dir/file").has_value());
+    assert(!index.find("dir/").has_value());
+    assert(!index.get_entry("missing").has_value());
+
+    assert(index.remove_entry("dir"));
+    assert(!index.remove_entry("dir"));
+    assert(!index.find("dir").has_value());
+    assert(index.find("dir/file").has_value());
+    assert(index.size() == 2);
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: path pool survives removals
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Removing most entries triggers a compaction of the path pool; the
+ *   remaining entries must keep their paths and ids.
+ */
+void test_path_pool_compaction() {
+    std::cout << "Test: path pool survives removals... ";
+
+    Index index;
+    std::vector<IndexEntry> batch;
+    for (int i = 0; i < 100; i++) {
+        batch.push_back(make_entry("dir/file" + std::to_string(1000 + i), static_cast<char>('0' + i % 10)));
+    }
+    index.add_entries(batch);
+    for (int i = 0; i < 100; i++) {
+        if (i % 10 != 3) {
+            assert(index.remove_entry("dir/file" + std::to_string(1000 + i)));
+        }
+    }
+
+    assert(index.size() == 10);
+    for (size_t pos = 0; pos < index.size(); pos++) {
+        assert(index[pos].path() == "dir/file" + std::to_string(1003 + 10 * pos));
+        assert(index[pos].sha() == std::string(40, '3'));
+    }
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: write / read round trip
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Entries written to .git/index are read back with identical fields,
+ *   including stat values above 2^31.
+ */
+void test_write_read_round_trip() {
+    std::cout << "Test: write / read round trip... ";
+
+    Repository repo = make_temp_repo("silt_index_roundtrip");
+
+    Index index;
+    IndexEntry big = make_entry("big.bin", 'f', 0xFFFFFFF0u);
+    // (a modification time after the write would make it racily clean)
+    big.stat.ctime_sec = 0x80000001u;
+    big.stat.mtime_nsec = 999999999u;
+    big.stat.ino = 0xDEADBEEFu;
+    index.add_entries({make_entry("a/b/c.txt", '1', 3), big});
+    assert(index.write(repo));
+
+    Index loaded(repo);
+    assert(loaded.size() == 2);
+    assert(loaded[0].path() == "a/b/c.txt");
+    assert(loaded[0].sha() == std::string(40, '1'));
+    assert(loaded[0].stat().file_size == 3);
+    assert(loaded[1].path() == "big.bin");
+    assert(loaded[1].stat().file_size == 0xFFFFFFF0u);
+    assert(loaded[1].stat().ctime_sec == 0x80000001u);
+    assert(loaded[1].stat().mtime_nsec == 999999999u);
+    assert(loaded[1].stat().ino == 0xDEADBEEFu);
+    assert(loaded[1].mode() == 0100644);
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: racily clean entries are smudged
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   An entry whose file was modified at or after the index write is
+ *   written with a size of 0, both from memory and copied from a mapped
+ *   index, so its stat data never passes for clean. An empty file only
+ *   passes with the empty blob.
+ */
+void test_racy_entries_smudged() {
+    std::cout << "Test: racily clean entries are smudged... ";
+
+    Repository repo = make_temp_repo("silt_index_racy");
+
+    Index index;
+    IndexEntry racy = make_entry("racy.txt", '1', 5);
+    racy.stat.mtime_sec = static_cast<uint32_t>(std::time(nullptr) + 3600);
+    IndexEntry settled = make_entry("settled.txt", '2', 5);
+    settled.stat.mtime_sec = 1000;
+    IndexEntry empty = make_entry("empty.txt", '3', 0);
+    empty.stat.mtime_sec = 1000;
+    IndexEntry empty_blob = make_entry("empty_blob.txt", '3', 0);
+    empty_blob.sha = "e69de29bb2d1d6434b8b29ae775ad8c2e48c5391";
+    empty_blob.stat.mtime_sec = 1000;
+    index.add_entries({racy, settled, empty, empty_blob});
+    assert(index.write(repo));
+
+    for (int pass = 0; pass < 2; pass++) {
+        Index loaded(repo);
+        assert(loaded[*loaded.find("racy.txt")].stat().file_size == 0);
+        assert(!loaded[*loaded.find("racy.txt")].stat_clean(racy.stat));
+        assert(loaded[*loaded.find("settled.txt")].stat_clean(settled.stat));
+        assert(!loaded[*loaded.find("empty.txt")].stat_clean(empty.stat));
+        assert(loaded[*loaded.find("empty_blob.txt")].stat_clean(empty_blob.stat));
+
+        // written again from the mapping
+        assert(loaded.write(repo));
+    }
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: stat data capture
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   index_stat records every field Git does, at full precision: the
+ *   nanoseconds of both timestamps, device and inode (their low 32 bits),
+ *   uid, gid and size, with the mode normalized. Symlinks aren't followed.
+ */
+void test_index_stat_capture() {
+    std::cout << "Test: stat data capture... ";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_index_stat";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::filesystem::path file = dir / "run.sh";
+    std::ofstream(file) << "#!/bin/sh\n";
+    std::filesystem::permissions(file, std::filesystem::perms::owner_exec, std::filesystem::perm_options::add);
+
+    IndexStat stat;
+    assert(index_stat(stat, file));
+    assert(stat.mode == 0100755 && stat.file_size == 10);
+#ifndef _WIN32
+    // a timestamp with nanoseconds, checked against lstat
+    struct timespec times[2] = {{1700000000, 123456789}, {1700000000, 987654321}};
+    assert(utimensat(AT_FDCWD, file.c_str(), times, 0) == 0);
+    assert(index_stat(stat, file));
+    struct stat st;
+    assert(lstat(file.c_str(), &st) == 0);
+    assert(stat.mtime_sec == 1700000000u && stat.mtime_nsec == 987654321u);
+    assert(stat.ctime_sec == static_cast<uint32_t>(st.st_ctim.tv_sec));
+    assert(stat.ctime_nsec == static_cast<uint32_t>(st.st_ctim.tv_nsec));
+    assert(stat.dev == static_cast<uint32_t>(st.st_dev) && stat.ino == static_cast<uint32_t>(st.st_ino));
+    assert(stat.uid == st.st_uid && stat.gid == st.st_gid);
+
+    std::filesystem::create_symlink("run.sh", dir / "link");
+    assert(index_stat(stat, dir / "link"));
+    assert(lstat((dir / "link").c_str(), &st) == 0);
+    assert(stat.mode == 0120000 && stat.file_size == 6 && stat.ino == static_cast<uint32_t>(st.st_ino));
+
+    // a link entry over the plain file written in its place still matches,
+    // a file entry over a link doesn't
+    IndexStat cached;
+    assert(index_stat(cached, file));
+    IndexStat plain = cached;
+    cached.mode = 0120000;
+    assert(index_stat_matches(cached, plain));
+    cached = stat;
+    cached.mode = 0100644;
+    assert(!index_stat_matches(cached, stat));
+#endif
+
+    std::filesystem::remove_all(dir);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: mapped entries survive edits
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   A loaded index keeps untouched entries in the mapping. Editing some of
+ *   them, adding and removing others, then writing and reading again must
+ *   give the same result as building the index from scratch, and the
+ *   written file must pass verify_checksum() while a corrupted one fails.
+ */
+void test_mapped_entries_edit_and_checksum() {
+    std::cout << "Test: mapped entries survive edits... ";
+
+    Repository repo = make_temp_repo("silt_index_mapped");
+
+    Index index;
+    index.add_entries({make_entry("a.txt", '1', 1), make_entry("dir/b.txt", '2', 2),
+                       make_entry("dir/c.txt", '3', 3), make_entry("z.txt", '4', 4)});
+    assert(index.write(repo));
+
+    Index loaded(repo);
+    assert(loaded.verify_checksum());
+    auto range = loaded.directory_range("dir");
+    assert(range.first == 1 && range.second == 3);
+
+    IndexStat st = loaded[1].stat();
+    st.mtime_sec = 42;
+    loaded.set_stat(1, st);
+    loaded.add_entry(make_entry("dir/c.txt", '5', 5));
+    loaded.add_entry(make_entry("m.txt", '6', 6));
+    assert(loaded.remove_entry("z.txt"));
+    assert(loaded.write(repo));
+
+    Index reloaded(repo);
+    assert(reloaded.verify_checksum());
+    assert(reloaded.size() == 4);
+    assert(reloaded[0].path() == "a.txt" && reloaded[0].sha() == std::string(40, '1'));
+    assert(reloaded[1].path() == "dir/b.txt" && reloaded[1].stat().mtime_sec == 42);
+    assert(reloaded[1].stat().file_size == 2);
+    assert(reloaded[2].path() == "dir/c.txt" && reloaded[2].sha() == std::string(40, '5'));
+    assert(reloaded[3].path() == "m.txt" && reloaded[3].stat().file_size == 6);
+
+    // Flip a byte of the first entry: still readable, but the checksum fails
+    std::filesystem::path index_path = Index::get_index_path(repo);
+    {
+        std::fstream file(index_path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(12 + 8);
+        file.put('\x7f');
+    }
+    Index corrupt(repo);
+    assert(corrupt.size() == 4);
+    assert(!corrupt.verify_checksum());
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: entry offset table and threaded read
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   With index.threads set, a large index is written with the IEOT and
+ *   EOIE extensions, and reading it back in parallel blocks gives the
+ *   entries in the same order as a single-threaded read. A table that
+ *   doesn't match the entries falls back to that read.
+ */
+void test_entry_offset_table_threaded_read() {
+    std::cout << "Test: entry offset table and threaded read... ";
+
+    Repository repo = make_temp_repo("silt_index_ieot");
+    {
+        std::ofstream config(repo.gitdir / "config", std::ios::app);
+        config << "[index]\n\tthreads = 4\n";
+    }
+
+    std::vector<IndexEntry> batch;
+    for (int i = 0; i < 35000; i++) {
+        batch.push_back(make_entry("dir" + std::to_string(i % 7) + "/file" + std::to_string(i) + ".txt",
+                                   "0123456789"[i % 10], static_cast<uint32_t>(i)));
+    }
+    Index index;
+    index.add_entries(batch);
+    assert(index.write(repo));
+
+    std::ifstream file(Index::get_index_path(repo), std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    assert(content.find("IEOT") != std::string::npos);
+    assert(content.compare(content.size() - 20 - 32, 4, "EOIE") == 0);
+
+    Index loaded(repo);
+    assert(loaded.verify_checksum());
+    assert(loaded.size() == index.size());
+    for (size_t i = 0; i < index.size(); i++) {
+        assert(loaded[i].path() == index[i].path());
+        assert(loaded[i].stat().file_size == index[i].stat().file_size);
+    }
+    loaded = Index();
+
+    // A table pointing into the middle of an entry only costs the
+    // parallel read: the entries are read again in one pass
+    size_t second_block = content.find("IEOT") + 8 + 4 + 8;
+    content[second_block + 3] = static_cast<char>(content[second_block + 3] + 8);
+    {
+        std::ofstream out(Index::get_index_path(repo), std::ios::binary | std::ios::trunc);
+        out << content;
+    }
+    Index rescanned(repo);
+    assert(rescanned.size() == index.size());
+    for (size_t i = 0; i < index.size(); i++) {
+        assert(rescanned[i].path() == index[i].path());
+    }
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: index version 4 round trip
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Writing version 4 prefix-compresses paths, making an index of deep
+ *   paths smaller than version 2. Reading it back (also in parallel
+ *   blocks, whose first path isn't compressed) gives the same entries, and
+ *   extended flags survive.
+ */
+void test_version_4_round_trip() {
+    std::cout << "Test: index version 4 round trip... ";
+
+    Repository repo = make_temp_repo("silt_index_v4");
+    {
+        std::ofstream config(repo.gitdir / "config", std::ios::app);
+        config << "[index]\n\tthreads = 3\n";
+    }
+
+    std::vector<IndexEntry> batch;
+    for (int i = 0; i < 25000; i++) {
+        batch.push_back(make_entry("src/components/module" + std::to_string(i / 100) + "/source" +
+                                   std::to_string(i) + ".cpp", "0123456789"[i % 10], static_cast<uint32_t>(i)));
+    }
+    batch[1234].extended_flags = 0x2000;
+
+    Index index;
+    index.add_entries(batch);
+    assert(index.write(repo));
+    auto v2_size = std::filesystem::file_size(Index::get_index_path(repo));
+
+    index.set_version(4);
+    assert(index.write(repo));
+    auto v4_size = std::filesystem::file_size(Index::get_index_path(repo));
+    assert(v4_size < v2_size * 3 / 4);
+
+    Index loaded(repo);
+    assert(loaded.version() == 4);
+    assert(loaded.verify_checksum());
+    assert(loaded.size() == index.size());
+    for (size_t i = 0; i < index.size(); i++) {
+        assert(loaded[i].path() == index[i].path());
+        assert(loaded[i].sha() == index[i].sha());
+        assert(loaded[i].extended_flags() == index[i].extended_flags());
+    }
+    assert(loaded[*loaded.find(batch[1234].path)].extended_flags() == 0x2000);
+
+    // Rewriting the loaded index gives back the same file
+    std::ifstream before_file(Index::get_index_path(repo), std::ios::binary);
+    std::string before((std::istreambuf_iterator<char>(before_file)), std::istreambuf_iterator<char>());
+    before_file.close();
+    assert(loaded.write(repo));
+    std::ifstream after_file(Index::get_index_path(repo), std::ios::binary);
+    std::string after((std::istreambuf_iterator<char>(after_file)), std::istreambuf_iterator<char>());
+    assert(before == after);
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: version 4 index written by Git in blocks
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Git starts each IEOT block of a version 4 index by stripping the whole
+ *   previous path. Such an index (made by git itself when it's installed)
+ *   reads the same in parallel blocks and in one pass, and the index silt
+ *   writes back in blocks is one Git reads too.
+ */
+void test_git_written_version_4_blocks() {
+    std::cout << "Test: version 4 index written by Git in blocks... ";
+    if (std::system("git --version > " NULL_DEVICE " 2>&1") != 0) {
+        std::cout << "SKIPPED (no git)" << std::endl;
+        return;
+    }
+
+    Repository repo = make_temp_repo("silt_index_git_v4");
+    std::string dir = repo.worktree.string();
+    {
+        std::ofstream config(repo.gitdir / "config", std::ios::app);
+        config << "[index]\n\tthreads = 4\n";
+        std::ofstream info(repo.worktree / "index-info");
+        for (int i = 0; i < 25000; i++) {
+            info << "100644 " << std::string(40, "123456789a"[i % 10]) << " 0\tdir" << i % 7 << "/file" << i
+                 << ".txt\n";
+        }
+    }
+    assert(std::system(("git -C \"" + dir + "\" update-index --index-info < \"" + dir + "/index-info\"").c_str()) ==
+           0);
+    assert(std::system(("git -C \"" + dir + "\" update-index --index-version 4 --force-write-index").c_str()) == 0);
+
+    std::ifstream file(Index::get_index_path(repo), std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    assert(content.find("IEOT") != std::string::npos);
+
+    Index loaded(repo);
+    assert(loaded.version() == 4);
+    assert(loaded.size() == 25000);
+    for (size_t i = 1; i < loaded.size(); i++) {
+        assert(loaded[i - 1].path() < loaded[i].path());
+    }
+    assert(loaded.find("dir2/file24999.txt"));
+
+    // the same index in one pass
+    {
+        std::ofstream config(repo.gitdir / "config", std::ios::app);
+        config << "[index]\n\tthreads = 1\n";
+    }
+    Index single(repo);
+    assert(single.size() == loaded.size());
+    for (size_t i = 0; i < loaded.size(); i++) {
+        assert(single[i].path() == loaded[i].path());
+    }
+
+    // silt's own blocks, read by Git in one pass
+    {
+        std::ofstream config(repo.gitdir / "config", std::ios::app);
+        config << "[index]\n\tthreads = 4\n";
+    }
+    loaded.add_entry(make_entry("dir0/new.txt"));
+    assert(loaded.write(repo));
+    std::string listing = dir + "/listing";
+    assert(std::system(("git -C \"" + dir + "\" -c index.threads=1 ls-files > \"" + listing + "\"").c_str()) == 0);
+    std::ifstream listed(listing);
+    size_t count = 0;
+    for (std::string line; std::getline(listed, line); count++) {
+        assert(line == loaded[count].path());
+    }
+    assert(count == 25001);
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: cache tree extension
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   The cache tree survives a write / read round trip in the TREE
+ *   extension. Staging a changed entry invalidates only the nodes along its
+ *   path, re-staging an identical entry invalidates nothing, and removing
+ *   an entry invalidates its parents.
+ */
+void test_cache_tree_extension() {
+    std::cout << "Test: cache tree extension... ";
+
+    Repository repo = make_temp_repo("silt_index_cache_tree");
+
+    Index index;
+    index.add_entries({make_entry("a/b/x.txt", '1'), make_entry("a/y.txt", '2'),
+                       make_entry("c/z.txt", '3'), make_entry("top.txt", '4')});
+    CacheTree& root = index.cache_tree();
+    root.set(4, std::string(40, 'e'));
+    root.subtree("a").set(2, std::string(40, 'a'));
+    root.subtree("a").subtree("b").set(1, std::string(40, 'b'));
+    root.subtree("c").set(1, std::string(40, 'c'));
+    assert(index.write(repo));
+
+    Index loaded(repo);
+    CacheTree& tree = loaded.cache_tree();
+    assert(tree.valid() && tree.entry_count == 4 && tree.sha(SHA1_SIZE) == std::string(40, 'e'));
+    assert(tree.subtrees.size() == 2);
+    assert(tree.find_subtree("a")->sha(SHA1_SIZE) == std::string(40, 'a'));
+    assert(tree.find_subtree("a")->find_subtree("b")->entry_count == 1);
+    assert(tree.find_subtree("c")->sha(SHA1_SIZE) == std::string(40, 'c'));
+
+    // identical content: nothing to rewrite
+    loaded.add_entry(make_entry("a/b/x.txt", '1', 99));
+    assert(tree.valid() && tree.find_subtree("a")->find_subtree("b")->valid());
+
+    // changed content: only the path to it
+    loaded.add_entries({make_entry("a/b/x.txt", '9')});
+    assert(!tree.valid());
+    assert(!tree.find_subtree("a")->valid());
+    assert(!tree.find_subtree("a")->find_subtree("b")->valid());
+    assert(tree.find_subtree("c")->valid());
+
+    assert(loaded.remove_entry("c/z.txt"));
+    assert(!tree.find_subtree("c")->valid());
+    assert(loaded.write(repo));
+
+    Index reloaded(repo);
+    assert(!reloaded.cache_tree().valid());
+    assert(reloaded.cache_tree().subtrees.size() == 2);
+    assert(!reloaded.cache_tree().find_subtree("a")->valid());
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: EWAH bitmap round trip
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Bitmaps mixing long clean runs (of zeros and of ones) with literal
+ *   words serialize and parse back to the same bits; an empty bitmap is
+ *   a single marker word.
+ */
+void test_ewah_round_trip() {
+    std::cout << "Test: EWAH bitmap round trip... ";
+
+    EwahBitmap bitmap;
+    std::vector<size_t> expected = {3, 64, 65, 1000};
+    for (size_t pos = 5000; pos < 5000 + 64 * 3; pos++) {
+        expected.push_back(pos);
+    }
+    expected.push_back(100000);
+    for (size_t pos : expected) {
+        bitmap.set(pos);
+    }
+
+    std::string data;
+    bitmap.serialize(data);
+    // much smaller than the 100001 bits it covers
+    assert(data.size() < 200);
+
+    EwahBitmap parsed;
+    const char* p = data.data();
+    assert(parsed.deserialize(p, data.data() + data.size()));
+    assert(p == data.data() + data.size());
+    assert(parsed.bit_size() == 100001);
+    assert(parsed.positions() == expected);
+    assert(parsed.get(5100) && !parsed.get(4999) && !parsed.get(200000));
+
+    std::string empty;
+    EwahBitmap().serialize(empty);
+    assert(empty.size() == 4 + 4 + 8 + 4);
+    p = empty.data();
+    assert(parsed.deserialize(p, empty.data() + empty.size()));
+    assert(parsed.empty() && parsed.bit_size() == 0);
+
+    // truncated data is rejected
+    p = data.data();
+    assert(!parsed.deserialize(p, data.data() + data.size() - 1));
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: split index
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   With core.splitIndex, entries go to a shared index and .git/index only
+ *   records changes: replacing, removing and adding entries keeps the
+ *   shared index and gives back the same entries on read. Once the changes
+ *   outgrow splitIndex.maxPercentChange, a new shared index is written.
+ */
+void test_split_index() {
+    std::cout << "Test: split index... ";
+
+    Repository repo = make_temp_repo("silt_index_split");
+    {
+        std::ofstream config(repo.gitdir / "config", std::ios::app);
+        config << "[core]\n\tsplitIndex = true\n";
+    }
+    auto shared_indexes = [&repo]() {
+        std::vector<std::string> names;
+        for (const auto& file : std::filesystem::directory_iterator(repo.gitdir)) {
+            std::string name = file.path().filename().string();
+            if (name.rfind("sharedindex.", 0) == 0) {
+                names.push_back(name);
+            }
+        }
+        return names;
+    };
+
+    std::vector<IndexEntry> batch;
+    for (int i = 0; i < 100; i++) {
+        batch.push_back(make_entry("dir/file" + std::to_string(100 + i), 'a'));
+    }
+    Index index;
+    index.add_entries(batch);
+    assert(index.write(repo));
+    auto first_shared = shared_indexes();
+    assert(first_shared.size() == 1);
+
+    Index loaded(repo);
+    assert(loaded.size() == 100);
+    loaded.add_entry(make_entry("dir/file150", 'b'));
+    assert(loaded.remove_entry("dir/file160"));
+    loaded.add_entry(make_entry("dir/file999", 'c'));
+    loaded.add_entry(make_entry("a.txt", 'd'));
+    assert(loaded.write(repo));
+
+    // the small delta goes to .git/index, the shared index stays
+    assert(shared_indexes() == first_shared);
+    assert(std::filesystem::file_size(Index::get_index_path(repo)) < 1000);
+
+    Index reloaded(repo);
+    assert(reloaded.verify_checksum());
+    assert(reloaded.size() == 101);
+    assert(reloaded[0].path() == "a.txt" && reloaded[0].sha() == std::string(40, 'd'));
+    assert(reloaded[*reloaded.find("dir/file150")].sha() == std::string(40, 'b'));
+    assert(!reloaded.find("dir/file160"));
+    assert(reloaded[reloaded.size() - 1].path() == "dir/file999");
+    for (size_t i = 1; i < reloaded.size(); i++) {
+        assert(reloaded[i - 1].path() < reloaded[i].path());
+    }
+
+    // many changes: a new shared index, and nothing left in the delta
+    for (int i = 0; i < 30; i++) {
+        reloaded.add_entry(make_entry("dir/file" + std::to_string(100 + i), 'e'));
+    }
+    assert(reloaded.write(repo));
+    assert(shared_indexes().size() == 2);
+
+    Index resplit(repo);
+    assert(resplit.size() == 101);
+    assert(resplit[*resplit.find("dir/file129")].sha() == std::string(40, 'e'));
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Run All Tests
+ * ---------------------------------------------------------------------------
+ */
+/*
+ * ---------------------------------------------------------------------------
+ * Test: untracked cache extension
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Directory lists, stat data and validity survive a write/read round
+ *   trip (also through a split index); staging or removing a path
+ *   invalidates only the directory holding it.
+ */
+void test_untracked_cache_extension() {
+    std::cout << "Test: untracked cache extension... ";
+
+    Repository repo = make_temp_repo("silt_index_untracked_cache");
+
+    Index index;
+    index.add_entries({make_entry("a/b/x.txt", '1'), make_entry("top.txt", '2')});
+    index.untracked_cache().emplace();
+    UntrackedCache& cache = *index.untracked_cache();
+    cache.ident = untracked_cache_ident(repo.worktree);
+    cache.root.valid = true;
+    cache.root.stat.mtime_sec = 42;
+    cache.root.untracked = {"new.txt"};
+    cache.root.dirs.resize(2);
+    cache.root.dirs[0].name = "a";
+    cache.root.dirs[0].valid = true;
+    cache.root.dirs[0].stat.ino = 7;
+    cache.root.dirs[0].dirs.resize(1);
+    cache.root.dirs[0].dirs[0].name = "b";
+    cache.root.dirs[0].dirs[0].valid = true;
+    cache.root.dirs[0].dirs[0].untracked = {"u1", "u2"};
+    cache.root.dirs[1].name = "c";
+    cache.root.dirs[1].exclude_oid[0] = 0xab;
+    assert(index.write(repo));
+
+    Index loaded(repo);
+    assert(loaded.untracked_cache().has_value());
+    UntrackedCache& read = *loaded.untracked_cache();
+    assert(read.ident == cache.ident && read.exclude_per_dir == ".gitignore");
+    assert(read.root.valid && read.root.stat.mtime_sec == 42);
+    assert(read.root.untracked == std::vector<std::string>{"new.txt"});
+    assert(read.root.dirs.size() == 2);
+    UntrackedCacheDir* a = read.root.find_dir("a");
+    UntrackedCacheDir* c = read.root.find_dir("c");
+    assert(a && a->valid && a->stat.ino == 7);
+    assert(a->find_dir("b")->untracked == (std::vector<std::string>{"u1", "u2"}));
+    assert(c && !c->valid && c->exclude_oid[0] == 0xab);
+
+    // only the directory holding the staged path
+    loaded.add_entry(make_entry("a/b/u1", '3'));
+    assert(!a->find_dir("b")->valid);
+    assert(a->valid && read.root.valid);
+    assert(loaded.remove_entry("top.txt"));
+    assert(!read.root.valid && a->valid);
+
+    // kept across a split index write and read
+    std::ofstream(repo.gitdir / "config") << "[core]\n\tsplitIndex = true\n";
+    assert(loaded.write(repo));
+    Index split(repo);
+    assert(split.untracked_cache().has_value());
+    assert(!split.untracked_cache()->root.valid);
+    assert(split.untracked_cache()->root.find_dir("a")->valid);
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: filesystem monitor extension
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   The monitor's token and which entries are known unchanged survive a
+ *   write/read round trip. Staged entries lose the mark, reported paths
+ *   and directories are invalidated, and the marks follow their entries
+ *   as others are inserted and removed.
+ */
+void test_fsmonitor_extension() {
+    std::cout << "Test: filesystem monitor extension... ";
+
+    Repository repo = make_temp_repo("silt_index_fsmonitor");
+
+    Index index;
+    index.add_entries({make_entry("a/x", '1'), make_entry("a/y", '2'), make_entry("b/z", '3'),
+                       make_entry("top", '4')});
+    assert(!index.fsmonitor_valid(0));
+    index.set_fsmonitor_token("silt:1:5");
+    for (size_t pos = 0; pos < index.size(); pos++) {
+        index.set_fsmonitor_valid(pos);
+    }
+    index.set_fsmonitor_valid(*index.find("b/z"), false);
+    assert(index.write(repo));
+
+    Index loaded(repo);
+    assert(loaded.fsmonitor_token() == "silt:1:5");
+    assert(loaded.fsmonitor_valid(*loaded.find("a/x")) && loaded.fsmonitor_valid(*loaded.find("top")));
+    assert(!loaded.fsmonitor_valid(*loaded.find("b/z")));
+
+    // new and replaced entries aren't known; the others keep their mark
+    loaded.add_entry(make_entry("a/w", '5'));
+    loaded.add_entries({make_entry("a/y", '6'), make_entry("c/v", '7')});
+    assert(!loaded.fsmonitor_valid(*loaded.find("a/w")));
+    assert(!loaded.fsmonitor_valid(*loaded.find("a/y")));
+    assert(!loaded.fsmonitor_valid(*loaded.find("c/v")));
+    assert(loaded.fsmonitor_valid(*loaded.find("a/x")) && loaded.fsmonitor_valid(*loaded.find("top")));
+    assert(loaded.remove_entry("a/w"));
+    assert(loaded.fsmonitor_valid(*loaded.find("a/x")) && loaded.fsmonitor_valid(*loaded.find("top")));
+
+    loaded.invalidate_fsmonitor("a/");
+    assert(!loaded.fsmonitor_valid(*loaded.find("a/x")) && loaded.fsmonitor_valid(*loaded.find("top")));
+    loaded.invalidate_fsmonitor("top");
+    assert(!loaded.fsmonitor_valid(*loaded.find("top")));
+
+    // without a token nothing is kept
+    loaded.set_fsmonitor_token("");
+    assert(loaded.write(repo));
+    Index reloaded(repo);
+    assert(reloaded.fsmonitor_token().empty() && !reloaded.fsmonitor_valid(0));
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: sparse directory entries
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Skip-worktree entries and sparse directory entries ("dir/" with a tree
+ *   mode) survive a write and read, the index is then written with the
+ *   sdir extension and at least version 3, and remove_ranges takes out
+ *   several ranges in one go.
+ */
+void test_sparse_directory_entries() {
+    std::cout << "Test: sparse directory entries... ";
+
+    Repository repo = make_temp_repo("silt_index_sparse");
+
+    IndexEntry skipped = make_entry("a/x", '1');
+    skipped.extended_flags = INDEX_SKIP_WORKTREE;
+    IndexEntry sparse_dir = make_entry("b/", '2');
+    sparse_dir.stat.mode = INDEX_SPARSE_DIR_MODE;
+    sparse_dir.extended_flags = INDEX_SKIP_WORKTREE;
+    Index index;
+    index.add_entries({skipped, sparse_dir, make_entry("b-c", '3'), make_entry("top", '4')});
+    assert(index[1].path() == "b-c" && index[2].path() == "b/");
+    assert(index.write(repo));
+
+    Index loaded(repo);
+    assert(loaded.version() >= 3);
+    assert(loaded.size() == 4);
+    assert(loaded[0].skip_worktree() && !loaded[0].sparse_dir());
+    assert(loaded[2].sparse_dir() && loaded[2].skip_worktree());
+    assert(!loaded[3].skip_worktree());
+    auto range = loaded.directory_range("b");
+    assert(range.first == 2 && range.second == 3);
+
+    std::ifstream file(Index::get_index_path(repo), std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    assert(data.find("sdir") != std::string::npos);
+
+    // without sparse directories there's no extension
+    loaded.remove_ranges({{0, 1}, {2, 3}});
+    assert(loaded.size() == 2 && loaded[0].path() == "b-c" && loaded[1].path() == "top");
+    assert(!loaded.find("b/") && loaded.find("top"));
+    assert(loaded.write(repo));
+    std::ifstream rewritten(Index::get_index_path(repo), std::ios::binary);
+    data.assign((std::istreambuf_iterator<char>(rewritten)), std::istreambuf_iterator<char>());
+    assert(data.find("sdir") == std::string::npos);
+
+    std::filesystem::remove_all(repo.worktree);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: SHA-1 engines
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   The incremental hash, fed in uneven pieces, gives the known digests,
+ *   and a batch hashed on each engine the CPU supports (one at a time,
+ *   8 or 16 side by side) agrees with hashing each message on its own, for
+ *   sizes on both sides of every padding boundary.
+ */
+void test_sha1_engines() {
+    std::cout << "Test: SHA-1 engines... ";
+
+    auto hex = [](const unsigned char* hash) {
+        std::string out;
+        char byte[3];
+        for (size_t i = 0; i < SHA1_SIZE; i++) {
+            std::snprintf(byte, sizeof(byte), "%02x", hash[i]);
+            out += byte;
+        }
+        return out;
+    };
+    unsigned char hash[SHA1_SIZE];
+    sha1("abc", 3, hash);
+    assert(hex(hash) == "a9993e364706816aba3e25717850c26c9cd0d89d");
+    std::string million(1000000, 'a');
+    Sha1 pieces;
+    for (size_t offset = 0, step = 1; offset < million.size(); offset += step, step = step % 97 + 13) {
+        pieces.update(million.data() + offset, std::min(step, million.size() - offset));
+    }
+    pieces.final(hash);
+    assert(hex(hash) == "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+
+    // the header and body split anywhere, and lengths around 55/56/64 bytes
+    std::vector<std::string> bodies;
+    std::vector<std::string> headers;
+    for (size_t size = 0; size < 300; size++) {
+        std::string body(size, '\0');
+        for (size_t i = 0; i < size; i++) {
+            body[i] = static_cast<char>(size * 31 + i * 7);
+        }
+        bodies.push_back(body);
+        headers.push_back("blob " + std::to_string(size) + std::string(1, '\0'));
+    }
+    bodies.push_back(std::string(100000, 'x'));
+    headers.push_back(std::string(130, 'h'));
+    std::vector<Sha1Input> inputs;
+    for (size_t i = 0; i < bodies.size(); i++) {
+        inputs.push_back({headers[i], bodies[i]});
+    }
+
+    std::vector<unsigned char> expected(inputs.size() * SHA1_SIZE);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        std::string whole = headers[i] + bodies[i];
+        sha1(whole.data(), whole.size(), &expected[i * SHA1_SIZE]);
+    }
+    for (Sha1Engine engine : {Sha1Engine::Auto, Sha1Engine::Single, Sha1Engine::Avx2, Sha1Engine::Avx512}) {
+        if (!sha1_engine_supported(engine)) {
+            continue;
+        }
+        std::vector<unsigned char> out(inputs.size() * SHA1_SIZE);
+        sha1_many(inputs.data(), inputs.size(), out.data(), engine);
+        assert(out == expected);
+        sha1_many(inputs.data(), 3, out.data(), engine);
+        assert(std::memcmp(out.data(), expected.data(), 3 * SHA1_SIZE) == 0);
+    }
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: SHA-256 object format
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   A repository created for SHA-256 records it in its config and is
+ *   reopened as one; its objects get the same 64-digit ids Git gives them,
+ *   trees carry 32-byte ids that read back intact, and abbreviated and
+ *   full ids resolve. Its index holds the 32-byte ids and ends in a
+ *   SHA-256 checksum, which read back intact.
+ */
+void test_sha256_object_format() {
+    std::cout << "Test: SHA-256 object format... ";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_sha256_repo";
+    std::filesystem::remove_all(dir);
+    repo_create(dir, ObjectFormat::Sha256);
+    Repository repo(dir);
+    assert(repo.object_format == ObjectFormat::Sha256);
+
+    const std::string blob_sha = "2cf8d83d9ee29543b34a87727421fdecb7e3f3a183d337639025de576db9ebb4";
+    assert(object_hash("hello\n", "blob", &repo) == blob_sha);
+    assert(object_hash_many({"hello\n"}, "blob", &repo, false) == std::vector<std::string>{blob_sha});
+    assert(object_hash("hello\n", "blob") != blob_sha);
+
+    auto tree = std::make_unique<GitTree>();
+    tree->add_leaf(GitTreeLeaf("100644", "hello.txt", blob_sha));
+    tree->add_leaf(GitTreeLeaf("100644", "again.txt", blob_sha));
+    std::string tree_sha = object_write(std::move(tree), &repo);
+    assert(tree_sha.size() == 64);
+
+    auto obj = object_read(&repo, const_cast<char*>(tree_sha.c_str()));
+    GitTree* read_back = obj ? dynamic_cast<GitTree*>(obj->get()) : nullptr;
+    assert(read_back && read_back->get_leaves().size() == 2);
+    assert(read_back->get_leaves()[0].path == "again.txt" && read_back->get_leaves()[0].sha == blob_sha);
+    assert(read_back->get_leaves()[1].path == "hello.txt" && read_back->get_leaves()[1].sha == blob_sha);
+
+    assert(object_resolve(&repo, tree_sha.substr(0, 10)) == std::vector<std::string>{tree_sha});
+    assert(object_resolve(&repo, tree_sha) == std::vector<std::string>{tree_sha});
+
+    // The index takes 32-byte ids and a SHA-256 checksum, in every version
+    for (const char* version : {"2", "4"}) {
+        assert(config_set(repo.gitdir / "config", "index", "version", version));
+
+        Index index;
+        assert(index.lock(repo));
+        for (const char* path : {"a.txt", "dir/b.txt", "dir/c.txt"}) {
+            IndexEntry entry = make_entry(path);
+            entry.sha = blob_sha;
+            index.add_entry(entry);
+        }
+        index.cache_tree().set(3, tree_sha);
+        assert(index.write(repo));
+
+        Index loaded(repo);
+        assert(loaded.object_format() == ObjectFormat::Sha256 && loaded.verify_checksum());
+        assert(loaded.size() == 3 && loaded[2].path() == "dir/c.txt" && loaded[2].sha() == blob_sha);
+        assert(loaded.cache_tree().sha(SHA256_SIZE) == tree_sha);
+        assert(std::filesystem::file_size(repo.gitdir / "index") > 3 * (62 + SHA256_SIZE));
+    }
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Bulk checkin
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Objects written during a transaction can be read and resolved before
+ *   it commits, and none of them is loose; committing leaves exactly one
+ *   pack and its index, which a freshly opened repository reads. A small
+ *   transaction writes loose objects instead, and one dropped without
+ *   committing leaves nothing behind.
+ */
+void test_bulk_checkin() {
+    std::cout << "Test: Bulk checkin... ";
+
+    Repository repo = make_temp_repo("silt_bulk_checkin");
+    std::filesystem::path objects = repo.gitdir / "objects";
+    auto count_files = [&](const std::filesystem::path& dir) {
+        size_t files = 0;
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(dir)) {
+            files += entry.is_regular_file();
+        }
+        return files;
+    };
+    auto blob_data = [](size_t i) { return "blob number " + std::to_string(i) + std::string(i, 'x'); };
+
+    std::vector<std::string> shas;
+    {
+        OdbTransaction transaction(repo);
+        for (size_t i = 0; i < 2 * BULK_CHECKIN_MIN_OBJECTS; i++) {
+            shas.push_back(object_hash(blob_data(i), "blob", &repo));
+        }
+        // a repeat is written once
+        assert(object_hash(blob_data(7), "blob", &repo) == shas[7]);
+
+        auto obj = object_read(&repo, const_cast<char*>(shas[5].c_str()));
+        assert(obj && (*obj)->serialize() == blob_data(5));
+        assert(object_resolve(&repo, shas[100].substr(0, 12)) == std::vector<std::string>{shas[100]});
+        assert(count_files(objects) == 1);  // the temporary pack
+        transaction.commit();
+    }
+    assert(count_files(objects) == 2);
+    bool idx = false, pack = false;
+    for (const auto& entry : std::filesystem::directory_iterator(objects / "pack")) {
+        idx |= entry.path().extension() == ".idx";
+        pack |= entry.path().extension() == ".pack";
+    }
+    assert(idx && pack);
+
+    Repository reopened(repo.worktree);
+    for (size_t i : {size_t(0), size_t(63), size_t(127)}) {
+        auto obj = object_read(&reopened, const_cast<char*>(shas[i].c_str()));
+        assert(obj && (*obj)->get_fmt() == "blob" && (*obj)->serialize() == blob_data(i));
+    }
+    assert(repo_packs(reopened).contains(shas[64]));
+
+    // few objects stay loose, and an uncommitted transaction is dropped
+    {
+        OdbTransaction transaction(repo);
+        object_hash("small one", "blob", &repo);
+        object_hash(blob_data(3), "blob", &repo);  // packed already
+        transaction.commit();
+    }
+    assert(count_files(objects) == 3);
+    {
+        OdbTransaction transaction(repo);
+        for (size_t i = 0; i < 2 * BULK_CHECKIN_MIN_OBJECTS; i++) {
+            object_hash("dropped " + std::to_string(i), "blob", &repo);
+        }
+    }
+    assert(count_files(objects) == 3 && !repo.transaction);
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Durable writes
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   core.fsync lists add to and take from the default, and fsyncMethod
+ *   picks batching. A lockfile excludes a second writer, replaces the file
+ *   on commit and leaves it alone on rollback; index.lock can be tried
+ *   without waiting and released unwritten. Staged files only show up
+ *   at their names once flushed, an object already there is kept, and
+ *   nothing is left behind by writes that are dropped.
+ */
+void test_durable_writes() {
+    std::cout << "Test: Durable writes... ";
+
+    ConfigParser config;
+    assert(fsync_policy(config).components == (FSYNC_LOOSE_OBJECT | FSYNC_PACK | FSYNC_REFERENCE));
+    config.set("core", "fsync", "index, -loose-object");
+    config.set("core", "fsyncMethod", "batch");
+    FsyncPolicy policy = fsync_policy(config);
+    assert(policy.wants(FSYNC_INDEX) && policy.wants(FSYNC_PACK) && !policy.wants(FSYNC_LOOSE_OBJECT));
+    assert(policy.batch);
+    config.set("core", "fsync", "none,reference");
+    assert(fsync_policy(config).components == FSYNC_REFERENCE);
+
+    Repository repo = make_temp_repo("silt_durable_writes");
+    repo.fsync = policy;
+    std::filesystem::path file = repo.gitdir / "refs" / "heads" / "topic";
+    auto contents = [](const std::filesystem::path& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), {});
+    };
+
+    {
+        LockFile lock, other;
+        assert(lock.acquire(file));
+        assert(!other.acquire(file) && !other.held());
+        lock.write("one\n");
+        assert(!std::filesystem::exists(file));
+        assert(lock.commit(repo.fsync, FSYNC_REFERENCE));
+        assert(contents(file) == "one\n" && !std::filesystem::exists(lock.lock_path()));
+
+        assert(lock.acquire(file));
+        lock.write("two\n");
+        lock.rollback();
+        assert(contents(file) == "one\n" && !std::filesystem::exists(lock.lock_path()));
+    }
+    {
+        Index holder, other;
+        assert(holder.lock(repo));
+        assert(!other.lock(repo, 0));
+        holder.unlock();
+        assert(other.lock(repo, 0));
+        other.unlock();
+        assert(!std::filesystem::exists(Index::get_index_path(repo)));
+        assert(!std::filesystem::exists(Index::get_index_path(repo).string() + ".lock"));
+    }
+
+    std::filesystem::path a = repo.gitdir / "objects" / "aa" / "one";
+    std::filesystem::path b = repo.gitdir / "objects" / "bb" / "two";
+    {
+        DurableWrites writes(repo);
+        writes.stage(a, "first", FSYNC_LOOSE_OBJECT, true);
+        writes.stage(b, "second", FSYNC_PACK);
+        assert(!std::filesystem::exists(a) && !std::filesystem::exists(b));
+        writes.flush();
+        assert(contents(a) == "first" && contents(b) == "second");
+
+        writes.stage(a, "again", FSYNC_LOOSE_OBJECT, true);
+        writes.stage(b, "replaced", FSYNC_PACK);
+        writes.flush();
+        assert(contents(a) == "first" && contents(b) == "replaced");
+
+        writes.stage(repo.gitdir / "objects" / "cc" / "dropped", "never", FSYNC_LOOSE_OBJECT);
+    }
+    size_t files = 0;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(repo.gitdir / "objects")) {
+        files += entry.is_regular_file();
+    }
+    assert(files == 2);
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Concurrent writers
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Threads sharing a repository, and processes of their own, write the
+ *   same objects and their own at once, loose and into one bulk checkin;
+ *   every object reads back whole and no temporary file is left over.
+ *   They also each add entries to the index under index.lock, many times
+ *   over, and no entry gets lost to another writer's read-modify-write.
+ */
+void test_concurrent_writers() {
+    std::cout << "Test: Concurrent writers... " << std::flush;
+
+    Repository repo = make_temp_repo("silt_concurrent_writers");
+    const int threads = 6, rounds = 15;
+    auto shared_blob = [](int i) { return "shared blob " + std::to_string(i) + std::string(i * 10, 's'); };
+    auto own_blob = [](int writer, int i) { return "blob " + std::to_string(i) + " of " + std::to_string(writer); };
+
+    // what each writer does: objects, then its own index entries, one
+    // locked read-modify-write at a time
+    auto work = [&](Repository& r, int writer) {
+        for (int i = 0; i < 40; i++) {
+            object_hash(shared_blob(i), "blob", &r);
+            object_hash(own_blob(writer, i), "blob", &r);
+        }
+        for (int i = 0; i < rounds; i++) {
+            Index index;
+            if (!index.lock(r)) {
+                return false;
+            }
+            index.read(r);
+            index.add_entry(make_entry("w" + std::to_string(writer) + "/" + std::to_string(i)));
+            if (!index.write(r)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    int writers = threads;
+#ifndef _WIN32
+    // processes first, while this one has no other threads
+    const int processes = 2;
+    std::vector<pid_t> children;
+    for (int p = 0; p < processes; p++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            Repository own(repo.worktree);
+            _exit(work(own, threads + p) ? 0 : 1);
+        }
+        assert(pid > 0);
+        children.push_back(pid);
+    }
+    writers += processes;
+#endif
+
+    std::atomic<int> failures{0};
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++) {
+        pool.emplace_back([&, t] { failures += !work(repo, t); });
+    }
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    assert(failures == 0);
+#ifndef _WIN32
+    for (pid_t pid : children) {
+        int status = 0;
+        assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+#endif
+
+    Repository reopened(repo.worktree);
+    for (int writer = 0; writer < writers; writer++) {
+        for (int i = 0; i < 40; i += 13) {
+            for (const std::string& data : {shared_blob(i), own_blob(writer, i)}) {
+                std::string sha = object_hash(data, "blob", &reopened, false);
+                auto obj = object_read(&reopened, const_cast<char*>(sha.c_str()));
+                assert(obj && (*obj)->serialize() == data);
+            }
+        }
+    }
+    Index index(reopened);
+    assert(index.size() == static_cast<size_t>(writers * rounds));
+    assert(!std::filesystem::exists(Index::get_index_path(reopened).string() + ".lock"));
+
+    // one bulk checkin written to from every thread
+    std::vector<std::vector<std::string>> shas(threads);
+    {
+        OdbTransaction transaction(repo);
+        pool.clear();
+        for (int t = 0; t < threads; t++) {
+            pool.emplace_back([&, t] {
+                for (int i = 0; i < 30; i++) {
+                    shas[t].push_back(object_hash("packed " + shared_blob(i) + own_blob(t, i), "blob", &repo));
+                }
+            });
+        }
+        for (auto& thread : pool) {
+            thread.join();
+        }
+        transaction.commit();
+    }
+    Repository packed(repo.worktree);
+    for (int t = 0; t < threads; t++) {
+        for (int i = 0; i < 30; i++) {
+            assert(repo_packs(packed).contains(shas[t][i]));
+        }
+    }
+
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(repo.gitdir / "objects")) {
+        assert(entry.path().filename().string().rfind("tmp_", 0) != 0);
+    }
+
+    std::cout << "PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "=== Silt Index Tests ===" << std::endl;
+    std::cout << std::endl;
+
+    // Ordering and lookup tests
+    test_add_entry_sorted_and_replaced();
+    test_add_entries_bulk_merge();
+    test_find_and_remove_entry();
+    test_path_pool_compaction();
+
+    // On-disk format tests
+    test_write_read_round_trip();
+    test_racy_entries_smudged();
+    test_index_stat_capture();
+    test_mapped_entries_edit_and_checksum();
+    test_entry_offset_table_threaded_read();
+    test_version_4_round_trip();
+    test_git_written_version_4_blocks();
+
+    // Extension tests
+    test_cache_tree_extension();
+    test_ewah_round_trip();
+    test_split_index();
+    test_untracked_cache_extension();
+    test_fsmonitor_extension();
+    test_sparse_directory_entries();
+
+    // Hashing tests
+    test_sha1_engines();
+    test_sha256_object_format();
+
+    // Object database tests
+    test_bulk_checkin();
+    test_durable_writes();
+    test_concurrent_writers();
+
+    std::cout << std::endl;
+    std::cout << "=== All Tests Passed ===" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,448 @@
+#include "IoBatch.hpp"
+#include "Repository.hpp"
+#include "Utils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define SILT_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+void io_request_run(IoRequest& request) {
+    request.ok = false;
+    switch (request.kind) {
+    case IoRequest::Kind::Stat:
+        request.ok = index_stat(request.stat, request.path);
+        break;
+
+    case IoRequest::Kind::Read: {
+        if (!index_stat(request.stat, request.path)) {
+            break;
+        }
+        std::error_code ec;
+        if ((request.stat.mode & 0170000) == 0120000) {
+            request.data = std::filesystem::read_symlink(request.path, ec).string();
+            request.ok = !ec;
+            break;
+        }
+        std::ifstream file(request.path, std::ios::binary);
+        if (file.is_open()) {
+            request.data.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            request.ok = true;
+        }
+        break;
+    }
+
+    case IoRequest::Kind::Write: {
+#ifdef _WIN32
+        std::ofstream file(request.path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open() || !file.write(request.data.data(), request.data.size())) {
+            break;
+        }
+        file.close();
+#else
+        int fd = open(request.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, request.mode);
+        if (fd < 0) {
+            break;
+        }
+        bool written = true;
+        for (size_t done = 0; done < request.data.size();) {
+            ssize_t n = write(fd, request.data.data() + done, request.data.size() - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                written = false;
+                break;
+            }
+            done += static_cast<size_t>(n);
+        }
+        if (close(fd) != 0 || !written) {
+            break;
+        }
+#endif
+        request.ok = index_stat(request.stat, request.path);
+        break;
+    }
+    }
+}
+
+#ifdef SILT_IO_URING
+namespace {
+// Requests in flight at once
+constexpr unsigned int RING_DEPTH = 128;
+
+long io_uring_setup(unsigned int entries, io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+long io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+long io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Where a request is: each stage is one operation for the kernel, except
+// Done. Stats are a Statx; reads go Statx, Open, Transfer, Close; writes
+// Open, Transfer, Close, Statx.
+struct RingOp {
+    enum class Stage { Statx, Open, Transfer, Close, Done };
+
+    Stage stage = Stage::Statx;
+    int fd = -1;
+    size_t offset = 0;         // bytes transferred so far
+    bool failed = false;
+    struct statx stx;
+};
+
+void fill_stat(IndexStat& stat, const struct statx& stx) {
+    // the same truncation as index_stat
+    stat.ctime_sec = static_cast<uint32_t>(stx.stx_ctime.tv_sec);
+    stat.ctime_nsec = stx.stx_ctime.tv_nsec;
+    stat.mtime_sec = static_cast<uint32_t>(stx.stx_mtime.tv_sec);
+    stat.mtime_nsec = stx.stx_mtime.tv_nsec;
+    stat.dev = static_cast<uint32_t>(makedev(stx.stx_dev_major, stx.stx_dev_minor));
+    stat.ino = static_cast<uint32_t>(stx.stx_ino);
+    stat.mode = index_mode_from_stat(stx.stx_mode);
+    stat.uid = stx.stx_uid;
+    stat.gid = stx.stx_gid;
+    stat.file_size = static_cast<uint32_t>(stx.stx_size);
+}
+}
+
+// A submission and a completion queue shared with the kernel
+class IoBatch::Ring {
+public:
+    // nullptr where the kernel can't take the operations a batch needs
+    static std::unique_ptr<Ring> create() {
+        std::unique_ptr<Ring> ring(new Ring());
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring->fd = static_cast<int>(io_uring_setup(RING_DEPTH, &params));
+        if (ring->fd < 0 || !ring->map(params) || !ring->supports_ops()) {
+            return nullptr;
+        }
+        return ring;
+    }
+
+    ~Ring() {
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    void run(std::vector<IoRequest>& requests) {
+        std::vector<RingOp> ops(requests.size());
+        // a stack, so a request that made progress goes on before new ones
+        // start and few files are open at a time
+        std::vector<uint32_t> ready;
+        ready.reserve(requests.size());
+        for (size_t i = requests.size(); i-- > 0;) {
+            requests[i].ok = false;
+            if (requests[i].kind == IoRequest::Kind::Write) {
+                ops[i].stage = RingOp::Stage::Open;
+            }
+            ready.push_back(static_cast<uint32_t>(i));
+        }
+
+        unsigned int in_flight = 0;
+        unsigned int unsubmitted = 0;
+        while (!ready.empty() || in_flight > 0) {
+            while (!ready.empty() && in_flight < RING_DEPTH) {
+                uint32_t i = ready.back();
+                ready.pop_back();
+                prepare(next_sqe(), requests[i], ops[i], i);
+                in_flight++;
+                unsubmitted++;
+            }
+
+            long submitted = io_uring_enter(fd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+            if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+            }
+            if (submitted > 0) {
+                unsubmitted -= static_cast<unsigned int>(submitted);
+            }
+
+            unsigned int head = *cq_head;
+            unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                const io_uring_cqe& cqe = cqes[head & cq_mask];
+                uint32_t i = static_cast<uint32_t>(cqe.user_data);
+                in_flight--;
+                if (complete(requests[i], ops[i], cqe.res)) {
+                    ready.push_back(i);
+                }
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+private:
+    int fd = -1;
+    void* sq_ring = MAP_FAILED;
+    void* cq_ring = MAP_FAILED;
+    void* sqes = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    size_t sqes_size = 0;
+
+    unsigned int* sq_tail = nullptr;
+    unsigned int sq_mask = 0;
+    unsigned int* sq_array = nullptr;
+    unsigned int* cq_head = nullptr;
+    unsigned int* cq_tail = nullptr;
+    unsigned int cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    Ring() = default;
+
+    bool map(const io_uring_params& params) {
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            return false;
+        }
+        cq_ring = single ? sq_ring
+                         : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+            return false;
+        }
+
+        char* sq = static_cast<char*>(sq_ring);
+        sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+        char* cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // statx, openat, read, write and close came in 5.6, and with them the
+    // probe that says so
+    bool supports_ops() {
+        constexpr unsigned int PROBE_OPS = 64;
+        std::vector<char> buffer(sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) < 0) {
+            return false;
+        }
+        for (unsigned int op : {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE}) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Never full: no more than RING_DEPTH requests are in flight, and the
+    // ring has that many entries
+    io_uring_sqe* next_sqe() {
+        unsigned int tail = *sq_tail;
+        unsigned int index = tail & sq_mask;
+        io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes) + index;
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    static void prepare(io_uring_sqe* sqe, IoRequest& request, RingOp& op, uint32_t i) {
+        sqe->user_data = i;
+        bool reading = request.kind != IoRequest::Kind::Write;
+        switch (op.stage) {
+        case RingOp::Stage::Statx:
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(request.path.c_str());
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = reinterpret_cast<uint64_t>(&op.stx);
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT;
+            break;
+        case RingOp::Stage::Open:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(request.path.c_str());
+            sqe->len = reading ? 0 : request.mode;
+            sqe->open_flags = reading ? O_RDONLY | O_CLOEXEC : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            break;
+        case RingOp::Stage::Transfer:
+            sqe->opcode = reading ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->fd = op.fd;
+            sqe->addr = reinterpret_cast<uint64_t>(request.data.data() + op.offset);
+            sqe->len = static_cast<uint32_t>(std::min<size_t>(request.data.size() - op.offset, 1u << 30));
+            sqe->off = op.offset;
+            break;
+        case RingOp::Stage::Close:
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = op.fd;
+            break;
+        case RingOp::Stage::Done:
+            break;
+        }
+    }
+
+    // Take the result `res` of the request's current stage; true if there's
+    // another stage to go
+    static bool complete(IoRequest& request, RingOp& op, int res) {
+        bool reading = request.kind != IoRequest::Kind::Write;
+        switch (op.stage) {
+        case RingOp::Stage::Statx:
+            if (res < 0) {
+                op.failed = true;
+                break;
+            }
+            // the last stage of a stat or a write
+            fill_stat(request.stat, op.stx);
+            if (request.kind != IoRequest::Kind::Read) {
+                break;
+            }
+            if ((request.stat.mode & 0170000) == 0120000) {
+                // there's no readlink for the ring, and symlinks are few
+                std::error_code ec;
+                request.data = std::filesystem::read_symlink(request.path, ec).string();
+                op.failed = static_cast<bool>(ec);
+                break;
+            }
+            if (!S_ISREG(op.stx.stx_mode)) {
+                op.failed = true;
+                break;
+            }
+            // a file growing from here on shows up as a stat change later
+            request.data.resize(op.stx.stx_size);
+            if (request.data.empty()) {
+                break;
+            }
+            op.stage = RingOp::Stage::Open;
+            return true;
+
+        case RingOp::Stage::Open:
+            if (res < 0) {
+                op.failed = true;
+                break;
+            }
+            op.fd = res;
+            op.stage = request.data.empty() ? RingOp::Stage::Close : RingOp::Stage::Transfer;
+            return true;
+
+        case RingOp::Stage::Transfer:
+            if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                op.failed = true;
+            } else if (res == 0 && reading) {
+                // the file shrank since its stat
+                request.data.resize(op.offset);
+            } else if (res > 0) {
+                op.offset += static_cast<size_t>(res);
+            }
+            if (!op.failed && op.offset < request.data.size() && (res != 0 || !reading)) {
+                return true;
+            }
+            op.stage = RingOp::Stage::Close;
+            return true;
+
+        case RingOp::Stage::Close:
+            op.fd = -1;
+            if (res < 0 && !reading) {
+                op.failed = true;
+            }
+            if (reading || op.failed) {
+                break;
+            }
+            op.stage = RingOp::Stage::Statx;
+            return true;
+
+        case RingOp::Stage::Done:
+            break;
+        }
+        op.stage = RingOp::Stage::Done;
+        request.ok = !op.failed;
+        return false;
+    }
+};
+#else
+class IoBatch::Ring {
+public:
+    static std::unique_ptr<Ring> create() { return nullptr; }
+    void run(std::vector<IoRequest>&) {}
+};
+#endif
+
+IoBatch::IoBatch(const Repository& repo) {
+    ConfigParser config;
+    config.read((repo.gitdir / "config").string());
+    if (config.get("core", "ioUring", "true") != "false") {
+        ring = Ring::create();
+    }
+    // the threads mostly wait on the disk, so more of them than CPUs
+    // keeps more requests in flight
+    threads = std::max(8u, 2 * std::thread::hardware_concurrency());
+}
+
+IoBatch::~IoBatch() = default;
+
+void IoBatch::run(std::vector<IoRequest>& requests) {
+    if (ring) {
+        ring->run(requests);
+    } else {
+        run_threads(requests);
+    }
+}
+
+void IoBatch::run_threads(std::vector<IoRequest>& requests) {
+    // a worker for every few dozen requests, so small batches stay on this thread
+    constexpr size_t REQUESTS_PER_WORKER = 32;
+    size_t workers = std::min<size_t>(threads, (requests.size() + REQUESTS_PER_WORKER - 1) / REQUESTS_PER_WORKER);
+
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < requests.size();) {
+            io_request_run(requests[i]);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; i++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+}
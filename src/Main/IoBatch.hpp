@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Index.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Repository;
+
+/*
+ * Batched file I/O for the commands that touch every file of the worktree:
+ * the stats of status, the reads of add and the writes of checkout. On
+ * Linux the batch goes through io_uring, which keeps a few hundred stats,
+ * opens, reads and writes in flight at once instead of making one system
+ * call after another and waiting on each; on a cold cache or a fast SSD,
+ * the depth of the queue is what sets the speed. Where io_uring isn't
+ * there (other systems, old kernels, or a sandbox that forbids it), or
+ * with core.ioUring=false, a pool of threads does the same work with
+ * ordinary system calls.
+ */
+
+// How many requests the commands put in a batch: plenty to keep the queue
+// deep, few enough that the files read or written at once fit in memory
+constexpr size_t IO_BATCH_SIZE = 4096;
+
+struct IoRequest {
+    enum class Kind { Stat, Read, Write };
+
+    Kind kind = Kind::Stat;
+    std::filesystem::path path;
+    std::string data;          // Read: the contents (a symlink's target); Write: what to write
+    uint32_t mode = 0666;      // Write: permissions of a new file, before the umask
+
+    // Stat and Read: the path's lstat, taken before reading it; Write: the
+    // file's stat once written
+    IndexStat stat;
+    bool ok = false;
+};
+
+class IoBatch {
+public:
+    explicit IoBatch(const Repository& repo);
+    ~IoBatch();
+    IoBatch(const IoBatch&) = delete;
+    IoBatch& operator=(const IoBatch&) = delete;
+
+    // Carry out all of `requests`, in no particular order, filling in their
+    // results. A failed request has ok == false and everything else about
+    // it unspecified.
+    void run(std::vector<IoRequest>& requests);
+
+    // Whether the batches go through io_uring rather than threads
+    bool uses_io_uring() const { return ring != nullptr; }
+
+private:
+    class Ring;
+    std::unique_ptr<Ring> ring;
+    unsigned int threads;
+
+    void run_threads(std::vector<IoRequest>& requests);
+};
+
+// Carry out one request with ordinary system calls
+void io_request_run(IoRequest& request);
@@ -9,7 +9,8 @@
 #include <vector>
 #include <sstream>
 #include <iomanip>
-#include <openssl/sha.h>
+#include "Hash.hpp"
+#include "Pack.hpp"
 #include <map>
 #include <variant>
 #include <iterator>
@@ -25,6 +26,23 @@ GitBlob::GitBlob(const std::string& data) {
 
 std::string object_write(std::unique_ptr<GitObject> obj, Repository* repo);
 
+// Build the object of type `fmt` from its contents
+static std::unique_ptr<GitObject> object_from_content(const std::string& fmt, const std::string& content,
+                                                      Repository* repo, const char* sha) {
+    // pick constructor based on object type (fmt)
+    if (fmt == "commit") {
+        return std::make_unique<GitCommit>(content);
+    } else if (fmt == "tree") {
+        return std::make_unique<GitTree>(content, repo->object_format);
+    } else if (fmt == "tag") {
+        return std::make_unique<GitTag>(content);
+    } else if (fmt == "blob") {
+        return std::make_unique<GitBlob>(content);
+    } else {
+        throw std::runtime_error("Unknown type for object " + std::string(sha));
+    }
+}
+
 // Implement the GitBlob constructor that takes a string
 // For example: 
 // 
@@ -41,11 +59,22 @@ std::optional<std::unique_ptr<GitObject>> object_read(Repository* repo, char* sh
 
     std::filesystem::path path = repo_file(*repo, "objects", dirname, filename, nullptr);
 
-    // if path is not a file
+    // if path is not a file, the object may be in a pack, or written by a
+    // bulk checkin that's still open
     if (!std::filesystem::is_regular_file(path)) {
         delete[] dirname;
         delete[] filename;
-        return std::nullopt;
+        std::optional<PackedObject> packed;
+        if (repo->transaction) {
+            packed = repo->transaction->read(sha);
+        }
+        if (!packed) {
+            packed = repo_packs(*repo).read(sha);
+        }
+        if (!packed) {
+            return std::nullopt;
+        }
+        return object_from_content(packed->type, packed->data, repo, sha);
     }
 
     // delete these because they're not needed anymore
@@ -149,81 +178,110 @@ std::optional<std::unique_ptr<GitObject>> object_read(Repository* repo, char* sh
         throw std::runtime_error("Malformed object: size mismatch.");
     }
 
-    // pick constructor based on object type (fmt)
-    if (fmt == "commit") {
-        // convert unique_ptr<GitCommit> to unique_ptr<GitObject>
-        std::unique_ptr<GitObject> obj = std::make_unique<GitCommit>(content);
-        return obj;
-    } else if (fmt == "tree") {
-        // convert unique_ptr<GitTree> to unique_ptr<GitObject>
-        std::unique_ptr<GitObject> obj = std::make_unique<GitTree>(content);
-        return obj;
-    } else if (fmt == "tag") {
-        // convert unique_ptr<GitTag> to unique_ptr<GitObject>
-        std::unique_ptr<GitObject> obj = std::make_unique<GitTag>(content);
-        return obj;
-    } else if (fmt == "blob") {
-        // convert unique_ptr<GitBlob> to unique_ptr<GitObject>
-        std::unique_ptr<GitObject> obj = std::make_unique<GitBlob>(content);
-        return obj;
-    } else {
-        throw std::runtime_error("Unknown type for object " + std::string(sha));
+    return object_from_content(fmt, content, repo, sha);
+}
+
+// The format ids are hashed with; SHA-1 when there's no repository
+static ObjectFormat object_format_of(const Repository* repo) {
+    return repo ? repo->object_format : ObjectFormat::Sha1;
+}
+
+void object_store(Repository* repo, const std::string& sha, const std::string& header, std::string_view data,
+                  DurableWrites* writes) {
+    // a bulk checkin takes it, and checks for it itself
+    if (repo->transaction) {
+        repo->transaction->add(sha, header.substr(0, header.find(' ')), data);
+        return;
+    }
+
+    std::filesystem::path path = repo_file(*repo, "objects", sha.substr(0, 2).c_str(), sha.substr(2).c_str(), nullptr);
+    if (std::filesystem::exists(path) || repo_packs(*repo).contains(sha)) {
+        return;
+    }
+
+    // Compress data
+    std::string result = header;
+    result.append(data.data(), data.size());
+    uLongf compressed_size = compressBound(result.length());
+    std::vector<char> compressed_data(compressed_size);
+    if (compress(reinterpret_cast<Bytef*>(compressed_data.data()), &compressed_size, reinterpret_cast<const Bytef*>(result.data()), result.length()) != Z_OK) {
+        throw std::runtime_error("Failed to compress object data.");
     }
+    compressed_data.resize(compressed_size);
+
+    // Write to a temporary file, linked to its name once it's complete
+    std::string_view compressed(compressed_data.data(), compressed_data.size());
+    if (writes) {
+        writes->stage(path, compressed, FSYNC_LOOSE_OBJECT, true);
+        return;
+    }
+    DurableWrites object(*repo);
+    object.stage(path, compressed, FSYNC_LOOSE_OBJECT, true);
+    object.flush();
 }
 
-std::string object_write(std::unique_ptr<GitObject> obj, Repository* repo) {
+std::string object_write(std::unique_ptr<GitObject> obj, Repository* repo, bool write) {
     // Serialize object data
     std::string data = obj->serialize();
-    // Add header (format + space + size + null terminator + data)
-    std::string result = obj->get_fmt() + " " + std::to_string(data.length()) + '\0' + data;
+    // Header (format + space + size + null terminator), hashed before the data
+    std::string header = obj->get_fmt() + " " + std::to_string(data.length()) + '\0';
+
+    // Compute the object id
+    std::string sha = with_object_format(object_format_of(repo), [&](auto algo) {
+        using Algo = decltype(algo);
+        unsigned char hash[Algo::raw_size];
+        typename Algo::Context ctx;
+        ctx.update(header.data(), header.size());
+        ctx.update(data.data(), data.size());
+        ctx.final(hash);
+        return hash_to_hex<Algo>(hash);
+    });
 
-    // Compute SHA1 hash
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1(reinterpret_cast<const unsigned char*>(result.data()), result.length(), hash);
+    if (repo && write) {
+        object_store(repo, sha, header, data);
+    }
 
-    // Convert hash to hex string
-    std::stringstream sha_stream;
-    sha_stream << std::hex << std::setfill('0');
-    for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-        sha_stream << std::setw(2) << static_cast<unsigned>(hash[i]);
+    return sha;
+}
+
+template <typename Algo>
+std::vector<std::string> object_hash_many_as(const std::vector<std::string_view>& contents, const std::string& fmt,
+                                             Repository* repo) {
+    std::vector<std::string> headers;
+    std::vector<Sha1Input> inputs;
+    headers.reserve(contents.size());
+    inputs.reserve(contents.size());
+    for (const auto& data : contents) {
+        headers.push_back(fmt + " " + std::to_string(data.size()) + '\0');
+        inputs.push_back({headers.back(), data});
     }
-    std::string sha = sha_stream.str();
 
-    if (repo) {
-        // Compute path
-        char* sha_ptr = const_cast<char*>(sha.c_str());
-        char* dirname = new char[3];
-        strncpy(dirname, sha_ptr, 2);
-        dirname[2] = '\0';
-
-        char* filename = new char[strlen(sha_ptr) - 1];
-        strncpy(filename, sha_ptr + 2, strlen(sha_ptr) - 2);
-        filename[strlen(sha_ptr) - 2] = '\0';
-
-        std::filesystem::path path = repo_file(*repo, "objects", dirname, filename, nullptr);
-
-        if (!std::filesystem::exists(path)) {
-            // Create directory if it doesn't exist
-            std::filesystem::create_directories(path.parent_path());
-
-            // Compress data
-            uLongf compressed_size = compressBound(result.length());
-            std::vector<char> compressed_data(compressed_size);
-            if (compress(reinterpret_cast<Bytef*>(compressed_data.data()), &compressed_size, reinterpret_cast<const Bytef*>(result.data()), result.length()) != Z_OK) {
-                throw std::runtime_error("Failed to compress object data.");
-            }
-            compressed_data.resize(compressed_size);
+    std::vector<unsigned char> hashes(contents.size() * Algo::raw_size);
+    Algo::hash_many(inputs.data(), inputs.size(), hashes.data());
 
-            // Write to file
-            std::ofstream file(path, std::ios::binary);
-            file.write(compressed_data.data(), compressed_data.size());
-            file.close();
+    std::vector<std::string> shas;
+    shas.reserve(contents.size());
+    std::optional<DurableWrites> writes;
+    if (repo) {
+        writes.emplace(*repo);
+    }
+    for (size_t i = 0; i < contents.size(); i++) {
+        shas.push_back(hash_to_hex<Algo>(&hashes[i * Algo::raw_size]));
+        if (repo) {
+            object_store(repo, shas.back(), headers[i], contents[i], &*writes);
         }
-        delete[] dirname;
-        delete[] filename;
     }
+    if (writes) {
+        writes->flush();
+    }
+    return shas;
+}
 
-    return sha;
+std::vector<std::string> object_hash_many(const std::vector<std::string_view>& contents, const std::string& fmt,
+                                          Repository* repo, bool write) {
+    return with_object_format(object_format_of(repo), [&](auto algo) {
+        return object_hash_many_as<decltype(algo)>(contents, fmt, write ? repo : nullptr);
+    });
 }
 
 
@@ -235,8 +293,8 @@ std::string object_write(std::unique_ptr<GitObject> obj, Repository* repo) {
 std::vector<std::string> object_resolve(Repository* repo, std::string name) {
     std::vector<std::string> candidates;
 
-    // create a regex to match hash
-    std::regex hashRE("^[0-9A-Fa-f]{4,40}$");
+    // create a regex to match hash (up to the full length of the repository's ids)
+    std::regex hashRE("^[0-9A-Fa-f]{4," + std::to_string(object_format_hex_size(repo->object_format)) + "}$");
 
     // if it's empty, return empty vector
     if (name.empty()) {
@@ -278,6 +336,14 @@ std::vector<std::string> object_resolve(Repository* repo, std::string name) {
                 }
             }
         }
+
+        // and the packed ones, and those of a bulk checkin in progress
+        repo_packs(*repo).find_prefix(name, candidates);
+        if (repo->transaction) {
+            repo->transaction->find_prefix(name, candidates);
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
     }
 
     // if it's not a hash, it's a reference, resolve it to a sha
@@ -400,13 +466,13 @@ std::string object_find(Repository* repo, std::string name, std::string fmt, boo
     return "";
 }
 
-std::string object_hash(const std::string& data, const std::string& fmt, Repository* repo) {
+std::string object_hash(const std::string& data, const std::string& fmt, Repository* repo, bool write) {
     std::unique_ptr<GitObject> obj;
 
     if (fmt == "commit") {
         obj = std::make_unique<GitCommit>(data);
     } else if (fmt == "tree") {
-        obj = std::make_unique<GitTree>(data);
+        obj = std::make_unique<GitTree>(data, object_format_of(repo));
     } else if (fmt == "tag") {
         obj = std::make_unique<GitTag>(data);
     } else if (fmt == "blob") {
@@ -415,7 +481,7 @@ std::string object_hash(const std::string& data, const std::string& fmt, Reposit
         throw std::runtime_error("Unknown type: " + fmt);
     }
 
-    return object_write(std::move(obj), repo);
+    return object_write(std::move(obj), repo, write);
 }
 
 KVLM kvlm_parse(const std::string& data) {
@@ -538,7 +604,7 @@ std::string kvlm_serialize(const KVLM& kvlm) {
 
 // tree_parse_one
 
-static std::string sha1_to_hex(const std::string& raw) {
+static std::string raw_to_hex(const std::string& raw) {
     // convert raw bytes to hex string
     std::ostringstream oss;
     // set the stream to hex mode with leading zeros
@@ -552,7 +618,8 @@ static std::string sha1_to_hex(const std::string& raw) {
     return oss.str();
 }
 
-std::pair<GitTreeLeaf, size_t> tree_parse_one(const std::string& raw, size_t start) {
+template <typename Algo>
+std::pair<GitTreeLeaf, size_t> tree_parse_one_as(const std::string& raw, size_t start) {
     // find space in raw string
     size_t space_pos = raw.find(' ', start);
     
@@ -571,19 +638,24 @@ std::pair<GitTreeLeaf, size_t> tree_parse_one(const std::string& raw, size_t sta
     std::string path = raw.substr(space_pos + 1, null_pos - space_pos - 1);
 
     // extract sha, convert from raw bytes to hex
-    std::string sha = sha1_to_hex(raw.substr(null_pos + 1, 20));
+    std::string sha = raw_to_hex(raw.substr(null_pos + 1, Algo::raw_size));
 
     // create GitTreeLeaf object
     GitTreeLeaf leaf = {mode, path, sha};
 
-    // next offset immediately after the 20-byte SHA
-    size_t next = null_pos + 1 + 20;
+    // next offset immediately after the SHA (20 bytes, or 32 for SHA-256)
+    size_t next = null_pos + 1 + Algo::raw_size;
     return std::make_pair(leaf, next);
 }
 
+std::pair<GitTreeLeaf, size_t> tree_parse_one(const std::string& raw, size_t start, ObjectFormat format) {
+    return with_object_format(format, [&](auto algo) { return tree_parse_one_as<decltype(algo)>(raw, start); });
+}
+
 
 // tree_parse
-std::vector<GitTreeLeaf> tree_parse(const std::string& raw) {
+template <typename Algo>
+std::vector<GitTreeLeaf> tree_parse_as(const std::string& raw) {
     // start at offset 0
     size_t offset = 0;
     // create vector to store leaves
@@ -592,7 +664,7 @@ std::vector<GitTreeLeaf> tree_parse(const std::string& raw) {
     // while offset is less than raw size
     while (offset < raw.size()) {
         // parse one leaf and get next offset
-        auto [leaf, next] = tree_parse_one(raw, offset);
+        auto [leaf, next] = tree_parse_one_as<Algo>(raw, offset);
         // add leaf to vector
         leaves.push_back(leaf);
         // update offset
@@ -603,14 +675,18 @@ std::vector<GitTreeLeaf> tree_parse(const std::string& raw) {
     return leaves;
 }
 
+std::vector<GitTreeLeaf> tree_parse(const std::string& raw, ObjectFormat format) {
+    return with_object_format(format, [&](auto algo) { return tree_parse_as<decltype(algo)>(raw); });
+}
+
 // tree_leaf_sort_key
 std::string tree_leaf_sort_key(const GitTreeLeaf& leaf) {
-    // if it starts with 10, return leaf path
-    if (leaf.mode.substr(0, 2) == "10") {
-        return leaf.path;
+    // if it's a tree (040000, or 40000 before normalization), return leaf path + '/'
+    if (leaf.mode == "040000" || leaf.mode == "40000") {
+        return leaf.path + "/";
     }
-    // otherwise, return leaf path + '/'
-    return leaf.path + "/";
+    // otherwise (files, symlinks, submodules), return leaf path
+    return leaf.path;
 }
 
 // tree_serialize
@@ -645,7 +721,7 @@ std::string GitTree::serialize() {
 }
 
 void GitTree::deserialize(const std::string& data) {
-    leaves = tree_parse(data);
+    leaves = tree_parse(data, format);
 }
 
 const std::vector<GitTreeLeaf>& GitTree::get_leaves() const {
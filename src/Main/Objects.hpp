@@ -3,12 +3,14 @@
 #include <cstddef>
 #include <optional>
 #include <string> // Added for std::string
+#include <string_view>
 #include <memory> // Added for std::unique_ptr
 #include <map>    // Added for std::map used in kvlm functions
 #include <variant> // Added for std::variant
 #include <vector>
 #include <utility>
 #include "Repository.hpp" // Added for Repository class
+#include "Durable.hpp"
 
 // key-value list with message (KVLM) functions
 using KVLMValue = std::variant<std::string, std::vector<std::string>>;
@@ -24,14 +26,17 @@ public:
     std::string path;
     std::string sha;
 
+    GitTreeLeaf() = default;
     GitTreeLeaf(std::string mode, std::string path, std::string sha)
         : mode(mode), path(path), sha(sha) {}
 
 
 };
 
-std::pair<GitTreeLeaf, size_t> tree_parse_one(const std::string& raw, size_t start = 0);
-std::vector<GitTreeLeaf> tree_parse(const std::string& raw);
+// Trees hold raw ids, whose size depends on the repository's object format
+std::pair<GitTreeLeaf, size_t> tree_parse_one(const std::string& raw, size_t start = 0,
+                                              ObjectFormat format = ObjectFormat::Sha1);
+std::vector<GitTreeLeaf> tree_parse(const std::string& raw, ObjectFormat format = ObjectFormat::Sha1);
 std::string tree_leaf_sort_key(const GitTreeLeaf& leaf);
 
 /*
@@ -47,7 +52,7 @@ std::string tree_leaf_sort_key(const GitTreeLeaf& leaf);
  *
  * Output:
  *   - A string containing the serialized tree data in binary format:
- *     [mode][space][path][null][20-byte SHA] for each entry, concatenated.
+ *     [mode][space][path][null][raw SHA] for each entry, concatenated.
  *
  * Example:
  *   Input:  [ { mode: "100644", path: "b.txt", sha: "abc..." },
@@ -55,7 +60,8 @@ std::string tree_leaf_sort_key(const GitTreeLeaf& leaf);
  *   Output: "<sorted binary data with a.txt before b.txt>"
  *
  * Constraints:
- *   - SHA must be converted from 40-char hex to 20 raw bytes
+ *   - SHA must be converted from hex to raw bytes (20 for SHA-1, 32 for
+ *     SHA-256)
  *   - Entries must be sorted before serialization
  *   - Mode should not have leading zeros stripped (use as-is)
  */
@@ -143,10 +149,11 @@ private:
 class GitTree : public GitObject {
 private:
     std::vector<GitTreeLeaf> leaves;
+    ObjectFormat format = ObjectFormat::Sha1;
 public:
     // Constructor for creating a new object with data
     GitTree() = default;
-    GitTree(const std::string& data) {
+    GitTree(const std::string& data, ObjectFormat format = ObjectFormat::Sha1) : format(format) {
         deserialize(data);
     }
 
@@ -178,7 +185,17 @@ public:
     }
 };
 
-std::string object_write(std::unique_ptr<GitObject> obj, Repository* repo = nullptr);
+// Object ids are hashed with `repo`'s object format (SHA-1 without one), and
+// the object is written to it unless `write` is false
+std::string object_write(std::unique_ptr<GitObject> obj, Repository* repo = nullptr, bool write = true);
+
+// Write the object with id `sha`, `header` ("<type> <size>\0") followed by
+// `data`, unless the repository already has it: as a loose object, or into
+// the repository's bulk checkin if one is open (see Pack.hpp). A loose
+// object is staged into `writes` when it's given, for the caller to flush
+// with others, and put in place right away otherwise.
+void object_store(Repository* repo, const std::string& sha, const std::string& header, std::string_view data,
+                  DurableWrites* writes = nullptr);
 
 std::optional<std::unique_ptr<GitObject>> object_read(Repository* repo, char* sha);
 
@@ -186,4 +203,10 @@ std::vector<std::string> object_resolve(Repository* repo, std::string name);
 
 std::string object_find(Repository* repo, std::string name, std::string fmt, bool follow=true);
 
-std::string object_hash(const std::string& data, const std::string& fmt, Repository* repo = nullptr);
\ No newline at end of file
+std::string object_hash(const std::string& data, const std::string& fmt, Repository* repo = nullptr,
+                        bool write = true);
+
+// The ids of many objects of type `fmt` at once, given their contents as
+// stored, hashed side by side (see Sha1.hpp); with `repo`, also writes them
+std::vector<std::string> object_hash_many(const std::vector<std::string_view>& contents, const std::string& fmt,
+                                          Repository* repo = nullptr, bool write = true);
\ No newline at end of file
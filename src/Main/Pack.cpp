@@ -0,0 +1,696 @@
+#include "Pack.hpp"
+#include "Objects.hpp"
+#include "Repository.hpp"
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace {
+
+// Object types as a pack numbers them
+enum PackType { OBJ_COMMIT = 1, OBJ_TREE = 2, OBJ_BLOB = 3, OBJ_TAG = 4, OBJ_OFS_DELTA = 6, OBJ_REF_DELTA = 7 };
+
+constexpr char IDX_MAGIC[4] = {'\377', 't', 'O', 'c'};
+constexpr size_t IDX_HEADER_SIZE = 8;
+constexpr size_t IDX_FANOUT_SIZE = 256 * 4;
+constexpr size_t PACK_HEADER_SIZE = 12;
+
+// Deltas of deltas deeper than this are taken as a broken pack
+constexpr int MAX_DELTA_DEPTH = 10000;
+
+uint32_t read_be32(const unsigned char* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+void append_be32(std::string& out, uint32_t value) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+const char* type_name(int type) {
+    switch (type) {
+    case OBJ_COMMIT: return "commit";
+    case OBJ_TREE: return "tree";
+    case OBJ_BLOB: return "blob";
+    case OBJ_TAG: return "tag";
+    default: return nullptr;
+    }
+}
+
+int type_code(const std::string& name) {
+    if (name == "commit") return OBJ_COMMIT;
+    if (name == "tree") return OBJ_TREE;
+    if (name == "blob") return OBJ_BLOB;
+    if (name == "tag") return OBJ_TAG;
+    throw std::runtime_error("Unknown type: " + name);
+}
+
+size_t hash_size_of(ObjectFormat format) {
+    return with_object_format(format, [](auto algo) { return decltype(algo)::raw_size; });
+}
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Hex id -> raw bytes; false unless it's a full id of `size` bytes
+bool hex_to_raw(const std::string& hex, size_t size, unsigned char* out) {
+    if (hex.size() != 2 * size) {
+        return false;
+    }
+    for (size_t i = 0; i < size; i++) {
+        int high = hex_value(hex[2 * i]);
+        int low = hex_value(hex[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        out[i] = static_cast<unsigned char>((high << 4) | low);
+    }
+    return true;
+}
+
+std::string raw_to_hex(const unsigned char* raw, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(2 * size, '0');
+    for (size_t i = 0; i < size; i++) {
+        hex[2 * i] = digits[raw[i] >> 4];
+        hex[2 * i + 1] = digits[raw[i] & 0xF];
+    }
+    return hex;
+}
+
+// An entry's header: the type, and the size of the object (or delta)
+// 4 bits in the first byte and 7 in each of the following ones
+std::string entry_header(int type, uint64_t size) {
+    std::string header;
+    unsigned char c = static_cast<unsigned char>((type << 4) | (size & 15));
+    size >>= 4;
+    while (size) {
+        header += static_cast<char>(c | 0x80);
+        c = size & 0x7F;
+        size >>= 7;
+    }
+    header += static_cast<char>(c);
+    return header;
+}
+
+// Parse the header of the entry at `p`, leaving `p` after it
+bool parse_entry_header(const unsigned char*& p, const unsigned char* end, int& type, uint64_t& size) {
+    if (p >= end) {
+        return false;
+    }
+    unsigned char c = *p++;
+    type = (c >> 4) & 7;
+    size = c & 15;
+    int shift = 4;
+    while (c & 0x80) {
+        if (p >= end || shift > 57) {
+            return false;
+        }
+        c = *p++;
+        size |= uint64_t(c & 0x7F) << shift;
+        shift += 7;
+    }
+    return true;
+}
+
+// Inflate the zlib stream at `p` into `out`, which must come to `size` bytes
+bool inflate_to(const unsigned char* p, const unsigned char* end, uint64_t size, std::string& out) {
+    out.resize(size);
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        return false;
+    }
+    zs.next_in = const_cast<Bytef*>(p);
+    zs.avail_in = static_cast<uInt>(std::min<uint64_t>(end - p, UINT32_MAX));
+    // one spare byte, so a stream longer than it claims is caught
+    std::string spare(1, '\0');
+    zs.next_out = reinterpret_cast<Bytef*>(out.data());
+    zs.avail_out = static_cast<uInt>(size);
+    int ret = inflate(&zs, Z_FINISH);
+    if (ret == Z_BUF_ERROR && zs.avail_out == 0) {
+        zs.next_out = reinterpret_cast<Bytef*>(spare.data());
+        zs.avail_out = 1;
+        ret = inflate(&zs, Z_FINISH);
+    }
+    bool ok = ret == Z_STREAM_END && zs.total_out == size;
+    inflateEnd(&zs);
+    return ok;
+}
+
+// The variable-length sizes at the start of a delta
+bool delta_size(const unsigned char*& p, const unsigned char* end, uint64_t& size) {
+    size = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        if (p >= end || shift > 63) {
+            return false;
+        }
+        c = *p++;
+        size |= uint64_t(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return true;
+}
+
+// Rebuild an object from its base and a delta: copies from the base and
+// inserts of new bytes
+bool apply_delta(const std::string& base, const std::string& delta, std::string& out) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(delta.data());
+    const unsigned char* end = p + delta.size();
+    uint64_t base_size, result_size;
+    if (!delta_size(p, end, base_size) || !delta_size(p, end, result_size) || base_size != base.size()) {
+        return false;
+    }
+
+    out.clear();
+    out.reserve(result_size);
+    while (p < end) {
+        unsigned char cmd = *p++;
+        if (cmd & 0x80) {
+            // copy: which offset and size bytes follow is in the low bits
+            uint64_t offset = 0, size = 0;
+            for (int i = 0; i < 4; i++) {
+                if (cmd & (1 << i)) {
+                    if (p >= end) return false;
+                    offset |= uint64_t(*p++) << (8 * i);
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                if (cmd & (0x10 << i)) {
+                    if (p >= end) return false;
+                    size |= uint64_t(*p++) << (8 * i);
+                }
+            }
+            if (size == 0) {
+                size = 0x10000;
+            }
+            if (offset + size > base.size()) {
+                return false;
+            }
+            out.append(base, offset, size);
+        } else if (cmd) {
+            // insert the next `cmd` bytes
+            if (static_cast<size_t>(end - p) < cmd) {
+                return false;
+            }
+            out.append(reinterpret_cast<const char*>(p), cmd);
+            p += cmd;
+        } else {
+            return false;
+        }
+    }
+    return out.size() == result_size;
+}
+
+// A whole (not deltified) object stored at `offset` of `data`
+bool read_whole_entry(const char* data, size_t size, uint64_t offset, PackedObject& object) {
+    if (offset >= size) {
+        return false;
+    }
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data) + offset;
+    const unsigned char* end = reinterpret_cast<const unsigned char*>(data) + size;
+    int type;
+    uint64_t object_size;
+    if (!parse_entry_header(p, end, type, object_size) || !type_name(type)) {
+        return false;
+    }
+    object.type = type_name(type);
+    return inflate_to(p, end, object_size, object.data);
+}
+
+// A fresh name for a temporary file in `dir`
+std::filesystem::path temp_path(const std::filesystem::path& dir, const std::string& prefix) {
+    thread_local std::mt19937_64 random{std::random_device{}()};
+    static const char digits[] = "0123456789abcdef";
+    std::string name = prefix;
+    uint64_t bits = random();
+    for (int i = 0; i < 16; i++) {
+        name += digits[(bits >> (4 * i)) & 0xF];
+    }
+    return dir / name;
+}
+
+}
+
+std::unique_ptr<Packfile> Packfile::open(const std::filesystem::path& idx_path, ObjectFormat format) {
+    std::unique_ptr<Packfile> file(new Packfile());
+    file->hash_size = hash_size_of(format);
+    file->idx = MappedFile::open(idx_path);
+    if (!file->idx || file->idx->size() < IDX_HEADER_SIZE + IDX_FANOUT_SIZE + 2 * file->hash_size) {
+        return nullptr;
+    }
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(file->idx->data());
+    if (std::memcmp(data, IDX_MAGIC, 4) != 0 || read_be32(data + 4) != 2) {
+        return nullptr;
+    }
+    file->count = read_be32(data + IDX_HEADER_SIZE + 255 * 4);
+
+    // ids, CRCs and 32-bit offsets, then any 64-bit ones, then the checksums
+    size_t tables = IDX_HEADER_SIZE + IDX_FANOUT_SIZE + size_t(file->count) * (file->hash_size + 8);
+    if (file->idx->size() < tables + 2 * file->hash_size) {
+        return nullptr;
+    }
+
+    std::filesystem::path pack_path = idx_path;
+    pack_path.replace_extension(".pack");
+    file->pack = MappedFile::open(pack_path);
+    if (!file->pack || file->pack->size() < PACK_HEADER_SIZE + file->hash_size ||
+        std::memcmp(file->pack->data(), "PACK", 4) != 0) {
+        return nullptr;
+    }
+    return file;
+}
+
+const unsigned char* Packfile::oid_at(uint32_t pos) const {
+    return reinterpret_cast<const unsigned char*>(idx->data()) + IDX_HEADER_SIZE + IDX_FANOUT_SIZE +
+           size_t(pos) * hash_size;
+}
+
+uint64_t Packfile::offset_at(uint32_t pos) const {
+    const unsigned char* offsets = oid_at(count) + size_t(count) * 4;
+    uint32_t offset = read_be32(offsets + size_t(pos) * 4);
+    if (!(offset & 0x80000000u)) {
+        return offset;
+    }
+    // past 2 GiB: the offset is in the table of 64-bit ones
+    const unsigned char* large = offsets + size_t(count) * 4 + size_t(offset & 0x7FFFFFFFu) * 8;
+    if (large + 8 > reinterpret_cast<const unsigned char*>(idx->data()) + idx->size()) {
+        return UINT64_MAX;
+    }
+    return (uint64_t(read_be32(large)) << 32) | read_be32(large + 4);
+}
+
+std::optional<uint32_t> Packfile::find(const unsigned char* oid) const {
+    const unsigned char* fanout = reinterpret_cast<const unsigned char*>(idx->data()) + IDX_HEADER_SIZE;
+    uint32_t lo = oid[0] ? read_be32(fanout + (oid[0] - 1) * 4) : 0;
+    uint32_t hi = read_be32(fanout + oid[0] * 4);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = std::memcmp(oid_at(mid), oid, hash_size);
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<PackedObject> Packfile::read(const unsigned char* oid) const {
+    std::optional<uint32_t> pos = find(oid);
+    PackedObject object;
+    if (!pos || !read_at(offset_at(*pos), object, 0)) {
+        return std::nullopt;
+    }
+    return object;
+}
+
+bool Packfile::read_at(uint64_t offset, PackedObject& object, int depth) const {
+    size_t end_offset = pack->size() - hash_size;
+    if (offset < PACK_HEADER_SIZE || offset >= end_offset || depth > MAX_DELTA_DEPTH) {
+        return false;
+    }
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(pack->data()) + offset;
+    const unsigned char* end = reinterpret_cast<const unsigned char*>(pack->data()) + end_offset;
+    int type;
+    uint64_t size;
+    if (!parse_entry_header(p, end, type, size)) {
+        return false;
+    }
+    if (type_name(type)) {
+        object.type = type_name(type);
+        return inflate_to(p, end, size, object.data);
+    }
+
+    // a delta against an earlier entry (by how far back it is) or against
+    // another object of the pack (by id)
+    PackedObject base;
+    if (type == OBJ_OFS_DELTA) {
+        if (p >= end) return false;
+        unsigned char c = *p++;
+        uint64_t back = c & 0x7F;
+        while (c & 0x80) {
+            if (p >= end) return false;
+            c = *p++;
+            back = ((back + 1) << 7) | (c & 0x7F);
+        }
+        if (back == 0 || back > offset || !read_at(offset - back, base, depth + 1)) {
+            return false;
+        }
+    } else if (type == OBJ_REF_DELTA) {
+        if (static_cast<size_t>(end - p) < hash_size) return false;
+        std::optional<uint32_t> base_pos = find(p);
+        p += hash_size;
+        if (!base_pos || !read_at(offset_at(*base_pos), base, depth + 1)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    std::string delta;
+    if (!inflate_to(p, end, size, delta) || !apply_delta(base.data, delta, object.data)) {
+        return false;
+    }
+    object.type = base.type;
+    return true;
+}
+
+void Packfile::find_prefix(const std::string& prefix, std::vector<std::string>& out) const {
+    uint32_t lo = 0, hi = count;
+    if (prefix.size() >= 2 && hex_value(prefix[0]) >= 0 && hex_value(prefix[1]) >= 0) {
+        // only the ids under the prefix's first byte
+        const unsigned char* fanout = reinterpret_cast<const unsigned char*>(idx->data()) + IDX_HEADER_SIZE;
+        int first = (hex_value(prefix[0]) << 4) | hex_value(prefix[1]);
+        lo = first ? read_be32(fanout + (first - 1) * 4) : 0;
+        hi = read_be32(fanout + first * 4);
+    }
+    for (uint32_t pos = lo; pos < hi && pos < count; pos++) {
+        std::string hex = raw_to_hex(oid_at(pos), hash_size);
+        if (hex.compare(0, prefix.size(), prefix) == 0) {
+            out.push_back(std::move(hex));
+        }
+    }
+}
+
+PackStore::PackStore(const Repository& repo)
+    : dir(repo.gitdir / "objects" / "pack"), format(repo.object_format) {
+    rescan();
+}
+
+void PackStore::rescan() {
+    std::vector<std::unique_ptr<Packfile>> found;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        const std::filesystem::path& path = entry.path();
+        if (path.extension() != ".idx" || path.filename().string().rfind("pack-", 0) != 0) {
+            continue;
+        }
+        if (auto pack = Packfile::open(path, format)) {
+            found.push_back(std::move(pack));
+        }
+    }
+    std::unique_lock<std::shared_mutex> guard(lock);
+    packs.swap(found);
+}
+
+bool PackStore::contains(const std::string& sha) const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    unsigned char oid[SHA256_SIZE];
+    if (packs.empty() || !hex_to_raw(sha, hash_size_of(format), oid)) {
+        return false;
+    }
+    for (const auto& pack : packs) {
+        if (pack->contains(oid)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::optional<PackedObject> PackStore::read(const std::string& sha) const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    unsigned char oid[SHA256_SIZE];
+    if (packs.empty() || !hex_to_raw(sha, hash_size_of(format), oid)) {
+        return std::nullopt;
+    }
+    for (const auto& pack : packs) {
+        if (auto object = pack->read(oid)) {
+            return object;
+        }
+    }
+    return std::nullopt;
+}
+
+void PackStore::find_prefix(const std::string& prefix, std::vector<std::string>& out) const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    for (const auto& pack : packs) {
+        pack->find_prefix(prefix, out);
+    }
+}
+
+PackStore& repo_packs(Repository& repo) {
+    // threads writing objects to one repository may get here at once
+    static std::mutex opening;
+    std::lock_guard<std::mutex> guard(opening);
+    if (!repo.packs) {
+        repo.packs = std::make_shared<PackStore>(repo);
+    }
+    return *repo.packs;
+}
+
+OdbTransaction::OdbTransaction(Repository& repo) : repo(repo), hash_size(hash_size_of(repo.object_format)) {
+    repo.transaction = this;
+}
+
+OdbTransaction::~OdbTransaction() {
+    if (!done) {
+        abort();
+    }
+}
+
+void OdbTransaction::add(const std::string& sha, const std::string& type, std::string_view data) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (written.count(sha)) {
+        return;
+    }
+    std::filesystem::path loose = repo.gitdir / "objects" / sha.substr(0, 2) / sha.substr(2);
+    if (std::filesystem::exists(loose) || repo_packs(repo).contains(sha)) {
+        return;
+    }
+
+    Written& entry = written[sha];
+    entry.object = {type, std::string(data)};
+    order.push_back(sha);
+
+    // enough objects to be worth a pack: move the ones held so far there
+    if (pack_path.empty() && order.size() >= BULK_CHECKIN_MIN_OBJECTS) {
+        start_pack();
+        for (const auto& held : order) {
+            append(written[held], held);
+        }
+    } else if (!pack_path.empty()) {
+        append(entry, sha);
+    }
+}
+
+void OdbTransaction::start_pack() {
+    std::filesystem::path dir = repo.gitdir / "objects" / "pack";
+    std::filesystem::create_directories(dir);
+    pack_path = temp_path(dir, "tmp_pack_");
+    pack.open(pack_path, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    if (!pack.is_open()) {
+        throw std::runtime_error("Failed to create pack: " + pack_path.string());
+    }
+
+    // the object count is filled in at the end
+    std::string header = "PACK";
+    append_be32(header, 2);
+    append_be32(header, 0);
+    pack.write(header.data(), header.size());
+    pack_size = header.size();
+}
+
+void OdbTransaction::append(Written& entry, const std::string& sha) {
+    const std::string& data = entry.object.data;
+    std::string stored = entry_header(type_code(entry.object.type), data.size());
+    uLongf compressed_size = compressBound(data.size());
+    size_t header_size = stored.size();
+    stored.resize(header_size + compressed_size);
+    if (compress(reinterpret_cast<Bytef*>(&stored[header_size]), &compressed_size,
+                 reinterpret_cast<const Bytef*>(data.data()), data.size()) != Z_OK) {
+        throw std::runtime_error("Failed to compress object " + sha);
+    }
+    stored.resize(header_size + compressed_size);
+
+    entry.offset = pack_size;
+    entry.crc = crc32(0, reinterpret_cast<const Bytef*>(stored.data()), stored.size());
+    pack.write(stored.data(), stored.size());
+    if (!pack) {
+        throw std::runtime_error("Failed to write pack: " + pack_path.string());
+    }
+    pack_size += stored.size();
+
+    // from now on it's read back from the pack
+    entry.object = PackedObject();
+}
+
+bool OdbTransaction::contains(const std::string& sha) const {
+    std::lock_guard<std::mutex> guard(lock);
+    return written.count(sha) != 0;
+}
+
+std::optional<PackedObject> OdbTransaction::read(const std::string& sha) const {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = written.find(sha);
+    if (it == written.end()) {
+        return std::nullopt;
+    }
+    if (pack_path.empty()) {
+        return it->second.object;
+    }
+
+    pack.flush();
+    auto map = MappedFile::open(pack_path);
+    PackedObject object;
+    if (!map || !read_whole_entry(map->data(), map->size(), it->second.offset, object)) {
+        return std::nullopt;
+    }
+    return object;
+}
+
+void OdbTransaction::find_prefix(const std::string& prefix, std::vector<std::string>& out) const {
+    std::lock_guard<std::mutex> guard(lock);
+    for (const auto& [sha, entry] : written) {
+        if (sha.compare(0, prefix.size(), prefix) == 0) {
+            out.push_back(sha);
+        }
+    }
+}
+
+void OdbTransaction::commit() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (done) {
+        return;
+    }
+    done = true;
+    repo.transaction = nullptr;
+
+    if (pack_path.empty()) {
+        // too few for a pack; loose, flushed together
+        DurableWrites writes(repo);
+        for (const auto& sha : order) {
+            const PackedObject& object = written[sha].object;
+            object_store(&repo, sha, object.type + " " + std::to_string(object.data.size()) + '\0', object.data,
+                         &writes);
+        }
+        writes.flush();
+    } else if (!order.empty()) {
+        finish_pack();
+    }
+    written.clear();
+    order.clear();
+}
+
+void OdbTransaction::finish_pack() {
+    std::string count;
+    append_be32(count, static_cast<uint32_t>(order.size()));
+    pack.seekp(8);
+    pack.write(count.data(), count.size());
+    pack.close();
+    if (!pack) {
+        abort();
+        throw std::runtime_error("Failed to write pack: " + pack_path.string());
+    }
+
+    // the pack ends with the hash of everything before it, which also names it
+    std::string trailer(hash_size, '\0');
+    {
+        auto map = MappedFile::open(pack_path);
+        if (!map) {
+            abort();
+            throw std::runtime_error("Failed to read back pack: " + pack_path.string());
+        }
+        with_object_format(repo.object_format, [&](auto algo) {
+            using Algo = decltype(algo);
+            Algo::hash(map->data(), map->size(), reinterpret_cast<unsigned char*>(trailer.data()));
+        });
+    }
+    if (!std::ofstream(pack_path, std::ios::binary | std::ios::app).write(trailer.data(), trailer.size())) {
+        abort();
+        throw std::runtime_error("Failed to write pack: " + pack_path.string());
+    }
+
+    // the index: ids in order, with a fanout table over their first byte,
+    // then CRCs and offsets in the same order
+    struct IdxEntry {
+        std::string oid;
+        uint32_t crc;
+        uint64_t offset;
+    };
+    std::vector<IdxEntry> entries;
+    entries.reserve(order.size());
+    for (const auto& sha : order) {
+        IdxEntry entry{std::string(hash_size, '\0'), written[sha].crc, written[sha].offset};
+        hex_to_raw(sha, hash_size, reinterpret_cast<unsigned char*>(entry.oid.data()));
+        entries.push_back(std::move(entry));
+    }
+    std::sort(entries.begin(), entries.end(), [](const IdxEntry& a, const IdxEntry& b) { return a.oid < b.oid; });
+
+    std::string idx(IDX_MAGIC, 4);
+    append_be32(idx, 2);
+    uint32_t fanout[256] = {};
+    for (const auto& entry : entries) {
+        fanout[static_cast<unsigned char>(entry.oid[0])]++;
+    }
+    for (int i = 0, total = 0; i < 256; i++) {
+        total += fanout[i];
+        append_be32(idx, total);
+    }
+    for (const auto& entry : entries) {
+        idx += entry.oid;
+    }
+    for (const auto& entry : entries) {
+        append_be32(idx, entry.crc);
+    }
+    std::vector<uint64_t> large;
+    for (const auto& entry : entries) {
+        if (entry.offset < 0x80000000u) {
+            append_be32(idx, static_cast<uint32_t>(entry.offset));
+        } else {
+            append_be32(idx, 0x80000000u | static_cast<uint32_t>(large.size()));
+            large.push_back(entry.offset);
+        }
+    }
+    for (uint64_t offset : large) {
+        append_be32(idx, static_cast<uint32_t>(offset >> 32));
+        append_be32(idx, static_cast<uint32_t>(offset));
+    }
+    idx += trailer;
+    std::string idx_hash(hash_size, '\0');
+    with_object_format(repo.object_format, [&](auto algo) {
+        decltype(algo)::hash(idx.data(), idx.size(), reinterpret_cast<unsigned char*>(idx_hash.data()));
+    });
+    idx += idx_hash;
+
+    // the pack goes in place first; readers only find it once its index is
+    std::filesystem::path dir = pack_path.parent_path();
+    std::string name = "pack-" + raw_to_hex(reinterpret_cast<const unsigned char*>(trailer.data()), hash_size);
+    DurableWrites writes(repo);
+    writes.stage_file(pack_path, dir / (name + ".pack"), FSYNC_PACK, true);
+    writes.stage(dir / (name + ".idx"), idx, FSYNC_PACK, true);
+    writes.flush();
+    pack_path.clear();
+
+    if (repo.packs) {
+        repo.packs->rescan();
+    }
+}
+
+void OdbTransaction::abort() {
+    done = true;
+    if (repo.transaction == this) {
+        repo.transaction = nullptr;
+    }
+    if (pack.is_open()) {
+        pack.close();
+    }
+    if (!pack_path.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(pack_path, ec);
+        pack_path.clear();
+    }
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "Hash.hpp"
+#include "Utils.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class Repository;
+
+/*
+ * Packfiles, in Git's format: many objects in objects/pack/pack-<id>.pack,
+ * each one zlib-compressed after a short type and size header, and a
+ * version 2 index of their ids beside it (pack-<id>.idx). Objects that
+ * aren't loose are looked up in the packs; deltas against other objects
+ * of the pack (as git gc and fetch write them) are resolved on the way.
+ *
+ * Bulk checkin: while an OdbTransaction is open on a repository, the
+ * objects written to it are appended to one new pack instead of each
+ * getting a loose file, which saves a directory lookup, a create and a
+ * close per object, and an inode each. The transaction's in-memory index
+ * of what it wrote answers reads and dedups repeats until it's committed;
+ * then the pack's .idx is written next to it, and the pack becomes visible
+ * to readers when the .idx is renamed into place. A transaction that
+ * writes only a few objects leaves them loose, so small adds don't leave
+ * a trail of tiny packs behind.
+ */
+
+// Fewer new objects than this are written loose by a transaction
+constexpr size_t BULK_CHECKIN_MIN_OBJECTS = 64;
+
+// An object as it's stored: its type ("blob", "tree", ...) and contents
+struct PackedObject {
+    std::string type;
+    std::string data;
+};
+
+// One pack and its index
+class Packfile {
+public:
+    // Returns nullptr if the index or the pack can't be read
+    static std::unique_ptr<Packfile> open(const std::filesystem::path& idx_path, ObjectFormat format);
+
+    bool contains(const unsigned char* oid) const { return find(oid).has_value(); }
+    std::optional<PackedObject> read(const unsigned char* oid) const;
+
+    // Append the ids (hex) starting with `prefix` (lowercase hex)
+    void find_prefix(const std::string& prefix, std::vector<std::string>& out) const;
+
+    size_t size() const { return count; }
+
+private:
+    Packfile() = default;
+
+    std::shared_ptr<MappedFile> idx;
+    std::shared_ptr<MappedFile> pack;
+    size_t hash_size = 0;
+    uint32_t count = 0;
+
+    // Position of `oid` among the sorted ids
+    std::optional<uint32_t> find(const unsigned char* oid) const;
+    const unsigned char* oid_at(uint32_t pos) const;
+    uint64_t offset_at(uint32_t pos) const;
+    bool read_at(uint64_t offset, PackedObject& object, int depth) const;
+};
+
+// The packs of a repository, as found in objects/pack when first needed
+class PackStore {
+public:
+    explicit PackStore(const Repository& repo);
+
+    bool contains(const std::string& sha) const;
+    std::optional<PackedObject> read(const std::string& sha) const;
+    void find_prefix(const std::string& prefix, std::vector<std::string>& out) const;
+
+    // Pick up packs added since
+    void rescan();
+
+private:
+    std::filesystem::path dir;
+    ObjectFormat format;
+    mutable std::shared_mutex lock;     // rescan() against readers
+    std::vector<std::unique_ptr<Packfile>> packs;
+};
+
+// The packs of `repo`
+PackStore& repo_packs(Repository& repo);
+
+class OdbTransaction {
+public:
+    // Start a bulk checkin on `repo`: objects written to it from now on go
+    // to this transaction until it's committed or destroyed, and what
+    // isn't committed by then is thrown away
+    explicit OdbTransaction(Repository& repo);
+    ~OdbTransaction();
+    OdbTransaction(const OdbTransaction&) = delete;
+    OdbTransaction& operator=(const OdbTransaction&) = delete;
+
+    // Write the object `sha`, unless the repository or the transaction
+    // has it already. Safe to call from several threads at once.
+    void add(const std::string& sha, const std::string& type, std::string_view data);
+
+    bool contains(const std::string& sha) const;
+    std::optional<PackedObject> read(const std::string& sha) const;
+    void find_prefix(const std::string& prefix, std::vector<std::string>& out) const;
+
+    // Make everything written so far visible in the repository, and end
+    // the transaction
+    void commit();
+
+private:
+    struct Written {
+        uint64_t offset = 0;   // in the pack, once there is one
+        uint32_t crc = 0;      // of the entry as stored in the pack
+        PackedObject object;   // until the objects go to a pack
+    };
+
+    Repository& repo;
+    size_t hash_size;
+    mutable std::mutex lock;            // objects may be added from many threads
+    std::unordered_map<std::string, Written> written;
+    std::vector<std::string> order;     // ids in the order written
+
+    std::filesystem::path pack_path;    // the temporary pack, once started
+    mutable std::fstream pack;          // flushed before reading it back
+    uint64_t pack_size = 0;
+    bool done = false;
+
+    void start_pack();
+    void append(Written& entry, const std::string& sha);
+    void finish_pack();
+    void abort();
+};
@@ -31,10 +31,31 @@ Repository::Repository(const std::filesystem::path& path, bool force) : worktree
 
     if (!force) {
         int vers = std::stoi(conf_parser.get("core", "repositoryformatversion", "0"));
-        if (vers != 0) {
+        if (vers != 0 && vers != 1) {
             throw std::runtime_error("Unsupported repository format version: " + std::to_string(vers));
         }
     }
+
+    // Version 1 repositories may hash their objects with something other
+    // than SHA-1. Read even when forced, which is how the commands open the
+    // repository they run in.
+    if (conf_parser.get("core", "repositoryformatversion", "0") == "1") {
+        std::string format_name = conf_parser.get("extensions", "objectformat", "sha1");
+        std::optional<ObjectFormat> format = parse_object_format(format_name);
+        if (format) {
+            object_format = *format;
+        } else if (!force) {
+            throw std::runtime_error("Unknown object format: " + format_name);
+        }
+    }
+
+    fsync = fsync_policy(conf_parser);
+    try {
+        ref_lock_timeout = std::stol(conf_parser.get("core", "filesRefLockTimeout",
+                                                     std::to_string(REF_LOCK_TIMEOUT_MS)));
+    } catch (const std::exception&) {
+        ref_lock_timeout = REF_LOCK_TIMEOUT_MS;
+    }
 }
 
 
@@ -135,8 +156,9 @@ std::filesystem::path repo_dir(const Repository& repo, bool create, const char*
 
 
 // Creates a new repository at the given path. this should only called once, by cmd_init
-Repository repo_create(const std::filesystem::path& path) {
+Repository repo_create(const std::filesystem::path& path, ObjectFormat format) {
     Repository repo(path, true);
+    repo.object_format = format;
 
     // If the work tree exists
     if (std::filesystem::exists(repo.worktree)) {
@@ -186,7 +208,7 @@ Repository repo_create(const std::filesystem::path& path) {
     std::filesystem::path config_path = repo_file(repo, "config", nullptr);
     std::ofstream config_file(config_path);
     if (config_file.is_open()) {
-        config_file << repo_default_config();
+        config_file << repo_default_config(format);
         config_file.close();
     } else {
         throw std::runtime_error("Failed to create config file: " + config_path.string());
@@ -196,11 +218,15 @@ Repository repo_create(const std::filesystem::path& path) {
 }
 
 // Default config, use config parser
-std::string repo_default_config() {
+std::string repo_default_config(ObjectFormat format) {
     ConfigParser config;
-    config.set("core", "repositoryformatversion", "0");
+    // Anything but SHA-1 needs version 1, so that older tools refuse the repository
+    config.set("core", "repositoryformatversion", format == ObjectFormat::Sha1 ? "0" : "1");
     config.set("core", "filemode", "false");
     config.set("core", "bare", "false");
+    if (format != ObjectFormat::Sha1) {
+        config.set("extensions", "objectformat", object_format_name(format));
+    }
 
     return config.toString();
 }
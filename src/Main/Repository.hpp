@@ -6,9 +6,14 @@
 #include <filesystem>
 #include <cstdarg>
 #include <optional>
+#include <memory>
+#include "Hash.hpp"
+#include "Durable.hpp"
 
 // Forward declaration
 class ConfigParser;
+class PackStore;
+class OdbTransaction;
 
 class Repository {
 public:
@@ -16,6 +21,11 @@ public:
     std::filesystem::path gitdir;   // The .git directory
     std::filesystem::path conf;
     bool force;
+    ObjectFormat object_format = ObjectFormat::Sha1; // extensions.objectFormat
+    std::shared_ptr<PackStore> packs;             // opened when first needed, see Pack.hpp
+    OdbTransaction* transaction = nullptr;        // bulk checkin in progress, if any
+    FsyncPolicy fsync;                            // core.fsync, see Durable.hpp
+    long ref_lock_timeout = REF_LOCK_TIMEOUT_MS;  // core.filesRefLockTimeout, in ms
 
     // If gitdir is not a repo, raise an exception
     Repository(const std::filesystem::path& path, bool force = false);
@@ -25,9 +35,9 @@ public:
 std::filesystem::path repo_path(const Repository& repo, const char* first, ...);
 std::filesystem::path repo_file(const Repository& repo, const char* first, ...);
 std::filesystem::path repo_dir(const Repository& repo, bool create, const char* first, ...);
-Repository repo_create(const std::filesystem::path& path);
+Repository repo_create(const std::filesystem::path& path, ObjectFormat format = ObjectFormat::Sha1);
 std::optional<Repository> repo_find(std::filesystem::path path = ".", bool required = true);
-std::string repo_default_config();
+std::string repo_default_config(ObjectFormat format = ObjectFormat::Sha1);
 std::optional<std::string> ref_resolve(const Repository& repo, const std::string& ref);
 std::map<std::string, std::string> ref_list(const Repository& repo, const std::filesystem::path& path_prefix = "");
 
@@ -0,0 +1,339 @@
+#include "Scan.hpp"
+#include "Ignore.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+bool is_dot_or_dotdot(const char* name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+#ifdef __linux__
+// The record getdents64 fills its buffer with
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+constexpr size_t DIRENT_BUFFER_SIZE = 64 * 1024;
+
+// Read the directory open at `fd`. Only filesystems that don't fill in
+// d_type cost a stat per entry.
+bool read_entries(int fd, DirListing& listing) {
+    alignas(LinuxDirent64) static thread_local char buffer[DIRENT_BUFFER_SIZE];
+    for (;;) {
+        long size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (size < 0) {
+            return false;
+        }
+        if (size == 0) {
+            return true;
+        }
+        for (long offset = 0; offset < size;) {
+            const LinuxDirent64* entry = reinterpret_cast<const LinuxDirent64*>(buffer + offset);
+            offset += entry->d_reclen;
+            if (is_dot_or_dotdot(entry->d_name)) {
+                continue;
+            }
+
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+            if (type == DT_DIR) {
+                listing.dirs.emplace_back(entry->d_name);
+            } else if (type == DT_REG || type == DT_LNK) {
+                listing.files.push_back({entry->d_name, type == DT_LNK});
+            }
+        }
+    }
+}
+
+constexpr int DIR_OPEN_FLAGS = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+#endif
+
+// The worktree a scan reads directories of, by path relative to it
+class ScanRoot {
+public:
+    explicit ScanRoot(const std::filesystem::path& worktree) : worktree(worktree) {
+#ifdef __linux__
+        fd = open(worktree.c_str(), DIR_OPEN_FLAGS);
+#endif
+    }
+    ~ScanRoot() {
+#ifdef __linux__
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+    ScanRoot(const ScanRoot&) = delete;
+    ScanRoot& operator=(const ScanRoot&) = delete;
+
+    // The contents of the file at `rel`, empty if it can't be read
+    std::string read_file(const std::string& rel) const {
+        std::string data;
+#ifdef __linux__
+        int file_fd = fd < 0 ? -1 : openat(fd, rel.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file_fd < 0) {
+            return data;
+        }
+        char buffer[16 * 1024];
+        ssize_t got;
+        while ((got = read(file_fd, buffer, sizeof(buffer))) > 0) {
+            data.append(buffer, static_cast<size_t>(got));
+        }
+        close(file_fd);
+#else
+        std::ifstream file(worktree / rel, std::ios::binary);
+        data.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+#endif
+        return data;
+    }
+
+    // `rel` is empty or ends in '/'
+    bool list(const std::string& rel, DirListing& listing) const {
+#ifdef __linux__
+        if (fd < 0) {
+            return false;
+        }
+        int dir_fd = openat(fd, rel.empty() ? "." : rel.c_str(), DIR_OPEN_FLAGS);
+        if (dir_fd < 0) {
+            return false;
+        }
+        bool ok = read_entries(dir_fd, listing);
+        close(dir_fd);
+        return ok;
+#else
+        return read_dir(worktree / rel, listing);
+#endif
+    }
+
+private:
+    std::filesystem::path worktree;
+#ifdef __linux__
+    int fd = -1;
+#endif
+};
+
+// A directory of the scan and, once read, what's in it
+struct ScanDir {
+    std::string rel;                     // worktree-relative, empty or ending in '/'
+    DirListing listing;
+    std::vector<std::unique_ptr<ScanDir>> subdirs;
+
+    const ScanDir* parent = nullptr;
+    std::unique_ptr<IgnoreList> ignore;  // its .gitignore, if it has one
+    bool ignored = false;                // read only for the tracked paths inside
+};
+
+// Whether `path`, in `dir`, is ignored: by the .gitignore files of `dir`
+// and its parents, deepest first, then by the global ones
+bool scan_ignored(const ScanDir& dir, std::string_view path, bool is_dir, const IgnoreRules& rules) {
+    if (dir.ignored) {
+        return true;
+    }
+    const IgnorePattern* pattern = nullptr;
+    for (const ScanDir* d = &dir; d && !pattern; d = d->parent) {
+        if (d->ignore) {
+            pattern = d->ignore->match(path, is_dir);
+        }
+    }
+    if (!pattern) {
+        pattern = rules.match_global(path, is_dir);
+    }
+    return pattern && !pattern->negated;
+}
+
+// Drop what `ignore` leaves out of the listing of `dir`, reading its
+// .gitignore first
+void filter_ignored(ScanDir& dir, const ScanRoot& root, const ScanIgnore& ignore) {
+    auto& files = dir.listing.files;
+    for (const auto& file : files) {
+        if (file.path == ".gitignore" && !file.symlink) {
+            dir.ignore = std::make_unique<IgnoreList>(root.read_file(dir.rel + ".gitignore"), dir.rel,
+                                                      dir.rel + ".gitignore");
+            break;
+        }
+    }
+
+    auto dropped = [&](const std::string& name, bool is_dir) {
+        std::string path = dir.rel + name;
+        return scan_ignored(dir, path, is_dir, *ignore.rules) && !(ignore.tracked && ignore.tracked(path, is_dir));
+    };
+    files.erase(std::remove_if(files.begin(), files.end(),
+                               [&](const ScanEntry& file) { return dropped(file.path, false); }),
+                files.end());
+    auto& names = dir.listing.dirs;
+    names.erase(std::remove_if(names.begin(), names.end(),
+                               [&](const std::string& name) { return dropped(name, true); }),
+                names.end());
+}
+
+// Directories still to read, shared by the workers. A directory is pending
+// from when it's found until it has been read, so the scan is over when
+// nothing is pending.
+class ScanQueue {
+public:
+    explicit ScanQueue(ScanDir* root) : todo{root}, pending(1) {}
+
+    void run(const ScanRoot& root, const ScanIgnore* ignore) {
+        for (;;) {
+            ScanDir* dir;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this] { return !todo.empty() || pending == 0; });
+                if (todo.empty()) {
+                    return;
+                }
+                dir = todo.back();
+                todo.pop_back();
+            }
+
+            root.list(dir->rel, dir->listing);
+            auto& names = dir->listing.dirs;
+            names.erase(std::remove(names.begin(), names.end(), ".git"), names.end());
+            if (ignore) {
+                filter_ignored(*dir, root, *ignore);
+            }
+            for (const auto& name : names) {
+                auto sub = std::make_unique<ScanDir>();
+                sub->rel = dir->rel + name + "/";
+                sub->parent = dir;
+                // kept for what's tracked inside, everything else in it is ignored
+                sub->ignored = ignore && scan_ignored(*dir, std::string_view(sub->rel).substr(0, sub->rel.size() - 1),
+                                                      true, *ignore->rules);
+                dir->subdirs.push_back(std::move(sub));
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& sub : dir->subdirs) {
+                todo.push_back(sub.get());
+            }
+            pending += dir->subdirs.size();
+            pending--;
+            if (pending == 0 || !dir->subdirs.empty()) {
+                ready.notify_all();
+            }
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<ScanDir*> todo;      // a stack, so workers go depth first
+    size_t pending;
+};
+
+// Append the files of `dir` and its subdirectories to `out` in index
+// order, where a directory sorts as if its name ended in '/'
+void collect(ScanDir& dir, std::vector<ScanEntry>& out) {
+    auto& files = dir.listing.files;
+    std::sort(files.begin(), files.end(), [](const ScanEntry& a, const ScanEntry& b) { return a.path < b.path; });
+    std::sort(dir.subdirs.begin(), dir.subdirs.end(),
+              [](const std::unique_ptr<ScanDir>& a, const std::unique_ptr<ScanDir>& b) { return a->rel < b->rel; });
+
+    size_t f = 0;
+    for (auto& sub : dir.subdirs) {
+        std::string_view key = std::string_view(sub->rel).substr(dir.rel.size());
+        for (; f < files.size() && std::string_view(files[f].path) < key; f++) {
+            out.push_back({dir.rel + files[f].path, files[f].symlink});
+        }
+        collect(*sub, out);
+        sub.reset();
+    }
+    for (; f < files.size(); f++) {
+        out.push_back({dir.rel + files[f].path, files[f].symlink});
+    }
+}
+}
+
+bool read_dir(const std::filesystem::path& path, DirListing& listing) {
+#ifdef __linux__
+    int fd = open(path.c_str(), DIR_OPEN_FLAGS);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = read_entries(fd, listing);
+    close(fd);
+    return ok;
+#else
+    std::error_code ec;
+    std::filesystem::directory_iterator it(path, ec);
+    if (ec) {
+        return false;
+    }
+    for (const auto& entry : it) {
+        std::string name = entry.path().filename().string();
+        if (entry.is_symlink(ec)) {
+            listing.files.push_back({name, true});
+        } else if (entry.is_regular_file(ec)) {
+            listing.files.push_back({name, false});
+        } else if (entry.is_directory(ec)) {
+            listing.dirs.push_back(name);
+        }
+    }
+    return true;
+#endif
+}
+
+std::vector<ScanEntry> scan_worktree(const std::filesystem::path& worktree, const std::string& dir,
+                                     unsigned int threads, const ScanIgnore* ignore) {
+    ScanRoot root(worktree);
+    ScanDir top;
+    if (!dir.empty()) {
+        top.rel = dir.back() == '/' ? dir : dir + "/";
+    }
+
+    // the .gitignore files above the directory apply too
+    std::vector<std::unique_ptr<ScanDir>> above;
+    for (size_t end = 0; ignore && end < top.rel.size(); end = top.rel.find('/', end) + 1) {
+        auto parent = std::make_unique<ScanDir>();
+        parent->rel = top.rel.substr(0, end);
+        parent->parent = above.empty() ? nullptr : above.back().get();
+        std::string text = root.read_file(parent->rel + ".gitignore");
+        if (!text.empty()) {
+            parent->ignore = std::make_unique<IgnoreList>(text, parent->rel, parent->rel + ".gitignore");
+        }
+        above.push_back(std::move(parent));
+    }
+    top.parent = above.empty() ? nullptr : above.back().get();
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    ScanQueue queue(&top);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; i++) {
+        workers.emplace_back([&] { queue.run(root, ignore); });
+    }
+    queue.run(root, ignore);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    std::vector<ScanEntry> result;
+    collect(top, result);
+    return result;
+}
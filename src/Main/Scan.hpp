@@ -0,0 +1,52 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class IgnoreRules;
+
+/*
+ * Worktree scanning for add and status. On Linux directories are read with
+ * getdents64, which hands out the file type of every entry along with its
+ * name, so nothing needs a stat just to tell files from directories, and
+ * each directory is opened relative to the worktree's descriptor instead of
+ * by its full path. Directories are read by a pool of workers at once; the
+ * results are put together in index order at the end.
+ *
+ * Only regular files, symlinks and directories are listed. A directory
+ * called .git is a repository of its own (or this one), never part of the
+ * worktree, and is left out wherever it is. With ignore rules, each worker
+ * reads the .gitignore of the directory it lists, and ignored directories
+ * are never opened.
+ */
+
+struct ScanEntry {
+    std::string path;        // a name in a listing, worktree-relative in a scan
+    bool symlink = false;
+};
+
+// The entries of one directory, in no particular order
+struct DirListing {
+    std::vector<ScanEntry> files;
+    std::vector<std::string> dirs;
+};
+
+// Read the directory at `path`; false if it can't be opened
+bool read_dir(const std::filesystem::path& path, DirListing& listing);
+
+// What a scan leaves out besides .git: whatever `rules` ignore, except
+// for tracked paths (a directory is tracked when something under it is),
+// which `tracked` tells. The calls to `tracked` come from several threads.
+struct ScanIgnore {
+    const IgnoreRules* rules = nullptr;
+    std::function<bool(std::string_view path, bool is_dir)> tracked;
+};
+
+// Every file under the directory `dir` of the worktree (worktree-relative,
+// empty for all of it, which must not be ignored itself), in index order.
+// `threads` workers read directories in parallel, 0 for one per CPU.
+std::vector<ScanEntry> scan_worktree(const std::filesystem::path& worktree, const std::string& dir = "",
+                                     unsigned int threads = 0, const ScanIgnore* ignore = nullptr);
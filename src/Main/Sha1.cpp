@@ -0,0 +1,500 @@
+// OpenSSL 3 deprecates the SHA1_* calls, which are the fallback here
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include "Sha1.hpp"
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SILT_SHA1_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace {
+constexpr uint32_t SHA1_IV[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+constexpr size_t BLOCK_SIZE = 64;
+
+void store_be32(unsigned char* out, uint32_t value) {
+    out[0] = static_cast<unsigned char>(value >> 24);
+    out[1] = static_cast<unsigned char>(value >> 16);
+    out[2] = static_cast<unsigned char>(value >> 8);
+    out[3] = static_cast<unsigned char>(value);
+}
+
+void store_be64(unsigned char* out, uint64_t value) {
+    store_be32(out, static_cast<uint32_t>(value >> 32));
+    store_be32(out + 4, static_cast<uint32_t>(value));
+}
+
+#ifdef SILT_SHA1_X86
+struct CpuFeatures {
+    bool sha_ni = false;
+    bool avx2 = false;
+    bool avx512 = false;
+
+    CpuFeatures() {
+        __builtin_cpu_init();
+        unsigned int eax, ebx, ecx, edx;
+        bool leaf7 = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+        sha_ni = leaf7 && (ebx & (1u << 29)) && __builtin_cpu_supports("sse4.1");
+        avx2 = __builtin_cpu_supports("avx2");
+        avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    }
+};
+
+const CpuFeatures& cpu() {
+    static const CpuFeatures features;
+    return features;
+}
+
+// Intel's sequence for the SHA extensions: each sha1rnds4 does four
+// rounds, sha1nexte works out E for the next four, and sha1msg1/sha1msg2
+// (with an xor between them) extend the message schedule four words at a
+// time. Group g covers rounds 4g to 4g+3.
+#define SHA1NI_GROUP(g)                                                              \
+    if ((g) == 0) {                                                                  \
+        e[0] = _mm_add_epi32(e[0], msg[0]);                                          \
+    } else {                                                                         \
+        e[(g) & 1] = _mm_sha1nexte_epu32(e[(g) & 1], msg[(g) & 3]);                  \
+    }                                                                                \
+    e[((g) + 1) & 1] = abcd;                                                         \
+    if ((g) >= 3 && (g) <= 18) {                                                     \
+        msg[((g) + 1) & 3] = _mm_sha1msg2_epu32(msg[((g) + 1) & 3], msg[(g) & 3]);   \
+    }                                                                                \
+    abcd = _mm_sha1rnds4_epu32(abcd, e[(g) & 1], (g) / 5);                           \
+    if ((g) >= 1 && (g) <= 16) {                                                     \
+        msg[((g) + 3) & 3] = _mm_sha1msg1_epu32(msg[((g) + 3) & 3], msg[(g) & 3]);   \
+    }                                                                                \
+    if ((g) >= 2 && (g) <= 17) {                                                     \
+        msg[((g) + 2) & 3] = _mm_xor_si128(msg[((g) + 2) & 3], msg[(g) & 3]);        \
+    }
+
+__attribute__((target("sha,sse4.1")))
+void compress_sha_ni(uint32_t state[5], const unsigned char* data, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+    __m128i e_start = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+
+    for (; blocks > 0; blocks--, data += BLOCK_SIZE) {
+        __m128i abcd_start = abcd;
+        __m128i e[2] = {e_start, e_start};
+        __m128i msg[4];
+        for (int i = 0; i < 4; i++) {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i)), byte_swap);
+        }
+        SHA1NI_GROUP(0) SHA1NI_GROUP(1) SHA1NI_GROUP(2) SHA1NI_GROUP(3) SHA1NI_GROUP(4)
+        SHA1NI_GROUP(5) SHA1NI_GROUP(6) SHA1NI_GROUP(7) SHA1NI_GROUP(8) SHA1NI_GROUP(9)
+        SHA1NI_GROUP(10) SHA1NI_GROUP(11) SHA1NI_GROUP(12) SHA1NI_GROUP(13) SHA1NI_GROUP(14)
+        SHA1NI_GROUP(15) SHA1NI_GROUP(16) SHA1NI_GROUP(17) SHA1NI_GROUP(18) SHA1NI_GROUP(19)
+
+        e_start = _mm_sha1nexte_epu32(e[0], e_start);
+        abcd = _mm_add_epi32(abcd, abcd_start);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = static_cast<uint32_t>(_mm_extract_epi32(e_start, 3));
+}
+#undef SHA1NI_GROUP
+
+// The 80 rounds over vectors of lanes, for the multi-buffer code. The
+// round functions are passed in as macros: CH(b, c, d), PARITY(b, c, d),
+// MAJ(b, c, d), ADD(x, y), ROL(x, n), XOR(x, y) and SET1(k).
+#define SHA1_LANE_ROUND(t, F, K)                                                     \
+    {                                                                                \
+        if ((t) >= 16) {                                                             \
+            w[(t) & 15] = ROL(XOR(XOR(w[((t) - 3) & 15], w[((t) - 8) & 15]),         \
+                                  XOR(w[((t) - 14) & 15], w[(t) & 15])), 1);         \
+        }                                                                            \
+        auto temp = ADD(ADD(ROL(a, 5), F(b, c, d)), ADD(ADD(e, SET1(K)), w[(t) & 15])); \
+        e = d;                                                                       \
+        d = c;                                                                       \
+        c = ROL(b, 30);                                                              \
+        b = a;                                                                       \
+        a = temp;                                                                    \
+    }
+
+// Unrolled, so the schedule indices are constants and w stays in registers
+#define SHA1_LANE_ROUNDS                                                             \
+    _Pragma("GCC unroll 20") for (int t = 0; t < 20; t++) SHA1_LANE_ROUND(t, CH, 0x5A827999)      \
+    _Pragma("GCC unroll 20") for (int t = 20; t < 40; t++) SHA1_LANE_ROUND(t, PARITY, 0x6ED9EBA1) \
+    _Pragma("GCC unroll 20") for (int t = 40; t < 60; t++) SHA1_LANE_ROUND(t, MAJ, 0x8F1BBCDC)    \
+    _Pragma("GCC unroll 20") for (int t = 60; t < 80; t++) SHA1_LANE_ROUND(t, PARITY, 0xCA62C1D6)
+
+// One block of each of 8 messages; `state` holds word i of lane l at [i][l]
+__attribute__((target("avx2")))
+void compress_avx2(uint32_t (*state)[8], const unsigned char* const* blocks) {
+    const __m256i byte_swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                               3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i w[16];
+    // transpose 8x8 words at a time: row l is lane l, column t is word t
+    for (int half = 0; half < 2; half++) {
+        __m256i r[8];
+        for (int l = 0; l < 8; l++) {
+            r[l] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[l] + 32 * half));
+        }
+        __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+        __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]), t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+        __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]), t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+        __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]), t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+        __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+        __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+        __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+        __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+        __m256i* out = w + 8 * half;
+        out[0] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u0, u4, 0x20), byte_swap);
+        out[1] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u1, u5, 0x20), byte_swap);
+        out[2] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u2, u6, 0x20), byte_swap);
+        out[3] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u3, u7, 0x20), byte_swap);
+        out[4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u0, u4, 0x31), byte_swap);
+        out[5] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u1, u5, 0x31), byte_swap);
+        out[6] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u2, u6, 0x31), byte_swap);
+        out[7] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u3, u7, 0x31), byte_swap);
+    }
+
+    __m256i h[5];
+    for (int i = 0; i < 5; i++) {
+        h[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state[i]));
+    }
+    __m256i a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+#define ADD(x, y) _mm256_add_epi32(x, y)
+#define XOR(x, y) _mm256_xor_si256(x, y)
+#define ROL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define SET1(k) _mm256_set1_epi32(static_cast<int>(k))
+#define CH(b, c, d) XOR(d, _mm256_and_si256(b, XOR(c, d)))
+#define PARITY(b, c, d) XOR(XOR(b, c), d)
+#define MAJ(b, c, d) _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)))
+    SHA1_LANE_ROUNDS
+#undef ADD
+#undef XOR
+#undef ROL
+#undef SET1
+#undef CH
+#undef PARITY
+#undef MAJ
+
+    __m256i result[5] = {a, b, c, d, e};
+    for (int i = 0; i < 5; i++) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(state[i]), _mm256_add_epi32(h[i], result[i]));
+    }
+}
+
+// One block of each of 16 messages
+__attribute__((target("avx512f,avx512bw")))
+void compress_avx512(uint32_t (*state)[16], const unsigned char* const* blocks) {
+    // gather word t of every lane from a copy of the blocks laid side by side
+    alignas(64) uint32_t words[16][16];
+    for (int l = 0; l < 16; l++) {
+        _mm512_store_si512(words[l], _mm512_loadu_si512(blocks[l]));
+    }
+    // (the masked forms of the gather and the rotate, with every lane
+    // set, because GCC 12 warns about the undefined vector the plain forms
+    // start from)
+    static const uint32_t swap_bytes[16] = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f};
+    const __m512i byte_swap = _mm512_loadu_si512(swap_bytes);
+    const __m512i lane_index = _mm512_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208,
+                                                 224, 240);
+    __m512i w[16];
+    for (int t = 0; t < 16; t++) {
+        __m512i column = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, lane_index, &words[0][t], 4);
+        w[t] = _mm512_shuffle_epi8(column, byte_swap);
+    }
+
+    __m512i h[5];
+    for (int i = 0; i < 5; i++) {
+        h[i] = _mm512_loadu_si512(state[i]);
+    }
+    __m512i a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+#define ADD(x, y) _mm512_add_epi32(x, y)
+#define XOR(x, y) _mm512_xor_si512(x, y)
+#define ROL(x, n) _mm512_mask_rol_epi32(x, 0xFFFF, x, n)
+#define SET1(k) _mm512_set1_epi32(static_cast<int>(k))
+#define CH(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0xCA)
+#define PARITY(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0x96)
+#define MAJ(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0xE8)
+    SHA1_LANE_ROUNDS
+#undef ADD
+#undef XOR
+#undef ROL
+#undef SET1
+#undef CH
+#undef PARITY
+#undef MAJ
+
+    __m512i result[5] = {a, b, c, d, e};
+    for (int i = 0; i < 5; i++) {
+        _mm512_storeu_si512(state[i], _mm512_add_epi32(h[i], result[i]));
+    }
+}
+#undef SHA1_LANE_ROUNDS
+#undef SHA1_LANE_ROUND
+#endif
+
+bool has_sha_ni() {
+#ifdef SILT_SHA1_X86
+    return cpu().sha_ni;
+#else
+    return false;
+#endif
+}
+
+// The blocks of one message with its padding: the 0x80 byte, zeros and
+// the length in bits, to a multiple of 64 bytes
+class PaddedMessage {
+public:
+    explicit PaddedMessage(const Sha1Input& input) : input(input) {
+        size_t size = input.header.size() + input.body.size();
+        block_count = (size + 8) / BLOCK_SIZE + 1;
+    }
+
+    size_t blocks() const { return block_count; }
+
+    // Block `k`, straight from the input when it lies within the header or
+    // the body, else put together in `scratch`
+    const unsigned char* block(size_t k, unsigned char* scratch) const {
+        const std::string_view& header = input.header;
+        const std::string_view& body = input.body;
+        size_t start = k * BLOCK_SIZE;
+        if (start + BLOCK_SIZE <= header.size()) {
+            return reinterpret_cast<const unsigned char*>(header.data() + start);
+        }
+        if (start >= header.size() && start + BLOCK_SIZE <= header.size() + body.size()) {
+            return reinterpret_cast<const unsigned char*>(body.data() + (start - header.size()));
+        }
+
+        size_t filled = 0;
+        if (start < header.size()) {
+            filled = header.size() - start;
+            std::memcpy(scratch, header.data() + start, filled);
+        }
+        size_t body_start = start + filled - header.size();
+        if (body_start < body.size()) {
+            size_t n = std::min(BLOCK_SIZE - filled, body.size() - body_start);
+            std::memcpy(scratch + filled, body.data() + body_start, n);
+            filled += n;
+        }
+        std::memset(scratch + filled, 0, BLOCK_SIZE - filled);
+        size_t size = header.size() + body.size();
+        if (size >= start && size < start + BLOCK_SIZE) {
+            scratch[size - start] = 0x80;
+        }
+        if (k + 1 == block_count) {
+            store_be64(scratch + BLOCK_SIZE - 8, static_cast<uint64_t>(size) * 8);
+        }
+        return scratch;
+    }
+
+private:
+    Sha1Input input;
+    size_t block_count;
+};
+
+void hash_single(const Sha1Input& input, unsigned char* out) {
+    Sha1 hash;
+    hash.update(input.header.data(), input.header.size());
+    hash.update(input.body.data(), input.body.size());
+    hash.final(out);
+}
+
+#ifdef SILT_SHA1_X86
+// Feed the messages through LANES lanes, a lane taking the next message as
+// soon as it's done with one. Longest first, so the lanes run dry together
+// at the end; the few messages left when they do are finished one at a
+// time with SHA-NI, if there's that.
+template <size_t LANES>
+void hash_lanes(const Sha1Input* inputs, size_t count, unsigned char* out,
+                void (*compress)(uint32_t (*)[LANES], const unsigned char* const*)) {
+    std::vector<PaddedMessage> messages(inputs, inputs + count);
+    std::vector<size_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t x, size_t y) { return messages[x].blocks() > messages[y].blocks(); });
+
+    alignas(64) uint32_t state[5][LANES];
+    alignas(64) unsigned char scratch[LANES][BLOCK_SIZE];
+    static const unsigned char idle_block[BLOCK_SIZE] = {};
+    const unsigned char* blocks[LANES];
+    size_t job[LANES];
+    size_t next_block[LANES];
+    const size_t IDLE = static_cast<size_t>(-1);
+
+    size_t next = 0;
+    size_t active = 0;
+    auto start = [&](size_t lane) {
+        if (next == count) {
+            job[lane] = IDLE;
+            return;
+        }
+        job[lane] = order[next++];
+        next_block[lane] = 0;
+        for (int i = 0; i < 5; i++) {
+            state[i][lane] = SHA1_IV[i];
+        }
+        active++;
+    };
+    auto finish = [&](size_t lane) {
+        unsigned char* digest = out + job[lane] * SHA1_SIZE;
+        for (int i = 0; i < 5; i++) {
+            store_be32(digest + 4 * i, state[i][lane]);
+        }
+        active--;
+    };
+    for (size_t lane = 0; lane < LANES; lane++) {
+        start(lane);
+    }
+
+    bool single = has_sha_ni();
+    while (active > 0) {
+        if (single && next == count && active <= LANES / 4) {
+            for (size_t lane = 0; lane < LANES; lane++) {
+                if (job[lane] == IDLE) {
+                    continue;
+                }
+                uint32_t lane_state[5];
+                for (int i = 0; i < 5; i++) {
+                    lane_state[i] = state[i][lane];
+                }
+                const PaddedMessage& message = messages[job[lane]];
+                for (size_t k = next_block[lane]; k < message.blocks(); k++) {
+                    compress_sha_ni(lane_state, message.block(k, scratch[lane]), 1);
+                }
+                for (int i = 0; i < 5; i++) {
+                    state[i][lane] = lane_state[i];
+                }
+                finish(lane);
+                job[lane] = IDLE;
+            }
+            break;
+        }
+
+        for (size_t lane = 0; lane < LANES; lane++) {
+            blocks[lane] = job[lane] == IDLE ? idle_block
+                                             : messages[job[lane]].block(next_block[lane], scratch[lane]);
+        }
+        compress(state, blocks);
+        for (size_t lane = 0; lane < LANES; lane++) {
+            if (job[lane] != IDLE && ++next_block[lane] == messages[job[lane]].blocks()) {
+                finish(lane);
+                start(lane);
+            }
+        }
+    }
+}
+#endif
+}
+
+Sha1::Sha1() {
+    if (has_sha_ni()) {
+        std::memcpy(state, SHA1_IV, sizeof(state));
+    } else {
+        SHA1_Init(&ctx);
+    }
+}
+
+void Sha1::update(const void* data, size_t size) {
+#ifdef SILT_SHA1_X86
+    if (has_sha_ni()) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        size_t used = length % BLOCK_SIZE;
+        length += size;
+        if (used > 0) {
+            size_t n = std::min(size, BLOCK_SIZE - used);
+            std::memcpy(buffer + used, bytes, n);
+            bytes += n;
+            size -= n;
+            if (used + n < BLOCK_SIZE) {
+                return;
+            }
+            compress_sha_ni(state, buffer, 1);
+        }
+        compress_sha_ni(state, bytes, size / BLOCK_SIZE);
+        std::memcpy(buffer, bytes + size / BLOCK_SIZE * BLOCK_SIZE, size % BLOCK_SIZE);
+        return;
+    }
+#endif
+    SHA1_Update(&ctx, data, size);
+}
+
+void Sha1::final(unsigned char* out) {
+#ifdef SILT_SHA1_X86
+    if (has_sha_ni()) {
+        size_t used = length % BLOCK_SIZE;
+        buffer[used++] = 0x80;
+        if (used > BLOCK_SIZE - 8) {
+            std::memset(buffer + used, 0, BLOCK_SIZE - used);
+            compress_sha_ni(state, buffer, 1);
+            used = 0;
+        }
+        std::memset(buffer + used, 0, BLOCK_SIZE - 8 - used);
+        store_be64(buffer + BLOCK_SIZE - 8, length * 8);
+        compress_sha_ni(state, buffer, 1);
+        for (int i = 0; i < 5; i++) {
+            store_be32(out + 4 * i, state[i]);
+        }
+        return;
+    }
+#endif
+    SHA1_Final(out, &ctx);
+}
+
+void sha1(const void* data, size_t size, unsigned char* out) {
+    Sha1 hash;
+    hash.update(data, size);
+    hash.final(out);
+}
+
+bool sha1_engine_supported(Sha1Engine engine) {
+    switch (engine) {
+    case Sha1Engine::Auto:
+    case Sha1Engine::Single:
+        return true;
+#ifdef SILT_SHA1_X86
+    case Sha1Engine::Avx2:
+        return cpu().avx2;
+    case Sha1Engine::Avx512:
+        return cpu().avx512;
+#else
+    case Sha1Engine::Avx2:
+    case Sha1Engine::Avx512:
+        return false;
+#endif
+    }
+    return false;
+}
+
+void sha1_many(const Sha1Input* inputs, size_t count, unsigned char* out, Sha1Engine engine) {
+    if (engine == Sha1Engine::Auto) {
+        // SHA-NI does a message about as fast as AVX2 does eight, so eight
+        // lanes only pay without it; sixteen pay either way. A couple of
+        // messages aren't worth filling lanes for.
+        if (count >= 4 && sha1_engine_supported(Sha1Engine::Avx512)) {
+            engine = Sha1Engine::Avx512;
+        } else if (count >= 4 && !has_sha_ni() && sha1_engine_supported(Sha1Engine::Avx2)) {
+            engine = Sha1Engine::Avx2;
+        } else {
+            engine = Sha1Engine::Single;
+        }
+    }
+
+    switch (engine) {
+#ifdef SILT_SHA1_X86
+    case Sha1Engine::Avx2:
+        hash_lanes<8>(inputs, count, out, compress_avx2);
+        return;
+    case Sha1Engine::Avx512:
+        hash_lanes<16>(inputs, count, out, compress_avx512);
+        return;
+#endif
+    default:
+        for (size_t i = 0; i < count; i++) {
+            hash_single(inputs[i], out + i * SHA1_SIZE);
+        }
+        return;
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <openssl/sha.h>
+
+/*
+ * SHA-1 for object ids and index checksums, picking the fastest code the
+ * CPU has when the program starts.
+ *
+ * A single message goes through the SHA extensions (SHA-NI) where the CPU
+ * has them, and through OpenSSL otherwise. Many messages at once, like the
+ * blobs of an add, are hashed side by side instead: each lane of an
+ * AVX-512 (16 lanes) or AVX2 (8 lanes) register carries its own message,
+ * so one pass of the compression function moves 8 or 16 of them along by
+ * a block. Most objects are a few blocks long, and hashing them one call
+ * at a time spends as much on the set-up and padding of each call as on
+ * the rounds.
+ */
+
+constexpr size_t SHA1_SIZE = 20;
+
+// Incremental SHA-1 of one message
+class Sha1 {
+public:
+    Sha1();
+    void update(const void* data, size_t size);
+    void final(unsigned char* out);
+
+private:
+    // With SHA-NI
+    uint32_t state[5];
+    unsigned char buffer[64];
+    uint64_t length = 0;     // bytes so far
+
+    // Without
+    SHA_CTX ctx;
+};
+
+// SHA-1 of one buffer
+void sha1(const void* data, size_t size, unsigned char* out);
+
+// A message hashed as `header` followed by `body`, the way an object id
+// covers "<type> <size>\0" and then the contents
+struct Sha1Input {
+    std::string_view header;
+    std::string_view body;
+};
+
+// How a batch is hashed
+enum class Sha1Engine {
+    Auto,       // the fastest of the others the CPU has
+    Single,     // one message after another (SHA-NI or OpenSSL)
+    Avx2,       // 8 messages side by side
+    Avx512,     // 16 messages side by side
+};
+
+bool sha1_engine_supported(Sha1Engine engine);
+
+// SHA-1 of each of `inputs`, into `out` (SHA1_SIZE bytes per input)
+void sha1_many(const Sha1Input* inputs, size_t count, unsigned char* out, Sha1Engine engine = Sha1Engine::Auto);
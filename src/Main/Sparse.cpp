@@ -0,0 +1,408 @@
+#include "Sparse.hpp"
+#include "Index.hpp"
+#include "Objects.hpp"
+#include "Repository.hpp"
+#include "Utils.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace {
+// Directories are kept without slashes at either end
+std::string normalize_dir(std::string dir) {
+    size_t start = dir.find_first_not_of('/');
+    if (start == std::string::npos) {
+        return "";
+    }
+    dir.erase(0, start);
+    dir.erase(dir.find_last_not_of('/') + 1);
+    return dir;
+}
+
+std::string unescape(std::string_view pattern) {
+    std::string result;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+            i++;
+        }
+        result += pattern[i];
+    }
+    return result;
+}
+
+std::string escape(const std::string& dir) {
+    std::string result;
+    for (char c : dir) {
+        if (c == '*' || c == '?' || c == '[' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
+bool has_suffix(std::string_view s, std::string_view suffix) {
+    return s.size() >= suffix.size() && s.substr(s.size() - suffix.size()) == suffix;
+}
+
+IndexEntry skip_entry(const std::string& path, uint32_t mode, const std::string& sha) {
+    IndexEntry entry(path);
+    entry.stat.mode = mode;
+    entry.sha = sha;
+    entry.flags = static_cast<uint16_t>(std::min<size_t>(path.size(), 0xFFF));
+    entry.extended_flags = INDEX_SKIP_WORKTREE;
+    return entry;
+}
+
+// Add skip-worktree entries for everything in the tree `sha` of the
+// directory `prefix` (with its trailing slash). Subdirectories `keep`
+// leaves entirely out of a sparse index stay sparse directory entries.
+bool skip_tree_entries(Repository* repo, const std::string& sha, const std::string& prefix,
+                       const SparseCheckout* keep, std::vector<IndexEntry>& out) {
+    auto obj = object_read(repo, const_cast<char*>(sha.c_str()));
+    GitTree* tree = obj ? dynamic_cast<GitTree*>(obj->get()) : nullptr;
+    if (!tree) {
+        std::cerr << "Warning: Unable to read tree '" << sha << "'." << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    for (const auto& leaf : tree->get_leaves()) {
+        std::string path = prefix + leaf.path;
+        uint32_t mode = static_cast<uint32_t>(std::stoul(leaf.mode, nullptr, 8));
+        if ((mode & 0170000) != INDEX_SPARSE_DIR_MODE) {
+            out.push_back(skip_entry(path, index_mode_from_stat(mode), leaf.sha));
+        } else if (keep && keep->sparse_index &&
+                   keep->match_dir(path) == SparseCheckout::DirMatch::Outside) {
+            out.push_back(skip_entry(path + "/", INDEX_SPARSE_DIR_MODE, leaf.sha));
+        } else {
+            ok = skip_tree_entries(repo, leaf.sha, path + "/", keep, out) && ok;
+        }
+    }
+    return ok;
+}
+
+void prune_empty_dirs(const std::filesystem::path& worktree, const std::set<std::string>& dirs) {
+    // deepest first: a directory sorts before everything under it
+    for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+        std::filesystem::path dir = worktree / *it;
+        std::error_code ec;
+        while (dir != worktree && std::filesystem::is_empty(dir, ec) && !ec) {
+            std::filesystem::remove(dir, ec);
+            dir = dir.parent_path();
+        }
+    }
+}
+}
+
+SparseCheckout::SparseCheckout(const std::vector<std::string>& dirs) : everything(false) {
+    add_dirs(dirs);
+}
+
+void SparseCheckout::add_dirs(const std::vector<std::string>& dirs) {
+    for (const auto& dir : dirs) {
+        std::string normalized = normalize_dir(dir);
+        if (!normalized.empty()) {
+            recursive.insert(normalized);
+        }
+    }
+
+    // a directory under another one adds nothing
+    for (auto it = recursive.begin(); it != recursive.end();) {
+        bool covered = false;
+        for (size_t slash = it->find('/'); slash != std::string::npos; slash = it->find('/', slash + 1)) {
+            if (recursive.count(it->substr(0, slash))) {
+                covered = true;
+                break;
+            }
+        }
+        it = covered ? recursive.erase(it) : std::next(it);
+    }
+
+    for (const auto& dir : recursive) {
+        for (size_t slash = dir.find('/'); slash != std::string::npos; slash = dir.find('/', slash + 1)) {
+            parents.insert(dir.substr(0, slash));
+        }
+    }
+}
+
+bool SparseCheckout::parse(const std::string& text) {
+    std::istringstream stream(text);
+    std::string line;
+    std::vector<std::string> dirs;
+    std::set<std::string> negated;
+    size_t count = 0;
+
+    while (std::getline(stream, line)) {
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        // every cone starts with its top-level files and nothing else
+        if (count == 0 && line != "/*") {
+            return false;
+        }
+        if (count == 1 && line != "!/*/") {
+            return false;
+        }
+        if (count++ < 2) {
+            continue;
+        }
+
+        if (line.size() > 5 && line.compare(0, 2, "!/") == 0 && has_suffix(line, "/*/")) {
+            negated.insert(unescape(std::string_view(line).substr(2, line.size() - 5)));
+        } else if (line.size() > 2 && line[0] == '/' && line.back() == '/' && line.find('*') == std::string::npos) {
+            dirs.push_back(unescape(std::string_view(line).substr(1, line.size() - 2)));
+        } else {
+            return false;
+        }
+    }
+    if (count < 2) {
+        return false;
+    }
+
+    // the negated directories are the parents, only their files are wanted
+    dirs.erase(std::remove_if(dirs.begin(), dirs.end(),
+                              [&](const std::string& dir) { return negated.count(dir) > 0; }),
+               dirs.end());
+    everything = false;
+    recursive.clear();
+    parents = negated;
+    add_dirs(dirs);
+    return true;
+}
+
+std::optional<SparseCheckout> SparseCheckout::load(const Repository& repo) {
+    ConfigParser config;
+    config.read((repo.gitdir / "config").string());
+    if (config.get("core", "sparseCheckout") != "true") {
+        return std::nullopt;
+    }
+    if (config.get("core", "sparseCheckoutCone") == "false") {
+        std::cerr << "Warning: only cone-mode sparse checkouts are supported, ignoring it" << std::endl;
+        return std::nullopt;
+    }
+
+    SparseCheckout cone;
+    cone.everything = false;
+    std::ifstream file(repo.gitdir / "info" / "sparse-checkout");
+    if (file.is_open()) {
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        if (!cone.parse(buffer.str())) {
+            std::cerr << "Warning: the sparse-checkout patterns aren't in cone mode, ignoring them" << std::endl;
+            return std::nullopt;
+        }
+    }
+
+    // as with Git, only an explicit cone mode makes the index sparse, and
+    // a split index stays a full one
+    cone.sparse_index = config.get("index", "sparse") == "true" &&
+                        config.get("core", "sparseCheckoutCone") == "true" &&
+                        config.get("core", "splitIndex") != "true";
+    return cone;
+}
+
+bool SparseCheckout::contains(std::string_view path) const {
+    if (everything) {
+        return true;
+    }
+    size_t slash = path.rfind('/');
+    if (slash == std::string_view::npos) {
+        return true;
+    }
+    std::string_view dir = path.substr(0, slash);
+    if (parents.count(std::string(dir))) {
+        return true;
+    }
+    return match_dir(dir) == DirMatch::Inside;
+}
+
+SparseCheckout::DirMatch SparseCheckout::match_dir(std::string_view dir) const {
+    if (everything) {
+        return DirMatch::Inside;
+    }
+    if (dir.empty() || parents.count(std::string(dir))) {
+        return DirMatch::Parent;
+    }
+    // inside when the directory or one of its ancestors is wanted whole
+    for (;;) {
+        if (recursive.count(std::string(dir))) {
+            return DirMatch::Inside;
+        }
+        size_t slash = dir.rfind('/');
+        if (slash == std::string_view::npos) {
+            return DirMatch::Outside;
+        }
+        dir = dir.substr(0, slash);
+    }
+}
+
+std::string SparseCheckout::patterns() const {
+    std::string result = "/*\n!/*/\n";
+    for (const auto& dir : parents) {
+        result += "/" + escape(dir) + "/\n!/" + escape(dir) + "/*/\n";
+    }
+    for (const auto& dir : recursive) {
+        result += "/" + escape(dir) + "/\n";
+    }
+    return result;
+}
+
+bool sparse_expand(Index& index, Repository* repo, const SparseCheckout& keep) {
+    std::vector<std::pair<size_t, size_t>> ranges;
+    std::vector<IndexEntry> batch;
+    bool ok = true;
+
+    for (size_t pos = 0; pos < index.size(); pos++) {
+        IndexEntryRef entry = index[pos];
+        if (!entry.sparse_dir()) {
+            continue;
+        }
+        std::string_view path = entry.path();
+        std::string dir(path.substr(0, path.size() - 1));
+        if (keep.sparse_index && keep.match_dir(dir) == SparseCheckout::DirMatch::Outside) {
+            continue;
+        }
+        if (!skip_tree_entries(repo, entry.sha(), dir + "/", &keep, batch)) {
+            ok = false;
+            continue;
+        }
+        ranges.emplace_back(pos, pos + 1);
+    }
+
+    index.remove_ranges(ranges);
+    index.add_entries(std::move(batch));
+    return ok;
+}
+
+void sparse_collapse(Index& index, const SparseCheckout& cone) {
+    std::vector<std::pair<size_t, size_t>> ranges;
+    std::vector<IndexEntry> batch;
+
+    // recurse through the directories the cone reaches into, and fold the
+    // ones it leaves out
+    auto walk = [&](auto& self, const CacheTree& node, const std::string& prefix) -> void {
+        for (const auto& child : node.subtrees) {
+            std::string dir = prefix + child.name;
+            SparseCheckout::DirMatch match = cone.match_dir(dir);
+            if (match == SparseCheckout::DirMatch::Parent) {
+                self(self, child, dir + "/");
+                continue;
+            }
+            if (match == SparseCheckout::DirMatch::Inside || !child.valid()) {
+                continue;
+            }
+
+            auto range = index.directory_range(dir);
+            if (range.second - range.first == 1 && index[range.first].sparse_dir()) {
+                continue;
+            }
+            bool all_skipped = true;
+            for (size_t pos = range.first; pos < range.second && all_skipped; pos++) {
+                IndexEntryRef entry = index[pos];
+                // conflicts and files still in the worktree keep their entries
+                all_skipped = entry.skip_worktree() && !(entry.flags() & 0x3000);
+            }
+            if (all_skipped && range.first < range.second) {
+                ranges.push_back(range);
+                batch.push_back(skip_entry(dir + "/", INDEX_SPARSE_DIR_MODE, child.sha(index.oid_size())));
+            }
+        }
+    };
+    walk(walk, index.cache_tree(), "");
+
+    // cache tree order isn't index order ("a-b" comes before "a/")
+    std::sort(ranges.begin(), ranges.end());
+    index.remove_ranges(ranges);
+    index.add_entries(std::move(batch));
+}
+
+bool sparse_update_worktree(Index& index, Repository* repo, const SparseCheckout& cone) {
+    bool ok = sparse_expand(index, repo, cone);
+    std::vector<IndexEntry> batch;
+    std::set<std::string> emptied;
+
+    for (size_t pos = 0; pos < index.size(); pos++) {
+        IndexEntryRef entry = index[pos];
+        if (entry.sparse_dir() || (entry.flags() & 0x3000)) {
+            continue;
+        }
+        std::string_view path = entry.path();
+        bool wanted = cone.contains(path);
+        std::filesystem::path file_path = repo->worktree / path;
+
+        if (wanted && entry.skip_worktree()) {
+            // coming into the cone: check it out
+            std::string sha = entry.sha();
+            auto obj = object_read(repo, const_cast<char*>(sha.c_str()));
+            if (!obj || (*obj)->get_fmt() != "blob") {
+                std::cerr << "Warning: Unable to read object '" << sha << "'." << std::endl;
+                ok = false;
+                continue;
+            }
+            std::error_code ec;
+            std::filesystem::create_directories(file_path.parent_path(), ec);
+            std::ofstream file(file_path, std::ios::binary);
+            if (!file.is_open()) {
+                std::cerr << "Warning: Could not write file '" << file_path.string() << "'." << std::endl;
+                ok = false;
+                continue;
+            }
+            std::string data = (*obj)->serialize();
+            file.write(data.data(), data.size());
+            file.close();
+
+            IndexEntry updated = entry.to_entry();
+            index_stat(updated.stat, file_path);
+            updated.stat.mode = entry.mode();
+            updated.extended_flags &= ~INDEX_SKIP_WORKTREE;
+            batch.push_back(std::move(updated));
+        } else if (!wanted && !entry.skip_worktree()) {
+            // leaving the cone: remove it, unless that would lose changes
+            IndexStat current;
+            if (index_stat(current, file_path)) {
+                if (!entry.stat_clean(current)) {
+                    std::ifstream file(file_path, std::ios::binary);
+                    std::string content((std::istreambuf_iterator<char>(file)),
+                                        std::istreambuf_iterator<char>());
+                    if (object_hash(content, "blob", nullptr) != entry.sha()) {
+                        std::cerr << "Warning: '" << path << "' has changes that aren't staged, not removing it"
+                                  << std::endl;
+                        continue;
+                    }
+                }
+                std::error_code ec;
+                std::filesystem::remove(file_path, ec);
+                size_t slash = path.rfind('/');
+                if (slash != std::string_view::npos) {
+                    emptied.insert(std::string(path.substr(0, slash)));
+                }
+            }
+
+            IndexEntry updated = entry.to_entry();
+            updated.stat = IndexStat();
+            updated.stat.mode = entry.mode();
+            updated.extended_flags |= INDEX_SKIP_WORKTREE;
+            batch.push_back(std::move(updated));
+        }
+    }
+
+    index.add_entries(std::move(batch));
+    prune_empty_dirs(repo->worktree, emptied);
+    return ok;
+}
+
+bool sparse_skip_tree(Index& index, Repository* repo, const std::string& sha, const std::string& dir,
+                      bool sparse_index) {
+    if (sparse_index) {
+        index.add_entry(skip_entry(dir + "/", INDEX_SPARSE_DIR_MODE, sha));
+        return true;
+    }
+    std::vector<IndexEntry> batch;
+    bool ok = skip_tree_entries(repo, sha, dir + "/", nullptr, batch);
+    index.add_entries(std::move(batch));
+    return ok;
+}
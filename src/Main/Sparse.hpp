@@ -0,0 +1,88 @@
+#pragma once
+
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Repository;
+class Index;
+
+/*
+ * Cone-mode sparse checkout, as Git does it. .git/info/sparse-checkout
+ * lists the directories to check out in Git's cone format: the top-level
+ * files, then for each directory wanted, its own files and those of its
+ * ancestors (see patterns() for the exact lines).
+ *
+ * The directories wanted whole are the recursive ones; their ancestors are
+ * parents, of which only the files directly inside are in the cone. Paths
+ * outside the cone stay in the index marked skip-worktree and are left out
+ * of the worktree.
+ *
+ * With index.sparse, a directory entirely outside the cone isn't listed
+ * entry by entry: the index holds one sparse directory entry "dir/" for
+ * its tree instead, so index size and the cost of checkout, status and
+ * commit follow the cone, not the whole repository.
+ */
+class SparseCheckout {
+public:
+    // Everything, i.e. no sparse checkout
+    SparseCheckout() = default;
+
+    // The cone made of `dirs` (worktree-relative, without slashes at either end)
+    explicit SparseCheckout(const std::vector<std::string>& dirs);
+
+    // The sparse checkout enabled for the repository (core.sparseCheckout),
+    // if any. Patterns that aren't in cone mode are warned about and ignored.
+    static std::optional<SparseCheckout> load(const Repository& repo);
+
+    // Parse the contents of a sparse-checkout file; false if not cone mode
+    bool parse(const std::string& text);
+
+    // Whether the file at `path` belongs in the worktree
+    bool contains(std::string_view path) const;
+
+    enum class DirMatch {
+        Outside,    // nothing under it is in the cone
+        Parent,     // its own files are, and some of its subdirectories
+        Inside      // all of it is
+    };
+    DirMatch match_dir(std::string_view dir) const;
+
+    // The directories in the cone as a whole, and the sparse-checkout file
+    // listing them
+    const std::set<std::string>& dirs() const { return recursive; }
+    std::string patterns() const;
+
+    // Keep directories outside the cone as sparse directory entries
+    bool sparse_index = false;
+
+private:
+    bool everything = true;
+    std::set<std::string> recursive;
+    std::set<std::string> parents;
+
+    void add_dirs(const std::vector<std::string>& dirs);
+};
+
+// Replace sparse directory entries with the entries of their trees, marked
+// skip-worktree, except for directories that stay entirely outside `keep`
+// with a sparse index. Returns false if a tree can't be read.
+bool sparse_expand(Index& index, Repository* repo, const SparseCheckout& keep = SparseCheckout());
+
+// Fold every directory outside the cone whose entries are all skip-worktree
+// into a sparse directory entry for its tree. The trees come from the cache
+// tree, which has to be up to date.
+void sparse_collapse(Index& index, const SparseCheckout& cone);
+
+// Make the worktree follow `cone`: check out the files coming into it,
+// and remove the ones leaving it, marking them skip-worktree. Files with
+// changes that aren't staged are kept. Returns false if anything failed.
+bool sparse_update_worktree(Index& index, Repository* repo, const SparseCheckout& cone);
+
+// Record the tree `sha` of directory `dir`, which is outside the cone, in
+// the index without checking anything out: as a sparse directory entry,
+// or entry by entry when the index isn't sparse
+bool sparse_skip_tree(Index& index, Repository* repo, const std::string& sha, const std::string& dir,
+                      bool sparse_index);
@@ -13,6 +13,13 @@
  *   - tree_checkout
  *   - cmd_ls_tree
  *   - cmd_checkout
+ *   - SparseCheckout cone patterns for sparse checkouts
+ *   - build_tree_from_index (the trees of a commit) and its cache tree
+ *   - index_tree_changes (the staged changes of status)
+ *   - scan_worktree order and .git handling
+ *   - IgnoreList pattern kinds and precedence, and ignored directory pruning
+ *   - IoBatch stats, reads and writes, through io_uring and through threads
+ *   - Line diffs (Myers, patience, histogram) and unified diff output
  *
  * To run these tests, compile with a test framework or use assertions.
  */
@@ -29,6 +36,13 @@
 #include "Commands.hpp"
 #include "Repository.hpp"
 #include "CLI.hpp"
+#include "Sparse.hpp"
+#include "Index.hpp"
+#include "Scan.hpp"
+#include "Ignore.hpp"
+#include "IoBatch.hpp"
+#include "Diff.hpp"
+#include <fstream>
 
 // Helper function to create a raw 20-byte SHA from hex string
 std::string hex_to_raw_sha(const std::string& hex) {
@@ -54,6 +68,26 @@ std::string create_raw_tree_entry(const std::string& mode, const std::string& pa
     return entry;
 }
 
+// Helper function to run a silt command line in `repo` through the parser
+// and return what it printed, asserting it printed no errors
+std::string run_silt(Repository& repo, std::vector<std::string> words) {
+    Parser parser("silt");
+    setup_parser(parser);
+    words.insert(words.begin(), "silt");
+    std::vector<char*> argv;
+    for (auto& word : words) {
+        argv.push_back(word.data());
+    }
+    std::ostringstream out, err;
+    std::streambuf* old_out = std::cout.rdbuf(out.rdbuf());
+    std::streambuf* old_err = std::cerr.rdbuf(err.rdbuf());
+    auto result = parser.parse_and_dispatch(static_cast<int>(argv.size()), argv.data(), &repo);
+    std::cout.rdbuf(old_out);
+    std::cerr.rdbuf(old_err);
+    assert(!result && err.str().empty());
+    return out.str();
+}
+
 /*
  * ---------------------------------------------------------------------------
  * Test: GitTreeLeaf Construction
@@ -793,6 +827,761 @@ void test_tree_serialize_space_unicode_roundtrip() {
     std::cout << "PASSED" << std::endl;
 }
 
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Sparse Checkout Cone
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify a cone keeps top-level files, the files directly inside the
+ *   parents of its directories, and everything under its directories,
+ *   and that its patterns read back as the same cone.
+ *
+ * Input:
+ *   - SparseCheckout({"a/b", "a/b/c", "d/"})
+ *
+ * Expected Output:
+ *   - Git's cone-mode patterns, with a as a parent of a/b
+ */
+void test_sparse_checkout_cone() {
+    std::cout << "Test: Sparse Checkout Cone... ";
+
+    SparseCheckout cone({"a/b", "a/b/c", "d/"});
+    assert(cone.patterns() == "/*\n!/*/\n/a/\n!/a/*/\n/a/b/\n/d/\n");
+
+    assert(cone.contains("top"));
+    assert(cone.contains("a/x"));
+    assert(cone.contains("a/b/c/y"));
+    assert(cone.contains("d/e/f"));
+    assert(!cone.contains("a/c/x"));
+    assert(!cone.contains("e/x"));
+
+    assert(cone.match_dir("a") == SparseCheckout::DirMatch::Parent);
+    assert(cone.match_dir("a/b/c") == SparseCheckout::DirMatch::Inside);
+    assert(cone.match_dir("a/bc") == SparseCheckout::DirMatch::Outside);
+    assert(cone.match_dir("e") == SparseCheckout::DirMatch::Outside);
+
+    SparseCheckout parsed;
+    assert(parsed.parse(cone.patterns()));
+    assert(parsed.dirs() == cone.dirs() && parsed.patterns() == cone.patterns());
+    assert(!parsed.parse("*.txt\n"));
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Index vs Tree Changes
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify the walk of a tree alongside the index finds added, deleted,
+ *   modified and typechanged files, in and under directories, and that a
+ *   sparse directory entry is compared as the tree it stands for.
+ *
+ * Input:
+ *   - tree: a/f, a/g, b/h, link (symlink), top
+ *   - index: a/f changed, a/g, b/ (sparse, same tree), c/n, link as a file
+ *
+ * Expected Output:
+ *   - modified a/f, new file c/n, typechange link, deleted top
+ */
+void test_index_tree_changes() {
+    std::cout << "Test: Index vs Tree Changes... ";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_tree_changes";
+    std::filesystem::remove_all(dir);
+    Repository repo = repo_create(dir);
+
+    auto blob = [&](const std::string& data) { return object_hash(data, "blob", &repo); };
+    auto tree = [&](const std::vector<GitTreeLeaf>& leaves) {
+        auto obj = std::make_unique<GitTree>();
+        obj->set_leaves(leaves);
+        return object_write(std::move(obj), &repo);
+    };
+    std::string a_tree = tree({{"100644", "f", blob("f")}, {"100644", "g", blob("g")}});
+    std::string b_tree = tree({{"100644", "h", blob("h")}});
+    std::string root = tree({{"040000", "a", a_tree}, {"040000", "b", b_tree},
+                             {"120000", "link", blob("top")}, {"100644", "top", blob("top")}});
+
+    auto entry = [](const std::string& path, uint32_t mode, const std::string& sha) {
+        IndexEntry e(path);
+        e.stat.mode = mode;
+        e.sha = sha;
+        e.flags = static_cast<uint16_t>(path.size());
+        return e;
+    };
+    Index index;
+    index.add_entries({entry("a/f", 0100644, blob("f2")), entry("a/g", 0100644, blob("g")),
+                       entry("b/", INDEX_SPARSE_DIR_MODE, b_tree), entry("c/n", 0100644, blob("n")),
+                       entry("link", 0100644, blob("top"))});
+
+    auto changes = index_tree_changes(index, &repo, root);
+    std::vector<std::pair<std::string, std::string>> expected = {
+        {"modified", "a/f"}, {"new file", "c/n"}, {"typechange", "link"}, {"deleted", "top"}};
+    assert(changes == expected);
+
+    // without a tree everything is new
+    changes = index_tree_changes(index, &repo, "");
+    assert(changes.size() == 5 && changes[2] == std::make_pair(std::string("new file"), std::string("b/h")));
+
+    std::filesystem::remove_all(dir);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Trees from the Index
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify the trees written for an index, where names like "a-b" and "a.c"
+ *   sort between a directory's entries and its siblings, match the trees
+ *   built leaf by leaf, and that a second build only rewrites directories
+ *   whose cached tree was invalidated.
+ *
+ * Input:
+ *   - index: a-b, a.c, a/b/x (executable), a/b/y, a/z, b/ (sparse), c/d/e
+ *   - then a/b/y changed and a/b/x removed
+ *
+ * Expected Output:
+ *   - the same root tree as writing each tree by hand, both times, with the
+ *     cached trees of c/ and c/d/ left untouched by the second build
+ */
+void test_build_tree_from_index() {
+    std::cout << "Test: Trees from the Index... ";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_tree_from_index";
+    std::filesystem::remove_all(dir);
+    Repository repo = repo_create(dir);
+
+    auto blob = [&](const std::string& data) { return object_hash(data, "blob", &repo); };
+    auto tree = [&](const std::vector<GitTreeLeaf>& leaves) {
+        auto obj = std::make_unique<GitTree>();
+        obj->set_leaves(leaves);
+        return object_write(std::move(obj), &repo);
+    };
+    auto entry = [](const std::string& path, uint32_t mode, const std::string& sha) {
+        IndexEntry e(path);
+        e.stat.mode = mode;
+        e.sha = sha;
+        e.flags = static_cast<uint16_t>(path.size());
+        return e;
+    };
+
+    std::string b_tree = tree({{"100644", "h", blob("h")}});
+    std::string cd_tree = tree({{"100644", "e", blob("e")}});
+    Index index;
+    index.add_entries({entry("a-b", 0100644, blob("1")), entry("a.c", 0100644, blob("2")),
+                       entry("a/b/x", 0100755, blob("3")), entry("a/b/y", 0100644, blob("4")),
+                       entry("a/z", 0100644, blob("5")), entry("b/", INDEX_SPARSE_DIR_MODE, b_tree),
+                       entry("c/d/e", 0100644, blob("e"))});
+
+    std::string ab_tree = tree({{"100755", "x", blob("3")}, {"100644", "y", blob("4")}});
+    std::string a_tree = tree({{"40000", "b", ab_tree}, {"100644", "z", blob("5")}});
+    std::string c_tree = tree({{"40000", "d", cd_tree}});
+    std::string root = tree({{"100644", "a-b", blob("1")}, {"100644", "a.c", blob("2")},
+                             {"40000", "a", a_tree}, {"40000", "b", b_tree}, {"40000", "c", c_tree}});
+    assert(build_tree_from_index(index, &repo) == root);
+    assert(index.cache_tree().entry_count == 7);
+    assert(index.cache_tree().find_subtree("a")->sha(SHA1_SIZE) == a_tree);
+    assert(index.cache_tree().find_subtree("c")->find_subtree("d")->sha(SHA1_SIZE) == cd_tree);
+
+    index.add_entry(entry("a/b/y", 0100644, blob("4'")));
+    index.remove_entry("a/b/x");
+    assert(!index.cache_tree().valid() && index.cache_tree().find_subtree("c")->valid());
+
+    ab_tree = tree({{"100644", "y", blob("4'")}});
+    a_tree = tree({{"40000", "b", ab_tree}, {"100644", "z", blob("5")}});
+    root = tree({{"100644", "a-b", blob("1")}, {"100644", "a.c", blob("2")},
+                 {"40000", "a", a_tree}, {"40000", "b", b_tree}, {"40000", "c", c_tree}});
+    assert(build_tree_from_index(index, &repo) == root);
+    assert(index.cache_tree().entry_count == 6 && index.cache_tree().find_subtree("a")->entry_count == 2);
+
+    std::filesystem::remove_all(dir);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Worktree Scan
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify the scanner lists files in index order (a directory sorts as if
+ *   its name ended in '/'), leaves out .git directories but not .github or
+ *   .gitignore, reports symlinks, and can scan a single subdirectory.
+ *
+ * Input:
+ *   - a/b/f, a-b/g, a.c, .github/ci, .gitignore, lnk -> a.c, .git/HEAD,
+ *     a/.git/config
+ *
+ * Expected Output:
+ *   - .github/ci, .gitignore, a-b/g, a.c, a/b/f, lnk (a symlink)
+ */
+void test_scan_worktree() {
+    std::cout << "Test: Worktree Scan... ";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_scan";
+    std::filesystem::remove_all(dir);
+    for (const char* sub : {"a/b", "a-b", ".github", ".git", "a/.git"}) {
+        std::filesystem::create_directories(dir / sub);
+    }
+    for (const char* file : {"a/b/f", "a-b/g", "a.c", ".github/ci", ".gitignore", ".git/HEAD", "a/.git/config"}) {
+        std::ofstream(dir / file) << file;
+    }
+    std::filesystem::create_symlink("a.c", dir / "lnk");
+
+    std::vector<std::string> expected = {".github/ci", ".gitignore", "a-b/g", "a.c", "a/b/f", "lnk"};
+    for (unsigned int threads : {1u, 4u}) {
+        auto entries = scan_worktree(dir, "", threads);
+        std::vector<std::string> paths;
+        for (const auto& entry : entries) {
+            paths.push_back(entry.path);
+            assert(entry.symlink == (entry.path == "lnk"));
+        }
+        assert(paths == expected);
+    }
+
+    auto sub = scan_worktree(dir, "a");
+    assert(sub.size() == 1 && sub[0].path == "a/b/f");
+
+    std::filesystem::remove_all(dir);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Ignore Patterns
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify each kind of compiled pattern (literal, prefix, suffix, glob)
+ *   matches like Git's wildmatch, that the last matching pattern wins, that
+ *   negated, directory-only and anchored patterns behave, and that a scan
+ *   with ignore rules skips ignored directories but keeps tracked files.
+ *
+ * Input:
+ *   - A .gitignore-style list with "node_modules", "build*", "*.o",
+ *     "!keep.o", "out/", a rooted root.txt, a doc pattern with "**", "[ab]?.log"
+ *
+ * Expected Output:
+ *   - Matches and non-matches as asserted; the scan lists only .gitignore,
+ *     src/a.c and the tracked node_modules/kept.js
+ */
+void test_ignore_patterns() {
+    std::cout << "Test: Ignore Patterns... ";
+
+    IgnoreList list("# comment\nnode_modules\nbuild*\n*.o\n!keep.o\nout/\n/root.txt\n"
+                    "doc/**/*.tmp\n[ab]?.log\n",
+                    "", ".gitignore");
+    auto ignored = [&](const char* path, bool is_dir) {
+        const IgnorePattern* pattern = list.match(path, is_dir);
+        return pattern && !pattern->negated;
+    };
+    assert(ignored("node_modules", true));
+    assert(ignored("src/node_modules", true));
+    assert(ignored("build-x86", false));
+    assert(!ignored("rebuild", false));
+    assert(ignored("src/main.o", false));
+    assert(!ignored("src/keep.o", false));
+    assert(list.match("src/keep.o", false)->line == "!keep.o");
+    assert(list.match("src/keep.o", false)->line_number == 5);
+    assert(ignored("out", true));
+    assert(!ignored("out", false));
+    assert(ignored("root.txt", false));
+    assert(!ignored("src/root.txt", false));
+    assert(ignored("doc/x.tmp", false));
+    assert(ignored("doc/a/b/x.tmp", false));
+    assert(!ignored("src/doc/x.tmp", false));
+    assert(ignored("a1.log", false));
+    assert(!ignored("c1.log", false));
+
+    assert(ignore_glob_match("*.c", "main.c"));
+    assert(!ignore_glob_match("*.c", "src/main.c"));
+    assert(ignore_glob_match("**/main.c", "src/lib/main.c"));
+    assert(ignore_glob_match("a/**", "a/b/c"));
+    assert(ignore_glob_match("[!x]y", "zy"));
+
+    // an ignored directory is left out unless something in it is tracked
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_scan_ignore";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / ".git");
+    std::filesystem::create_directories(dir / "node_modules/pkg");
+    std::filesystem::create_directories(dir / "src");
+    std::ofstream(dir / ".gitignore") << "node_modules/\n*.o\n";
+    for (const char* file : {"node_modules/pkg/index.js", "node_modules/kept.js", "src/a.c", "src/a.o"}) {
+        std::ofstream(dir / file) << file;
+    }
+    std::ofstream(dir / ".git/config") << "";
+
+    Repository repo(dir.string(), true);
+    IgnoreRules rules(repo);
+    ScanIgnore ignore;
+    ignore.rules = &rules;
+    ignore.tracked = [](std::string_view path, bool is_dir) {
+        return path == "node_modules/kept.js" || (is_dir && path == "node_modules");
+    };
+    auto entries = scan_worktree(dir, "", 2, &ignore);
+    std::vector<std::string> paths;
+    for (const auto& entry : entries) {
+        paths.push_back(entry.path);
+    }
+    assert((paths == std::vector<std::string>{".gitignore", "node_modules/kept.js", "src/a.c"}));
+
+    std::filesystem::remove_all(dir);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Batched File I/O
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify a batch writes files (with their permissions) and stats them,
+ *   stats and reads them back (a symlink's contents being its target), and
+ *   fails the requests for missing paths, both with io_uring where the
+ *   kernel has it and with core.ioUring=false.
+ *
+ * Input:
+ *   - Writes of 300 files, one empty, one large and one executable; then
+ *     stats and reads of them, of a symlink and of a missing file
+ *
+ * Expected Output:
+ *   - The same contents and stat data back, whichever backend runs
+ */
+void test_io_batch() {
+    std::cout << "Test: Batched File I/O... ";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_io_batch";
+    for (const char* use_uring : {"true", "false"}) {
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directories(dir / ".git");
+        std::ofstream(dir / ".git/config") << "[core]\n\tioUring = " << use_uring << "\n";
+        Repository repo(dir.string(), true);
+        IoBatch io(repo);
+        if (std::string(use_uring) == "false") {
+            assert(!io.uses_io_uring());
+        }
+
+        std::vector<IoRequest> writes(300);
+        for (size_t i = 0; i < writes.size(); i++) {
+            writes[i].kind = IoRequest::Kind::Write;
+            writes[i].path = dir / ("f" + std::to_string(i));
+            writes[i].data = i == 1 ? std::string(3 * 1024 * 1024, 'x') : std::string(i, char('a' + i % 26));
+        }
+        writes[2].mode = 0777;
+        io.run(writes);
+        for (const auto& write : writes) {
+            assert(write.ok && write.stat.file_size == write.data.size());
+        }
+        assert(writes[2].stat.mode == 0100755);
+        assert(writes[3].stat.mode == 0100644);
+        std::filesystem::create_symlink("f7", dir / "lnk");
+
+        std::vector<IoRequest> reads(writes.size() + 2);
+        for (size_t i = 0; i < writes.size(); i++) {
+            reads[i].kind = i % 2 ? IoRequest::Kind::Read : IoRequest::Kind::Stat;
+            reads[i].path = writes[i].path;
+        }
+        reads[writes.size()].kind = IoRequest::Kind::Read;
+        reads[writes.size()].path = dir / "lnk";
+        reads[writes.size() + 1].kind = IoRequest::Kind::Read;
+        reads[writes.size() + 1].path = dir / "missing";
+        io.run(reads);
+        for (size_t i = 0; i < writes.size(); i++) {
+            assert(reads[i].ok);
+            assert(index_stat_matches(writes[i].stat, reads[i].stat));
+            assert(reads[i].kind == IoRequest::Kind::Stat || reads[i].data == writes[i].data);
+        }
+        assert(reads[writes.size()].ok && reads[writes.size()].data == "f7");
+        assert(reads[writes.size()].stat.mode == 0120000);
+        assert(!reads[writes.size() + 1].ok);
+    }
+
+    std::filesystem::remove_all(dir);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Line Diffs
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify the edits of diff_lines turn the old text into the new one with
+ *   as few changed lines as possible, and that unified_diff prints Git's
+ *   hunks: merged when their context overlaps, with the line counts and
+ *   function lines Git prints and a marker for a missing newline at the end.
+ *
+ * Input:
+ *   - Random texts of few distinct lines, so they repeat a lot, some long
+ *     enough for the vectorized prefix and suffix compares
+ *   - Two small texts with a change, a removal and an appended last line
+ *
+ * Expected Output:
+ *   - As many changed lines as the longest common subsequence allows
+ *   - The exact hunks Git prints for the small texts
+ */
+void test_unified_diff() {
+    std::cout << "Test: Line Diffs... ";
+
+    uint32_t seed = 12345;
+    auto random = [&seed](uint32_t n) {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) % n;
+    };
+    for (int round = 0; round < 300; round++) {
+        std::vector<std::string> a_lines, b_lines;
+        size_t shared = round % 3 == 0 ? 40 : 0;
+        for (size_t i = random(30) + shared; i > 0; i--) {
+            a_lines.push_back(std::string(1, static_cast<char>('a' + random(4))) + "\n");
+        }
+        b_lines = a_lines;
+        for (size_t edits = random(8); edits > 0; edits--) {
+            size_t at = random(static_cast<uint32_t>(b_lines.size() + 1));
+            if (random(2) && at < b_lines.size()) {
+                b_lines.erase(b_lines.begin() + at);
+            } else {
+                b_lines.insert(b_lines.begin() + at, std::string(1, static_cast<char>('a' + random(6))) + "\n");
+            }
+        }
+        std::string a_text, b_text;
+        for (const auto& line : a_lines) a_text += line;
+        for (const auto& line : b_lines) b_text += line;
+
+        DiffLines lines(a_text, b_text);
+        std::vector<DiffEdit> edits = diff_lines(lines);
+
+        // applying the edits gives the new text
+        std::string applied;
+        size_t pos = 0, changed = 0;
+        for (const auto& edit : edits) {
+            for (; pos < edit.old_start; pos++) applied += a_lines[pos];
+            for (size_t j = 0; j < edit.new_count; j++) applied += b_lines[edit.new_start + j];
+            pos = edit.old_start + edit.old_count;
+            changed += edit.old_count + edit.new_count;
+        }
+        for (; pos < a_lines.size(); pos++) applied += a_lines[pos];
+        assert(applied == b_text);
+
+        // and changes no more lines than it has to
+        std::vector<std::vector<size_t>> lcs(a_lines.size() + 1, std::vector<size_t>(b_lines.size() + 1, 0));
+        for (size_t i = 1; i <= a_lines.size(); i++) {
+            for (size_t j = 1; j <= b_lines.size(); j++) {
+                lcs[i][j] = a_lines[i - 1] == b_lines[j - 1] ? lcs[i - 1][j - 1] + 1
+                                                             : std::max(lcs[i - 1][j], lcs[i][j - 1]);
+            }
+        }
+        assert(changed == a_lines.size() + b_lines.size() - 2 * lcs[a_lines.size()][b_lines.size()]);
+    }
+
+    std::string old_text = "a\nb\nc\nd\ne\nf\ng\nh\ni\nj\n";
+    std::string new_text = "a\nb\nC\nd\ne\nf\ng\nh\nj\nk";
+    assert(unified_diff(old_text, new_text) ==
+           "@@ -1,10 +1,10 @@\n a\n b\n-c\n+C\n d\n e\n f\n g\n h\n-i\n j\n+k\n\\ No newline at end of file\n");
+    assert(unified_diff(old_text, new_text, 1) ==
+           "@@ -2,3 +2,3 @@ a\n b\n-c\n+C\n d\n"
+           "@@ -8,3 +8,3 @@ g\n h\n-i\n j\n+k\n\\ No newline at end of file\n");
+    assert(unified_diff("", "x\n") == "@@ -0,0 +1 @@\n+x\n");
+    assert(unified_diff(old_text, old_text).empty());
+    assert(diff_is_binary(std::string("a\0b", 3)) && !diff_is_binary(old_text));
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: Patience and Histogram Diffs
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify the patience and histogram diffs give edits that turn the old
+ *   text into the new one, also where they have no anchor to split at and
+ *   hand parts to Myers, and that they pick the lines Git's do.
+ *
+ * Input:
+ *   - Random texts of few distinct lines, some with one line repeated more
+ *     times than a histogram diff splits at
+ *   - A small text that Myers, patience and histogram each diff differently
+ *
+ * Expected Output:
+ *   - Edits that apply to the new text, for both algorithms
+ *   - The hunks Git prints with each algorithm
+ */
+void test_anchored_diffs() {
+    std::cout << "Test: Patience and Histogram Diffs... ";
+
+    uint32_t seed = 777;
+    auto random = [&seed](uint32_t n) {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) % n;
+    };
+    for (DiffAlgorithm algorithm : {DiffAlgorithm::Patience, DiffAlgorithm::Histogram}) {
+        for (int round = 0; round < 200; round++) {
+            std::vector<std::string> a_lines, b_lines;
+            size_t repeated = round % 4 == 0 ? 100 : 0;
+            for (size_t i = random(40) + repeated; i > 0; i--) {
+                a_lines.push_back(i <= repeated && random(4) ? "x\n" : std::to_string(random(8)) + "\n");
+            }
+            b_lines = a_lines;
+            for (size_t edits = random(10); edits > 0; edits--) {
+                size_t at = random(static_cast<uint32_t>(b_lines.size() + 1));
+                if (random(2) && at < b_lines.size()) {
+                    b_lines.erase(b_lines.begin() + at);
+                } else {
+                    b_lines.insert(b_lines.begin() + at, std::to_string(random(12)) + "\n");
+                }
+            }
+            std::string a_text, b_text;
+            for (const auto& line : a_lines) a_text += line;
+            for (const auto& line : b_lines) b_text += line;
+
+            DiffLines lines(a_text, b_text);
+            std::string applied;
+            size_t pos = 0;
+            for (const auto& edit : diff_lines(lines, algorithm)) {
+                for (; pos < edit.old_start; pos++) applied += a_lines[pos];
+                for (size_t j = 0; j < edit.new_count; j++) applied += b_lines[edit.new_start + j];
+                pos = edit.old_start + edit.old_count;
+            }
+            for (; pos < a_lines.size(); pos++) applied += a_lines[pos];
+            assert(applied == b_text);
+        }
+    }
+
+    std::string old_text = "b\na\nb\nb\n}\n}\n}\n";
+    std::string new_text = "b\nb\na\nb\n}\nc\n}\n}\n";
+    assert(unified_diff(old_text, new_text, 3, DiffAlgorithm::Myers) ==
+           "@@ -1,7 +1,8 @@\n b\n-a\n b\n+a\n b\n }\n+c\n }\n }\n");
+    assert(unified_diff(old_text, new_text, 3, DiffAlgorithm::Patience) ==
+           "@@ -1,7 +1,8 @@\n b\n+b\n a\n b\n-b\n }\n+c\n }\n }\n");
+    assert(unified_diff(old_text, new_text, 3, DiffAlgorithm::Histogram) ==
+           "@@ -1,7 +1,8 @@\n b\n+b\n a\n b\n-b\n-}\n+}\n+c\n }\n }\n");
+
+    DiffAlgorithm parsed = DiffAlgorithm::Myers;
+    assert(parse_diff_algorithm("histogram", parsed) && parsed == DiffAlgorithm::Histogram);
+    assert(parse_diff_algorithm("minimal", parsed) && parsed == DiffAlgorithm::Myers);
+    assert(!parse_diff_algorithm("fast", parsed));
+
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: diff Command Algorithm
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify `silt diff` with no --diff-algorithm uses diff.algorithm, or
+ *   Myers without it, and that the option overrides the config.
+ *
+ * Input:
+ *   - A staged file changed in the worktree, diffed through the parser
+ *
+ * Expected Output:
+ *   - The Myers hunks, then the histogram hunks once diff.algorithm is
+ *     set, then the patience hunks with --diff-algorithm=patience
+ */
+void test_diff_command_algorithm() {
+    std::cout << "Test: diff Command Algorithm... ";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_diff_command";
+    std::filesystem::remove_all(dir);
+    Repository repo = repo_create(dir);
+    std::string file = (dir / "f").string();
+    auto write_file = [&file](const std::string& content) {
+        std::ofstream out(file, std::ios::binary);
+        out << content;
+    };
+
+    auto run = [&repo](std::vector<std::string> words) { return run_silt(repo, std::move(words)); };
+    auto ends_with = [](const std::string& text, const std::string& end) {
+        return text.size() >= end.size() && text.compare(text.size() - end.size(), end.size(), end) == 0;
+    };
+
+    write_file("b\na\nb\nb\n}\n}\n}\n");
+    run({"add", file});
+    write_file("b\nb\na\nb\n}\nc\n}\n}\n");
+
+    assert(ends_with(run({"diff"}), "@@ -1,7 +1,8 @@\n b\n-a\n b\n+a\n b\n }\n+c\n }\n }\n"));
+    {
+        std::ofstream config(repo.gitdir / "config", std::ios::app);
+        config << "[diff]\n\talgorithm = histogram\n";
+    }
+    assert(ends_with(run({"diff"}), "@@ -1,7 +1,8 @@\n b\n+b\n a\n b\n-b\n-}\n+}\n+c\n }\n }\n"));
+    assert(ends_with(run({"diff", "--diff-algorithm=patience"}),
+                     "@@ -1,7 +1,8 @@\n b\n+b\n a\n b\n-b\n }\n+c\n }\n }\n"));
+
+    std::filesystem::remove_all(dir);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: add Command Symlinks
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify `silt add` of a single symlink stages the link itself, as Git
+ *   does, also for a link to a directory, and names it by its path in the
+ *   worktree rather than its target's.
+ *
+ * Input:
+ *   - A file, a symlink to it and a symlink to its directory, each added
+ *     by name
+ *
+ * Expected Output:
+ *   - The links staged with mode 120000 and their targets as blobs
+ *   - The file staged once, under its own path
+ */
+void test_add_command_symlinks() {
+    std::cout << "Test: add Command Symlinks... ";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_add_symlinks";
+    std::filesystem::remove_all(dir);
+    Repository repo = repo_create(dir);
+    std::filesystem::create_directories(dir / "d");
+    std::ofstream(dir / "d" / "t") << "hi\n";
+    std::filesystem::create_symlink("d/t", dir / "link");
+    std::filesystem::create_directory_symlink("d", dir / "dlink");
+
+    run_silt(repo, {"add", (dir / "link").string(), (dir / "dlink").string(), (dir / "d" / "t").string()});
+
+    Index index(repo);
+    assert(index.size() == 3);
+    assert(index[0].path() == "d/t" && index[0].mode() == 0100644);
+    assert(index[0].sha() == "45b983be36b73c0788dc9cbcb76cbb80fc7bb057");
+    assert(index[1].path() == "dlink" && index[1].mode() == 0120000);
+    assert(index[1].sha() == object_hash("d", "blob"));
+    assert(index[2].path() == "link" && index[2].mode() == 0120000);
+    assert(index[2].sha() == object_hash("d/t", "blob"));
+
+    std::filesystem::remove_all(dir);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: checkout Fills the Index
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify checking a tree out into a subdirectory of the worktree records
+ *   every file written in the index with its stat data, none of it smudged
+ *   for being as new as the index, creates symlinks as links, and replaces
+ *   what the index had under that directory.
+ *
+ * Input:
+ *   - a tree with a file, an executable, a symlink and a subdirectory
+ *   - an index with a stale entry under the target directory
+ *
+ * Expected Output:
+ *   - one entry per file, with the mode from the tree and stat data
+ *     matching the file on disk, and the stale entry gone
+ */
+void test_checkout_fills_index() {
+    std::cout << "Test: checkout Fills the Index... ";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_checkout_index";
+    std::filesystem::remove_all(dir);
+    Repository repo = repo_create(dir);
+
+    auto blob = [&](const std::string& data) { return object_hash(data, "blob", &repo); };
+    auto tree = [&](const std::vector<GitTreeLeaf>& leaves) {
+        auto obj = std::make_unique<GitTree>();
+        obj->set_leaves(leaves);
+        return object_write(std::move(obj), &repo);
+    };
+    std::string root = tree({{"100644", "a.txt", blob("a\n")}, {"40000", "d", tree({{"100644", "e", blob("e")}})},
+                             {"120000", "link", blob("a.txt")}, {"100755", "run.sh", blob("x")}});
+
+    {
+        Index stale;
+        assert(stale.lock(repo));
+        IndexEntry old("sub/old");
+        old.stat.mode = 0100644;
+        old.sha = blob("old");
+        stale.add_entry(old);
+        assert(stale.write(repo));
+    }
+    run_silt(repo, {"checkout", root, (dir / "sub").string()});
+
+    Index index(repo);
+    assert(index.size() == 4);
+    const std::vector<std::pair<std::string, uint32_t>> expected = {
+        {"sub/a.txt", 0100644}, {"sub/d/e", 0100644}, {"sub/link", 0120000}, {"sub/run.sh", 0100755}};
+    for (size_t i = 0; i < expected.size(); i++) {
+        IndexStat current;
+        assert(index[i].path() == expected[i].first && index[i].mode() == expected[i].second);
+        assert(index_stat(current, dir / expected[i].first));
+        assert(index[i].stat_clean(current));
+    }
+    assert(std::filesystem::read_symlink(dir / "sub" / "link") == "a.txt");
+    assert(index[2].sha() == blob("a.txt"));
+
+    std::filesystem::remove_all(dir);
+    std::cout << "PASSED" << std::endl;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Test: status Refreshes Stat Data
+ * ---------------------------------------------------------------------------
+ * Description:
+ *   Verify `silt status` writes back the stat data of files it had to hash
+ *   and found unchanged, so the next status hashes nothing, and that it
+ *   still notices a file changed afterwards.
+ *
+ * Input:
+ *   - two files just written, staged with their blobs but smudged stat
+ *     data, as an index written in the same instant would have them
+ *   - status run twice, then one file rewritten with another size
+ *
+ * Expected Output:
+ *   - no unstaged change; after the first run every entry's stat data is
+ *     clean, and the second run leaves the index as it was
+ *   - then the rewritten file listed as modified
+ */
+void test_status_refreshes_stat_data() {
+    std::cout << "Test: status Refreshes Stat Data... ";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "silt_status_stat";
+    std::filesystem::remove_all(dir);
+    Repository repo = repo_create(dir);
+    std::ofstream(dir / "f") << "one\n";
+    std::ofstream(dir / "g") << "two\n";
+
+    {
+        Index index;
+        assert(index.lock(repo));
+        for (const char* name : {"f", "g"}) {
+            IndexEntry entry(name);
+            assert(index_stat(entry.stat, dir / name));
+            entry.stat.file_size = 0;
+            entry.sha = object_hash(name[0] == 'f' ? "one\n" : "two\n", "blob");
+            entry.flags = 1;
+            index.add_entry(entry);
+        }
+        assert(index.write(repo));
+    }
+    auto read_index = [&] {
+        std::ifstream in(Index::get_index_path(repo), std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+
+    assert(run_silt(repo, {"status"}).find("modified:") == std::string::npos);
+    {
+        Index index(repo);
+        assert(index.size() == 2);
+        for (size_t i = 0; i < index.size(); i++) {
+            IndexStat current;
+            assert(index_stat(current, dir / std::string(index[i].path())));
+            assert(index[i].stat_clean(current));
+        }
+    }
+    // an entry hashed and found unchanged would be refreshed and written
+    std::string refreshed = read_index();
+    assert(run_silt(repo, {"status"}).find("modified:") == std::string::npos);
+    assert(read_index() == refreshed);
+
+    std::ofstream(dir / "f") << "three\n";
+    assert(run_silt(repo, {"status"}).find("modified:   f") != std::string::npos);
+
+    std::filesystem::remove_all(dir);
+    std::cout << "PASSED" << std::endl;
+}
+
 /*
  * ---------------------------------------------------------------------------
  * Run All Tests
@@ -839,6 +1628,26 @@ int main() {
     test_symlink_mode_detection();
     test_submodule_mode_detection();
 
+    // Sparse checkout tests
+    test_sparse_checkout_cone();
+
+    // Status tests
+    test_build_tree_from_index();
+    test_index_tree_changes();
+    test_scan_worktree();
+    test_ignore_patterns();
+    test_io_batch();
+
+    // Diff tests
+    test_unified_diff();
+    test_anchored_diffs();
+    test_diff_command_algorithm();
+
+    // Staging and checkout tests
+    test_add_command_symlinks();
+    test_checkout_fills_index();
+    test_status_refreshes_stat_data();
+
     // New sample tests
     test_hex_to_raw_sha_length();
     test_create_raw_tree_entry_space_unicode();
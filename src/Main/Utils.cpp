@@ -0,0 +1,135 @@
+#include "Utils.hpp"
+#include <iterator>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::filesystem::path& path) {
+    std::shared_ptr<MappedFile> file(new MappedFile());
+
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    file->length = static_cast<size_t>(st.st_size);
+    if (file->length > 0) {
+        void* addr = mmap(nullptr, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            file->bytes = static_cast<const char*>(addr);
+            file->mapped = true;
+        }
+    }
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+
+    if (file->mapped || file->length == 0) {
+        return file;
+    }
+#endif
+
+    // Fall back to reading the whole file
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        return nullptr;
+    }
+    file->buffer.assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    file->bytes = file->buffer.data();
+    file->length = file->buffer.size();
+    return file;
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (mapped) {
+        munmap(const_cast<char*>(bytes), length);
+    }
+#endif
+}
+
+namespace {
+std::string lowercase(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+    return text;
+}
+
+std::string trimmed(const std::string& text) {
+    size_t start = text.find_first_not_of(" \t\r");
+    if (start == std::string::npos) {
+        return "";
+    }
+    return text.substr(start, text.find_last_not_of(" \t\r") + 1 - start);
+}
+}
+
+bool config_set(const std::filesystem::path& path, const std::string& section, const std::string& key,
+                const std::string& value) {
+    std::vector<std::string> lines;
+    {
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            lines.push_back(line);
+        }
+    }
+
+    std::string header = "[" + lowercase(section) + "]";
+    std::string setting = "\t" + key + " = " + value;
+
+    // find the section, then the key in it or where the section ends
+    bool found_section = false;
+    bool done = false;
+    size_t insert_at = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+        std::string line = trimmed(lines[i]);
+        if (!line.empty() && line[0] == '[') {
+            if (found_section) {
+                break;
+            }
+            found_section = lowercase(line) == header;
+            insert_at = i + 1;
+            continue;
+        }
+        if (!found_section || line.empty()) {
+            continue;
+        }
+        insert_at = i + 1;
+        if (line[0] != '#' && line[0] != ';' && lowercase(trimmed(line.substr(0, line.find('=')))) == lowercase(key)) {
+            lines[i] = setting;
+            done = true;
+            break;
+        }
+    }
+    if (!done && found_section) {
+        lines.insert(lines.begin() + insert_at, setting);
+    } else if (!done) {
+        lines.push_back(header);
+        lines.push_back(setting);
+    }
+
+    std::filesystem::path temp = path;
+    temp += ".lock";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        for (const auto& line : lines) {
+            out << line << "\n";
+        }
+        if (!out) {
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, path, ec);
+    return !ec;
+}
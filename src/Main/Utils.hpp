@@ -7,6 +7,8 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <memory>
+#include <filesystem>
 
 class ConfigParser {
 private:
@@ -127,4 +129,37 @@ public:
     }
 };
 
+// Set `key` in `section` of the config file at `path` the way `git config`
+// does: the line is edited in place, or added to the end of the section
+// (which is created if missing), and everything else is left as it was.
+// Names compare case-insensitively. Returns false if the file can't be
+// written.
+bool config_set(const std::filesystem::path& path, const std::string& section, const std::string& key,
+                const std::string& value);
+
+// Read-only view of a whole file. The file is memory-mapped where the
+// platform allows it, so only the pages that get touched are read in. On
+// Windows the contents are read into memory instead, since a mapped file
+// can't be replaced by a rename while the mapping is open.
+class MappedFile {
+public:
+    // Returns nullptr if the file can't be opened or mapped
+    static std::shared_ptr<MappedFile> open(const std::filesystem::path& path);
+
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    MappedFile() = default;
+
+    const char* bytes = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::string buffer; // used when the file isn't mapped
+};
+
 #endif // UTILS_HPP
\ No newline at end of file
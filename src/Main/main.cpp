@@ -5,6 +5,7 @@
 #include "Utils.hpp"
 #include <iostream>
 #include <filesystem>
+#include <optional>
 
 
 void test();
@@ -20,8 +21,16 @@ int main(int argc, char* argv[]) {
     // Create a dummy repository instance for now
     Repository repo(std::filesystem::current_path(), true); // Provide a path and force=true for a dummy repo
 
-    // Parse arguments and dispatch to the appropriate command
-    auto result = parser.parse_and_dispatch(argc, argv, &repo);
+    // Parse arguments and dispatch to the appropriate command. Errors a
+    // command throws are reported here, after unwinding, so the locks it
+    // held (index.lock among them) are rolled back rather than left behind.
+    std::optional<std::string> result;
+    try {
+        result = parser.parse_and_dispatch(argc, argv, &repo);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
 
     // If there was an error, print it
     if (result.has_value()) {